@@ -0,0 +1,329 @@
+; 2048 on a 4x4 board, played with w/a/s/d read through GETC until q
+;
+; Cells hold exponents, 0 is empty. After every move that changes the board a
+; 1, or a 2 one time in eight, appears on an empty cell chosen by an LCG and
+; the board is printed. A full board ends the game and starts the next one.
+; q prints the number of moves, merges and games.
+        .ORIG x3000
+        JSR NEWGAME
+MAIN    GETC
+        LD R1, NQ
+        ADD R1, R1, R0
+        BRz QUIT
+        LEA R2, DIRS
+        AND R5, R5, #0
+        ADD R5, R5, #4
+MKEY    LDR R1, R2, #0
+        ADD R1, R1, R0
+        BRz MFOUND
+        ADD R2, R2, #4
+        ADD R5, R5, #-1
+        BRp MKEY
+        BRnzp MAIN
+MFOUND  LDR R1, R2, #1
+        ST R1, DSTART
+        LDR R1, R2, #2
+        ST R1, DLINE
+        LDR R1, R2, #3
+        ST R1, DCELL
+        JSR MOVE
+        LD R0, MOVED
+        BRz MAIN
+        LD R0, MOVES
+        ADD R0, R0, #1
+        ST R0, MOVES
+        JSR SPAWN
+        JSR SHOW
+        JSR EMPTY
+        BRp MAIN
+        LEA R0, OVER
+        PUTS
+        JSR NEWGAME
+        BRnzp MAIN
+
+QUIT    LEA R0, SMOVES
+        PUTS
+        LD R0, MOVES
+        JSR PHEX
+        LEA R0, SMERGES
+        PUTS
+        LD R0, MERGES
+        JSR PHEX
+        LEA R0, SGAMES
+        PUTS
+        LD R0, GAMES
+        JSR PHEX
+        HALT
+
+NQ      .FILL #-113
+; per key: minus the key, first cell, step between lines, step along a line
+DIRS    .FILL #-97
+        .FILL #0
+        .FILL #4
+        .FILL #1
+        .FILL #-100
+        .FILL #3
+        .FILL #4
+        .FILL #-1
+        .FILL #-119
+        .FILL #0
+        .FILL #1
+        .FILL #4
+        .FILL #-115
+        .FILL #12
+        .FILL #1
+        .FILL #-4
+DSTART  .FILL #0
+DLINE   .FILL #0
+DCELL   .FILL #0
+MOVED   .FILL #0
+MOVES   .FILL #0
+MERGES  .FILL #0
+GAMES   .FILL #0
+SEED    .FILL #1
+SEEDINC .FILL #13849
+MASK2   .FILL x0070
+OVER    .STRINGZ "game over\n"
+SMOVES  .STRINGZ "moves "
+SMERGES .STRINGZ "merges "
+SGAMES  .STRINGZ "games "
+BOARD   .BLKW #16
+TILES   .STRINGZ ".123456789ABCDEF"
+SCREEN  .BLKW #22
+
+; slide all four lines towards their first cell, sets MOVED on any change
+MOVE    ST R7, MVR7
+        AND R0, R0, #0
+        ST R0, MOVED
+        LD R1, DSTART
+        LEA R2, BOARD
+        ADD R1, R1, R2
+        AND R5, R5, #0
+        ADD R5, R5, #4
+MVLINE  ST R1, LADDR
+        JSR SLIDE
+        LD R1, LADDR
+        LD R2, DLINE
+        ADD R1, R1, R2
+        ADD R5, R5, #-1
+        BRp MVLINE
+        LD R7, MVR7
+        RET
+MVR7    .FILL #0
+LADDR   .FILL #0
+
+; the line at R1 with cells DCELL apart: R1 reads, R3 writes, R4 holds the
+; value waiting for its neighbour
+SLIDE   ST R7, SLR7
+        ST R5, SLR5
+        LD R2, DCELL
+        ADD R3, R1, #0
+        AND R4, R4, #0
+        AND R5, R5, #0
+        ADD R5, R5, #4
+SLREAD  LDR R0, R1, #0
+        BRz SLNEXT
+        ADD R4, R4, #0
+        BRz SLHOLD
+        NOT R7, R4
+        ADD R7, R7, #1
+        ADD R7, R7, R0
+        BRnp SLEMIT
+        ADD R0, R4, #1
+        JSR EMIT
+        LD R7, MERGES
+        ADD R7, R7, #1
+        ST R7, MERGES
+        AND R4, R4, #0
+        BRnzp SLNEXT
+SLEMIT  ST R0, SLV
+        ADD R0, R4, #0
+        JSR EMIT
+        LD R4, SLV
+        BRnzp SLNEXT
+SLHOLD  ADD R4, R0, #0
+SLNEXT  ADD R1, R1, R2
+        ADD R5, R5, #-1
+        BRp SLREAD
+        ADD R0, R4, #0
+        BRz SLZERO
+        JSR EMIT
+SLZERO  NOT R7, R3
+        ADD R7, R7, #1
+        ADD R7, R7, R1
+        BRz SLDONE
+        AND R0, R0, #0
+        JSR EMIT
+        BRnzp SLZERO
+SLDONE  LD R5, SLR5
+        LD R7, SLR7
+        RET
+SLR7    .FILL #0
+SLR5    .FILL #0
+SLV     .FILL #0
+
+; store R0 at R3 and step R3 by R2
+EMIT    ST R4, EMR4
+        LDR R4, R3, #0
+        NOT R4, R4
+        ADD R4, R4, #1
+        ADD R4, R4, R0
+        BRz EMSAME
+        STR R0, R3, #0
+        AND R4, R4, #0
+        ADD R4, R4, #1
+        ST R4, MOVED
+EMSAME  ADD R3, R3, R2
+        LD R4, EMR4
+        RET
+EMR4    .FILL #0
+
+; clear the board and place two tiles
+NEWGAME ST R7, NGR7
+        LEA R1, BOARD
+        AND R0, R0, #0
+        AND R5, R5, #0
+        ADD R5, R5, #15
+        ADD R5, R5, #1
+NGCLEAR STR R0, R1, #0
+        ADD R1, R1, #1
+        ADD R5, R5, #-1
+        BRp NGCLEAR
+        LD R0, GAMES
+        ADD R0, R0, #1
+        ST R0, GAMES
+        JSR SPAWN
+        JSR SPAWN
+        JSR SHOW
+        LD R7, NGR7
+        RET
+NGR7    .FILL #0
+
+; a new tile on the first empty cell from a random one on
+SPAWN   ST R7, SPR7
+        JSR RAND
+        AND R1, R0, #15
+        LEA R2, BOARD
+        AND R5, R5, #0
+        ADD R5, R5, #15
+        ADD R5, R5, #1
+SPSCAN  ADD R3, R2, R1
+        LDR R4, R3, #0
+        BRz SPPUT
+        ADD R1, R1, #1
+        AND R1, R1, #15
+        ADD R5, R5, #-1
+        BRp SPSCAN
+        BRnzp SPDONE
+SPPUT   AND R4, R4, #0
+        ADD R4, R4, #1
+        LD R7, MASK2
+        AND R0, R0, R7
+        BRnp SPONE
+        ADD R4, R4, #1
+SPONE   STR R4, R3, #0
+SPDONE  LD R7, SPR7
+        RET
+SPR7    .FILL #0
+
+; R0 = the next seed * 5 + SEEDINC, rotated left by 8 so that its better
+; high bits come first
+RAND    LD R0, SEED
+        ADD R1, R0, R0
+        ADD R1, R1, R1
+        ADD R0, R0, R1
+        LD R1, SEEDINC
+        ADD R0, R0, R1
+        ST R0, SEED
+        AND R1, R1, #0
+        ADD R1, R1, #8
+RROT    ADD R0, R0, #0
+        BRn RNEG
+        ADD R0, R0, R0
+        BRnzp RNEXT
+RNEG    ADD R0, R0, R0
+        ADD R0, R0, #1
+RNEXT   ADD R1, R1, #-1
+        BRp RROT
+        RET
+
+; R0 = the number of empty cells
+EMPTY   LEA R1, BOARD
+        AND R0, R0, #0
+        AND R5, R5, #0
+        ADD R5, R5, #15
+        ADD R5, R5, #1
+EMLOOP  LDR R2, R1, #0
+        BRnp EMNEXT
+        ADD R0, R0, #1
+EMNEXT  ADD R1, R1, #1
+        ADD R5, R5, #-1
+        BRp EMLOOP
+        ADD R0, R0, #0
+        RET
+
+; print the board, one character per cell
+SHOW    ST R7, SHR7
+        LEA R1, BOARD
+        LEA R2, SCREEN
+        AND R5, R5, #0
+        ADD R5, R5, #4
+SHROW   AND R4, R4, #0
+        ADD R4, R4, #4
+SHCELL  LDR R0, R1, #0
+        LEA R3, TILES
+        ADD R3, R3, R0
+        LDR R0, R3, #0
+        STR R0, R2, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #1
+        ADD R4, R4, #-1
+        BRp SHCELL
+        AND R0, R0, #0
+        ADD R0, R0, #10
+        STR R0, R2, #0
+        ADD R2, R2, #1
+        ADD R5, R5, #-1
+        BRp SHROW
+        STR R0, R2, #0
+        AND R0, R0, #0
+        STR R0, R2, #1
+        LEA R0, SCREEN
+        PUTS
+        LD R7, SHR7
+        RET
+SHR7    .FILL #0
+
+; print R0 as four hex digits and a newline
+PHEX    ST R7, PHR7
+        ADD R3, R0, #0
+        AND R2, R2, #0
+        ADD R2, R2, #4
+PHDIG   AND R0, R0, #0
+        AND R4, R4, #0
+        ADD R4, R4, #4
+PHBIT   ADD R0, R0, R0
+        ADD R3, R3, #0
+        BRzp PHZERO
+        ADD R0, R0, #1
+PHZERO  ADD R3, R3, R3
+        ADD R4, R4, #-1
+        BRp PHBIT
+        ADD R1, R0, #-10
+        BRn PHDEC
+        LD R1, PHALPHA
+        BRnzp PHOUT
+PHDEC   LD R1, PHZCHAR
+PHOUT   ADD R0, R0, R1
+        OUT
+        ADD R2, R2, #-1
+        BRp PHDIG
+        AND R0, R0, #0
+        ADD R0, R0, #10
+        OUT
+        LD R7, PHR7
+        RET
+PHR7    .FILL #0
+PHALPHA .FILL #55
+PHZCHAR .FILL #48
+        .END
@@ -0,0 +1,53 @@
+; ALU loop: ADD, AND and NOT on registers in a counted loop
+; 400 x 8000 x 6 instructions, prints the final value of R2
+        .ORIG x3000
+        LD R5, OUTER
+        AND R2, R2, #0
+OUTL    LD R1, INNER
+INL     ADD R2, R2, R1
+        AND R3, R2, #15
+        NOT R4, R3
+        ADD R2, R2, R4
+        ADD R1, R1, #-1
+        BRp INL
+        ADD R5, R5, #-1
+        BRp OUTL
+        ADD R0, R2, #0
+        JSR PHEX
+        HALT
+OUTER   .FILL #400
+INNER   .FILL #8000
+
+; print R0 as four hex digits and a newline
+PHEX    ST R7, PHR7
+        ADD R3, R0, #0
+        AND R2, R2, #0
+        ADD R2, R2, #4
+PHDIG   AND R0, R0, #0
+        AND R4, R4, #0
+        ADD R4, R4, #4
+PHBIT   ADD R0, R0, R0
+        ADD R3, R3, #0
+        BRzp PHZERO
+        ADD R0, R0, #1
+PHZERO  ADD R3, R3, R3
+        ADD R4, R4, #-1
+        BRp PHBIT
+        ADD R1, R0, #-10
+        BRn PHDEC
+        LD R1, PHALPHA
+        BRnzp PHOUT
+PHDEC   LD R1, PHZCHAR
+PHOUT   ADD R0, R0, R1
+        OUT
+        ADD R2, R2, #-1
+        BRp PHDIG
+        AND R0, R0, #0
+        ADD R0, R0, #10
+        OUT
+        LD R7, PHR7
+        RET
+PHR7    .FILL #0
+PHALPHA .FILL #55
+PHZCHAR .FILL #48
+        .END
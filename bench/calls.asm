@@ -0,0 +1,62 @@
+; recursive calls: fib(27) through JSR/RET with a stack in R6, about 636000
+; calls; prints the result modulo 2^16
+        .ORIG x3000
+        LD R6, STACK
+        LD R0, N
+        JSR FIB
+        JSR PHEX
+        HALT
+N       .FILL #27
+STACK   .FILL x8000
+
+; R0 = fib(R0), clobbers R1
+FIB     ADD R1, R0, #-2
+        BRn FIBRET
+        ADD R6, R6, #-3
+        STR R7, R6, #0
+        STR R0, R6, #1
+        ADD R0, R0, #-1
+        JSR FIB
+        STR R0, R6, #2
+        LDR R0, R6, #1
+        ADD R0, R0, #-2
+        JSR FIB
+        LDR R1, R6, #2
+        ADD R0, R0, R1
+        LDR R7, R6, #0
+        ADD R6, R6, #3
+FIBRET  RET
+
+; print R0 as four hex digits and a newline
+PHEX    ST R7, PHR7
+        ADD R3, R0, #0
+        AND R2, R2, #0
+        ADD R2, R2, #4
+PHDIG   AND R0, R0, #0
+        AND R4, R4, #0
+        ADD R4, R4, #4
+PHBIT   ADD R0, R0, R0
+        ADD R3, R3, #0
+        BRzp PHZERO
+        ADD R0, R0, #1
+PHZERO  ADD R3, R3, R3
+        ADD R4, R4, #-1
+        BRp PHBIT
+        ADD R1, R0, #-10
+        BRn PHDEC
+        LD R1, PHALPHA
+        BRnzp PHOUT
+PHDEC   LD R1, PHZCHAR
+PHOUT   ADD R0, R0, R1
+        OUT
+        ADD R2, R2, #-1
+        BRp PHDIG
+        AND R0, R0, #0
+        ADD R0, R0, #10
+        OUT
+        LD R7, PHR7
+        RET
+PHR7    .FILL #0
+PHALPHA .FILL #55
+PHZCHAR .FILL #48
+        .END
@@ -0,0 +1,153 @@
+// micro-benchmark: eager vs lazy condition codes
+//
+// Runs the same ALU-heavy instruction stream (ADD/AND/NOT with the occasional
+// BR) through two copies of the interpreter step, one computing N/Z/P after
+// every result like the original update_flags() and one only keeping the
+// result, and prints the cost per instruction of each.
+//
+// lc3_flags_bench [iterations]
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum { OP_BR = 0, OP_ADD = 1, OP_AND = 5, OP_NOT = 9 };
+enum { FL_POS = 1 << 0, FL_ZRO = 1 << 1, FL_NEG = 1 << 2 };
+enum { R_COND = 8, R_COUNT = 10 };
+enum { STREAM = 4096 };
+
+uint16_t stream[STREAM];
+
+uint16_t sign_extend(uint16_t x, int bit_count) {
+  if ((x >> (bit_count - 1)) & 1) {
+    x |= (0xFFFF << bit_count);
+  }
+  return x;
+}
+
+// one in 16 instructions is a BR that reads the flags but never jumps far
+void build_stream() {
+  srand(1);
+  for (int i = 0; i < STREAM; i++) {
+    uint16_t dr = rand() & 0x7;
+    uint16_t sr1 = rand() & 0x7;
+    if (i % 16 == 15) {
+      stream[i] = (OP_BR << 12) | ((rand() & 0x7) << 9); // offset 0
+      continue;
+    }
+    switch (rand() % 3) {
+    case 0:
+      stream[i] = (OP_ADD << 12) | (dr << 9) | (sr1 << 6) | (rand() & 0x3f);
+      break;
+    case 1:
+      stream[i] = (OP_AND << 12) | (dr << 9) | (sr1 << 6) | (rand() & 0x3f);
+      break;
+    default:
+      stream[i] = (OP_NOT << 12) | (dr << 9) | (sr1 << 6) | 0x3f;
+      break;
+    }
+  }
+}
+
+#define STEP(UPDATE_FLAGS, FLAGS)                                              \
+  uint16_t instr = stream[i];                                                  \
+  uint16_t dr = (instr >> 9) & 0x7;                                            \
+  uint16_t sr1 = (instr >> 6) & 0x7;                                           \
+  uint16_t b = (instr >> 5) & 1 ? sign_extend(instr & 0x1f, 5)                 \
+                                : reg[instr & 0x7];                            \
+  switch (instr >> 12) {                                                       \
+  case OP_ADD:                                                                 \
+    reg[dr] = reg[sr1] + b;                                                    \
+    UPDATE_FLAGS(dr);                                                          \
+    break;                                                                     \
+  case OP_AND:                                                                 \
+    reg[dr] = reg[sr1] & b;                                                    \
+    UPDATE_FLAGS(dr);                                                          \
+    break;                                                                     \
+  case OP_NOT:                                                                 \
+    reg[dr] = ~reg[sr1];                                                       \
+    UPDATE_FLAGS(dr);                                                          \
+    break;                                                                     \
+  case OP_BR:                                                                  \
+    taken += (dr & FLAGS) != 0;                                                \
+    break;                                                                     \
+  }
+
+#define EAGER_UPDATE(r)                                                        \
+  do {                                                                         \
+    if (reg[r] == 0) {                                                         \
+      reg[R_COND] = FL_ZRO;                                                    \
+    } else if (reg[r] >> 15) {                                                 \
+      reg[R_COND] = FL_NEG;                                                    \
+    } else {                                                                   \
+      reg[R_COND] = FL_POS;                                                    \
+    }                                                                          \
+  } while (0)
+
+#define EAGER_FLAGS (reg[R_COND])
+
+#define LAZY_UPDATE(r) (reg[R_COND] = reg[r])
+
+#define LAZY_FLAGS                                                             \
+  (FL_POS << ((reg[R_COND] == 0) + ((reg[R_COND] >> 15) << 1)))
+
+__attribute__((noinline)) long run_eager(long iterations, uint16_t *reg) {
+  long taken = 0;
+  for (long n = 0; n < iterations; n++) {
+    for (int i = 0; i < STREAM; i++) {
+      STEP(EAGER_UPDATE, EAGER_FLAGS)
+    }
+  }
+  return taken;
+}
+
+__attribute__((noinline)) long run_lazy(long iterations, uint16_t *reg) {
+  long taken = 0;
+  for (long n = 0; n < iterations; n++) {
+    for (int i = 0; i < STREAM; i++) {
+      STEP(LAZY_UPDATE, LAZY_FLAGS)
+    }
+  }
+  return taken;
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, const char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : 20000;
+  double instrs = (double)iterations * STREAM;
+  uint16_t reg[R_COUNT];
+
+  build_stream();
+
+  for (int i = 0; i < R_COUNT; i++) {
+    reg[i] = i;
+  }
+  reg[R_COND] = FL_POS;
+  double t = now();
+  long eager_taken = run_eager(iterations, reg);
+  double eager = (now() - t) * 1e9 / instrs;
+
+  for (int i = 0; i < R_COUNT; i++) {
+    reg[i] = i;
+  }
+  reg[R_COND] = 1;
+  t = now();
+  long lazy_taken = run_lazy(iterations, reg);
+  double lazy = (now() - t) * 1e9 / instrs;
+
+  // both must see the same branches
+  if (eager_taken != lazy_taken) {
+    printf("mismatch: %ld vs %ld branches taken\n", eager_taken, lazy_taken);
+    return 1;
+  }
+  printf("eager flags: %.3f ns/instr\n", eager);
+  printf("lazy flags:  %.3f ns/instr\n", lazy);
+  printf("saving:      %.3f ns/instr (%.1f%%)\n", eager - lazy,
+         100.0 * (eager - lazy) / eager);
+  return 0;
+}
@@ -0,0 +1,56 @@
+; keyboard polling: every input byte up to '.' is waited for on KBSR and read
+; from KBDR; prints the number of bytes and their sum
+        .ORIG x3000
+        AND R5, R5, #0
+        AND R6, R6, #0
+POLL    LDI R1, KBSR
+        BRzp POLL
+        LDI R0, KBDR
+        LD R2, NDOT
+        ADD R2, R2, R0
+        BRz DONE
+        ADD R5, R5, R0
+        ADD R6, R6, #1
+        BRnzp POLL
+DONE    ADD R0, R6, #0
+        JSR PHEX
+        ADD R0, R5, #0
+        JSR PHEX
+        HALT
+KBSR    .FILL xFE00
+KBDR    .FILL xFE02
+NDOT    .FILL #-46
+
+; print R0 as four hex digits and a newline
+PHEX    ST R7, PHR7
+        ADD R3, R0, #0
+        AND R2, R2, #0
+        ADD R2, R2, #4
+PHDIG   AND R0, R0, #0
+        AND R4, R4, #0
+        ADD R4, R4, #4
+PHBIT   ADD R0, R0, R0
+        ADD R3, R3, #0
+        BRzp PHZERO
+        ADD R0, R0, #1
+PHZERO  ADD R3, R3, R3
+        ADD R4, R4, #-1
+        BRp PHBIT
+        ADD R1, R0, #-10
+        BRn PHDEC
+        LD R1, PHALPHA
+        BRnzp PHOUT
+PHDEC   LD R1, PHZCHAR
+PHOUT   ADD R0, R0, R1
+        OUT
+        ADD R2, R2, #-1
+        BRp PHDIG
+        AND R0, R0, #0
+        ADD R0, R0, #10
+        OUT
+        LD R7, PHR7
+        RET
+PHR7    .FILL #0
+PHALPHA .FILL #55
+PHZCHAR .FILL #48
+        .END
@@ -0,0 +1,395 @@
+// benchmark suite: the workloads in bench/ under every dispatch engine
+//
+// lc3_bench [--runs=N] [--dir=DIR] [--save=FILE] [--compare=FILE]
+//           [--tolerance=PERCENT] [--check] [workload ...]
+//
+// A workload is an image from DIR, the bench directory of the source tree by
+// default, and the keyboard input it is played with, generated here so that
+// every run sees the same bytes. It runs --runs times (default 5) in a fresh
+// VM under every engine of this build; the table shows the median MIPS, the
+// fastest and slowest run and the standard deviation in percent of the mean.
+// Loading is not timed, JIT compilation is.
+//
+// Every run must halt with the output and instruction count of the first run
+// of its workload; a mismatch is reported and makes the exit status 1.
+// --save writes the medians as `workload engine mips` lines, --compare reads
+// such a file and flags every median more than --tolerance percent (default
+// 5) below the saved one, which also fails the run.
+//
+// The .asm source next to each image must assemble to the same memory as the
+// image loads, word for word; --check stops after that, without running.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lc3.h"
+
+#ifndef LC3_BENCH_DIR
+#define LC3_BENCH_DIR "bench"
+#endif
+
+// no workload gets anywhere near this, a run that does is stuck
+#define BENCH_BUDGET (1ull << 32)
+
+enum { MAX_RUNS = 100, MAX_BASELINE = 256 };
+
+struct input {
+  char *buf;
+  size_t len;
+};
+
+struct workload {
+  const char *name;
+  const char *image;
+  void (*input)(struct input *in); // NULL when it reads nothing
+};
+
+// guest I/O of one run: input from the workload, output hashed and counted
+struct run {
+  const struct input *in;
+  size_t pos;
+  uint64_t hash;
+  uint64_t bytes;
+};
+
+struct baseline {
+  char workload[32];
+  char engine[32];
+  double mips;
+};
+
+// the same pseudo-random bytes on every host
+uint32_t next_random(uint32_t *state) {
+  *state = *state * 1103515245u + 12345u;
+  return *state >> 16;
+}
+
+void random_input(struct input *in, size_t n, const char *alphabet,
+                  char last) {
+  size_t k = strlen(alphabet);
+  uint32_t state = 1;
+  in->buf = malloc(n + 1);
+  if (!in->buf) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < n; i++) {
+    in->buf[i] = alphabet[next_random(&state) % k];
+  }
+  in->buf[n] = last;
+  in->len = n + 1;
+}
+
+// text for kbpoll, which stops at '.'
+void text_input(struct input *in) {
+  random_input(in, 1000000, "etaoin shrdlu", '.');
+}
+
+// moves for 2048 and q to quit
+void moves_input(struct input *in) { random_input(in, 30000, "wasd", 'q'); }
+
+static const struct workload workloads[] = {
+    {"alu", "alu.obj", NULL},
+    {"memcpy", "memcpy.obj", NULL},
+    {"calls", "calls.obj", NULL},
+    {"puts", "puts.obj", NULL},
+    {"kbpoll", "kbpoll.obj", text_input},
+    {"2048", "2048.obj", moves_input},
+};
+
+static const char *const engines[] = {"switch", "threaded", "decoded", "jit"};
+
+int run_getc(void *ctx) {
+  struct run *r = ctx;
+  if (!r->in || r->pos == r->in->len) {
+    return -1;
+  }
+  return (unsigned char)r->in->buf[r->pos++];
+}
+
+int run_poll(void *ctx) {
+  struct run *r = ctx;
+  return r->in && r->pos < r->in->len;
+}
+
+void run_write(void *ctx, const char *buf, size_t n) {
+  struct run *r = ctx;
+  uint64_t hash = r->hash;
+  for (size_t i = 0; i < n; i++) {
+    hash = (hash ^ (unsigned char)buf[i]) * 0x100000001b3ull;
+  }
+  r->hash = hash;
+  r->bytes += n;
+}
+
+void run_flush(void *ctx) {}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int by_value(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// one timed run, returns its wall time or a negative value when the VM could
+// not be created or the image not loaded
+double run_once(const char *path, int dispatch, const struct input *in,
+                struct run *r, int *exit, uint64_t *instructions) {
+  lc3_vm *vm = lc3_vm_create();
+  if (!vm || !lc3_vm_load_image(vm, path)) {
+    lc3_vm_destroy(vm);
+    return -1;
+  }
+  lc3_vm_set_dispatch(vm, dispatch);
+  *r = (struct run){in, 0, 0xcbf29ce484222325ull, 0};
+  struct lc3_io io = {r, run_getc, run_poll, run_write, run_flush};
+  lc3_vm_set_io(vm, &io);
+  double start = now();
+  *exit = lc3_vm_run(vm, BENCH_BUDGET);
+  double seconds = now() - start;
+  *instructions = lc3_vm_instructions(vm);
+  lc3_vm_destroy(vm);
+  return seconds;
+}
+
+// 1 when path.asm assembles to exactly what path loads, which ends in .obj
+int source_matches(const char *path) {
+  char source[4096];
+  snprintf(source, sizeof(source), "%.*s.asm", (int)strlen(path) - 4, path);
+  lc3_vm *assembled = lc3_vm_create();
+  lc3_vm *loaded = lc3_vm_create();
+  struct lc3_asm_error error;
+  int ok = assembled && loaded && lc3_vm_load_image(loaded, path);
+  if (ok && !lc3_vm_assemble_file(assembled, source, NULL, &error)) {
+    if (error.line) {
+      printf("%s:%d: %s\n", source, error.line, error.message);
+    } else {
+      printf("%s\n", error.message);
+    }
+    ok = 0;
+  }
+  for (uint32_t a = 0; ok && a <= 0xFFFF; a++) {
+    if (lc3_vm_peek(assembled, a) != lc3_vm_peek(loaded, a)) {
+      printf("%s: x%04X is x%04X, %s has x%04X\n", source, a,
+             lc3_vm_peek(assembled, a), path, lc3_vm_peek(loaded, a));
+      ok = 0;
+    }
+  }
+  lc3_vm_destroy(assembled);
+  lc3_vm_destroy(loaded);
+  return ok;
+}
+
+int read_baseline(const char *path, struct baseline *b, int *count) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+  *count = 0;
+  while (*count < MAX_BASELINE &&
+         fscanf(f, "%31s %31s %lf", b[*count].workload, b[*count].engine,
+                &b[*count].mips) == 3) {
+    (*count)++;
+  }
+  fclose(f);
+  return 1;
+}
+
+const struct baseline *find_baseline(const struct baseline *b, int count,
+                                     const char *workload,
+                                     const char *engine) {
+  for (int i = 0; i < count; i++) {
+    if (strcmp(b[i].workload, workload) == 0 &&
+        strcmp(b[i].engine, engine) == 0) {
+      return &b[i];
+    }
+  }
+  return NULL;
+}
+
+int selected(const char *name, int argc, const char *argv[], int first) {
+  if (first == argc) {
+    return 1;
+  }
+  for (int i = first; i < argc; i++) {
+    if (strcmp(argv[i], name) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, const char *argv[]) {
+  int runs = 5;
+  const char *dir = LC3_BENCH_DIR;
+  const char *save = NULL;
+  const char *compare = NULL;
+  double tolerance = 5;
+  int check = 0;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strncmp(argv[i], "--runs=", 7) == 0) {
+      runs = atoi(argv[i] + 7);
+    } else if (strncmp(argv[i], "--dir=", 6) == 0) {
+      dir = argv[i] + 6;
+    } else if (strncmp(argv[i], "--save=", 7) == 0) {
+      save = argv[i] + 7;
+    } else if (strncmp(argv[i], "--compare=", 10) == 0) {
+      compare = argv[i] + 10;
+    } else if (strncmp(argv[i], "--tolerance=", 12) == 0) {
+      tolerance = atof(argv[i] + 12);
+    } else if (strcmp(argv[i], "--check") == 0) {
+      check = 1;
+    } else {
+      printf("lc3_bench [--runs=N] [--dir=DIR] [--save=FILE] "
+             "[--compare=FILE] [--tolerance=PERCENT] [--check] "
+             "[workload ...]\n");
+      return 2;
+    }
+  }
+  if (runs < 1 || runs > MAX_RUNS) {
+    printf("--runs must be between 1 and %d\n", MAX_RUNS);
+    return 2;
+  }
+
+  static struct baseline baseline[MAX_BASELINE];
+  int baseline_count = 0;
+  if (compare && !read_baseline(compare, baseline, &baseline_count)) {
+    printf("failed to read baseline: %s\n", compare);
+    return 2;
+  }
+  FILE *saved = NULL;
+  if (save && !(saved = fopen(save, "w"))) {
+    printf("failed to write baseline: %s\n", save);
+    return 2;
+  }
+
+  // engines this build does not have fall back to another one
+  int available[4];
+  lc3_vm *probe = lc3_vm_create();
+  if (!probe) {
+    printf("out of memory\n");
+    return 1;
+  }
+  for (int e = 0; e < 4; e++) {
+    available[e] = lc3_vm_set_dispatch(probe, e) == e;
+  }
+  lc3_vm_destroy(probe);
+
+  int failed = 0;
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, workloads[w].image);
+    if (selected(workloads[w].name, argc, argv, i) && !source_matches(path)) {
+      printf("%-8s source and image differ\n", workloads[w].name);
+      failed = 1;
+    }
+  }
+  if (check) {
+    return failed;
+  }
+
+  printf("%-8s %-8s %10s %10s %10s %7s %12s\n", "workload", "engine",
+         "MIPS", "min", "max", "stdev", "instructions");
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    const struct workload *wl = &workloads[w];
+    if (!selected(wl->name, argc, argv, i)) {
+      continue;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, wl->image);
+    struct input in = {NULL, 0};
+    if (wl->input) {
+      wl->input(&in);
+    }
+    int have_reference = 0;
+    struct run reference;
+    uint64_t reference_instructions = 0;
+    int missing = 0;
+
+    for (int e = 0; e < 4 && !missing; e++) {
+      if (!available[e]) {
+        continue;
+      }
+      double mips[MAX_RUNS];
+      uint64_t instructions = 0;
+      int ok = 1;
+      for (int k = 0; k < runs && ok; k++) {
+        struct run r;
+        int exit;
+        double seconds =
+            run_once(path, e, wl->input ? &in : NULL, &r, &exit, &instructions);
+        if (seconds < 0) {
+          printf("%-8s failed to load %s\n", wl->name, path);
+          missing = 1;
+          ok = 0;
+        } else if (exit != LC3_EXIT_HALT) {
+          printf("%-8s %-8s did not halt\n", wl->name, engines[e]);
+          ok = 0;
+        } else if (!have_reference) {
+          reference = r;
+          reference_instructions = instructions;
+          have_reference = 1;
+        } else if (r.hash != reference.hash || r.bytes != reference.bytes ||
+                   instructions != reference_instructions) {
+          printf("%-8s %-8s MISMATCH: %llu instructions and %llu bytes of "
+                 "output, expected %llu and %llu\n",
+                 wl->name, engines[e], (unsigned long long)instructions,
+                 (unsigned long long)r.bytes,
+                 (unsigned long long)reference_instructions,
+                 (unsigned long long)reference.bytes);
+          ok = 0;
+        }
+        mips[k] = seconds > 0 ? instructions / seconds / 1e6 : 0;
+      }
+      if (!ok) {
+        failed = 1;
+        continue;
+      }
+
+      double mean = 0;
+      for (int k = 0; k < runs; k++) {
+        mean += mips[k];
+      }
+      mean /= runs;
+      double variance = 0;
+      for (int k = 0; k < runs; k++) {
+        variance += (mips[k] - mean) * (mips[k] - mean);
+      }
+      variance /= runs;
+      qsort(mips, runs, sizeof(mips[0]), by_value);
+      double median = runs % 2 ? mips[runs / 2]
+                               : (mips[runs / 2 - 1] + mips[runs / 2]) / 2;
+      printf("%-8s %-8s %10.1f %10.1f %10.1f %6.1f%% %12llu", wl->name,
+             engines[e], median, mips[0], mips[runs - 1],
+             mean > 0 ? 100 * sqrt(variance) / mean : 0,
+             (unsigned long long)instructions);
+      const struct baseline *b =
+          find_baseline(baseline, baseline_count, wl->name, engines[e]);
+      if (b && b->mips > 0) {
+        double change = 100 * (median - b->mips) / b->mips;
+        printf("  %+6.1f%%", change);
+        if (change < -tolerance) {
+          printf(" REGRESSION");
+          failed = 1;
+        }
+      }
+      printf("\n");
+      if (saved) {
+        fprintf(saved, "%s %s %.3f\n", wl->name, engines[e], median);
+      }
+    }
+    free(in.buf);
+  }
+  if (saved) {
+    fclose(saved);
+  }
+  return failed;
+}
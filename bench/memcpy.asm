@@ -0,0 +1,82 @@
+; memory copy: 4096 words moved with LDR/STR, four per iteration, back and
+; forth between x4000 and x6000 1500 times; prints the sum of the last copy
+        .ORIG x3000
+        LD R1, SRC
+        LD R2, WORDS
+        AND R0, R0, #0
+FILL    STR R0, R1, #0
+        ADD R0, R0, #7
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp FILL
+        LD R5, PASSES
+PASS    LD R1, SRC
+        LD R2, DST
+        LD R3, BLOCKS
+COPY    LDR R0, R1, #0
+        STR R0, R2, #0
+        LDR R0, R1, #1
+        STR R0, R2, #1
+        LDR R0, R1, #2
+        STR R0, R2, #2
+        LDR R0, R1, #3
+        STR R0, R2, #3
+        ADD R1, R1, #4
+        ADD R2, R2, #4
+        ADD R3, R3, #-1
+        BRp COPY
+        LD R1, SRC
+        LD R2, DST
+        ST R1, DST
+        ST R2, SRC
+        ADD R5, R5, #-1
+        BRp PASS
+        LD R1, SRC
+        LD R2, WORDS
+        AND R0, R0, #0
+SUM     LDR R3, R1, #0
+        ADD R0, R0, R3
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp SUM
+        JSR PHEX
+        HALT
+SRC     .FILL x4000
+DST     .FILL x6000
+WORDS   .FILL #4096
+BLOCKS  .FILL #1024
+PASSES  .FILL #1500
+
+; print R0 as four hex digits and a newline
+PHEX    ST R7, PHR7
+        ADD R3, R0, #0
+        AND R2, R2, #0
+        ADD R2, R2, #4
+PHDIG   AND R0, R0, #0
+        AND R4, R4, #0
+        ADD R4, R4, #4
+PHBIT   ADD R0, R0, R0
+        ADD R3, R3, #0
+        BRzp PHZERO
+        ADD R0, R0, #1
+PHZERO  ADD R3, R3, R3
+        ADD R4, R4, #-1
+        BRp PHBIT
+        ADD R1, R0, #-10
+        BRn PHDEC
+        LD R1, PHALPHA
+        BRnzp PHOUT
+PHDEC   LD R1, PHZCHAR
+PHOUT   ADD R0, R0, R1
+        OUT
+        ADD R2, R2, #-1
+        BRp PHDIG
+        AND R0, R0, #0
+        ADD R0, R0, #10
+        OUT
+        LD R7, PHR7
+        RET
+PHR7    .FILL #0
+PHALPHA .FILL #55
+PHZCHAR .FILL #48
+        .END
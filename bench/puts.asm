@@ -0,0 +1,38 @@
+; string output: a 44 character line through PUTS and a 42 character one
+; through PUTSP, 20000 times each
+        .ORIG x3000
+        LD R5, COUNT
+LOOP    LEA R0, LINE
+        PUTS
+        LEA R0, PACKED
+        PUTSP
+        ADD R5, R5, #-1
+        BRp LOOP
+        HALT
+COUNT   .FILL #20000
+LINE    .STRINGZ "the quick brown fox jumps over the lazy dog\n"
+; "pack my box with five dozen liquor jugs!\n", two characters a word
+PACKED
+        .FILL x6170
+        .FILL x6B63
+        .FILL x6D20
+        .FILL x2079
+        .FILL x6F62
+        .FILL x2078
+        .FILL x6977
+        .FILL x6874
+        .FILL x6620
+        .FILL x7669
+        .FILL x2065
+        .FILL x6F64
+        .FILL x657A
+        .FILL x206E
+        .FILL x696C
+        .FILL x7571
+        .FILL x726F
+        .FILL x6A20
+        .FILL x6775
+        .FILL x2173
+        .FILL x000A
+        .FILL x0000
+        .END
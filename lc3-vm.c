@@ -1,564 +1,544 @@
 #include <signal.h>
-#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 /* unix */
 #include <fcntl.h>
 #include <unistd.h>
 
-#include <sys/mman.h>
-#include <sys/termios.h>
-#include <sys/time.h>
-#include <sys/types.h>
+#include "lc3.h"
 
-// registers
-enum {
-  R_R0 = 0,
-  R_R1,
-  R_R2,
-  R_R3,
-  R_R4,
-  R_R5,
-  R_R6,
-  R_R7,
-  R_PC,   // program counter
-  R_COND, // condition flags
-  R_COUNT
-};
+// --trace: the ring is written on an illegal instruction, on SIGINT and at the
+// breakpoint, from the signal handler with open, write and close only
+lc3_vm *traced_vm = NULL;
+const char *trace_path = NULL;
 
-enum {
-  OP_BR = 0, /* branch */
-  OP_ADD,    /* add  */
-  OP_LD,     /* load */
-  OP_ST,     /* store */
-  OP_JSR,    /* jump register */
-  OP_AND,    /* bitwise and */
-  OP_LDR,    /* load register */
-  OP_STR,    /* store register */
-  OP_RTI,    /* unused */
-  OP_NOT,    /* bitwise not */
-  OP_LDI,    /* load indirect */
-  OP_STI,    /* store indirect */
-  OP_JMP,    /* jump */
-  OP_RES,    /* reserved (unused) */
-  OP_LEA,    /* load effective address */
-  OP_TRAP    /* execute trap */
-};
-
-enum {
-  FL_POS = 1 << 0, /* P */
-  FL_ZRO = 1 << 1, /* Z */
-  FL_NEG = 1 << 2, /* N */
-};
-
-// definition trap code
-enum {
-  TRAP_GETC =
-      0x20, /* get character from keyboard, not echoed onto the terminal */
-  TRAP_OUT = 0x21,   /* output a character */
-  TRAP_PUTS = 0x22,  /* output a word string */
-  TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
-  TRAP_PUTSP = 0x24, /* output a byte string */
-  TRAP_HALT = 0x25   /* halt the program */
-};
-
-// KBSR: keyboard status register
-// KBDR: keyboard data register
-enum {
-  MR_KBSR = 0xFE00, /* keyboard status */
-  MR_KBDR = 0xFE02  /* keyboard data */
-};
-
-// 65536 locations
-uint16_t memory[UINT16_MAX];
-
-uint16_t reg[R_COUNT];
-
-// the break condition
-int running = 1;
-
-// sign-extending
-uint16_t sign_extend(uint16_t x, int bit_count) {
-  if ((x >> (bit_count - 1)) & 1) {
-    x |= (0xFFFF << bit_count);
-  }
-  return x;
-}
-
-// The condition codes are set, based on whether the result is
-// negative, zero, or positive.
-
-// update flags: negative, zero, positive
-void update_flags(uint16_t r) {
-  if (reg[r] == 0) {
-    reg[R_COND] = FL_ZRO;
-  } else if (reg[r] >> 15) {
-    reg[R_COND] = FL_NEG;
-  } else {
-    reg[R_COND] = FL_POS;
-  }
-}
-
-// big-endian
-uint16_t swap16(uint16_t x) { return (x << 8) | (x >> 8); }
-
-void read_image_file(FILE *file) {
-  uint16_t origin;
-  fread(&origin, sizeof(origin), 1, file);
-  origin = swap16(origin);
-
-  uint16_t max_read = UINT16_MAX - origin;
-  uint16_t *p = memory + origin;
-  size_t read = fread(p, sizeof(uint16_t), max_read, file);
-
-  while (read-- > 0) {
-    *p = swap16(*p);
-    ++p;
-  }
-}
-
-int read_image(const char *image_path) {
-  FILE *file = fopen(image_path, "rb");
-  if (!file) {
+int write_trace(void) {
+  int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
     return 0;
-  };
-  read_image_file(file);
-  fclose(file);
-  return 1;
-}
-
-uint16_t check_key() {
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(STDIN_FILENO, &readfds);
-
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 0;
-  return select(1, &readfds, NULL, NULL, &timeout) != 0;
-}
-
-// Memory Mapped Registers
-void mem_write(uint16_t address, uint16_t val) { memory[address] = val; }
-
-// Memory Mapped Registers
-uint16_t mem_read(uint16_t address) {
-  if (address == MR_KBSR) {
-    if (check_key()) {
-      memory[MR_KBSR] = (1 << 15);
-      memory[MR_KBDR] = getchar();
-    } else {
-      memory[MR_KBSR] = 0;
-    }
   }
-  return memory[address];
-}
-// unix terminal input
-struct termios original_tio;
-
-void disable_input_buffering() {
-  tcgetattr(STDIN_FILENO, &original_tio);
-  struct termios new_tio = original_tio;
-  new_tio.c_lflag &= ~ICANON & ~ECHO;
-  tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
-}
-
-void restore_input_buffering() {
-  tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+  int ok = lc3_vm_write_trace(traced_vm, fd);
+  return close(fd) == 0 && ok;
 }
 
 void handle_interrupt(int signal) {
-  restore_input_buffering();
+  if (traced_vm) {
+    write_trace();
+  }
+  lc3_console_stop();
   printf("\n");
   exit(-2);
 }
 
-// -------------------------------------------------
-
-// Addition
-// ADD | DR | SR1 | SR2/imm5
-// example:
-// ADD R2, R3, R4 ;R2 ← R3 + R4
-// ADD R2, R3, #7 ;R@ ← R3 + 7
-void ADD(uint16_t instr) {
-  uint16_t dr = (instr >> 9) & 0x7;
-  uint16_t sr1 = (instr >> 6) & 0x7;
-  uint16_t imm_flag = (instr >> 5) & 0x1;
+// SIGUSR1 asks for the stats, they are printed between two slices
+enum { STATS_SLICE = 1 << 24 };
+volatile sig_atomic_t stats_requested = 0;
 
-  if (!imm_flag) {
-    uint16_t sr2 = instr & 0x7;
-    reg[dr] = reg[sr1] + reg[sr2];
-  } else {
-    uint16_t imm = sign_extend(instr & 0x1F, 5);
-    reg[dr] = reg[sr1] + imm;
-  }
+void handle_stats(int signal) { stats_requested = 1; }
 
-  update_flags(dr);
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-// Bit-wise Logical AND
-// AND | DR | SR1 | SR2/imm5
-// example:
-// AND R2, R3, R4 ;R2 ← R3 AND R4
-// AND R2, R3, #7 ;R2 ← R3 AND 7
-void AND(uint16_t instr) {
-  uint16_t dr = (instr >> 9) & 0x7;
-  uint16_t sr1 = (instr >> 6) & 0x7;
-  uint16_t imm_flag = (instr >> 5) & 0x1;
-
-  if (!imm_flag) {
-    uint16_t sr2 = instr & 0x7;
-    reg[dr] = reg[sr1] & reg[sr2];
-  } else {
-    uint16_t imm = sign_extend(instr & 0x1f, 5);
-    reg[dr] = reg[sr1] & imm;
+// one line on stderr and, with a path, the same as JSON in that file
+void report_stats(lc3_vm *vm, const char *path, double seconds,
+                  const char *state, int timed) {
+  unsigned long long instructions = lc3_vm_instructions(vm);
+  unsigned long long cycles = lc3_vm_cycles(vm);
+  double mips = seconds > 0 ? instructions / seconds / 1e6 : 0;
+  fprintf(stderr, "%s: %llu instructions", state, instructions);
+  if (timed) {
+    fprintf(stderr, ", %llu cycles", cycles);
   }
-
-  update_flags(dr);
-}
-
-// Bit-Wise Complement
-// Assembler Format
-// NOT DR, SR
-// example:
-// NOT R4, R2 ;R4 <- NOT(R2)
-void NOT(uint16_t instr) {
-  uint16_t dr = (instr >> 9) & 0x7;
-  uint16_t sr = (instr >> 6) & 0x7;
-
-  reg[dr] = ~reg[sr];
-  update_flags(dr);
-}
-
-// Conditional Branch
-// Format:
-// BR LAMBEL
-
-// Description：
-// The condition codes specified by the state of bits [11:9] are tested. If bit
-// [11] is set, N is tested; if bit [11] is clear, N is not tested. If bit [10]
-// is set, Z is tested, etc. If any of the condition codes tested is set, the
-// program branches to the location specified by adding the sign-extended
-// PCoffset9 field to the incremented PC.
-
-// example：
-// BRzp LOOP ;Branch to LOOP if the last result was zero or positive.
-// BR   NEXT ;Unconditionally branch to NEXT.
-void BR(uint16_t instr) {
-  uint16_t cond_flag = (instr >> 9) & 0x7;
-  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-  if (cond_flag & reg[R_COND]) {
-    reg[R_PC] += pc_offset;
+  fprintf(stderr, ", %.3f s, %.1f MIPS\n", seconds, mips);
+  if (!path) {
+    return;
   }
-}
-
-// Jump/Return from Subroutine
-// example:
-// JMP R2 ;PC <- R2
-// RET    ;PC <- R7
-void JMP(uint16_t instr) {
-  // Also handles RET
-  uint16_t jmp_flag = (instr >> 6) & 0x7;
-  reg[R_PC] = reg[jmp_flag];
-}
-
-// Jump to Subroutine
-// JSR/JSRR LABEL/BaseR
-// Description
-// First, the incremented PC is saved in R7. This is the linkage back to the
-// calling routine. Then the PC is loaded with the address of the first
-// instruction of the subroutine, causing an unconditional jump to that address.
-// The address of the subroutine is obtained from the base register (if bit [11]
-// is 0), or the address is computed by sign-extending bits [10:0] and adding
-// this value to the incremented PC (if bit [11] is 1).
-
-void JSR(uint16_t instr) {
-  uint16_t baser = (instr >> 6) & 0x7;
-  uint16_t long_pc_offset = sign_extend(instr & 0x7ff, 11);
-  uint16_t long_flag = (instr >> 11) & 1;
-
-  reg[R_R7] = reg[R_PC];
-
-  if (long_flag) {
-    reg[R_PC] += long_pc_offset; // JSR
-  } else {
-    reg[R_PC] = reg[baser]; // JSRR
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "failed to write stats: %s\n", path);
+    return;
   }
+  fprintf(f,
+          "{\"state\":\"%s\",\"instructions\":%llu,\"cycles\":%llu,"
+          "\"seconds\":%.6f,\"mips\":%.3f}\n",
+          state, instructions, timed ? cycles : 0, seconds, mips);
+  fclose(f);
 }
 
-// load
-// lD DR, LABEL
-// example:
-// LD R4, VALUE ;R4 <- mem[VALUE]
-void LD(uint16_t instr) {
-  uint16_t dr = (instr >> 9) & 0x7;
-  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-
-  reg[dr] = mem_read(reg[R_PC] + pc_offset);
-  update_flags(dr);
-}
-
-// load indirect
-// example:
-// LDI R4, ONEMORE ; R4 <- mem[mem[ONEMORE]]
-void LDI(uint16_t instr) {
-  uint16_t dr = (instr >> 9) & 0x7;
-  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-
-  reg[dr] = mem_read(mem_read(reg[R_PC] + pc_offset));
-  update_flags(dr);
-}
-
-// Load Base+offset
-// Assembler Format
-// LDR DR, BaseR, offset6
-// example:
-// LDR R4, R2, #−5 ;R4 <- mem[R2 − 5]
-void LDR(uint16_t instr) {
-  uint16_t dr = (instr >> 9) & 0x7;
-  uint16_t baser = (instr >> 6) & 0x7;
-  uint16_t offset = sign_extend(instr & 0x3f, 6);
-
-  reg[dr] = mem_read(reg[baser] + offset);
-  update_flags(dr);
+const char *exit_name(int exit) {
+  switch (exit) {
+  case LC3_EXIT_HALT:
+    return "halt";
+  case LC3_EXIT_ILLEGAL:
+    return "illegal";
+  }
+  return "running";
 }
 
-// Load Effective Address
-// Assembler Format
-// LEA DR, LABEL
-// Description:
-// An address is computed by sign-extending bits [8:0] to 16 bits and adding
-// this value to the incremented PC. This address is loaded into DR. The
-// condition codes are set, based on whether the value loaded is negative, zero,
-// or positive.
-// Example:
-// LEA R4, TARGET ;R4 <- address of TARGET.
-
-void LEA(uint16_t instr) {
-  uint16_t dr = (instr >> 9) & 0x7;
-  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-
-  reg[dr] = reg[R_PC] + pc_offset;
-  update_flags(dr);
+int parse_dispatch(const char *name) {
+  if (strcmp(name, "switch") == 0) {
+    return LC3_DISPATCH_SWITCH;
+  }
+  if (strcmp(name, "threaded") == 0) {
+    return LC3_DISPATCH_THREADED;
+  }
+  if (strcmp(name, "decoded") == 0) {
+    return LC3_DISPATCH_DECODED;
+  }
+  if (strcmp(name, "jit") == 0) {
+    return LC3_DISPATCH_JIT;
+  }
+  return -1;
 }
 
-// Store
-// Assembler Format
-// ST SR, LABEL
-// Description:
-// The contents of the register specified by SR are stored in the memory
-// location whose address is computed by sign-extending bits [8:0] to 16 bits
-// and adding this value to the incremented PC.
-// Example:
-// ST R4, HERE ;mem[HERE] <- R4
-void ST(uint16_t instr) {
-  uint16_t sr = (instr >> 9) & 0x7;
-  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-
-  mem_write(reg[R_PC] + pc_offset, reg[sr]);
+const char *dispatch_name(int dispatch) {
+  static const char *const names[] = {"switch", "threaded", "decoded", "jit"};
+  return names[dispatch];
 }
 
-// Store Indirect
-// Assembler Format
-// STI SR, LABEL
-// Description
-// The contents of the register specified by SR are stored in the memory
-// location whose address is obtained as follows: Bits [8:0] are sign-extended
-// to 16 bits and added to the incremented PC. What is in memory at this address
-// is the address of the location to which the data in SR is stored.
-// Example:
-// STI R4, NOT_HERE ;mem[mem[NOT_HERE]] <- R4
-void STI(uint16_t instr) {
-  uint16_t sr = (instr >> 9) & 0x7;
-  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-
-  mem_write(mem_read(reg[R_PC] + pc_offset), reg[sr]);
+// with --obj-cache the native-endian <image>.cache is used, and written when
+// missing or stale
+int load_image(lc3_vm *vm, const char *path, int cache) {
+  if (!cache) {
+    return lc3_vm_load_image(vm, path);
+  }
+  lc3_image *image = lc3_image_open(path, LC3_IMAGE_CACHE);
+  if (!image) {
+    return 0;
+  }
+  int ok = lc3_vm_load_from(vm, image);
+  lc3_image_close(image);
+  return ok;
 }
-// Store Base+offset
-// Assembler Format
-// STR SR, BaseR, offset6
-// Example:
-// STR R4, R2, #5 ;mem[R2 + 5] <- R4
-void STR(uint16_t instr) {
-  uint16_t sr = (instr >> 9) & 0x7;
-  uint16_t baser = (instr >> 6) & 0x7;
-  uint16_t offset = sign_extend(instr & 0x3f, 6);
 
-  mem_write(reg[baser] + offset, reg[sr]);
+// sources, named *.asm or all of them with --asm, are assembled in place and
+// their labels added to symbols
+int load_source(lc3_vm *vm, const char *path, lc3_symbols *symbols) {
+  struct lc3_asm_error error;
+  if (!lc3_vm_assemble_file(vm, path, symbols, &error)) {
+    if (error.line) {
+      printf("%s:%d: %s\n", path, error.line, error.message);
+    } else {
+      printf("%s\n", error.message);
+    }
+    return 0;
+  }
+  return 1;
 }
 
-// TRAP
-// --------------------------------------------------
-
-// GETC
-// Read a single character from the keyboard. The character is not echoed onto
-// the console. Its ASCII code is copied into R0. The high eight bits of R0 are
-// cleared.
-void GETC() { reg[R_R0] = (uint16_t)getchar(); }
-
-// OUT
-// Write a character in R0[7:0] to the console display.
-void OUT() {
-  putc((char)reg[R_R0], stdout);
-  fflush(stdout);
+// --analyze: what lc3_vm_analyze() found, on stderr
+void print_analysis(const struct lc3_analysis *a) {
+  fprintf(stderr,
+          "analysis: %zu instructions in %zu blocks, %zu unknown jumps\n"
+          "analysis: stores %zu to data, %zu to code, %zu computed; %s\n"
+          "analysis: %zu of %zu condition code results never read\n",
+          a->code_words, a->blocks, a->unknown_jumps, a->data_stores,
+          a->code_stores, a->dynamic_stores,
+          a->may_self_modify ? "may modify itself" : "does not modify itself",
+          a->dead_flags, a->flag_results);
 }
 
-// PUTS
-// Write a string of ASCII characters to the console display. The characters are
-// contained in consecutive memory locations, one character per memory location,
-// starting with the address specified in R0. Writing terminates with the
-// occurrence of x0000 in a memory location.
-void PUTS() {
-  uint16_t *c = memory + reg[R_R0];
-  while (*c) {
-    putc((char)*c, stdout);
-    ++c;
-  }
-  fflush(stdout);
+int is_source(const char *path, int asm_all) {
+  size_t len = strlen(path);
+  return asm_all || (len > 4 && strcmp(path + len - 4, ".asm") == 0);
 }
 
-// IN
-// Print a prompt on the screen and read a single character from the keyboard.
-// The character is echoed onto the console monitor, and its ASCII code is
-// copied into R0. The high eight bits of R0 are cleared.
-void IN() {
-  printf("Enter a character: ");
-  char c = getchar();
-  putc(c, stdout);
-  reg[R_R0] = (uint16_t)c;
+// the captured output of a headless run, in one write
+int write_output(const struct lc3_headless *h, const char *path) {
+  FILE *f = path ? fopen(path, "wb") : stdout;
+  if (!f) {
+    return 0;
+  }
+  int ok = fwrite(h->out, 1, h->out_len, f) == h->out_len;
+  if (path) {
+    ok &= fclose(f) == 0;
+  } else {
+    ok &= fflush(f) == 0;
+  }
+  if (h->dropped) {
+    fprintf(stderr, "output buffer full, %llu bytes dropped\n",
+            (unsigned long long)h->dropped);
+  }
+  return ok;
 }
 
-// PUTSP
-// Write a string of ASCII characters to the console. The characters are
-// contained in
-// consecutive memory locations, two characters per memory location, starting
-// with the address specified in R0. The ASCII code contained in bits [7:0] of a
-// memory location is written to the console first. Then the ASCII code contained
-// in bits [15:8] of that memory location is written to the console. (A character
-// string consisting of an odd number of characters to be written will have x00
-// in bits [15:8] of the memory location containing the last character to be
-// written.) Writing terminates with the occurrence of x0000 in a memory
-// location.
-void PUTSP() {
-  uint16_t *c = memory + reg[R_R0];
-  while (*c) {
-    char char1 = (*c) & 0xff;
-    putc(char1, stdout);
-    char char2 = (*c) >> 8;
-    if (char2) {
-      putc(char2, stdout);
-    }
-    ++c;
-  }
-  fflush(stdout);
+// the sorted report in path, the folded stacks in path.folded
+void write_profile(lc3_vm *vm, const char *path) {
+  char folded[4096];
+  snprintf(folded, sizeof(folded), "%s.folded", path);
+  if (!lc3_vm_write_profile(vm, path, folded)) {
+    fprintf(stderr, "failed to write profile: %s\n", path);
+  }
 }
 
-// HALT
-// Halt execution and print a message on the console.
-void HALT() {
-  puts("HALT");
-  fflush(stdout);
-  running = 0;
-}
+// opcode pairs --fuse-profile takes from the report
+enum { FUSE_PROFILE_PAIRS = 4 };
 
 // -------------------main func----------------------
 //
 int main(int argc, const char *argv[]) {
-  // show usage string
-  if (argc < 2) {
-    printf("lc3 [image-file1] ...\n");
-    exit(2);
+  lc3_vm *vm = lc3_vm_create();
+  int dispatch = -1;
+  int images = 0;
+  int cache = 0;
+  const char *profile = NULL;
+  int stats = 0;
+  const char *stats_path = NULL;
+  int timed = 0;
+  size_t flush_bytes = 1 << 16;
+  long flush_ms = 100;
+  int headless = 0;
+  const char *input_path = NULL;
+  const char *output_path = NULL;
+  size_t output_size = 1 << 24;
+  int asm_all = 0;
+  const char *symbols_path = NULL;
+  lc3_symbols *symbols = lc3_symbols_create();
+  size_t trace_size = 1 << 24;
+  long trace_break = -1;
+  int gdb_port = 0;
+  const char *record_dir = NULL;
+  uint64_t checkpoint_every = 100;
+  const char *replay_dir = NULL;
+  uint64_t replay_to = 0;
+  int analyze = 0;
+  const char *code_cache = NULL;
+
+  if (!vm || !symbols) {
+    printf("out of memory\n");
+    exit(1);
   }
 
   for (int i = 1; i < argc; i++) {
-    if (!read_image(argv[i])) {
+    if (strncmp(argv[i], "--dispatch=", 11) == 0) {
+      dispatch = parse_dispatch(argv[i] + 11);
+      if (dispatch < 0) {
+        printf("unknown dispatch engine: %s\n", argv[i] + 11);
+        exit(2);
+      }
+      continue;
+    }
+    if (strncmp(argv[i], "--flush-bytes=", 14) == 0) {
+      flush_bytes = strtoul(argv[i] + 14, NULL, 10);
+      continue;
+    }
+    if (strncmp(argv[i], "--flush-ms=", 11) == 0) {
+      flush_ms = strtol(argv[i] + 11, NULL, 10);
+      continue;
+    }
+    if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+      long threshold = atol(argv[i] + 16);
+      if (threshold <= 0 || threshold > LC3_JIT_THRESHOLD_MAX) {
+        printf("bad jit threshold: %s\n", argv[i] + 16);
+        exit(2);
+      }
+      lc3_vm_set_jit_threshold(vm, threshold);
+      continue;
+    }
+    if (strncmp(argv[i], "--traps=", 8) == 0) {
+      if (strcmp(argv[i] + 8, "native") == 0) {
+        lc3_vm_set_traps(vm, LC3_TRAPS_NATIVE);
+      } else if (strcmp(argv[i] + 8, "os") == 0) {
+        lc3_vm_set_traps(vm, LC3_TRAPS_OS);
+      } else {
+        printf("unknown trap mode: %s\n", argv[i] + 8);
+        exit(2);
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--no-idle") == 0) {
+      lc3_vm_set_idle(vm, 0);
+      continue;
+    }
+    if (strcmp(argv[i], "--no-fusion") == 0) {
+      lc3_vm_set_fusion(vm, 0);
+      continue;
+    }
+    if (strncmp(argv[i], "--fuse-profile=", 15) == 0) {
+      if (lc3_vm_fuse_report(vm, argv[i] + 15, FUSE_PROFILE_PAIRS) < 0) {
+        printf("failed to read profile: %s\n", argv[i] + 15);
+        exit(1);
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--profile") == 0) {
+      profile = "lc3.profile";
+      continue;
+    }
+    if (strncmp(argv[i], "--profile=", 10) == 0) {
+      profile = argv[i] + 10;
+      continue;
+    }
+    if (strcmp(argv[i], "--trace") == 0) {
+      trace_path = "lc3.trace";
+      continue;
+    }
+    if (strncmp(argv[i], "--trace=", 8) == 0) {
+      trace_path = argv[i] + 8;
+      continue;
+    }
+    if (strncmp(argv[i], "--trace-size=", 13) == 0) {
+      trace_size = strtoul(argv[i] + 13, NULL, 10);
+      continue;
+    }
+    if (strncmp(argv[i], "--trace-break=", 14) == 0) {
+      const char *pc = argv[i] + 14;
+      char *end;
+      trace_break = pc[0] == 'x' || pc[0] == 'X' ? strtol(pc + 1, &end, 16)
+                                                 : strtol(pc, &end, 0);
+      if (*end || end == pc || trace_break < 0 || trace_break > 0xFFFF) {
+        printf("bad breakpoint: %s\n", pc);
+        exit(2);
+      }
+      continue;
+    }
+    if (strncmp(argv[i], "--gdb=", 6) == 0) {
+      gdb_port = atoi(argv[i] + 6);
+      if (gdb_port <= 0 || gdb_port > 0xFFFF) {
+        printf("bad port: %s\n", argv[i] + 6);
+        exit(2);
+      }
+      continue;
+    }
+    if (strncmp(argv[i], "--record=", 9) == 0) {
+      record_dir = argv[i] + 9;
+      continue;
+    }
+    if (strncmp(argv[i], "--checkpoint-every=", 19) == 0) {
+      checkpoint_every = strtoull(argv[i] + 19, NULL, 10);
+      if (!checkpoint_every) {
+        printf("bad checkpoint interval: %s\n", argv[i] + 19);
+        exit(2);
+      }
+      continue;
+    }
+    if (strncmp(argv[i], "--replay=", 9) == 0) {
+      replay_dir = argv[i] + 9;
+      continue;
+    }
+    if (strncmp(argv[i], "--replay-to=", 12) == 0) {
+      replay_to = strtoull(argv[i] + 12, NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--cycles") == 0) {
+      timed = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--stats") == 0) {
+      stats = 1;
+      continue;
+    }
+    if (strncmp(argv[i], "--stats=", 8) == 0) {
+      stats = 1;
+      stats_path = argv[i] + 8;
+      continue;
+    }
+    if (strcmp(argv[i], "--headless") == 0) {
+      headless = 1;
+      continue;
+    }
+    if (strncmp(argv[i], "--input=", 8) == 0) {
+      headless = 1;
+      input_path = argv[i] + 8;
+      continue;
+    }
+    if (strncmp(argv[i], "--output=", 9) == 0) {
+      headless = 1;
+      output_path = argv[i] + 9;
+      continue;
+    }
+    if (strncmp(argv[i], "--output-size=", 14) == 0) {
+      output_size = strtoul(argv[i] + 14, NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--analyze") == 0) {
+      analyze = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--asm") == 0) {
+      asm_all = 1;
+      continue;
+    }
+    if (strncmp(argv[i], "--symbols=", 10) == 0) {
+      symbols_path = argv[i] + 10;
+      continue;
+    }
+    if (strcmp(argv[i], "--obj-cache") == 0) {
+      cache = 1;
+      continue;
+    }
+    if (strncmp(argv[i], "--code-cache=", 13) == 0) {
+      code_cache = argv[i] + 13;
+      continue;
+    }
+    argv[images++] = argv[i];
+  }
+
+  for (int i = 0; i < images; i++) {
+    if (is_source(argv[i], asm_all)) {
+      if (!load_source(vm, argv[i], symbols)) {
+        exit(1);
+      }
+    } else if (!load_image(vm, argv[i], cache)) {
       printf("failed to load image: %s\n", argv[i]);
       exit(1);
     }
   }
+  if (symbols_path && !lc3_symbols_write(symbols, symbols_path)) {
+    printf("failed to write symbols: %s\n", symbols_path);
+    exit(1);
+  }
+  lc3_vm_set_symbols(vm, symbols);
+
+  // show usage string
+  if (images == 0) {
+    printf("lc3 [--dispatch=switch|threaded|decoded|jit] "
+           "[--jit-threshold=N] [--no-fusion] [--fuse-profile=FILE] "
+           "[--no-idle] [--traps=native|os] "
+           "[--flush-bytes=N] [--flush-ms=N] [--profile[=FILE]] [--cycles] "
+           "[--stats[=FILE]] [--trace[=FILE]] [--trace-size=N] "
+           "[--trace-break=ADDR] [--gdb=PORT] [--record=DIR] "
+           "[--checkpoint-every=MILLIONS] [--replay=DIR] [--replay-to=N] "
+           "[--headless] [--input=FILE] [--output=FILE] [--output-size=N] "
+           "[--obj-cache] [--code-cache=DIR] [--asm] [--symbols=FILE] "
+           "[--analyze] [image-file1] ...\n");
+    exit(2);
+  }
+
+  if (record_dir && replay_dir) {
+    printf("--record and --replay cannot be combined\n");
+    exit(2);
+  }
+
+  if (dispatch >= 0) {
+    int used = lc3_vm_set_dispatch(vm, dispatch);
+    if (used != dispatch) {
+      fprintf(stderr, "%s dispatch not available, using %s\n",
+              dispatch_name(dispatch), dispatch_name(used));
+    }
+  }
+
+  if (code_cache && !lc3_vm_set_code_cache(vm, code_cache)) {
+    printf("cannot use code cache: %s\n", code_cache);
+    exit(1);
+  }
+  if (timed) {
+    lc3_vm_set_cycle_costs(vm, lc3_default_cycles);
+  }
+  if (profile && !lc3_vm_set_profile(vm, 1)) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  if (trace_path) {
+    if (!lc3_vm_set_trace(vm, trace_size)) {
+      printf("out of memory\n");
+      exit(1);
+    }
+    if (trace_break >= 0) {
+      lc3_vm_set_trace_break(vm, 1, (uint16_t)trace_break);
+    }
+    traced_vm = vm;
+  }
 
   /* Setup */
   signal(SIGINT, handle_interrupt);
-  disable_input_buffering();
+  signal(SIGUSR1, handle_stats);
+  struct lc3_headless h;
+  struct lc3_io io;
+  if (headless) {
+    if (!lc3_headless_init(&h, output_size)) {
+      printf("out of memory\n");
+      exit(1);
+    }
+    if (input_path && !lc3_headless_map_input(&h, input_path)) {
+      printf("failed to read input: %s\n", input_path);
+      exit(1);
+    }
+    io = lc3_headless_io(&h);
+  } else {
+    lc3_console_set_flush(flush_bytes, flush_ms);
+    lc3_console_start();
+    io = lc3_console_io();
+  }
+  lc3_vm_set_io(vm, &io);
 
-  /* set the PC to starting position */
-  /* 0x3000 is the default */
-  enum { PC_START = 0x3000 };
-  reg[R_PC] = PC_START;
+  // a replay starts where it was asked to and goes on with the recorded input
+  if (replay_dir && !lc3_vm_replay(vm, replay_dir, replay_to)) {
+    lc3_console_stop();
+    fprintf(stderr, "failed to replay %s\n", replay_dir);
+    return 1;
+  }
+  if (record_dir &&
+      !lc3_vm_record(vm, record_dir, checkpoint_every * 1000000)) {
+    lc3_console_stop();
+    fprintf(stderr, "failed to record to %s\n", record_dir);
+    return 1;
+  }
 
-  while (running) {
-    uint16_t instr = mem_read(reg[R_PC]++);
-    uint16_t op = instr >> 12;
+  // where the guest starts, after any replay; the decoded engine uses it
+  struct lc3_analysis analysis;
+  if (!lc3_vm_analyze(vm, &analysis)) {
+    fprintf(stderr, "out of memory for the analysis\n");
+  } else if (analyze) {
+    print_analysis(&analysis);
+  }
 
-    switch (op) {
-    case OP_ADD:
-      ADD(instr);
-      break;
-    case OP_AND:
-      AND(instr);
-      break;
-    case OP_NOT:
-      NOT(instr);
-      break;
-    case OP_BR:
-      BR(instr);
-      break;
-    case OP_JMP:
-      JMP(instr);
-      break;
-    case OP_JSR:
-      JSR(instr);
-      break;
-    case OP_LD:
-      LD(instr);
-      break;
-    case OP_LDI:
-      LDI(instr);
-      break;
-    case OP_LDR:
-      LDR(instr);
-      break;
-    case OP_LEA:
-      LEA(instr);
-      break;
-    case OP_ST:
-      ST(instr);
-      break;
-    case OP_STI:
-      STI(instr);
-      break;
-    case OP_STR:
-      STR(instr);
-      break;
-    case OP_TRAP:
-      switch (instr & 0xFF) {
-      case TRAP_GETC:
-        GETC();
-        break;
-      case TRAP_OUT:
-        OUT();
-        break;
-      case TRAP_PUTS:
-        PUTS();
-        break;
-      case TRAP_IN:
-        IN();
-        break;
-      case TRAP_PUTSP:
-        PUTSP();
-        break;
-      case TRAP_HALT:
-        HALT();
-        break;
+  double start = now();
+  int exit = LC3_EXIT_BUDGET;
+  if (gdb_port) {
+    // the guest runs under the debugger until it leaves, then on its own
+    fprintf(stderr, "waiting for gdb on port %d\n", gdb_port);
+    exit = lc3_vm_serve_gdb(vm, gdb_port);
+    if (exit < 0) {
+      lc3_console_stop();
+      fprintf(stderr, "cannot listen on port %d\n", gdb_port);
+      return 1;
+    }
+  }
+  while (exit == LC3_EXIT_BUDGET || exit == LC3_EXIT_BREAK) {
+    exit = lc3_vm_run(vm, STATS_SLICE);
+    if (exit == LC3_EXIT_BREAK) {
+      // the first time only, a breakpoint in a loop would write it forever
+      lc3_vm_set_trace_break(vm, 0, 0);
+      if (!write_trace()) {
+        fprintf(stderr, "failed to write trace: %s\n", trace_path);
       }
-      break;
-    case OP_RES:
-    case OP_RTI:
-    default:
-      abort();
-      break;
     }
+    if (stats_requested) {
+      stats_requested = 0;
+      report_stats(vm, stats_path, now() - start, "running", timed);
+    }
+  }
+  double seconds = now() - start;
+  if (record_dir && !lc3_vm_record(vm, NULL, 0)) {
+    fprintf(stderr, "failed to write recording: %s\n", record_dir);
+  }
+  if (headless) {
+    if (!write_output(&h, output_path)) {
+      fprintf(stderr, "failed to write output: %s\n",
+              output_path ? output_path : "stdout");
+    }
+    lc3_headless_free(&h);
+  } else {
+    lc3_console_stop();
+  }
+  if (stats) {
+    report_stats(vm, stats_path, seconds, exit_name(exit), timed);
+  }
+  if (profile) {
+    write_profile(vm, profile);
+  }
+  if (exit == LC3_EXIT_ILLEGAL) {
+    if (traced_vm && !write_trace()) {
+      fprintf(stderr, "failed to write trace: %s\n", trace_path);
+    }
+    abort();
   }
-  restore_input_buffering();
+  lc3_vm_destroy(vm);
+  lc3_symbols_free(symbols);
 }
@@ -0,0 +1,250 @@
+// static analysis
+// --------------------------------------------------
+// lc3_vm_analyze() builds the control-flow graph of the words in memory,
+// starting at the PC (PC_START after loading): BR to its target and past it,
+// JSR into the subroutine and past it, traps past them unless they HALT.
+// JMP, JSRR and traps served from the vector table go somewhere only known
+// when they run, RET (JMP R7) is taken to come back past its JSR. Two things
+// come out of it:
+//  - which ST instructions write a word that is not code, so that the decoded
+//    engine can store without invalidating its caches;
+//  - which results set condition codes that no BR reads before the next
+//    result replaces them. These are only reported: the flags are the last
+//    result itself in R_COND, one store, and the host can read the PSR after
+//    any instruction, so the engines keep writing them.
+//
+// The ST handlers rely on the targets never running as code. That holds as
+// long as control stays on the graph and its instructions stay as they were,
+// so the analysis is dropped, and the decode cache with it, when a store
+// writes a reachable instruction, a jump or trap leaves the graph or the
+// decoded engine starts off it, and when memory or the engine is changed from
+// outside.
+#include "vm.h"
+
+#include <stdlib.h>
+
+static inline void bit_set(uint64_t *bits, uint16_t a) {
+  bits[a >> 6] |= (uint64_t)1 << (a & 63);
+}
+
+// the next instructions of the one at pc, 0 to 2 of them; *unknown is set for
+// a jump or trap whose target is only known when it runs
+static int successors(const lc3_vm *vm, uint16_t pc, uint16_t next[2],
+                      int *unknown) {
+  uint16_t instr = vm->memory[pc];
+  uint16_t after = pc + 1;
+  *unknown = 0;
+  switch (instr >> 12) {
+  case OP_BR: {
+    uint16_t target = after + sign_extend(instr & 0x1FF, 9);
+    int nzp = (instr >> 9) & 0x7;
+    if (nzp == 0x7) {
+      next[0] = target;
+      return 1;
+    }
+    next[0] = after;
+    if (nzp) {
+      next[1] = target;
+      return 2;
+    }
+    return 1;
+  }
+  case OP_JMP:
+    *unknown = ((instr >> 6) & 0x7) != R_R7;
+    return 0;
+  case OP_JSR:
+    next[0] = after;
+    if (instr & 0x800) {
+      next[1] = after + sign_extend(instr & 0x7FF, 11);
+      return 2;
+    }
+    *unknown = 1;
+    return 1;
+  case OP_TRAP:
+    switch (instr & 0xFF) {
+    case TRAP_HALT:
+      return 0;
+    case TRAP_GETC:
+    case TRAP_OUT:
+    case TRAP_PUTS:
+    case TRAP_IN:
+    case TRAP_PUTSP:
+      break;
+    default:
+      *unknown = vm->memory[TRAP_TABLE + (instr & 0xFF)] != 0;
+      break;
+    }
+    next[0] = after;
+    return 1;
+  case OP_RTI:
+  case OP_RES:
+    return 0; // the VM stops
+  }
+  next[0] = after;
+  return 1;
+}
+
+// ADD, AND, NOT, LEA and the loads
+static int sets_flags(uint16_t instr) {
+  switch (instr >> 12) {
+  case OP_ADD:
+  case OP_AND:
+  case OP_NOT:
+  case OP_LEA:
+  case OP_LD:
+  case OP_LDI:
+  case OP_LDR:
+    return 1;
+  }
+  return 0;
+}
+
+// Condition codes live into each instruction, to a fixed point: read by a BR
+// with a condition, or passed on by an instruction that does not set them.
+// Past an unknown target they may be read.
+static void flags_liveness(const lc3_vm *vm, const uint64_t *code,
+                           uint64_t *live) {
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    for (int a = IO_PAGE - 1; a >= 0; a--) {
+      if (!analysis_bit(code, a) || analysis_bit(live, a)) {
+        continue;
+      }
+      uint16_t instr = vm->memory[a];
+      int in = 0;
+      if ((instr >> 12) == OP_BR) {
+        in = (instr & 0x0E00) != 0;
+      }
+      if (!in && !sets_flags(instr)) {
+        uint16_t next[2];
+        int unknown;
+        int n = successors(vm, a, next, &unknown);
+        in = unknown || (instr >> 12) == OP_JMP;
+        for (int i = 0; i < n && !in; i++) {
+          in = next[i] >= IO_PAGE || analysis_bit(live, next[i]);
+        }
+      }
+      if (in) {
+        bit_set(live, a);
+        changed = 1;
+      }
+    }
+  }
+}
+
+void vm_analysis_drop(lc3_vm *vm) {
+  if (!vm->analysis) {
+    return;
+  }
+  free(vm->analysis);
+  vm->analysis = NULL;
+  if (vm->decode_cache) {
+    vm_decode_invalidate_all(vm);
+  }
+}
+
+int lc3_vm_analyze(lc3_vm *vm, struct lc3_analysis *report) {
+  vm_analysis_drop(vm);
+  struct analysis *an = calloc(1, sizeof(*an));
+  uint16_t *stack = malloc((UINT16_MAX + 1) * sizeof(uint16_t));
+  uint64_t *leaders = calloc((UINT16_MAX + 1) / 64, sizeof(uint64_t));
+  uint64_t *live = calloc((UINT16_MAX + 1) / 64, sizeof(uint64_t));
+  if (!an || !stack || !leaders || !live) {
+    free(an);
+    free(stack);
+    free(leaders);
+    free(live);
+    return 0;
+  }
+  struct lc3_analysis r = {0};
+
+  // depth first from the PC, never into the device page
+  size_t depth = 0;
+  uint16_t entry = vm->reg[R_PC];
+  if (entry < IO_PAGE) {
+    bit_set(an->code, entry);
+    bit_set(leaders, entry);
+    stack[depth++] = entry;
+  }
+  while (depth) {
+    uint16_t pc = stack[--depth];
+    uint16_t next[2];
+    int unknown;
+    int n = successors(vm, pc, next, &unknown);
+    r.code_words++;
+    r.unknown_jumps += unknown;
+    uint16_t instr = vm->memory[pc];
+    int branch = (instr >> 12) == OP_BR || (instr >> 12) == OP_JSR ||
+                 (instr >> 12) == OP_JMP || unknown;
+    for (int i = 0; i < n; i++) {
+      if (next[i] >= IO_PAGE) {
+        r.unknown_jumps++;
+        continue;
+      }
+      if (branch) {
+        bit_set(leaders, next[i]);
+      }
+      if (!analysis_bit(an->code, next[i])) {
+        bit_set(an->code, next[i]);
+        stack[depth++] = next[i];
+      }
+    }
+  }
+
+  // stores and flags over the whole graph
+  flags_liveness(vm, an->code, live);
+  for (int a = 0; a < IO_PAGE; a++) {
+    if (!analysis_bit(an->code, a)) {
+      continue;
+    }
+    uint16_t instr = vm->memory[a];
+    r.blocks += analysis_bit(leaders, a);
+    switch (instr >> 12) {
+    case OP_ST: {
+      uint16_t target = a + 1 + sign_extend(instr & 0x1FF, 9);
+      if (target >= IO_PAGE) {
+        break; // a device register
+      }
+      if (analysis_bit(an->code, target)) {
+        r.code_stores++;
+      } else {
+        r.data_stores++;
+        bit_set(an->data_st, a);
+      }
+      break;
+    }
+    case OP_STI:
+    case OP_STR:
+      r.dynamic_stores++;
+      break;
+    }
+    if (sets_flags(instr)) {
+      r.flag_results++;
+      uint16_t next[2];
+      int unknown;
+      int n = successors(vm, a, next, &unknown);
+      int out = unknown;
+      for (int i = 0; i < n && !out; i++) {
+        out = next[i] >= IO_PAGE || analysis_bit(live, next[i]);
+      }
+      r.dead_flags += !out;
+    }
+  }
+  r.may_self_modify = r.code_stores || r.dynamic_stores;
+  free(stack);
+  free(leaders);
+  free(live);
+  if (report) {
+    *report = r;
+  }
+
+  // the other trap mode jumps through tables the graph does not follow
+  if (vm->traps != LC3_TRAPS_NATIVE) {
+    free(an);
+    return 1;
+  }
+  vm_invalidate_all(vm);
+  vm->analysis = an;
+  return 1;
+}
@@ -0,0 +1,588 @@
+// assembler
+// --------------------------------------------------
+// LC-3 assembly in two passes. The first splits every line into a label, a
+// mnemonic and operands, gives each statement its address and enters the
+// labels into a symbol table; the second encodes the statements straight into
+// the memory of the VM, resolving labels through that table.
+#include "vm.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// label, mnemonic and three operands
+enum { MAX_TOKENS = 5, MAX_OPERANDS = 3 };
+
+struct token {
+  const char *s;
+  size_t len;
+};
+
+enum {
+  K_ALU,     // ADD, AND: DR, SR1, SR2 or imm5
+  K_NOT,     // DR, SR
+  K_BR,      // PCoffset9
+  K_JMP,     // BaseR, also JSRR
+  K_JSR,     // PCoffset11
+  K_PC9,     // LD, LDI, LEA, ST, STI: R, PCoffset9
+  K_BASE6,   // LDR, STR: R, BaseR, offset6
+  K_TRAP,    // trapvect8
+  K_FIXED,   // no operands: RET, RTI and the trap aliases
+  K_ORIG,    // directives
+  K_END,
+  K_FILL,
+  K_BLKW,
+  K_STRINGZ
+};
+
+struct mnemonic {
+  const char *name;
+  uint8_t kind;
+  uint8_t operands;
+  uint16_t bits;
+};
+
+// BR and its condition suffixes are matched in find_mnemonic()
+static const struct mnemonic mnemonics[] = {
+    {"ADD", K_ALU, 3, 0x1000},       {"AND", K_ALU, 3, 0x5000},
+    {"NOT", K_NOT, 2, 0x903F},       {"JMP", K_JMP, 1, 0xC000},
+    {"RET", K_FIXED, 0, 0xC1C0},     {"JSR", K_JSR, 1, 0x4800},
+    {"JSRR", K_JMP, 1, 0x4000},      {"LD", K_PC9, 2, 0x2000},
+    {"LDI", K_PC9, 2, 0xA000},       {"LEA", K_PC9, 2, 0xE000},
+    {"ST", K_PC9, 2, 0x3000},        {"STI", K_PC9, 2, 0xB000},
+    {"LDR", K_BASE6, 3, 0x6000},     {"STR", K_BASE6, 3, 0x7000},
+    {"TRAP", K_TRAP, 1, 0xF000},     {"RTI", K_FIXED, 0, 0x8000},
+    {"GETC", K_FIXED, 0, 0xF020},    {"OUT", K_FIXED, 0, 0xF021},
+    {"PUTS", K_FIXED, 0, 0xF022},    {"IN", K_FIXED, 0, 0xF023},
+    {"PUTSP", K_FIXED, 0, 0xF024},   {"HALT", K_FIXED, 0, 0xF025},
+    {".ORIG", K_ORIG, 1, 0},         {".END", K_END, 0, 0},
+    {".FILL", K_FILL, 1, 0},         {".BLKW", K_BLKW, 1, 0},
+    {".STRINGZ", K_STRINGZ, 1, 0},
+};
+
+struct statement {
+  int line;
+  uint16_t address;
+  uint8_t kind;
+  uint8_t count; // operands
+  uint16_t bits;
+  struct token operand[MAX_OPERANDS];
+};
+
+struct assembler {
+  struct statement *list;
+  size_t count;
+  size_t cap;
+  lc3_symbols *symbols; // the labels of this source
+  struct lc3_asm_error *error;
+};
+
+static int fail(struct assembler *a, int line, const char *format, ...) {
+  if (a->error) {
+    va_list args;
+    va_start(args, format);
+    a->error->line = line;
+    vsnprintf(a->error->message, sizeof(a->error->message), format, args);
+    va_end(args);
+  }
+  return 0;
+}
+
+// tokens
+// --------------------------------------------------
+
+// split the line [p, end) at blanks and commas up to its comment, a quoted
+// string is one token with its quotes; -1 for an unterminated string, -2 for
+// too many tokens
+static int split(const char *p, const char *end, struct token *t) {
+  int n = 0;
+  while (p < end && *p != ';') {
+    if (isspace((unsigned char)*p) || *p == ',') {
+      p++;
+      continue;
+    }
+    if (n == MAX_TOKENS) {
+      return -2;
+    }
+    const char *start = p;
+    if (*p == '"') {
+      for (p++; p < end && *p != '"'; p++) {
+        if (*p == '\\' && p + 1 < end) {
+          p++;
+        }
+      }
+      if (p == end) {
+        return -1;
+      }
+      p++;
+    } else {
+      while (p < end && !isspace((unsigned char)*p) && *p != ',' &&
+             *p != ';') {
+        p++;
+      }
+    }
+    t[n++] = (struct token){start, p - start};
+  }
+  return n;
+}
+
+static int token_is(struct token t, const char *s) {
+  return strlen(s) == t.len && strncasecmp(t.s, s, t.len) == 0;
+}
+
+// #decimal, decimal, xhex or 0xhex, with an optional sign after the prefix
+static int number(struct token t, long *value) {
+  const char *p = t.s;
+  const char *end = t.s + t.len;
+  int base = 10;
+  if (p < end && *p == '#') {
+    p++;
+  } else if (p < end && (*p == 'x' || *p == 'X')) {
+    base = 16;
+    p++;
+  } else if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    base = 16;
+    p += 2;
+  }
+  int negative = 0;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p++ == '-';
+  }
+  if (p == end || end - p > 8) {
+    return 0;
+  }
+  long v = 0;
+  for (; p < end; p++) {
+    int c = tolower((unsigned char)*p);
+    int digit = isdigit(c) ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : 99;
+    if (digit >= base) {
+      return 0;
+    }
+    v = v * base + digit;
+  }
+  *value = negative ? -v : v;
+  return 1;
+}
+
+// R0..R7, -1 otherwise
+static int reg(struct token t) {
+  if (t.len == 2 && (t.s[0] == 'R' || t.s[0] == 'r') && t.s[1] >= '0' &&
+      t.s[1] <= '7') {
+    return t.s[1] - '0';
+  }
+  return -1;
+}
+
+static int is_label(struct token t) {
+  long v;
+  if (!(isalpha((unsigned char)t.s[0]) || t.s[0] == '_') || reg(t) >= 0 ||
+      number(t, &v)) {
+    return 0;
+  }
+  for (size_t i = 1; i < t.len; i++) {
+    if (!isalnum((unsigned char)t.s[i]) && t.s[i] != '_') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// the mnemonic or directive t names, into m; 0 when it is none
+static int find_mnemonic(struct token t, struct mnemonic *m) {
+  for (size_t i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); i++) {
+    if (token_is(t, mnemonics[i].name)) {
+      *m = mnemonics[i];
+      return 1;
+    }
+  }
+  // BR, BRn, BRz, BRp, BRnz, BRnp, BRzp and BRnzp, BR alone is BRnzp
+  if (t.len < 2 || t.len > 5 || strncasecmp(t.s, "BR", 2) != 0) {
+    return 0;
+  }
+  uint16_t nzp = 0;
+  int last = 3;
+  for (size_t i = 2; i < t.len; i++) {
+    const char *flag = strchr("nzp", tolower((unsigned char)t.s[i]));
+    int bit = flag ? 2 - (int)(flag - "nzp") : 3;
+    if (!flag || bit >= last) {
+      return 0;
+    }
+    nzp |= 1 << bit;
+    last = bit;
+  }
+  *m = (struct mnemonic){"BR", K_BR, 1, (nzp ? nzp : 7) << 9};
+  return 1;
+}
+
+// the bytes of a .STRINGZ operand without its quotes and escapes, into buf
+// unless it is NULL; -1 for an unknown escape
+static long string_bytes(struct token t, char *buf) {
+  long n = 0;
+  for (size_t i = 1; i + 1 < t.len; i++) {
+    char c = t.s[i];
+    if (c == '\\') {
+      switch (t.s[++i]) {
+      case 'n':
+        c = '\n';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 'e':
+        c = 27;
+        break;
+      case '0':
+        c = 0;
+        break;
+      case '\\':
+      case '"':
+      case '\'':
+        c = t.s[i];
+        break;
+      default:
+        return -1;
+      }
+    }
+    if (buf) {
+      buf[n] = c;
+    }
+    n++;
+  }
+  return n;
+}
+
+// first pass
+// --------------------------------------------------
+
+static int add_statement(struct assembler *a, const struct statement *st) {
+  if (a->count == a->cap) {
+    size_t cap = a->cap ? a->cap * 2 : 256;
+    struct statement *list = realloc(a->list, cap * sizeof(*list));
+    if (!list) {
+      return 0;
+    }
+    a->list = list;
+    a->cap = cap;
+  }
+  a->list[a->count++] = *st;
+  return 1;
+}
+
+// the words a statement occupies, 0 with the error set when it is invalid
+static long statement_size(struct assembler *a, const struct statement *st) {
+  long v;
+  switch (st->kind) {
+  case K_BLKW:
+    if (!number(st->operand[0], &v) || v < 1) {
+      return fail(a, st->line, ".BLKW needs a positive word count");
+    }
+    return v;
+  case K_STRINGZ:
+    if (st->operand[0].s[0] != '"') {
+      return fail(a, st->line, ".STRINGZ needs a quoted string");
+    }
+    v = string_bytes(st->operand[0], NULL);
+    if (v < 0) {
+      return fail(a, st->line, "unknown escape in string");
+    }
+    return v + 1;
+  default:
+    return 1;
+  }
+}
+
+static int first_pass(struct assembler *a, const char *text, size_t len) {
+  long pc = -1; // outside of .ORIG blocks
+  int line = 0;
+  for (const char *p = text, *end = text + len; p < end;) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol) {
+      eol = end;
+    }
+    line++;
+    struct token t[MAX_TOKENS];
+    int n = split(p, eol, t);
+    p = eol + 1;
+    if (n == -1) {
+      return fail(a, line, "unterminated string");
+    }
+    if (n == -2) {
+      return fail(a, line, "too many operands");
+    }
+    if (n == 0) {
+      continue;
+    }
+
+    int i = 0;
+    struct mnemonic m;
+    if (!find_mnemonic(t[0], &m)) {
+      struct token label = t[0];
+      if (label.len > 1 && label.s[label.len - 1] == ':') {
+        label.len--;
+      }
+      if (!is_label(label)) {
+        return fail(a, line, "invalid label '%.*s'", (int)t[0].len, t[0].s);
+      }
+      if (pc < 0) {
+        return fail(a, line, "label '%.*s' outside of .ORIG", (int)label.len,
+                    label.s);
+      }
+      if (vm_symbols_find(a->symbols, label.s, label.len) >= 0) {
+        return fail(a, line, "label '%.*s' defined twice", (int)label.len,
+                    label.s);
+      }
+      if (!vm_symbols_add(a->symbols, label.s, label.len, (uint16_t)pc)) {
+        return fail(a, line, "out of memory");
+      }
+      if (n == 1) {
+        continue;
+      }
+      i = 1;
+      if (!find_mnemonic(t[1], &m)) {
+        // `FOO R1` misspells an instruction rather than labels one
+        long v;
+        struct token bad = reg(t[1]) >= 0 || number(t[1], &v) ? t[0] : t[1];
+        return fail(a, line, "unknown instruction '%.*s'", (int)bad.len,
+                    bad.s);
+      }
+    }
+    if (n - i - 1 != m.operands) {
+      return fail(a, line, "%s takes %d operand%s", m.name, m.operands,
+                  m.operands == 1 ? "" : "s");
+    }
+
+    long v;
+    if (m.kind == K_ORIG) {
+      if (pc >= 0) {
+        return fail(a, line, ".ORIG before the .END of the previous block");
+      }
+      if (!number(t[i + 1], &v) || v < 0 || v > UINT16_MAX) {
+        return fail(a, line, ".ORIG needs an address");
+      }
+      pc = v;
+      continue;
+    }
+    if (m.kind == K_END) {
+      if (pc < 0) {
+        return fail(a, line, ".END without .ORIG");
+      }
+      pc = -1;
+      continue;
+    }
+    if (pc < 0) {
+      return fail(a, line, "%s outside of .ORIG", m.name);
+    }
+
+    struct statement st = {line, (uint16_t)pc, m.kind, (uint8_t)(n - i - 1),
+                           m.bits};
+    memcpy(st.operand, t + i + 1, st.count * sizeof(struct token));
+    long size = statement_size(a, &st);
+    if (size == 0) {
+      return 0;
+    }
+    if (pc + size > UINT16_MAX + 1) {
+      return fail(a, line, "program runs past xFFFF");
+    }
+    if (!add_statement(a, &st)) {
+      return fail(a, line, "out of memory");
+    }
+    pc += size;
+  }
+  return 1;
+}
+
+// second pass
+// --------------------------------------------------
+
+static int operand_reg(struct assembler *a, const struct statement *st, int i,
+                       int *r) {
+  *r = reg(st->operand[i]);
+  if (*r < 0) {
+    return fail(a, st->line, "expected a register, not '%.*s'",
+                (int)st->operand[i].len, st->operand[i].s);
+  }
+  return 1;
+}
+
+// a number in [lo, hi], masked to bits
+static int operand_imm(struct assembler *a, const struct statement *st, int i,
+                       long lo, long hi, int bits, uint16_t *field) {
+  long v;
+  if (!number(st->operand[i], &v)) {
+    return fail(a, st->line, "expected a number, not '%.*s'",
+                (int)st->operand[i].len, st->operand[i].s);
+  }
+  if (v < lo || v > hi) {
+    return fail(a, st->line, "%ld does not fit in %d bits", v, bits);
+  }
+  *field = (uint16_t)v & ((1u << bits) - 1);
+  return 1;
+}
+
+static int operand_label(struct assembler *a, const struct statement *st, int i,
+                         uint16_t *address) {
+  struct token t = st->operand[i];
+  if (!vm_symbols_lookup(a->symbols, t.s, t.len, address)) {
+    return fail(a, st->line, "undefined label '%.*s'", (int)t.len, t.s);
+  }
+  return 1;
+}
+
+// a label relative to the next instruction, or a number taken as the offset
+static int operand_offset(struct assembler *a, const struct statement *st,
+                          int i, int bits, uint16_t *field) {
+  struct token t = st->operand[i];
+  long lo = -(1l << (bits - 1));
+  long hi = (1l << (bits - 1)) - 1;
+  if (!is_label(t)) {
+    return operand_imm(a, st, i, lo, hi, bits, field);
+  }
+  uint16_t target;
+  if (!operand_label(a, st, i, &target)) {
+    return 0;
+  }
+  long offset = (long)target - (st->address + 1);
+  if (offset < lo || offset > hi) {
+    return fail(a, st->line, "'%.*s' is too far for a %d-bit offset",
+                (int)t.len, t.s, bits);
+  }
+  *field = (uint16_t)offset & ((1u << bits) - 1);
+  return 1;
+}
+
+static int emit(lc3_vm *vm, uint16_t address, uint16_t word) {
+  vm_load_words(vm, address, &word, 1);
+  return 1;
+}
+
+static int encode(struct assembler *a, lc3_vm *vm, const struct statement *st) {
+  int r, s, t;
+  uint16_t field = 0;
+  long v;
+  switch (st->kind) {
+  case K_ALU:
+    if (!operand_reg(a, st, 0, &r) || !operand_reg(a, st, 1, &s)) {
+      return 0;
+    }
+    if ((t = reg(st->operand[2])) >= 0) {
+      return emit(vm, st->address, st->bits | r << 9 | s << 6 | t);
+    }
+    if (!operand_imm(a, st, 2, -16, 15, 5, &field)) {
+      return 0;
+    }
+    return emit(vm, st->address, st->bits | r << 9 | s << 6 | 0x20 | field);
+  case K_NOT:
+    if (!operand_reg(a, st, 0, &r) || !operand_reg(a, st, 1, &s)) {
+      return 0;
+    }
+    return emit(vm, st->address, st->bits | r << 9 | s << 6);
+  case K_BR:
+    return operand_offset(a, st, 0, 9, &field) &&
+           emit(vm, st->address, st->bits | field);
+  case K_JMP:
+    return operand_reg(a, st, 0, &r) &&
+           emit(vm, st->address, st->bits | r << 6);
+  case K_JSR:
+    return operand_offset(a, st, 0, 11, &field) &&
+           emit(vm, st->address, st->bits | field);
+  case K_PC9:
+    return operand_reg(a, st, 0, &r) && operand_offset(a, st, 1, 9, &field) &&
+           emit(vm, st->address, st->bits | r << 9 | field);
+  case K_BASE6:
+    return operand_reg(a, st, 0, &r) && operand_reg(a, st, 1, &s) &&
+           operand_imm(a, st, 2, -32, 31, 6, &field) &&
+           emit(vm, st->address, st->bits | r << 9 | s << 6 | field);
+  case K_TRAP:
+    return operand_imm(a, st, 0, 0, 0xFF, 8, &field) &&
+           emit(vm, st->address, st->bits | field);
+  case K_FIXED:
+    return emit(vm, st->address, st->bits);
+  case K_FILL:
+    if (is_label(st->operand[0])) {
+      uint16_t address;
+      return operand_label(a, st, 0, &address) &&
+             emit(vm, st->address, address);
+    }
+    return operand_imm(a, st, 0, INT16_MIN, UINT16_MAX, 16, &field) &&
+           emit(vm, st->address, field);
+  case K_BLKW:
+    number(st->operand[0], &v);
+    for (long i = 0; i < v; i++) {
+      emit(vm, st->address + i, 0);
+    }
+    return 1;
+  case K_STRINGZ: {
+    size_t n = string_bytes(st->operand[0], NULL);
+    char *bytes = malloc(n + 1);
+    if (!bytes) {
+      return fail(a, st->line, "out of memory");
+    }
+    string_bytes(st->operand[0], bytes);
+    for (size_t i = 0; i < n; i++) {
+      emit(vm, st->address + i, (uint8_t)bytes[i]);
+    }
+    emit(vm, st->address + n, 0);
+    free(bytes);
+    return 1;
+  }
+  }
+  return 0;
+}
+
+int lc3_vm_assemble(lc3_vm *vm, const char *text, size_t len,
+                    lc3_symbols *symbols, struct lc3_asm_error *error) {
+  struct assembler a = {NULL, 0, 0, lc3_symbols_create(), error};
+  if (!a.symbols) {
+    return fail(&a, 0, "out of memory");
+  }
+  int ok = first_pass(&a, text, len);
+  for (size_t i = 0; ok && i < a.count; i++) {
+    ok = encode(&a, vm, &a.list[i]);
+  }
+  if (ok && symbols && !vm_symbols_append(symbols, a.symbols)) {
+    ok = fail(&a, 0, "out of memory");
+  }
+  free(a.list);
+  lc3_symbols_free(a.symbols);
+  return ok;
+}
+
+int lc3_vm_assemble_file(lc3_vm *vm, const char *path, lc3_symbols *symbols,
+                         struct lc3_asm_error *error) {
+  struct assembler a = {NULL, 0, 0, NULL, error};
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return fail(&a, 0, "cannot open %s", path);
+  }
+  char *text = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  for (;;) {
+    if (cap - len < 4096) {
+      cap = cap ? cap * 2 : 1 << 16;
+      char *grown = realloc(text, cap);
+      if (!grown) {
+        free(text);
+        fclose(f);
+        return fail(&a, 0, "out of memory");
+      }
+      text = grown;
+    }
+    size_t n = fread(text + len, 1, cap - len, f);
+    len += n;
+    if (n == 0) {
+      break;
+    }
+  }
+  int read_error = ferror(f);
+  fclose(f);
+  int ok = read_error ? fail(&a, 0, "cannot read %s", path)
+                      : lc3_vm_assemble(vm, text, len, symbols, error);
+  free(text);
+  return ok;
+}
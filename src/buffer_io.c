@@ -0,0 +1,50 @@
+// memory backend: input and output in host buffers
+#include "lc3.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int buffer_getc(void *ctx) {
+  struct lc3_buffer *b = ctx;
+  if (b->in_pos == b->in_len) {
+    return -1;
+  }
+  return (unsigned char)b->in[b->in_pos++];
+}
+
+static int buffer_poll(void *ctx) {
+  struct lc3_buffer *b = ctx;
+  return b->in_pos < b->in_len;
+}
+
+static void buffer_write(void *ctx, const char *buf, size_t n) {
+  struct lc3_buffer *b = ctx;
+  if (b->out_cap - b->out_len < n) {
+    size_t cap = b->out_cap ? b->out_cap : 256;
+    while (cap - b->out_len < n) {
+      cap *= 2;
+    }
+    char *out = realloc(b->out, cap);
+    if (!out) {
+      return;
+    }
+    b->out = out;
+    b->out_cap = cap;
+  }
+  memcpy(b->out + b->out_len, buf, n);
+  b->out_len += n;
+}
+
+static void buffer_flush(void *ctx) {}
+
+struct lc3_io lc3_buffer_io(struct lc3_buffer *b) {
+  struct lc3_io io = {b, buffer_getc, buffer_poll, buffer_write, buffer_flush};
+  return io;
+}
+
+void lc3_buffer_free(struct lc3_buffer *b) {
+  free(b->out);
+  b->out = NULL;
+  b->out_len = 0;
+  b->out_cap = 0;
+}
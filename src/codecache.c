@@ -0,0 +1,219 @@
+// persistent code cache
+// --------------------------------------------------
+// A profile is three bitmaps over the addresses below the device page, kept
+// in <dir>/<key>.lc3p where the key is a hash of those words as the first
+// run found them: the entries of the decode cache that were filled, the heads
+// of superinstruction groups and the entries of compiled blocks. Attaching
+// maps the file and prepares all of it before the first instruction; saving
+// merges the caches of the run into what the file holds by then and replaces
+// it, under a temporary name, only when that adds something. Concurrent runs
+// of one program lose at most the additions of the one renamed first.
+//
+// Only addresses go to disk. Decode entries hold handler pointers and compiled
+// blocks call helpers at absolute addresses, neither survives into another
+// process, and both are rebuilt from memory in microseconds. Since every
+// entry is rebuilt from the words actually there, a profile of other contents
+// costs some wasted decoding at most, never a wrong instruction.
+#include "vm.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum { CODE_CACHE_VERSION = 1, CODE_CACHE_WORDS = IO_PAGE / 64 };
+
+struct code_profile {
+  char magic[4]; // "LC3P"
+  uint32_t version;
+  uint64_t key;
+  uint64_t decoded[CODE_CACHE_WORDS]; // decode cache entries filled
+  uint64_t fused[CODE_CACHE_WORDS];   // heads of superinstruction groups
+  uint64_t blocks[CODE_CACHE_WORDS];  // entries of compiled blocks
+};
+
+// FNV-1a over 64-bit lanes of the words below the device page, never 0
+static uint64_t code_hash(const uint16_t *words) {
+  const uint64_t *p = (const uint64_t *)words;
+  uint64_t h = 0xcbf29ce484222325;
+  for (size_t i = 0; i < IO_PAGE * sizeof(uint16_t) / sizeof(*p); i++) {
+    h = (h ^ p[i]) * 0x100000001b3;
+  }
+  return h ? h : 1;
+}
+
+static void profile_path(const struct code_cache *c, char *buf, size_t n) {
+  snprintf(buf, n, "%s/%016llx.lc3p", c->dir, (unsigned long long)c->key);
+}
+
+// the profile of the key, NULL when there is none or it does not fit
+static const struct code_profile *profile_map(const struct code_cache *c) {
+  char path[4096 + 32];
+  profile_path(c, path, sizeof(path));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  const struct code_profile *p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size == sizeof(*p)) {
+    p = mmap(NULL, sizeof(*p), PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+  if (memcmp(p->magic, "LC3P", 4) != 0 || p->version != CODE_CACHE_VERSION ||
+      p->key != c->key) {
+    munmap((void *)p, sizeof(*p));
+    return NULL;
+  }
+  return p;
+}
+
+static inline void bits_for_each(const uint64_t *bits, lc3_vm *vm,
+                                 void (*fn)(lc3_vm *vm, uint16_t pc)) {
+  for (int w = 0; w < CODE_CACHE_WORDS; w++) {
+    for (uint64_t m = bits[w]; m; m &= m - 1) {
+      fn(vm, w * 64 + __builtin_ctzll(m));
+    }
+  }
+}
+
+static void predecode(lc3_vm *vm, uint16_t pc) {
+  struct decoded *d = &vm->decode_cache[pc];
+  if (d->fn == vm_d_miss) {
+    vm_decode(vm, pc, d);
+  }
+}
+
+void vm_code_cache_attach(lc3_vm *vm) {
+  struct code_cache *c = vm->code_cache;
+  c->key = code_hash(vm->memory);
+  if (!vm->decode_cache || (vm->dispatch != LC3_DISPATCH_DECODED &&
+                            vm->dispatch != LC3_DISPATCH_JIT)) {
+    return; // the other engines keep nothing, there is nothing to prepare
+  }
+  const struct code_profile *p = profile_map(c);
+  if (!p) {
+    return;
+  }
+  bits_for_each(p->decoded, vm, predecode);
+  if (vm->fusion && vm->dispatch == LC3_DISPATCH_DECODED) {
+    bits_for_each(p->fused, vm, vm_fuse);
+  }
+#if LC3_HAVE_JIT
+  if (vm->dispatch == LC3_DISPATCH_JIT) {
+    vm_jit_warm(vm, p->blocks, CODE_CACHE_WORDS);
+  }
+#endif
+  munmap((void *)p, sizeof(*p));
+}
+
+// what the caches hold now, 0 when they hold nothing
+static int profile_take(const lc3_vm *vm, struct code_profile *p) {
+  int any = 0;
+  if (vm->decode_cache) {
+    const struct decoded *cache = vm->decode_cache;
+    for (int a = 0; a < IO_PAGE; a++) {
+      uint64_t bit = (uint64_t)1 << (a & 63);
+      if (cache[a].fn != vm_d_miss) {
+        p->decoded[a >> 6] |= bit;
+        any = 1;
+      }
+      if (cache[a].len > 1) {
+        p->fused[a >> 6] |= bit;
+      }
+    }
+  }
+#if LC3_HAVE_JIT
+  if (vm->jit) {
+    any |= vm_jit_entries(vm, p->blocks, CODE_CACHE_WORDS);
+  }
+#endif
+  return any;
+}
+
+// or `from` into `to`, nonzero when that set a bit `to` did not have
+static int bits_merge(uint64_t *to, const uint64_t *from) {
+  int added = 0;
+  for (int w = 0; w < CODE_CACHE_WORDS; w++) {
+    added |= (from[w] & ~to[w]) != 0;
+    to[w] |= from[w];
+  }
+  return added;
+}
+
+// like lc3_vm_save(), written whole under a temporary name and renamed
+static void code_cache_save(lc3_vm *vm) {
+  struct code_cache *c = vm->code_cache;
+  struct code_profile *run = calloc(1, sizeof(*run));
+  if (!run || !profile_take(vm, run)) {
+    free(run);
+    return;
+  }
+  const struct code_profile *old = profile_map(c);
+  if (old) {
+    int added = bits_merge(run->decoded, old->decoded) |
+                bits_merge(run->fused, old->fused) |
+                bits_merge(run->blocks, old->blocks);
+    munmap((void *)old, sizeof(*old));
+    if (!added) {
+      free(run);
+      return; // an identical or larger profile is there already
+    }
+  }
+  memcpy(run->magic, "LC3P", 4);
+  run->version = CODE_CACHE_VERSION;
+  run->key = c->key;
+
+  char path[4096 + 32];
+  char tmp[4096 + 40];
+  profile_path(c, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd >= 0) {
+    int ok = vm_write_all(fd, run, sizeof(*run)) && fchmod(fd, 0644) == 0;
+    ok &= close(fd) == 0;
+    if (!ok || rename(tmp, path) < 0) {
+      unlink(tmp);
+    }
+  }
+  free(run);
+}
+
+void vm_code_cache_detach(lc3_vm *vm) {
+  if (vm->code_cache && vm->code_cache->key) {
+    code_cache_save(vm);
+    vm->code_cache->key = 0;
+  }
+}
+
+void vm_code_cache_free(lc3_vm *vm) {
+  vm_code_cache_detach(vm);
+  free(vm->code_cache);
+  vm->code_cache = NULL;
+}
+
+int lc3_vm_set_code_cache(lc3_vm *vm, const char *dir) {
+  vm_code_cache_free(vm);
+  if (!dir) {
+    return 1;
+  }
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    return 0;
+  }
+  struct code_cache *c = calloc(1, sizeof(*c));
+  if (!c) {
+    return 0;
+  }
+  snprintf(c->dir, sizeof(c->dir), "%s", dir);
+  vm->code_cache = c;
+  return 1;
+}
@@ -0,0 +1,264 @@
+// console backend: the terminal on stdin and stdout
+#include "lc3.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+/* unix */
+#include <unistd.h>
+
+#include <sys/termios.h>
+#include <sys/types.h>
+
+// keyboard input
+// A reader thread moves stdin into a single-producer single-consumer ring, so
+// a guest polling KBSR only does an atomic load. Only a consumer that has to
+// block (GETC, IN) or a producer facing a full ring touch the mutex.
+enum { KEY_QUEUE_SIZE = 4096 }; // power of two
+
+struct key_queue {
+  _Atomic uint32_t head; // next slot written by the reader thread
+  _Atomic uint32_t tail; // next slot read by the guest
+  _Atomic int eof;
+  _Atomic int consumer_waiting;
+  _Atomic int producer_waiting;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  uint8_t buf[KEY_QUEUE_SIZE];
+};
+
+static struct key_queue keys = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                .not_empty = PTHREAD_COND_INITIALIZER,
+                                .not_full = PTHREAD_COND_INITIALIZER};
+
+static void key_wake(_Atomic int *waiting, pthread_cond_t *cond) {
+  if (atomic_load(waiting)) {
+    pthread_mutex_lock(&keys.lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&keys.lock);
+  }
+}
+
+static void *key_reader(void *arg) {
+  for (;;) {
+    uint32_t head = atomic_load_explicit(&keys.head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&keys.tail, memory_order_acquire);
+    uint32_t space = KEY_QUEUE_SIZE - (head - tail);
+    if (space == 0) {
+      pthread_mutex_lock(&keys.lock);
+      atomic_store(&keys.producer_waiting, 1);
+      while (atomic_load(&keys.head) - atomic_load(&keys.tail) ==
+             KEY_QUEUE_SIZE) {
+        pthread_cond_wait(&keys.not_full, &keys.lock);
+      }
+      atomic_store(&keys.producer_waiting, 0);
+      pthread_mutex_unlock(&keys.lock);
+      continue;
+    }
+    // never read across the end of the ring
+    uint32_t offset = head & (KEY_QUEUE_SIZE - 1);
+    if (space > KEY_QUEUE_SIZE - offset) {
+      space = KEY_QUEUE_SIZE - offset;
+    }
+    ssize_t n = read(STDIN_FILENO, keys.buf + offset, space);
+    if (n <= 0) {
+      atomic_store(&keys.eof, 1);
+      key_wake(&keys.consumer_waiting, &keys.not_empty);
+      return NULL;
+    }
+    atomic_store(&keys.head, head + (uint32_t)n);
+    key_wake(&keys.consumer_waiting, &keys.not_empty);
+  }
+}
+
+static void key_start(void) {
+  pthread_t thread;
+  pthread_create(&thread, NULL, key_reader, NULL);
+  pthread_detach(thread);
+}
+
+// a key is waiting
+static int key_ready(void) {
+  return atomic_load_explicit(&keys.head, memory_order_acquire) !=
+         atomic_load_explicit(&keys.tail, memory_order_relaxed);
+}
+
+// consume the next key, only valid when key_ready()
+static uint8_t key_pop(void) {
+  uint32_t tail = atomic_load_explicit(&keys.tail, memory_order_relaxed);
+  uint8_t c = keys.buf[tail & (KEY_QUEUE_SIZE - 1)];
+  atomic_store(&keys.tail, tail + 1);
+  key_wake(&keys.producer_waiting, &keys.not_full);
+  return c;
+}
+
+// blocking read like getchar(), -1 at the end of input
+static int key_get(void) {
+  if (!key_ready()) {
+    pthread_mutex_lock(&keys.lock);
+    atomic_store(&keys.consumer_waiting, 1);
+    while (!key_ready() && !atomic_load(&keys.eof)) {
+      pthread_cond_wait(&keys.not_empty, &keys.lock);
+    }
+    atomic_store(&keys.consumer_waiting, 0);
+    pthread_mutex_unlock(&keys.lock);
+    if (!key_ready()) {
+      return -1;
+    }
+  }
+  return key_pop();
+}
+
+// block until a key is waiting, the end of input or timeout_ms, forever when
+// it is negative
+static int key_wait(long timeout_ms) {
+  if (key_ready() || atomic_load(&keys.eof)) {
+    return key_ready();
+  }
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock(&keys.lock);
+  atomic_store(&keys.consumer_waiting, 1);
+  while (!key_ready() && !atomic_load(&keys.eof)) {
+    if (timeout_ms < 0) {
+      pthread_cond_wait(&keys.not_empty, &keys.lock);
+    } else if (pthread_cond_timedwait(&keys.not_empty, &keys.lock,
+                                      &deadline) != 0) {
+      break;
+    }
+  }
+  atomic_store(&keys.consumer_waiting, 0);
+  pthread_mutex_unlock(&keys.lock);
+  return key_ready();
+}
+
+// console output
+// Trap output is collected in one buffer and handed to the kernel with a
+// single write(). It is flushed before the guest blocks on input, on HALT, when
+// it reaches console_flush_bytes and once console_flush_ms have passed since
+// the last flush. On a terminal every output trap is flushed right away.
+enum { CONSOLE_BUFFER_SIZE = 1 << 16 };
+
+static char console_buf[CONSOLE_BUFFER_SIZE];
+static size_t console_len;
+static size_t console_flush_bytes = CONSOLE_BUFFER_SIZE;
+static long console_flush_ms = 100;
+static int console_tty;
+static struct timespec console_last_flush;
+
+static long ms_since(const struct timespec *t) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static void console_init(void) {
+  console_tty = isatty(STDOUT_FILENO);
+  clock_gettime(CLOCK_MONOTONIC, &console_last_flush);
+}
+
+static void console_flush(void) {
+  size_t done = 0;
+  while (done < console_len) {
+    ssize_t n = write(STDOUT_FILENO, console_buf + done, console_len - done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  console_len = 0;
+  clock_gettime(CLOCK_MONOTONIC, &console_last_flush);
+}
+
+static void console_write(const char *s, size_t n) {
+  while (n > 0) {
+    if (console_len == CONSOLE_BUFFER_SIZE) {
+      console_flush();
+    }
+    size_t chunk = CONSOLE_BUFFER_SIZE - console_len;
+    if (chunk > n) {
+      chunk = n;
+    }
+    memcpy(console_buf + console_len, s, chunk);
+    console_len += chunk;
+    s += chunk;
+    n -= chunk;
+  }
+}
+
+// end of an output trap, the VM hands over its output once per trap
+static void console_trap_done(void) {
+  if (console_tty || console_len >= console_flush_bytes ||
+      (console_len > 0 && ms_since(&console_last_flush) >= console_flush_ms)) {
+    console_flush();
+  }
+}
+
+// unix terminal input, a pipe or file on stdin is read as it is
+static struct termios original_tio;
+static int input_buffering_disabled;
+
+static void disable_input_buffering(void) {
+  if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &original_tio) < 0) {
+    return;
+  }
+  struct termios new_tio = original_tio;
+  new_tio.c_lflag &= ~ICANON & ~ECHO;
+  input_buffering_disabled = tcsetattr(STDIN_FILENO, TCSANOW, &new_tio) == 0;
+}
+
+static void restore_input_buffering(void) {
+  if (input_buffering_disabled) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    input_buffering_disabled = 0;
+  }
+}
+
+// lc3_io callbacks
+static int console_io_getc(void *ctx) { return key_get(); }
+
+static int console_io_poll(void *ctx) { return key_ready(); }
+
+static int console_io_wait(void *ctx, long timeout_ms) {
+  return key_wait(timeout_ms);
+}
+
+static void console_io_write(void *ctx, const char *buf, size_t n) {
+  console_write(buf, n);
+  console_trap_done();
+}
+
+static void console_io_flush(void *ctx) { console_flush(); }
+
+void lc3_console_start(void) {
+  disable_input_buffering();
+  key_start();
+  console_init();
+}
+
+void lc3_console_stop(void) {
+  console_flush();
+  restore_input_buffering();
+}
+
+struct lc3_io lc3_console_io(void) {
+  struct lc3_io io = {NULL,           console_io_getc,
+                      console_io_poll, console_io_write,
+                      console_io_flush, 0,
+                      console_io_wait};
+  return io;
+}
+
+void lc3_console_set_flush(size_t flush_bytes, long flush_ms) {
+  console_flush_bytes = flush_bytes;
+  console_flush_ms = flush_ms;
+}
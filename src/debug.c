@@ -0,0 +1,572 @@
+// breakpoints and the GDB remote serial protocol
+// --------------------------------------------------
+// While a VM has breakpoints it runs under vm_run_debug(), which checks the PC
+// against a bitmap before every instruction and runs that instruction on its
+// own through the switch engine, or the tracing, profiling or timed copy of it
+// when one is on; the threaded, decoded and JIT engines never run under
+// breakpoints. The bitmap is only consulted there: without breakpoints
+// run_engine() never looks at it, so the fast engines, the decode cache and
+// the JIT stay exactly as they are.
+//
+// lc3_vm_serve_gdb() speaks the remote protocol to one debugger over TCP.
+// GDB has no LC-3 target, so the layout is this stub's own: registers 0 to 7
+// are R0..R7, 8 the PC and 9 the PSR, 16 bits each, and memory is addressed in
+// bytes, word w at 2w, low byte first. Memory goes through mem_read() and
+// mem_write() like the guest's own loads and stores, so device registers act
+// as they would for the guest. A VM replaying a recording can also step and
+// continue backwards.
+#include "vm.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void vm_debug_free(lc3_vm *vm) {
+  free(vm->debug);
+  vm->debug = NULL;
+}
+
+int lc3_vm_set_breakpoint(lc3_vm *vm, uint16_t address, int on) {
+  struct debug *d = vm->debug;
+  if (!d) {
+    if (!on) {
+      return 1;
+    }
+    d = vm->debug = calloc(1, sizeof(*d));
+    if (!d) {
+      return 0;
+    }
+    d->resume = UINT64_MAX;
+  }
+  uint64_t bit = (uint64_t)1 << (address & 63);
+  if (!(d->bits[address >> 6] & bit) != !on) {
+    d->bits[address >> 6] ^= bit;
+    d->count += on ? 1 : -1;
+  }
+  // the last one gone, the engines run untouched again
+  if (!d->count) {
+    vm_debug_free(vm);
+  }
+  return 1;
+}
+
+void lc3_vm_clear_breakpoints(lc3_vm *vm) { vm_debug_free(vm); }
+
+// one instruction through the switch engine or the recording, counting or
+// timed copy of it that run_engine() would have picked, never the dispatch
+// engine
+static uint64_t step(lc3_vm *vm) {
+  if (vm->trace) {
+    return vm_run_trace(vm, 1);
+  }
+  if (vm->profile) {
+    return vm_run_profile(vm, 1);
+  }
+  return vm->timed ? vm_run_timed(vm, 1) : vm_run_switch(vm, 1);
+}
+
+uint64_t vm_run_debug(lc3_vm *vm, uint64_t budget) {
+  struct debug *d = vm->debug;
+  uint64_t n = 0;
+  while (n < budget && vm->running) {
+    uint16_t pc = vm->reg[R_PC];
+    uint64_t at = vm->instructions + n;
+    if (d->bits[pc >> 6] >> (pc & 63) & 1 && d->resume != at) {
+      d->resume = at;
+      vm_stop(vm, LC3_EXIT_BREAK);
+      break;
+    }
+    n += step(vm);
+  }
+  return n;
+}
+
+// remote protocol
+// --------------------------------------------------
+
+enum {
+  GDB_PACKET = 4096,
+  GDB_SLICE = 1 << 16, // instructions between checks for an interrupt
+  GDB_REGS = 10,
+};
+
+// what gdb_command() leaves the server to do
+enum { GDB_REPLY, GDB_REPLIED, GDB_DETACH, GDB_KILL };
+
+// signals in stop replies
+enum { SIG_INT = 2, SIG_ILL = 4, SIG_TRAP = 5 };
+
+struct gdb {
+  lc3_vm *vm;
+  int fd;
+  int no_ack;
+  int stop; // the last stop reply, a signal or -1 after the guest halted
+  uint8_t in[GDB_PACKET];
+  size_t in_len;
+  size_t in_pos;
+  char packet[GDB_PACKET + 1];
+  char reply[GDB_PACKET + 1];
+};
+
+// the next byte from the debugger, -1 when it went away
+static int gdb_byte(struct gdb *g) {
+  if (g->in_pos == g->in_len) {
+    ssize_t n = read(g->fd, g->in, sizeof(g->in));
+    if (n <= 0) {
+      return -1;
+    }
+    g->in_len = n;
+    g->in_pos = 0;
+  }
+  return g->in[g->in_pos++];
+}
+
+// 1 when the debugger sent an interrupt (0x03) while the guest ran; anything
+// else it sends then is dropped
+static int gdb_interrupted(struct gdb *g) {
+  struct pollfd p = {g->fd, POLLIN, 0};
+  while (g->in_pos < g->in_len || poll(&p, 1, 0) > 0) {
+    int c = gdb_byte(g);
+    if (c < 0 || c == 0x03) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int hex_digit(int c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// a hex number at *p, moving past it
+static unsigned long parse_hex(const char **p) {
+  unsigned long v = 0;
+  int d;
+  while ((d = hex_digit(**p)) >= 0) {
+    v = v << 4 | d;
+    (*p)++;
+  }
+  return v;
+}
+
+// a packet into g->packet, NUL-terminated; 0 when the debugger went away
+static int gdb_recv(struct gdb *g) {
+  for (;;) {
+    int c;
+    while ((c = gdb_byte(g)) != '$') {
+      if (c < 0) {
+        return 0;
+      }
+    }
+    size_t len = 0;
+    uint8_t sum = 0;
+    while ((c = gdb_byte(g)) != '#') {
+      if (c < 0) {
+        return 0;
+      }
+      if (len < GDB_PACKET) {
+        g->packet[len++] = c;
+      }
+      sum += c;
+    }
+    int hi = gdb_byte(g);
+    int lo = gdb_byte(g);
+    if (hi < 0 || lo < 0) {
+      return 0;
+    }
+    int ok = hex_digit(hi) >= 0 && hex_digit(lo) >= 0 &&
+             (hex_digit(hi) << 4 | hex_digit(lo)) == sum;
+    if (!g->no_ack && write(g->fd, ok ? "+" : "-", 1) != 1) {
+      return 0;
+    }
+    if (ok) {
+      g->packet[len] = '\0';
+      return 1;
+    }
+  }
+}
+
+static int gdb_send(struct gdb *g, const char *data) {
+  static const char digits[] = "0123456789abcdef";
+  char buf[GDB_PACKET + 4];
+  size_t len = strlen(data);
+  uint8_t sum = 0;
+  buf[0] = '$';
+  for (size_t i = 0; i < len; i++) {
+    buf[1 + i] = data[i];
+    sum += (uint8_t)data[i];
+  }
+  buf[1 + len] = '#';
+  buf[2 + len] = digits[sum >> 4];
+  buf[3 + len] = digits[sum & 0xF];
+  return vm_write_all(g->fd, buf, len + 4);
+}
+
+static void put_hex16(char *out, uint16_t v) {
+  snprintf(out, 5, "%02x%02x", v & 0xFF, v >> 8);
+}
+
+// 4 hex digits, low byte first; -1 when they are not
+static long get_hex16(const char *p) {
+  int d[4];
+  for (int i = 0; i < 4; i++) {
+    if ((d[i] = hex_digit(p[i])) < 0) {
+      return -1;
+    }
+  }
+  return (d[0] << 4 | d[1]) | (d[2] << 4 | d[3]) << 8;
+}
+
+static uint16_t gdb_reg(const lc3_vm *vm, int r) {
+  return r == GDB_REGS - 1 ? vm_psr(vm) : vm->reg[r];
+}
+
+static void gdb_set_reg(lc3_vm *vm, int r, uint16_t v) {
+  if (r < GDB_REGS - 1) {
+    vm->reg[r] = v;
+    return;
+  }
+  vm->psr = v & (PSR_USER | PSR_PRIORITY);
+  // any result with the same N/Z/P, as RTI does
+  vm->reg[R_COND] = v & FL_NEG ? 0x8000 : v & FL_ZRO ? 0 : 1;
+}
+
+static void stop_reply(struct gdb *g) {
+  if (g->stop < 0) {
+    snprintf(g->reply, sizeof(g->reply), "W00");
+  } else {
+    snprintf(g->reply, sizeof(g->reply), "S%02x", g->stop);
+  }
+}
+
+// runs the guest for c (one instruction for s) and sets the stop reply;
+// a breakpoint at the PC it resumes from does not stop it again
+static void gdb_resume(struct gdb *g, int single) {
+  lc3_vm *vm = g->vm;
+  const char *p = g->packet + 1;
+  if (*p) {
+    vm->reg[R_PC] = (uint16_t)(parse_hex(&p) >> 1);
+  }
+  if (vm->debug) {
+    vm->debug->resume = vm->instructions;
+  }
+  int exit;
+  for (;;) {
+    exit = lc3_vm_run(vm, single ? 1 : GDB_SLICE);
+    if (exit != LC3_EXIT_BUDGET || single) {
+      break;
+    }
+    if (gdb_interrupted(g)) {
+      g->stop = SIG_INT;
+      stop_reply(g);
+      return;
+    }
+  }
+  g->stop = exit == LC3_EXIT_HALT      ? -1
+            : exit == LC3_EXIT_ILLEGAL ? SIG_ILL
+                                       : SIG_TRAP;
+  stop_reply(g);
+}
+
+// the last breakpoint hit before `now`: each interval from its checkpoint is
+// run again, the latest first, up to the start of the next one searched; the
+// start of the recording when there is none
+static uint64_t previous_break(lc3_vm *vm, uint64_t now) {
+  struct record *r = vm->record;
+  for (size_t i = r->checkpoint_count; vm->debug && i-- > 0;) {
+    uint64_t from = r->checkpoints[i].instructions;
+    if (from >= now || !vm_replay_seek(vm, from)) {
+      continue;
+    }
+    vm->debug->resume = UINT64_MAX;
+    uint64_t hit = UINT64_MAX;
+    while (vm->instructions < now &&
+           lc3_vm_run(vm, now - vm->instructions) == LC3_EXIT_BREAK) {
+      hit = vm->instructions;
+    }
+    if (hit != UINT64_MAX) {
+      return hit;
+    }
+    now = from;
+  }
+  return r->checkpoints[0].instructions;
+}
+
+// bs and bc, while replaying: the guest goes back one instruction, or to the
+// last breakpoint it hit, by replaying the recording up to there
+static void gdb_reverse(struct gdb *g, int single) {
+  lc3_vm *vm = g->vm;
+  struct record *r = vm->record;
+  if (!r || !r->replaying) {
+    return; // not supported
+  }
+  uint64_t now = vm->instructions;
+  uint64_t target = r->checkpoints[0].instructions;
+  if (single) {
+    target = now > target ? now - 1 : target;
+  } else {
+    target = previous_break(vm, now);
+  }
+  if (!vm_replay_seek(vm, target)) {
+    snprintf(g->reply, sizeof(g->reply), "E01");
+    return;
+  }
+  g->stop = SIG_TRAP;
+  stop_reply(g);
+}
+
+// m addr,len and M addr,len:bytes, addresses in bytes
+static void gdb_memory(struct gdb *g, int store) {
+  lc3_vm *vm = g->vm;
+  const char *p = g->packet + 1;
+  uint32_t addr = parse_hex(&p);
+  if (*p++ != ',') {
+    snprintf(g->reply, sizeof(g->reply), "E01");
+    return;
+  }
+  unsigned long len = parse_hex(&p);
+  if (len > (GDB_PACKET - 1) / 2 || (store && *p++ != ':')) {
+    snprintf(g->reply, sizeof(g->reply), "E01");
+    return;
+  }
+  char *out = g->reply;
+  for (unsigned long i = 0; i < len;) {
+    uint32_t b = (addr + i) & 0x1FFFF;
+    uint16_t w = b >> 1;
+    // every word is read (and written) once, whole, as the guest would
+    int first = b & 1;
+    int n = first || len - i == 1 ? 1 : 2;
+    if (!store) {
+      uint16_t v = mem_read(vm, w);
+      for (int k = first; k < first + n; k++) {
+        out += snprintf(out, 3, "%02x", (v >> (8 * k)) & 0xFF);
+      }
+    } else {
+      uint16_t v = n == 2 ? 0 : mem_read(vm, w);
+      for (int k = first; k < first + n; k++, p += 2) {
+        int hi = hex_digit(p[0]);
+        int lo = hi < 0 ? -1 : hex_digit(p[1]);
+        if (lo < 0) {
+          snprintf(g->reply, sizeof(g->reply), "E01");
+          return;
+        }
+        v = (v & ~(0xFF << (8 * k))) | (hi << 4 | lo) << (8 * k);
+      }
+      mem_write(vm, w, v);
+    }
+    i += n;
+  }
+  if (store) {
+    snprintf(g->reply, sizeof(g->reply), "OK");
+  } else {
+    *out = '\0';
+  }
+}
+
+// Z0/Z1 addr,kind and z0/z1, software and hardware breakpoints alike
+static void gdb_breakpoint(struct gdb *g) {
+  const char *p = g->packet;
+  int on = *p++ == 'Z';
+  if (*p != '0' && *p != '1') {
+    g->reply[0] = '\0'; // watchpoints are not supported
+    return;
+  }
+  p++;
+  if (*p++ != ',') {
+    snprintf(g->reply, sizeof(g->reply), "E01");
+    return;
+  }
+  uint16_t address = (parse_hex(&p) >> 1) & 0xFFFF;
+  snprintf(g->reply, sizeof(g->reply), "%s",
+           lc3_vm_set_breakpoint(g->vm, address, on) ? "OK" : "E0c");
+}
+
+// one packet, the reply in g->reply
+static int gdb_command(struct gdb *g) {
+  lc3_vm *vm = g->vm;
+  const char *p = g->packet;
+  g->reply[0] = '\0';
+  switch (p[0]) {
+  case '?':
+    stop_reply(g);
+    break;
+  case 'g':
+    for (int r = 0; r < GDB_REGS; r++) {
+      put_hex16(g->reply + 4 * r, gdb_reg(vm, r));
+    }
+    break;
+  case 'G':
+    if (strlen(p + 1) < 4 * GDB_REGS) {
+      snprintf(g->reply, sizeof(g->reply), "E01");
+      break;
+    }
+    for (int r = 0; r < GDB_REGS; r++) {
+      long v = get_hex16(p + 1 + 4 * r);
+      if (v < 0) {
+        snprintf(g->reply, sizeof(g->reply), "E01");
+        return GDB_REPLY;
+      }
+      gdb_set_reg(vm, r, v);
+    }
+    snprintf(g->reply, sizeof(g->reply), "OK");
+    break;
+  case 'p': {
+    p++;
+    unsigned long r = parse_hex(&p);
+    if (r >= GDB_REGS) {
+      snprintf(g->reply, sizeof(g->reply), "E01");
+      break;
+    }
+    put_hex16(g->reply, gdb_reg(vm, r));
+    break;
+  }
+  case 'P': {
+    p++;
+    unsigned long r = parse_hex(&p);
+    long v = *p == '=' ? get_hex16(p + 1) : -1;
+    if (r >= GDB_REGS || v < 0) {
+      snprintf(g->reply, sizeof(g->reply), "E01");
+      break;
+    }
+    gdb_set_reg(vm, r, v);
+    snprintf(g->reply, sizeof(g->reply), "OK");
+    break;
+  }
+  case 'm':
+  case 'M':
+    gdb_memory(g, p[0] == 'M');
+    break;
+  case 'c':
+  case 's':
+    gdb_resume(g, p[0] == 's');
+    break;
+  case 'b':
+    if (p[1] == 's' || p[1] == 'c') {
+      gdb_reverse(g, p[1] == 's');
+    }
+    break;
+  case 'Z':
+  case 'z':
+    gdb_breakpoint(g);
+    break;
+  case 'D':
+    snprintf(g->reply, sizeof(g->reply), "OK");
+    return GDB_DETACH;
+  case 'k':
+    return GDB_KILL;
+  case 'H':
+    snprintf(g->reply, sizeof(g->reply), "OK");
+    break;
+  case 'q':
+    if (strncmp(p, "qSupported", 10) == 0) {
+      snprintf(g->reply, sizeof(g->reply),
+               "PacketSize=%x;QStartNoAckMode+%s", GDB_PACKET,
+               vm->record && vm->record->replaying
+                   ? ";ReverseStep+;ReverseContinue+"
+                   : "");
+    } else if (strcmp(p, "qAttached") == 0) {
+      snprintf(g->reply, sizeof(g->reply), "1");
+    }
+    break;
+  case 'Q':
+    if (strcmp(p, "QStartNoAckMode") == 0) {
+      // acknowledged still, the ones after it are not
+      snprintf(g->reply, sizeof(g->reply), "OK");
+      if (!gdb_send(g, g->reply)) {
+        return GDB_DETACH;
+      }
+      g->no_ack = 1;
+      return GDB_REPLIED;
+    }
+    break;
+  case 'v':
+    if (strcmp(p, "vKill") == 0 || strncmp(p, "vKill;", 6) == 0) {
+      snprintf(g->reply, sizeof(g->reply), "OK");
+      gdb_send(g, g->reply);
+      return GDB_KILL;
+    }
+    break; // no vCont, GDB falls back to c and s
+  }
+  return GDB_REPLY;
+}
+
+static int gdb_listen(int port) {
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0) {
+    return -1;
+  }
+  int one = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // never beyond this host
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(s, 1) < 0) {
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+int lc3_vm_serve_gdb(lc3_vm *vm, int port) {
+  int s = gdb_listen(port);
+  if (s < 0) {
+    return -1;
+  }
+  int fd = accept(s, NULL, NULL);
+  close(s);
+  if (fd < 0) {
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  struct gdb *g = calloc(1, sizeof(*g));
+  if (!g) {
+    close(fd);
+    return -1;
+  }
+  g->vm = vm;
+  g->fd = fd;
+  g->stop = SIG_TRAP;
+  // until the debugger detaches, kills the guest or goes away
+  int action = GDB_DETACH;
+  while (gdb_recv(g)) {
+    action = gdb_command(g);
+    if (action == GDB_REPLY || action == GDB_DETACH) {
+      if (!gdb_send(g, g->reply)) {
+        action = GDB_DETACH;
+        break;
+      }
+    }
+    if (action == GDB_DETACH || action == GDB_KILL) {
+      break;
+    }
+    action = GDB_DETACH;
+  }
+  close(fd);
+  free(g);
+  if (action == GDB_KILL) {
+    vm_stop(vm, LC3_EXIT_HALT);
+  }
+  // a debugger that left takes its breakpoints with it
+  lc3_vm_clear_breakpoints(vm);
+  return vm->running || vm->exit == LC3_EXIT_BREAK ? LC3_EXIT_BUDGET
+                                                   : vm->exit;
+}
@@ -0,0 +1,541 @@
+// decoded interpreter
+// --------------------------------------------------
+// Same semantics as the handlers in vm.c, with every operand taken from the
+// decode cache entry. vm->reg[R_PC] has already been incremented when they
+// run, so PC-relative addresses are resolved at decode time. Every handler
+// returns the number of instructions it retired.
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int d_add_reg(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = vm->reg[d->sr1] + vm->reg[d->sr2];
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_add_imm(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = vm->reg[d->sr1] + d->imm;
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_and_reg(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = vm->reg[d->sr1] & vm->reg[d->sr2];
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_and_imm(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = vm->reg[d->sr1] & d->imm;
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_not(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = ~vm->reg[d->sr1];
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_br(lc3_vm *vm, const struct decoded *d) {
+  if (d->dr & cond_flags(vm)) {
+    vm->reg[R_PC] = d->imm;
+  }
+  return 1;
+}
+
+static int d_jmp(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[R_PC] = vm->reg[d->sr1];
+  analysis_check(vm, vm->reg[R_PC]);
+  return 1;
+}
+
+static int d_jsr(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[R_R7] = vm->reg[R_PC];
+  vm->reg[R_PC] = d->imm;
+  return 1;
+}
+
+static int d_jsrr(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[R_R7] = vm->reg[R_PC];
+  vm->reg[R_PC] = vm->reg[d->sr1];
+  analysis_check(vm, vm->reg[R_PC]);
+  return 1;
+}
+
+static int d_ld(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = mem_read(vm, d->imm);
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_ld_ram(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = mem_read_ram(vm, d->imm);
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_ldi(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = mem_read(vm, mem_read(vm, d->imm));
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_ldi_ram(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = mem_read(vm, mem_read_ram(vm, d->imm));
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_ldr(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = mem_read(vm, vm->reg[d->sr1] + d->imm);
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_lea(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = d->imm;
+  update_flags(vm, d->dr);
+  return 1;
+}
+
+static int d_st(lc3_vm *vm, const struct decoded *d) {
+  mem_write(vm, d->imm, vm->reg[d->dr]);
+  return 1;
+}
+
+static int d_st_ram(lc3_vm *vm, const struct decoded *d) {
+  mem_write_ram(vm, d->imm, vm->reg[d->dr]);
+  return 1;
+}
+
+// the analysis found that the word is not code, there is nothing to
+// invalidate
+static int d_st_data(lc3_vm *vm, const struct decoded *d) {
+  vm->memory[d->imm] = vm->reg[d->dr];
+  vm->page_dirty[d->imm / VM_PAGE_WORDS] = 1;
+  return 1;
+}
+
+static int d_sti(lc3_vm *vm, const struct decoded *d) {
+  mem_write(vm, mem_read(vm, d->imm), vm->reg[d->dr]);
+  return 1;
+}
+
+static int d_sti_ram(lc3_vm *vm, const struct decoded *d) {
+  mem_write(vm, mem_read_ram(vm, d->imm), vm->reg[d->dr]);
+  return 1;
+}
+
+static int d_str(lc3_vm *vm, const struct decoded *d) {
+  mem_write(vm, vm->reg[d->sr1] + d->imm, vm->reg[d->dr]);
+  return 1;
+}
+
+static int d_trap(lc3_vm *vm, const struct decoded *d) {
+  vm_TRAP(vm, d->imm);
+  if (vm->running) {
+    analysis_check(vm, vm->reg[R_PC]); // a vector from the table
+  }
+  return 1;
+}
+
+static int d_rti(lc3_vm *vm, const struct decoded *d) {
+  vm_RTI(vm);
+  return 1;
+}
+
+static int d_res(lc3_vm *vm, const struct decoded *d) {
+  vm_RES(vm);
+  return 1;
+}
+
+// superinstructions
+// --------------------------------------------------
+// Common LC-3 idioms, each run by one handler: a constant loaded with AND #0
+// and ADD #imm, negation with NOT and ADD #1, a loop counter stepped by ADD
+// right before its BR, and a read-modify-write of one word with LDR, ADD #imm
+// and STR. On top of those come the opcode pairs a profile counted most often,
+// picked by vm_fuse_select(): their head runs its own handler inlined and then
+// the entry after it, one trip through the dispatch loop instead of two.
+//
+// The head entry of a group runs all of it, taking the operands of the others
+// from their own entries, which stay decoded; its len counts the group. Only
+// the last instruction of a group may store, so a group never runs stale code,
+// and store_hook() unfuses every group a store reaches.
+
+static int f_const(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = d[1].imm;
+  update_flags(vm, d->dr);
+  vm->reg[R_PC]++;
+  return 2;
+}
+
+static int f_neg(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = -vm->reg[d->sr1];
+  update_flags(vm, d->dr);
+  vm->reg[R_PC]++;
+  return 2;
+}
+
+static int f_add_imm_br(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = vm->reg[d->sr1] + d->imm;
+  update_flags(vm, d->dr);
+  vm->reg[R_PC]++;
+  if (d[1].dr & cond_flags(vm)) {
+    vm->reg[R_PC] = d[1].imm;
+  }
+  return 2;
+}
+
+static int f_add_reg_br(lc3_vm *vm, const struct decoded *d) {
+  vm->reg[d->dr] = vm->reg[d->sr1] + vm->reg[d->sr2];
+  update_flags(vm, d->dr);
+  vm->reg[R_PC]++;
+  if (d[1].dr & cond_flags(vm)) {
+    vm->reg[R_PC] = d[1].imm;
+  }
+  return 2;
+}
+
+// a device read may end the run, then only the LDR retires
+static int f_rmw(lc3_vm *vm, const struct decoded *d) {
+  uint16_t address = vm->reg[d->sr1] + d->imm;
+  if (address >= IO_PAGE) {
+    return d_ldr(vm, d);
+  }
+  vm->reg[d->dr] = mem_read_ram(vm, address) + d[1].imm;
+  update_flags(vm, d->dr);
+  vm->reg[R_PC] += 2;
+  mem_write_ram(vm, address, vm->reg[d->dr]);
+  return 3;
+}
+
+// Profiled pairs are built from the handlers above, one function for every
+// head and second below, so the compiler inlines both. A head neither stores
+// nor jumps, and a device read may end the run, in which case only the LDR
+// retires.
+#define PAIR_HEADS(X, ...)                                                     \
+  X(add_reg, 0, __VA_ARGS__)                                                   \
+  X(add_imm, 0, __VA_ARGS__)                                                   \
+  X(and_reg, 0, __VA_ARGS__)                                                   \
+  X(and_imm, 0, __VA_ARGS__)                                                   \
+  X(not, 0, __VA_ARGS__)                                                       \
+  X(lea, 0, __VA_ARGS__)                                                       \
+  X(ld_ram, 0, __VA_ARGS__)                                                    \
+  X(ldr, (uint16_t)(vm->reg[d->sr1] + d->imm) >= IO_PAGE, __VA_ARGS__)
+
+#define PAIR_SECONDS(X, head, device)                                          \
+  X(head, device, add_reg)                                                     \
+  X(head, device, add_imm)                                                     \
+  X(head, device, and_reg)                                                     \
+  X(head, device, and_imm)                                                     \
+  X(head, device, not)                                                         \
+  X(head, device, br)                                                          \
+  X(head, device, ld_ram)                                                      \
+  X(head, device, ldr)                                                         \
+  X(head, device, lea)                                                         \
+  X(head, device, st_ram)                                                      \
+  X(head, device, str)                                                         \
+  X(head, device, jsr)                                                         \
+  X(head, device, jmp)
+
+// opcodes of the heads and seconds, at least in some form
+enum {
+  PAIR_FIRST = 1 << OP_ADD | 1 << OP_AND | 1 << OP_NOT | 1 << OP_LEA |
+               1 << OP_LD | 1 << OP_LDR,
+  PAIR_SECOND = PAIR_FIRST | 1 << OP_BR | 1 << OP_ST | 1 << OP_STR |
+                1 << OP_JSR | 1 << OP_JMP
+};
+
+#define PAIR_FN(head, device, second)                                          \
+  static int p_##head##_##second(lc3_vm *vm, const struct decoded *d) {        \
+    if (device) {                                                              \
+      return d_##head(vm, d);                                                  \
+    }                                                                          \
+    d_##head(vm, d);                                                           \
+    vm->reg[R_PC]++;                                                           \
+    return 1 + d_##second(vm, &d[1]);                                          \
+  }
+#define PAIR_ROW_FN(head, device, unused)                                      \
+  PAIR_SECONDS(PAIR_FN, head, device)
+
+PAIR_HEADS(PAIR_ROW_FN, 0)
+
+#define PAIR_ENTRY(head, device, second) p_##head##_##second,
+#define PAIR_ROW(head, device, unused) {PAIR_SECONDS(PAIR_ENTRY, head, device)},
+#define PAIR_PLAIN_HEAD(head, device, unused) d_##head,
+#define PAIR_PLAIN_SECOND(head, device, second) d_##second,
+
+static const exec_fn pair_heads[] = {PAIR_HEADS(PAIR_PLAIN_HEAD, 0)};
+static const exec_fn pair_seconds[] = {
+    PAIR_SECONDS(PAIR_PLAIN_SECOND, 0, 0)};
+static const exec_fn
+    pair_fns[][sizeof(pair_seconds) / sizeof(pair_seconds[0])] = {
+        PAIR_HEADS(PAIR_ROW, 0)};
+
+// the pair handler for two decoded entries, NULL when there is none
+static exec_fn pair_fn(exec_fn head, exec_fn second) {
+  for (size_t h = 0; h < sizeof(pair_heads) / sizeof(pair_heads[0]); h++) {
+    for (size_t s = 0; head == pair_heads[h] &&
+                       s < sizeof(pair_seconds) / sizeof(pair_seconds[0]);
+         s++) {
+      if (second == pair_seconds[s]) {
+        return pair_fns[h][s];
+      }
+    }
+  }
+  return NULL;
+}
+
+// fuse the `pairs` opcode pairs with the highest counts that have handlers,
+// counts indexed by first opcode * 16 + second; the number chosen
+int vm_fuse_select(lc3_vm *vm, const uint64_t counts[16 * 16], int pairs) {
+  memset(vm->fuse_pairs, 0, sizeof(vm->fuse_pairs));
+  int chosen = 0;
+  for (; chosen < pairs; chosen++) {
+    int best = -1;
+    for (int i = 0; i < 16 * 16; i++) {
+      if (counts[i] && (PAIR_FIRST >> (i / 16) & 1) &&
+          (PAIR_SECOND >> (i % 16) & 1) &&
+          !(vm->fuse_pairs[i / 16] >> (i % 16) & 1) &&
+          (best < 0 || counts[i] > counts[best])) {
+        best = i;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    vm->fuse_pairs[best / 16] |= 1 << (best % 16);
+  }
+  if (vm->decode_cache) {
+    vm_decode_invalidate_all(vm);
+  }
+  return chosen;
+}
+
+// ADD r, r, #imm
+static int is_add_imm(uint16_t instr, uint16_t r) {
+  return (instr & 0xFFE0) == ((OP_ADD << 12) | (r << 9) | (r << 6) | 0x20);
+}
+
+// the handler of the idiom starting at pc, NULL for none
+static exec_fn idiom(const uint16_t *mem, uint16_t pc, uint8_t *len) {
+  if (pc > UINT16_MAX - 2) {
+    return NULL; // no room for a group
+  }
+  uint16_t i0 = mem[pc];
+  uint16_t i1 = mem[pc + 1];
+  uint16_t r = (i0 >> 9) & 0x7;
+  *len = 2;
+  switch (i0 >> 12) {
+  case OP_AND:
+    if ((i0 & 0x3F) == 0x20 && is_add_imm(i1, r)) {
+      return f_const;
+    }
+    break;
+  case OP_NOT:
+    if (i1 == ((OP_ADD << 12) | (r << 9) | (r << 6) | 0x21)) {
+      return f_neg;
+    }
+    break;
+  case OP_ADD:
+    if ((i1 >> 12) == OP_BR) {
+      return (i0 >> 5) & 0x1 ? f_add_imm_br : f_add_reg_br;
+    }
+    break;
+  case OP_LDR: {
+    uint16_t base = (i0 >> 6) & 0x7;
+    if (base != r && is_add_imm(i1, r) &&
+        mem[pc + 2] == ((OP_STR << 12) | (i0 & 0x0FFF))) {
+      *len = 3;
+      return f_rmw;
+    }
+    break;
+  }
+  }
+  return NULL;
+}
+
+// make the decoded entry at pc the head of a group when one starts there: an
+// idiom, or else a profiled pair unless that would split the idiom after it
+void vm_fuse(lc3_vm *vm, uint16_t pc) {
+  struct decoded *cache = vm->decode_cache;
+  const uint16_t *mem = vm->memory;
+  if (pc > UINT16_MAX - 2 || cache[pc].fn == vm_d_miss) {
+    return; // no room for a group, or pc was written while it ran
+  }
+  uint8_t len;
+  uint8_t next_len;
+  exec_fn fn = idiom(mem, pc, &len);
+  uint16_t pairs = vm->fuse_pairs[mem[pc] >> 12];
+  int pair = !fn && (pairs >> (mem[pc + 1] >> 12) & 1) &&
+             !idiom(mem, pc + 1, &next_len);
+  if (!fn && !pair) {
+    return;
+  }
+  for (int k = 1; k < len; k++) {
+    if (cache[pc + k].fn == vm_d_miss) {
+      vm_decode(vm, pc + k, &cache[pc + k]);
+    }
+  }
+  if (pair) {
+    // by the handlers of both, a second heading a group of its own has none
+    fn = pair_fn(cache[pc].fn, cache[pc + 1].fn);
+    if (!fn) {
+      return;
+    }
+  }
+  cache[pc].fn = fn;
+  cache[pc].len = len;
+}
+
+// fill in the entry for the instruction at pc
+void vm_decode(lc3_vm *vm, uint16_t pc, struct decoded *d) {
+  uint16_t instr = vm->memory[pc];
+  uint16_t next = pc + 1;
+
+  d->len = 1;
+  d->dr = (instr >> 9) & 0x7;
+  d->sr1 = (instr >> 6) & 0x7;
+  d->sr2 = instr & 0x7;
+  d->imm = 0;
+
+  switch (instr >> 12) {
+  case OP_ADD:
+  case OP_AND: {
+    int add = (instr >> 12) == OP_ADD;
+    if ((instr >> 5) & 0x1) {
+      d->fn = add ? d_add_imm : d_and_imm;
+      d->imm = sign_extend(instr & 0x1f, 5);
+    } else {
+      d->fn = add ? d_add_reg : d_and_reg;
+    }
+    break;
+  }
+  case OP_NOT:
+    d->fn = d_not;
+    break;
+  case OP_BR:
+    d->fn = d_br;
+    d->imm = next + sign_extend(instr & 0x1ff, 9);
+    break;
+  case OP_JMP:
+    d->fn = d_jmp;
+    break;
+  case OP_JSR:
+    if ((instr >> 11) & 1) {
+      d->fn = d_jsr;
+      d->imm = next + sign_extend(instr & 0x7ff, 11);
+    } else {
+      d->fn = d_jsrr;
+    }
+    break;
+  case OP_LD:
+    d->imm = next + sign_extend(instr & 0x1ff, 9);
+    d->fn = d->imm < IO_PAGE ? d_ld_ram : d_ld;
+    break;
+  case OP_LDI:
+    d->imm = next + sign_extend(instr & 0x1ff, 9);
+    d->fn = d->imm < IO_PAGE ? d_ldi_ram : d_ldi;
+    break;
+  case OP_LDR:
+    d->fn = d_ldr;
+    d->imm = sign_extend(instr & 0x3f, 6);
+    break;
+  case OP_LEA:
+    d->fn = d_lea;
+    d->imm = next + sign_extend(instr & 0x1ff, 9);
+    break;
+  case OP_ST:
+    d->imm = next + sign_extend(instr & 0x1ff, 9);
+    d->fn = d->imm < IO_PAGE ? d_st_ram : d_st;
+    if (vm->analysis && vm->dispatch == LC3_DISPATCH_DECODED &&
+        analysis_bit(vm->analysis->data_st, pc)) {
+      d->fn = d_st_data;
+    }
+    break;
+  case OP_STI:
+    d->imm = next + sign_extend(instr & 0x1ff, 9);
+    d->fn = d->imm < IO_PAGE ? d_sti_ram : d_sti;
+    break;
+  case OP_STR:
+    d->fn = d_str;
+    d->imm = sign_extend(instr & 0x3f, 6);
+    break;
+  case OP_TRAP:
+    d->fn = d_trap;
+    d->imm = instr;
+    break;
+  case OP_RTI:
+    d->fn = d_rti;
+    break;
+  case OP_RES:
+    d->fn = d_res;
+    break;
+  }
+}
+
+// first execution from an address since it was loaded or written
+// It runs the single instruction, the group is only used from the next time
+// on, when the budget check in vm_run_decoded() has seen its length.
+int vm_d_miss(lc3_vm *vm, const struct decoded *d) {
+  uint16_t pc = d - vm->decode_cache;
+  struct decoded *entry = &vm->decode_cache[pc];
+  if (vm->stats) {
+    stat_add(&vm->stats->decoded, 1);
+  }
+  vm_decode(vm, pc, entry);
+  int n = entry->fn(vm, entry);
+  if (vm->fusion && vm->dispatch == LC3_DISPATCH_DECODED) {
+    vm_fuse(vm, pc);
+  }
+  return n;
+}
+
+// the cache starts out with every entry a miss
+int vm_decode_init(lc3_vm *vm) {
+  if (vm->decode_cache) {
+    return 1;
+  }
+  vm->decode_cache = malloc((UINT16_MAX + 1) * sizeof(struct decoded));
+  if (!vm->decode_cache) {
+    return 0;
+  }
+  vm_decode_invalidate_all(vm);
+  return 1;
+}
+
+void vm_decode_invalidate_all(lc3_vm *vm) {
+  if (vm->stats) {
+    stat_add(&vm->stats->invalidations, 1);
+  }
+  for (size_t i = 0; i <= UINT16_MAX; i++) {
+    vm->decode_cache[i].fn = vm_d_miss;
+    vm->decode_cache[i].len = 1;
+  }
+}
+
+void vm_decode_free(lc3_vm *vm) {
+  free(vm->decode_cache);
+  vm->decode_cache = NULL;
+}
+
+// handlers straight from the decode cache
+uint64_t vm_run_decoded(lc3_vm *vm, uint64_t budget) {
+  const struct decoded *cache = vm->decode_cache;
+  uint64_t n = 0;
+  analysis_check(vm, vm->reg[R_PC]); // another engine may have left the code
+  while (n < budget && vm->running) {
+    const struct decoded *d = &cache[vm->reg[R_PC]];
+    if (d->len > budget - n) {
+      // a group would overrun the budget, the last instructions run unfused
+      return n + vm_run_switch(vm, budget - n);
+    }
+    vm->reg[R_PC]++;
+    n += d->fn(vm, d);
+  }
+  return n;
+}
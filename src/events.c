@@ -0,0 +1,187 @@
+// device events and interrupts
+// --------------------------------------------------
+// Time is the number of retired instructions. A device schedules its event
+// with vm_event_after(); lc3_vm_run() runs the engine up to the earliest event,
+// fires those that are due and then delivers the highest priority interrupt
+// request above the priority of the PSR through the interrupt vector table.
+// Interrupts are only taken with LC3_TRAPS_OS, native traps have no OS to
+// serve them.
+#include "vm.h"
+
+#include <string.h>
+
+// heap of event ids ordered by when[]
+static void heap_swap(struct events *e, int a, int b) {
+  uint8_t t = e->heap[a];
+  e->heap[a] = e->heap[b];
+  e->heap[b] = t;
+  e->pos[e->heap[a]] = a;
+  e->pos[e->heap[b]] = b;
+}
+
+static void heap_up(struct events *e, int i) {
+  while (i > 0 && e->when[e->heap[i]] < e->when[e->heap[(i - 1) / 2]]) {
+    heap_swap(e, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void heap_down(struct events *e, int i) {
+  for (;;) {
+    int least = i;
+    for (int c = 2 * i + 1; c <= 2 * i + 2 && c < e->count; c++) {
+      if (e->when[e->heap[c]] < e->when[e->heap[least]]) {
+        least = c;
+      }
+    }
+    if (least == i) {
+      return;
+    }
+    heap_swap(e, i, least);
+    i = least;
+  }
+}
+
+static void heap_remove(struct events *e, int event) {
+  int i = e->pos[event];
+  e->pos[event] = EV_IDLE;
+  if (i == --e->count) {
+    return;
+  }
+  e->heap[i] = e->heap[e->count];
+  e->pos[e->heap[i]] = i;
+  heap_up(e, i);
+  heap_down(e, i);
+}
+
+static void heap_insert(struct events *e, int event, uint64_t when) {
+  if (e->pos[event] != EV_IDLE) {
+    heap_remove(e, event);
+  }
+  e->when[event] = when;
+  e->heap[e->count] = event;
+  e->pos[event] = e->count;
+  heap_up(e, e->count++);
+}
+
+void vm_event_after(lc3_vm *vm, int event, uint64_t delay) {
+  vm->events.arming |= 1 << event;
+  vm->events.delay[event] = delay;
+  vm_yield(vm);
+}
+
+void vm_event_cancel(lc3_vm *vm, int event) {
+  vm->events.arming &= ~(1 << event);
+  if (vm->events.pos[event] != EV_IDLE) {
+    heap_remove(&vm->events, event);
+  }
+}
+
+uint64_t vm_event_next(const lc3_vm *vm) {
+  return vm->events.count ? vm->events.when[vm->events.heap[0]] : UINT64_MAX;
+}
+
+void vm_events_clear(lc3_vm *vm) {
+  memset(&vm->events, 0, sizeof(vm->events));
+  memset(vm->events.pos, EV_IDLE, sizeof(vm->events.pos));
+}
+
+static void keyboard_event(lc3_vm *vm) {
+  vm_keyboard_latch(vm);
+  if (vm->memory[MR_KBSR] & DEV_IE) {
+    heap_insert(&vm->events, EV_KEYBOARD, vm->instructions + KEYBOARD_POLL);
+  }
+}
+
+// TSR is raised every TIR instructions until TIR is cleared
+static void timer_event(lc3_vm *vm) {
+  vm->memory[MR_TSR] |= DEV_READY;
+  store_hook(vm, MR_TSR);
+  if (vm->memory[MR_TIR]) {
+    heap_insert(&vm->events, EV_TIMER, vm->instructions + vm->memory[MR_TIR]);
+  }
+}
+
+static void (*const event_fns[EV_COUNT])(lc3_vm *vm) = {keyboard_event,
+                                                         timer_event};
+
+void vm_events_commit(lc3_vm *vm) {
+  struct events *e = &vm->events;
+  while (e->arming) {
+    int event = __builtin_ctz(e->arming);
+    e->arming &= e->arming - 1;
+    heap_insert(e, event, vm->instructions + e->delay[event]);
+  }
+}
+
+void vm_events_run(lc3_vm *vm) {
+  struct events *e = &vm->events;
+  for (;;) {
+    vm_events_commit(vm);
+    if (!e->count || e->when[e->heap[0]] > vm->instructions) {
+      return;
+    }
+    int event = e->heap[0];
+    heap_remove(e, event);
+    event_fns[event](vm);
+  }
+}
+
+void vm_event_at(lc3_vm *vm, int event, uint64_t when) {
+  heap_insert(&vm->events, event, when);
+}
+
+int vm_event_when(const lc3_vm *vm, int event, uint64_t *when) {
+  if (vm->events.pos[event] == EV_IDLE) {
+    return 0;
+  }
+  *when = vm->events.when[event];
+  return 1;
+}
+
+void vm_interrupts_deliver(lc3_vm *vm) {
+  if (vm->traps != LC3_TRAPS_OS) {
+    return;
+  }
+  uint16_t ready = DEV_READY | DEV_IE;
+  int priority = (vm->psr & PSR_PRIORITY) >> 8;
+  if ((vm->memory[MR_TSR] & ready) == ready && PL_TIMER > priority) {
+    vm_interrupt(vm, INT_TIMER, PL_TIMER);
+  } else if ((vm->memory[MR_KBSR] & ready) == ready &&
+             PL_KEYBOARD > priority) {
+    vm_interrupt(vm, INT_KEYBOARD, PL_KEYBOARD);
+  }
+}
+
+// timer
+// Reading TSR acknowledges the tick, writing it sets the interrupt enable.
+// Writing TIR restarts the timer with the new interval.
+static uint16_t tsr_read(lc3_vm *vm, uint16_t address) {
+  uint16_t status = vm->memory[MR_TSR];
+  if (status & DEV_READY) {
+    vm->memory[MR_TSR] = status & ~DEV_READY;
+    store_hook(vm, MR_TSR);
+  }
+  return status;
+}
+
+static void tsr_write(lc3_vm *vm, uint16_t address, uint16_t val) {
+  vm->memory[MR_TSR] = (vm->memory[MR_TSR] & DEV_READY) | (val & DEV_IE);
+  store_hook(vm, MR_TSR);
+  vm_yield(vm); // an interrupt may be due right away
+}
+
+static void tir_write(lc3_vm *vm, uint16_t address, uint16_t val) {
+  vm->memory[MR_TIR] = val;
+  store_hook(vm, MR_TIR);
+  if (val) {
+    vm_event_after(vm, EV_TIMER, val);
+  } else {
+    vm_event_cancel(vm, EV_TIMER);
+  }
+}
+
+void vm_timer_init(lc3_vm *vm) {
+  vm_io_register(vm, MR_TSR, tsr_read, tsr_write);
+  vm_io_register(vm, MR_TIR, NULL, tir_write);
+}
@@ -0,0 +1,115 @@
+// headless backend: mapped input and a preallocated output buffer
+#define _GNU_SOURCE
+#include "lc3.h"
+
+#include <stdlib.h>
+#include <string.h>
+/* unix */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int headless_getc(void *ctx) {
+  struct lc3_headless *h = ctx;
+  if (h->in_pos == h->in_len) {
+    return -1;
+  }
+  return (unsigned char)h->in[h->in_pos++];
+}
+
+static int headless_poll(void *ctx) {
+  struct lc3_headless *h = ctx;
+  return h->in_pos < h->in_len;
+}
+
+static void headless_write(void *ctx, const char *buf, size_t n) {
+  struct lc3_headless *h = ctx;
+  size_t room = h->out_cap - h->out_len;
+  if (n > room) {
+    h->dropped += n - room;
+    n = room;
+  }
+  memcpy(h->out + h->out_len, buf, n);
+  h->out_len += n;
+}
+
+static void headless_flush(void *ctx) {}
+
+int lc3_headless_init(struct lc3_headless *h, size_t out_cap) {
+  memset(h, 0, sizeof(*h));
+  h->out = malloc(out_cap ? out_cap : 1);
+  if (!h->out) {
+    return 0;
+  }
+  h->out_cap = out_cap;
+  return 1;
+}
+
+static void unmap_input(struct lc3_headless *h) {
+  if (h->map) {
+    munmap(h->map, h->map_len);
+    h->map = NULL;
+    h->map_len = 0;
+  }
+}
+
+int lc3_headless_map_input(struct lc3_headless *h, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return 0;
+  }
+  void *map = NULL;
+  if (st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return 0;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  unmap_input(h);
+  h->map = map;
+  h->map_len = st.st_size;
+  h->in = map;
+  h->in_len = st.st_size;
+  h->in_pos = 0;
+  return 1;
+}
+
+void lc3_headless_set_input(struct lc3_headless *h, const void *in,
+                            size_t len) {
+  unmap_input(h);
+  h->in = in;
+  h->in_len = len;
+  h->in_pos = 0;
+}
+
+void lc3_headless_rewind(struct lc3_headless *h) {
+  h->in_pos = 0;
+  h->out_len = 0;
+  h->dropped = 0;
+}
+
+struct lc3_io lc3_headless_io(struct lc3_headless *h) {
+  struct lc3_io io = {h,
+                      headless_getc,
+                      headless_poll,
+                      headless_write,
+                      headless_flush,
+                      LC3_IO_NO_PROMPT};
+  return io;
+}
+
+void lc3_headless_free(struct lc3_headless *h) {
+  unmap_input(h);
+  free(h->out);
+  memset(h, 0, sizeof(*h));
+}
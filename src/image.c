@@ -0,0 +1,279 @@
+// shared images
+// --------------------------------------------------
+// An image is a file holding the 65536 native-endian words of a memory with
+// the .obj loaded at its origin: an anonymous memfd, or the <path>.cache
+// sidecar when caching is on. VMs map it MAP_PRIVATE over their memory, so the
+// kernel shares the pages between all of them and copies one only when a
+// guest writes to it.
+//
+// The sidecar starts with a header page recording the size and modification
+// time of the .obj it was built from; the words follow at IMAGE_CACHE_DATA,
+// which is a multiple of any host page size so they can be mapped directly.
+// It is written sparse, only the loaded range takes disk space.
+#define _GNU_SOURCE
+#include "vm.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__APPLE__)
+#define st_mtim st_mtimespec
+#endif
+
+enum { IMAGE_CACHE_VERSION = 1, IMAGE_CACHE_DATA = 1 << 16 };
+
+struct image_cache_header {
+  char magic[4]; // "LC3C"
+  uint32_t version;
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint32_t origin;
+  uint32_t count;
+};
+
+struct lc3_image {
+  _Atomic int refs; // the opener and every VM mapping it
+  int fd;
+  off_t offset;          // of the first word in fd
+  const uint16_t *words; // read-only view of all 65536 words
+  uint16_t origin;
+  uint32_t count; // words loaded from the .obj
+  uint64_t hash;  // of words, identifies the image in snapshots
+};
+
+// a file nobody else can open, removed when the last mapping goes away
+static int anonymous_file(size_t size) {
+#if defined(__linux__)
+  int fd = memfd_create("lc3-image", MFD_CLOEXEC);
+#else
+  char name[] = "/tmp/lc3-image-XXXXXX";
+  int fd = mkstemp(name);
+  if (fd >= 0) {
+    unlink(name);
+  }
+#endif
+  if (fd >= 0 && ftruncate(fd, size) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// convert the .obj into fd at offset, which already holds zeros
+static int image_fill(int fd, off_t offset, const uint8_t *obj, size_t size,
+                      uint16_t *origin, uint32_t *count) {
+  uint16_t *words = mmap(NULL, VM_MEMORY_BYTES, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, offset);
+  if (words == MAP_FAILED) {
+    return 0;
+  }
+  *origin = (obj[0] << 8) | obj[1];
+  size_t n = (size - 2) / 2;
+  if (n > UINT16_MAX + 1 - *origin) {
+    n = UINT16_MAX + 1 - *origin;
+  }
+  vm_swap_words(words + *origin, obj + 2, n);
+  *count = n;
+  munmap(words, VM_MEMORY_BYTES);
+  return 1;
+}
+
+// FNV-1a over 64-bit lanes of a whole memory, never 0
+static uint64_t memory_hash(const uint16_t *words) {
+  const uint64_t *p = (const uint64_t *)words;
+  uint64_t h = 0xcbf29ce484222325;
+  for (size_t i = 0; i < VM_MEMORY_BYTES / sizeof(*p); i++) {
+    h = (h ^ p[i]) * 0x100000001b3;
+  }
+  return h ? h : 1;
+}
+
+static void cache_path(char *buf, size_t len, const char *path) {
+  snprintf(buf, len, "%s.cache", path);
+}
+
+// the sidecar of path when it was built from the .obj described by st
+static int cache_open(const char *path, const struct stat *st, uint16_t *origin,
+                      uint32_t *count) {
+  char name[4096];
+  cache_path(name, sizeof(name), path);
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  struct image_cache_header h;
+  struct stat cst;
+  if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || fstat(fd, &cst) < 0 ||
+      memcmp(h.magic, "LC3C", 4) != 0 || h.version != IMAGE_CACHE_VERSION ||
+      h.source_size != (uint64_t)st->st_size ||
+      h.source_mtime_sec != st->st_mtim.tv_sec ||
+      h.source_mtime_nsec != st->st_mtim.tv_nsec || h.origin > UINT16_MAX ||
+      h.count > UINT16_MAX + 1 - h.origin ||
+      cst.st_size < (off_t)(IMAGE_CACHE_DATA + VM_MEMORY_BYTES)) {
+    close(fd);
+    return -1;
+  }
+  *origin = h.origin;
+  *count = h.count;
+  return fd;
+}
+
+// build the sidecar under a temporary name and move it into place, so that
+// concurrent runs never see half of one
+static int cache_write(const char *path, const struct stat *st,
+                       const uint8_t *obj, size_t size, uint16_t *origin,
+                       uint32_t *count) {
+  char name[4096];
+  char tmp[4096 + 8];
+  cache_path(name, sizeof(name), path);
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", name);
+  int fd = mkstemp(tmp);
+  if (fd < 0) {
+    return -1;
+  }
+  struct image_cache_header h = {{'L', 'C', '3', 'C'}, IMAGE_CACHE_VERSION};
+  h.source_size = st->st_size;
+  h.source_mtime_sec = st->st_mtim.tv_sec;
+  h.source_mtime_nsec = st->st_mtim.tv_nsec;
+  if (ftruncate(fd, IMAGE_CACHE_DATA + VM_MEMORY_BYTES) < 0 ||
+      !image_fill(fd, IMAGE_CACHE_DATA, obj, size, origin, count)) {
+    goto fail;
+  }
+  h.origin = *origin;
+  h.count = *count;
+  if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) || fchmod(fd, 0644) < 0 ||
+      rename(tmp, name) < 0) {
+    goto fail;
+  }
+  return fd;
+
+fail:
+  close(fd);
+  unlink(tmp);
+  return -1;
+}
+
+lc3_image *lc3_image_open(const char *path, int flags) {
+  int src = open(path, O_RDONLY | O_CLOEXEC);
+  if (src < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(src, &st) < 0 || st.st_size < 2) {
+    close(src);
+    return NULL;
+  }
+  lc3_image *image = calloc(1, sizeof(*image));
+  if (!image) {
+    close(src);
+    return NULL;
+  }
+  image->fd = -1;
+  atomic_init(&image->refs, 1);
+
+  if (flags & LC3_IMAGE_CACHE) {
+    image->fd = cache_open(path, &st, &image->origin, &image->count);
+    image->offset = IMAGE_CACHE_DATA;
+  }
+  if (image->fd < 0) {
+    const uint8_t *obj =
+        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, src, 0);
+    if (obj == MAP_FAILED) {
+      goto fail;
+    }
+    if (flags & LC3_IMAGE_CACHE) {
+      image->fd = cache_write(path, &st, obj, st.st_size, &image->origin,
+                              &image->count);
+      image->offset = IMAGE_CACHE_DATA;
+    }
+    if (image->fd < 0) {
+      image->offset = 0;
+      image->fd = anonymous_file(VM_MEMORY_BYTES);
+      if (image->fd >= 0 && !image_fill(image->fd, 0, obj, st.st_size,
+                                        &image->origin, &image->count)) {
+        close(image->fd);
+        image->fd = -1;
+      }
+    }
+    munmap((void *)obj, st.st_size);
+    if (image->fd < 0) {
+      goto fail;
+    }
+  }
+  close(src);
+
+  image->words = mmap(NULL, VM_MEMORY_BYTES, PROT_READ, MAP_SHARED,
+                      image->fd, image->offset);
+  if (image->words == MAP_FAILED) {
+    close(image->fd);
+    free(image);
+    return NULL;
+  }
+  image->hash = memory_hash(image->words);
+  return image;
+
+fail:
+  close(src);
+  free(image);
+  return NULL;
+}
+
+const uint16_t *vm_image_words(const lc3_image *image) { return image->words; }
+
+uint64_t vm_image_hash(const lc3_image *image) { return image->hash; }
+
+static lc3_image *image_ref(lc3_image *image) {
+  if (image) {
+    atomic_fetch_add(&image->refs, 1);
+  }
+  return image;
+}
+
+void lc3_image_close(lc3_image *image) {
+  if (!image || atomic_fetch_sub(&image->refs, 1) > 1) {
+    return;
+  }
+  munmap((void *)image->words, VM_MEMORY_BYTES);
+  close(image->fd);
+  free(image);
+}
+
+int vm_map_base(lc3_vm *vm, lc3_image *image) {
+  vm_code_cache_detach(vm);
+  void *p;
+  if (image) {
+    p = mmap(vm->memory, VM_MEMORY_BYTES, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, image->fd, image->offset);
+  } else {
+    p = mmap(vm->memory, VM_MEMORY_BYTES, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  }
+  if (p == MAP_FAILED) {
+    return 0;
+  }
+  lc3_image_close(vm->base);
+  vm->base = image_ref(image);
+  memset(vm->page_dirty, 0, sizeof(vm->page_dirty));
+  vm_events_clear(vm);
+  vm_invalidate_all(vm);
+  return 1;
+}
+
+int lc3_vm_map_image(lc3_vm *vm, lc3_image *image) {
+  return vm_map_base(vm, image);
+}
+
+int lc3_vm_load_from(lc3_vm *vm, const lc3_image *image) {
+  vm_load_words(vm, image->origin, image->words + image->origin,
+                image->count);
+  return 1;
+}
@@ -0,0 +1,692 @@
+#include "vm.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#if LC3_HAVE_JIT
+// JIT
+// --------------------------------------------------
+// Basic blocks that get hot under the decoded interpreter are compiled to
+// x86-64. A block runs from its entry up to and including the first BR, JMP
+// or JSR; it stops before a TRAP, RTI or reserved opcode so those stay in the
+// interpreter. Guest R0..R7 live in r8..r15 for the whole block (only their
+// low 16 bits are ever written, the upper bits stay zero), rbx points at
+// vm->reg[] and rbp at vm->memory[].
+//
+// R_COND is not written per instruction: the compiler tracks which register
+// the last ALU/load op wrote, copies it to R_COND at a block exit and tests it
+// directly for a BR.
+//
+// Loads outside the device page read memory[] inline, everything else goes
+// through mem_read()/mem_write(). A store that hits compiled code leaves the
+// block right after that instruction, since the rest of it may be stale.
+
+enum {
+  JIT_CODE_SIZE = 4 << 20,  // executable arena
+  JIT_MAX_BLOCKS = 8192,    // block descriptors in the arena
+  JIT_MAX_INSTRS = 64,      // guest instructions per block
+  JIT_BLOCK_RESERVE = 16384 // arena bytes needed to start a block
+};
+
+// returns the number of guest instructions it retired
+typedef uint16_t (*jit_fn)(lc3_vm *vm);
+
+struct jit_block {
+  jit_fn fn;
+  uint16_t start;
+  uint16_t end; // last guest address covered
+};
+
+// executions of each address as a block entry, JIT_NEVER when it cannot be
+// compiled
+enum { JIT_NEVER = 0xFFFF };
+_Static_assert((int)LC3_JIT_THRESHOLD_MAX < (int)JIT_NEVER,
+               "unreachable threshold");
+
+struct jit {
+  uint8_t *code;
+  size_t code_used;
+  struct jit_block pool[JIT_MAX_BLOCKS];
+  int pool_used;
+  struct jit_block *blocks[UINT16_MAX + 1]; // block starting at each address
+  uint16_t code_count[UINT16_MAX + 1]; // blocks covering each location
+  uint16_t heat[UINT16_MAX + 1];
+};
+
+int vm_jit_init(lc3_vm *vm) {
+  if (vm->jit) {
+    return 1;
+  }
+  struct jit *j = calloc(1, sizeof(*j));
+  if (!j) {
+    return 0;
+  }
+  void *p = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    free(j);
+    return 0;
+  }
+  j->code = p;
+  vm->jit = j;
+  return 1;
+}
+
+void vm_jit_free(lc3_vm *vm) {
+  if (vm->jit) {
+    munmap(vm->jit->code, JIT_CODE_SIZE);
+    free(vm->jit);
+    vm->jit = NULL;
+  }
+}
+
+// drop every block, used when the arena or the pool are exhausted
+static void jit_flush(struct jit *j) {
+  memset(j->blocks, 0, sizeof(j->blocks));
+  memset(j->code_count, 0, sizeof(j->code_count));
+  memset(j->heat, 0, sizeof(j->heat));
+  j->pool_used = 0;
+  j->code_used = 0;
+}
+
+void vm_jit_reset(lc3_vm *vm) { jit_flush(vm->jit); }
+
+static void jit_kill(struct jit *j, struct jit_block *b) {
+  j->blocks[b->start] = NULL;
+  j->heat[b->start] = 0;
+  for (uint32_t a = b->start; a <= b->end; a++) {
+    j->code_count[a]--;
+  }
+  b->fn = NULL;
+}
+
+// `address`, covered by at least one block, was written; returns how many
+// blocks that killed
+static int jit_invalidate(struct jit *j, uint16_t address) {
+  int killed = 0;
+  for (int i = 0; i < j->pool_used; i++) {
+    struct jit_block *b = &j->pool[i];
+    if (b->fn && b->start <= address && address <= b->end) {
+      jit_kill(j, b);
+      killed++;
+    }
+  }
+  return killed;
+}
+
+void vm_jit_store_hook(lc3_vm *vm, uint16_t address) {
+  struct jit *j = vm->jit;
+  if (j->code_count[address]) {
+    int killed = jit_invalidate(j, address);
+    if (vm->stats) {
+      stat_add(&vm->stats->invalidations, killed);
+    }
+  }
+  if (j->heat[address] == JIT_NEVER) {
+    j->heat[address] = 0;
+  }
+}
+
+static uint16_t jit_load(lc3_vm *vm, uint16_t address) {
+  return mem_read(vm, address);
+}
+
+// nonzero when the block has to be left: it wrote code, or MCR stopped the VM
+static int jit_store(lc3_vm *vm, uint16_t address, uint16_t val) {
+  int code = vm->jit->code_count[address] != 0;
+  mem_write(vm, address, val);
+  return code || !vm->running;
+}
+
+// x86-64 encoding
+enum { X_RAX = 0, X_RCX = 1, X_RDX = 2, X_RBX = 3, X_RBP = 5, X_RSI = 6 };
+enum { X_RDI = 7, X_R8 = 8 };
+
+// guest register to host register
+#define HREG(r) (X_R8 + (r))
+
+struct emitter {
+  uint8_t *p;
+  uint16_t dirty; // guest registers written so far
+  int flag_reg;   // register holding the last result, -1 when reg[R_COND]
+                  // is current
+};
+
+static void emit8(struct emitter *e, uint8_t b) { *e->p++ = b; }
+
+static void emit16(struct emitter *e, uint16_t v) {
+  memcpy(e->p, &v, 2);
+  e->p += 2;
+}
+
+static void emit32(struct emitter *e, uint32_t v) {
+  memcpy(e->p, &v, 4);
+  e->p += 4;
+}
+
+static void emit64(struct emitter *e, uint64_t v) {
+  memcpy(e->p, &v, 8);
+  e->p += 8;
+}
+
+// REX prefix for reg (ModRM.reg) and rm (ModRM.rm), omitted when not needed
+static void emit_rex(struct emitter *e, int w, int reg_, int rm) {
+  uint8_t rex = 0x40 | (w << 3) | ((reg_ >> 3) << 2) | (rm >> 3);
+  if (rex != 0x40) {
+    emit8(e, rex);
+  }
+}
+
+static void emit_modrm(struct emitter *e, int mod, int reg_, int rm) {
+  emit8(e, (mod << 6) | ((reg_ & 7) << 3) | (rm & 7));
+}
+
+// movzx dst32, word [base + disp32]
+static void emit_load_disp(struct emitter *e, int dst, int base, int32_t disp) {
+  emit_rex(e, 0, dst, base);
+  emit8(e, 0x0F);
+  emit8(e, 0xB7);
+  emit_modrm(e, 2, dst, base);
+  emit32(e, disp);
+}
+
+// mov word [rbx + disp32], src16
+static void emit_store_reg(struct emitter *e, int src, int32_t disp) {
+  emit8(e, 0x66);
+  emit_rex(e, 0, src, X_RBX);
+  emit8(e, 0x89);
+  emit_modrm(e, 2, src, X_RBX);
+  emit32(e, disp);
+}
+
+// mov word [rbx + disp32], imm16
+static void emit_store_imm(struct emitter *e, uint16_t imm, int32_t disp) {
+  emit8(e, 0x66);
+  emit8(e, 0xC7);
+  emit_modrm(e, 2, 0, X_RBX);
+  emit32(e, disp);
+  emit16(e, imm);
+}
+
+// op r/m16, r16 (op is 0x01 add, 0x21 and, 0x89 mov, 0x85 test)
+static void emit_alu16(struct emitter *e, uint8_t op, int dst, int src) {
+  emit8(e, 0x66);
+  emit_rex(e, 0, src, dst);
+  emit8(e, op);
+  emit_modrm(e, 3, src, dst);
+}
+
+// op r/m16, imm16 (ext is 0 add, 4 and)
+static void emit_alu16_imm(struct emitter *e, int ext, int dst, uint16_t imm) {
+  emit8(e, 0x66);
+  emit_rex(e, 0, 0, dst);
+  emit8(e, 0x81);
+  emit_modrm(e, 3, ext, dst);
+  emit16(e, imm);
+}
+
+// mov r16, imm16
+static void emit_mov16_imm(struct emitter *e, int dst, uint16_t imm) {
+  emit8(e, 0x66);
+  emit_rex(e, 0, 0, dst);
+  emit8(e, 0xB8 + (dst & 7));
+  emit16(e, imm);
+}
+
+// mov dst32, src32
+static void emit_mov32(struct emitter *e, int dst, int src) {
+  emit_rex(e, 0, src, dst);
+  emit8(e, 0x89);
+  emit_modrm(e, 3, src, dst);
+}
+
+// mov r32, imm32
+static void emit_mov32_imm(struct emitter *e, int dst, uint32_t imm) {
+  emit_rex(e, 0, 0, dst);
+  emit8(e, 0xB8 + (dst & 7));
+  emit32(e, imm);
+}
+
+// jcc/jmp rel32 with the target patched later, returns the rel32 location
+static uint8_t *emit_jump(struct emitter *e, int cc) {
+  if (cc < 0) {
+    emit8(e, 0xE9);
+  } else {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 + cc);
+  }
+  uint8_t *rel = e->p;
+  emit32(e, 0);
+  return rel;
+}
+
+static void patch_jump(uint8_t *rel, uint8_t *target) {
+  int32_t d = (int32_t)(target - (rel + 4));
+  memcpy(rel, &d, 4);
+}
+
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5 };
+enum { CC_S = 0x8, CC_NS = 0x9 };
+enum { CC_LE = 0xE, CC_G = 0xF };
+
+// call fn(vm, esi, edx) keeping r8..r11, the caller-saved guest registers
+static void emit_call(struct emitter *e, void *fn) {
+  for (int r = 8; r < 12; r++) {
+    emit8(e, 0x41);
+    emit8(e, 0x50 + (r & 7));
+  }
+  // lea rdi, [rbx - offsetof(lc3_vm, reg)]
+  emit_rex(e, 1, X_RDI, X_RBX);
+  emit8(e, 0x8D);
+  emit_modrm(e, 2, X_RDI, X_RBX);
+  emit32(e, -(int32_t)offsetof(lc3_vm, reg));
+  emit8(e, 0x48);
+  emit8(e, 0xB8);
+  emit64(e, (uint64_t)(uintptr_t)fn);
+  emit8(e, 0xFF);
+  emit8(e, 0xD0);
+  for (int r = 11; r >= 8; r--) {
+    emit8(e, 0x41);
+    emit8(e, 0x58 + (r & 7));
+  }
+}
+
+// flag register -> reg[R_COND]
+static void emit_flags(struct emitter *e) {
+  if (e->flag_reg < 0) {
+    return;
+  }
+  emit_store_reg(e, HREG(e->flag_reg), R_COND * 2);
+  e->flag_reg = -1;
+}
+
+// Before a callout to a device register: reg[] as the interpreter would have
+// it, flags included, since PSR reads them there. The emitter state does not
+// change, the path that skips the callout has not written anything.
+static void emit_sync(struct emitter *e) {
+  if (e->flag_reg >= 0) {
+    emit_store_reg(e, HREG(e->flag_reg), R_COND * 2);
+  }
+  for (int r = 0; r < 8; r++) {
+    if (e->dirty & (1 << r)) {
+      emit_store_reg(e, HREG(r), r * 2);
+    }
+  }
+}
+
+// write back, set reg[R_PC] (from cx when pc < 0) and return count
+static void emit_exit(struct emitter *e, int32_t pc, uint16_t count) {
+  struct emitter x = *e;
+  emit_flags(&x);
+  for (int r = 0; r < 8; r++) {
+    if (x.dirty & (1 << r)) {
+      emit_store_reg(&x, HREG(r), r * 2);
+    }
+  }
+  if (pc < 0) {
+    emit_store_reg(&x, X_RCX, R_PC * 2);
+  } else {
+    emit_store_imm(&x, pc, R_PC * 2);
+  }
+  emit_mov32_imm(&x, X_RAX, count);
+  static const uint8_t epilogue[] = {0x48, 0x83, 0xC4, 0x08, // add rsp, 8
+                                     0x41, 0x5F, 0x41, 0x5E, // pop r15, r14
+                                     0x41, 0x5D, 0x41, 0x5C, // pop r13, r12
+                                     0x5D, 0x5B, 0xC3};      // pop rbp, rbx
+  memcpy(x.p, epilogue, sizeof(epilogue));
+  e->p = x.p + sizeof(epilogue);
+}
+
+// dst32 <- memory[ecx], through mem_read() for the device page. For the load
+// of guest register dr (-1 for an address) the block is left after it, at
+// next with count instructions, when the read stopped the VM: KBSR for a guest
+// that waits for input.
+static void emit_load_dynamic(struct emitter *e, int dst, int dr, uint16_t next,
+                              uint16_t count) {
+  emit8(e, 0x81); // cmp ecx, IO_PAGE
+  emit8(e, 0xF9);
+  emit32(e, IO_PAGE);
+  uint8_t *slow = emit_jump(e, CC_AE);
+  // movzx dst32, word [rbp + rcx*2 + 0]
+  emit_rex(e, 0, dst, 0);
+  emit8(e, 0x0F);
+  emit8(e, 0xB7);
+  emit_modrm(e, 1, dst, 4);
+  emit8(e, (1 << 6) | (X_RCX << 3) | X_RBP);
+  emit8(e, 0);
+  uint8_t *done = emit_jump(e, -1);
+  patch_jump(slow, e->p);
+  emit_sync(e);
+  emit_mov32(e, X_RSI, X_RCX);
+  emit_call(e, (void *)jit_load);
+  emit_rex(e, 0, dst, X_RAX); // movzx dst32, ax
+  emit8(e, 0x0F);
+  emit8(e, 0xB7);
+  emit_modrm(e, 3, dst, X_RAX);
+  if (dr >= 0) {
+    // cmp dword [rbx + offsetof(lc3_vm, running) - offsetof(lc3_vm, reg)], 0
+    emit8(e, 0x83);
+    emit_modrm(e, 2, 7, X_RBX);
+    emit32(e, (int32_t)offsetof(lc3_vm, running) - offsetof(lc3_vm, reg));
+    emit8(e, 0);
+    uint8_t *stay = emit_jump(e, CC_NE);
+    struct emitter x = *e;
+    x.dirty |= 1 << dr;
+    x.flag_reg = dr;
+    emit_exit(&x, next, count);
+    e->p = x.p;
+    patch_jump(stay, e->p);
+  }
+  patch_jump(done, e->p);
+}
+
+// dst32 <- memory[address] for an address known at compile time
+static void emit_load_const(struct emitter *e, int dst, uint16_t address,
+                            int dr, uint16_t next, uint16_t count) {
+  if (address < IO_PAGE) {
+    emit_load_disp(e, dst, X_RBP, address * 2);
+    return;
+  }
+  emit_mov32_imm(e, X_RCX, address);
+  emit_load_dynamic(e, dst, dr, next, count);
+}
+
+// memory[ecx] <- src, leaving the block if that was code
+static void emit_store(struct emitter *e, int src, uint16_t next,
+                       uint16_t count) {
+  emit8(e, 0x81); // cmp ecx, IO_PAGE
+  emit8(e, 0xF9);
+  emit32(e, IO_PAGE);
+  uint8_t *ram = emit_jump(e, CC_B);
+  emit_sync(e);
+  patch_jump(ram, e->p);
+  emit_mov32(e, X_RSI, X_RCX);
+  emit_mov32(e, X_RDX, src);
+  emit_call(e, (void *)jit_store);
+  emit8(e, 0x85); // test eax, eax
+  emit8(e, 0xC0);
+  uint8_t *stay = emit_jump(e, CC_E);
+  emit_exit(e, next, count);
+  patch_jump(stay, e->p);
+}
+
+// guest dr <- guest sr
+static void emit_move(struct emitter *e, int dr, int sr) {
+  if (dr != sr) {
+    emit_alu16(e, 0x89, HREG(dr), HREG(sr));
+  }
+}
+
+// ecx <- reg + imm, wrapped to 16 bits
+static void emit_address(struct emitter *e, int r, uint16_t imm) {
+  emit_mov32(e, X_RCX, HREG(r));
+  if (imm) {
+    emit_alu16_imm(e, 0, X_RCX, imm);
+  }
+}
+
+// compile the block starting at pc, 0 when there is nothing to compile
+static int jit_compile(lc3_vm *vm, uint16_t pc) {
+  struct jit *j = vm->jit;
+  if (j->pool_used == JIT_MAX_BLOCKS ||
+      JIT_CODE_SIZE - j->code_used < JIT_BLOCK_RESERVE) {
+    jit_flush(j);
+  }
+
+  struct emitter e = {j->code + j->code_used, 0, -1};
+  uint8_t *start = e.p;
+  static const uint8_t prologue[] = {0x53, 0x55,             // push rbx, rbp
+                                     0x41, 0x54, 0x41, 0x55, // push r12, r13
+                                     0x41, 0x56, 0x41, 0x57, // push r14, r15
+                                     0x48, 0x83, 0xEC, 0x08}; // sub rsp, 8
+  memcpy(e.p, prologue, sizeof(prologue));
+  e.p += sizeof(prologue);
+  // lea rbx, [rdi + offsetof(lc3_vm, reg)]
+  emit_rex(&e, 1, X_RBX, X_RDI);
+  emit8(&e, 0x8D);
+  emit_modrm(&e, 2, X_RBX, X_RDI);
+  emit32(&e, offsetof(lc3_vm, reg));
+  // mov rbp, [rdi + offsetof(lc3_vm, memory)]
+  emit_rex(&e, 1, X_RBP, X_RDI);
+  emit8(&e, 0x8B);
+  emit_modrm(&e, 2, X_RBP, X_RDI);
+  emit32(&e, offsetof(lc3_vm, memory));
+  for (int r = 0; r < 8; r++) {
+    emit_load_disp(&e, HREG(r), X_RBX, r * 2);
+  }
+
+  uint16_t addr = pc;
+  uint16_t n = 0;
+  int ended = 0;
+  while (!ended) {
+    // never run into the device page or wrap around
+    if (n == JIT_MAX_INSTRS || addr >= IO_PAGE) {
+      if (n == 0) {
+        return 0;
+      }
+      emit_exit(&e, addr, n);
+      break;
+    }
+    uint16_t instr = vm->memory[addr];
+    uint16_t next = addr + 1;
+    int dr = (instr >> 9) & 0x7;
+    int sr1 = (instr >> 6) & 0x7;
+    uint16_t pc9 = next + sign_extend(instr & 0x1ff, 9);
+    uint16_t off6 = sign_extend(instr & 0x3f, 6);
+
+    switch (instr >> 12) {
+    case OP_ADD:
+    case OP_AND: {
+      int ext = (instr >> 12) == OP_ADD ? 0 : 4;
+      uint8_t op = ext ? 0x21 : 0x01;
+      if ((instr >> 5) & 0x1) {
+        uint16_t imm = sign_extend(instr & 0x1f, 5);
+        emit_move(&e, dr, sr1);
+        emit_alu16_imm(&e, ext, HREG(dr), imm);
+      } else if (dr == (instr & 0x7)) {
+        emit_alu16(&e, op, HREG(dr), HREG(sr1));
+      } else {
+        emit_move(&e, dr, sr1);
+        emit_alu16(&e, op, HREG(dr), HREG(instr & 0x7));
+      }
+      break;
+    }
+    case OP_NOT:
+      emit_move(&e, dr, sr1);
+      emit8(&e, 0x66);
+      emit_rex(&e, 0, 0, HREG(dr));
+      emit8(&e, 0xF7);
+      emit_modrm(&e, 3, 2, HREG(dr));
+      break;
+    case OP_LEA:
+      emit_mov16_imm(&e, HREG(dr), pc9);
+      break;
+    case OP_LD:
+      emit_load_const(&e, HREG(dr), pc9, dr, next, n + 1);
+      break;
+    case OP_LDI:
+      emit_load_const(&e, X_RCX, pc9, -1, 0, 0);
+      emit_load_dynamic(&e, HREG(dr), dr, next, n + 1);
+      break;
+    case OP_LDR:
+      emit_address(&e, sr1, off6);
+      emit_load_dynamic(&e, HREG(dr), dr, next, n + 1);
+      break;
+    case OP_ST:
+      emit_mov32_imm(&e, X_RCX, pc9);
+      emit_store(&e, HREG(dr), next, n + 1);
+      break;
+    case OP_STI:
+      emit_load_const(&e, X_RCX, pc9, -1, 0, 0);
+      emit_store(&e, HREG(dr), next, n + 1);
+      break;
+    case OP_STR:
+      emit_address(&e, sr1, off6);
+      emit_store(&e, HREG(dr), next, n + 1);
+      break;
+    case OP_BR: {
+      // condition bits to the jcc taken when the flag register matches
+      static const int cc_for[8] = {-2, CC_G, CC_E, CC_NS, CC_S, CC_NE, CC_LE,
+                                    -1};
+      int cc = cc_for[dr];
+      n++;
+      if (cc == -2) {
+        emit_exit(&e, next, n);
+      } else if (cc == -1) {
+        emit_exit(&e, pc9, n);
+      } else {
+        int flag = X_RAX;
+        if (e.flag_reg >= 0) {
+          flag = HREG(e.flag_reg);
+        } else {
+          emit_load_disp(&e, X_RAX, X_RBX, R_COND * 2);
+        }
+        emit_alu16(&e, 0x85, flag, flag);
+        uint8_t *taken = emit_jump(&e, cc);
+        emit_exit(&e, next, n);
+        patch_jump(taken, e.p);
+        emit_exit(&e, pc9, n);
+      }
+      ended = 1;
+      continue;
+    }
+    case OP_JMP:
+      n++;
+      emit_mov32(&e, X_RCX, HREG(sr1));
+      emit_exit(&e, -1, n);
+      ended = 1;
+      continue;
+    case OP_JSR:
+      n++;
+      emit_flags(&e);
+      emit_mov16_imm(&e, HREG(R_R7), next);
+      e.dirty |= 1 << R_R7;
+      if ((instr >> 11) & 1) {
+        emit_exit(&e, next + sign_extend(instr & 0x7ff, 11), n);
+      } else {
+        emit_mov32(&e, X_RCX, HREG(sr1));
+        emit_exit(&e, -1, n);
+      }
+      ended = 1;
+      continue;
+    default:
+      // TRAP, RTI and reserved stay in the interpreter
+      if (n == 0) {
+        return 0;
+      }
+      emit_exit(&e, addr, n);
+      ended = 1;
+      continue;
+    }
+
+    switch (instr >> 12) {
+    case OP_ADD:
+    case OP_AND:
+    case OP_NOT:
+    case OP_LEA:
+    case OP_LD:
+    case OP_LDI:
+    case OP_LDR:
+      e.dirty |= 1 << dr;
+      e.flag_reg = dr;
+      break;
+    }
+    addr = next;
+    n++;
+  }
+
+  struct jit_block *b = &j->pool[j->pool_used++];
+  b->fn = (jit_fn)start;
+  b->start = pc;
+  b->end = pc + (n ? n - 1 : 0);
+  for (uint32_t a = b->start; a <= b->end; a++) {
+    j->code_count[a]++;
+  }
+  j->blocks[pc] = b;
+  j->code_used = (e.p - j->code + 15) & ~(size_t)15;
+  if (vm->stats) {
+    stat_add(&vm->stats->jit_compiles, 1);
+  }
+  return 1;
+}
+
+static int is_block_end(uint16_t instr) {
+  switch (instr >> 12) {
+  case OP_BR:
+  case OP_JMP:
+  case OP_JSR:
+  case OP_TRAP:
+  case OP_RTI:
+  case OP_RES:
+    return 1;
+  }
+  return 0;
+}
+
+// a persistent profile is replayed
+void vm_jit_warm(lc3_vm *vm, const uint64_t *entries, int words) {
+  struct jit *j = vm->jit;
+  for (int w = 0; w < words; w++) {
+    for (uint64_t m = entries[w]; m; m &= m - 1) {
+      uint16_t pc = w * 64 + __builtin_ctzll(m);
+      if (!j->blocks[pc] && j->heat[pc] != JIT_NEVER && !jit_compile(vm, pc)) {
+        j->heat[pc] = JIT_NEVER;
+      }
+    }
+  }
+}
+
+int vm_jit_entries(const lc3_vm *vm, uint64_t *entries, int words) {
+  const struct jit *j = vm->jit;
+  int any = 0;
+  for (int i = 0; i < j->pool_used; i++) {
+    const struct jit_block *b = &j->pool[i];
+    if (b->fn && b->start < words * 64) {
+      entries[b->start >> 6] |= (uint64_t)1 << (b->start & 63);
+      any = 1;
+    }
+  }
+  return any;
+}
+
+// Tiered: blocks are counted at their entry and run under the decoded
+// handlers until they reach vm->jit_threshold, then compiled. A block longer
+// than what is left of the budget is interpreted instead.
+uint64_t vm_run_jit(lc3_vm *vm, uint64_t budget) {
+  struct jit *j = vm->jit;
+  const struct decoded *cache = vm->decode_cache;
+  uint64_t n = 0;
+  uint64_t native = 0;
+  while (n < budget && vm->running) {
+    uint16_t pc = vm->reg[R_PC];
+    struct jit_block *b = j->blocks[pc];
+    if (b && (uint64_t)(b->end - b->start) < budget - n) {
+      uint16_t ran = b->fn(vm);
+      n += ran;
+      native += ran;
+      continue;
+    }
+    if (!b && j->heat[pc] != JIT_NEVER &&
+        ++j->heat[pc] >= vm->jit_threshold) {
+      if (jit_compile(vm, pc)) {
+        continue;
+      }
+      j->heat[pc] = JIT_NEVER;
+    }
+    // interpret up to the end of the basic block
+    uint16_t instr;
+    do {
+      instr = vm->memory[vm->reg[R_PC]];
+      const struct decoded *d = &cache[vm->reg[R_PC]++];
+      n += d->fn(vm, d);
+    } while (n < budget && vm->running && !is_block_end(instr));
+  }
+  if (vm->stats) {
+    stat_add(&vm->stats->jit_instructions, native);
+  }
+  return n;
+}
+#endif
@@ -0,0 +1,462 @@
+// lc3 virtual machine library
+//
+// Every guest lives in its own lc3_vm, so one process can create, run and
+// destroy as many of them as it likes. A VM never touches the terminal: its
+// input and output go through the lc3_io callbacks, the console backend below
+// is what the lc3_vm executable plugs in.
+//
+// A lc3_vm must only be used by one thread at a time, different VMs can run
+// on different threads.
+#ifndef LC3_H
+#define LC3_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct lc3_vm lc3_vm;
+
+// dispatch engines
+enum {
+  LC3_DISPATCH_SWITCH = 0, /* portable switch loop */
+  LC3_DISPATCH_THREADED,   /* direct threaded, computed goto */
+  LC3_DISPATCH_DECODED,    /* handlers from the decode cache */
+  LC3_DISPATCH_JIT         /* decoded, hot blocks compiled to native code */
+};
+
+// why lc3_vm_run() returned
+enum {
+  LC3_EXIT_BUDGET = 0, /* ran the requested number of instructions */
+  LC3_EXIT_HALT,       /* HALT trap */
+  LC3_EXIT_ILLEGAL,    /* RTI or reserved opcode */
+  LC3_EXIT_BREAK,      /* at a breakpoint, the next run goes on */
+  LC3_EXIT_WAIT        /* waiting for input, the next run returns at once
+                          until poll says a byte is there */
+};
+
+// no instruction budget
+#define LC3_RUN_FOREVER UINT64_MAX
+
+// guest I/O
+// getc blocks for the next input byte and returns -1 at the end of input,
+// poll is nonzero when getc would not block. write receives the output of
+// every trap once the trap is done, flush is called when that output has to
+// be visible right away: before the guest waits for input and on HALT.
+// wait, which may be NULL, blocks until poll would be nonzero or timeout_ms
+// have passed (-1 for no limit) and returns poll; a backend whose input is
+// all there from the start leaves it out.
+// With LC3_IO_NO_PROMPT in flags the IN trap reads without printing its prompt.
+// With LC3_IO_NONBLOCK getc is only called once poll is nonzero: GETC, IN and
+// a read of KBSR with nothing latched and interrupts off stop the VM with
+// LC3_EXIT_WAIT instead, and the trap finishes, or the guest goes on past the
+// read, in the first run after input arrives. One thread can then serve many
+// guests, running whichever has something to do.
+enum { LC3_IO_NO_PROMPT = 1 << 0, LC3_IO_NONBLOCK = 1 << 1 };
+
+struct lc3_io {
+  void *ctx;
+  int (*getc)(void *ctx);
+  int (*poll)(void *ctx);
+  void (*write)(void *ctx, const char *buf, size_t n);
+  void (*flush)(void *ctx);
+  int flags;
+  int (*wait)(void *ctx, long timeout_ms);
+};
+
+// a new VM with zeroed memory and registers, the PC at 0x3000, no input and
+// output discarded; NULL when out of memory
+lc3_vm *lc3_vm_create(void);
+void lc3_vm_destroy(lc3_vm *vm);
+
+void lc3_vm_set_io(lc3_vm *vm, const struct lc3_io *io);
+
+// select the engine for the following lc3_vm_run() calls, returns the one
+// actually used when it is not available on this build or host
+int lc3_vm_set_dispatch(lc3_vm *vm, int dispatch);
+
+// traps
+// LC3_TRAPS_NATIVE, the default, runs GETC, OUT, PUTS, IN, PUTSP and HALT as
+// host code, leaving R7 as it was, and every other vector through the trap
+// vector table when its entry is set; a trap with an empty entry is ignored.
+// LC3_TRAPS_OS sends all of them through the table at 0x0000-0x00FF, with the
+// return address in R7, and turns RTI and the reserved opcode into the
+// privilege and illegal opcode exceptions of the interrupt vector table at
+// 0x0100-0x01FF, taken on the supervisor stack. That runs a stock LC-3 OS
+// image loaded next to the program; without one the first trap jumps to
+// whatever the table holds. In native mode RTI and the reserved opcode stop
+// the VM with LC3_EXIT_ILLEGAL.
+enum { LC3_TRAPS_NATIVE = 0, LC3_TRAPS_OS };
+
+void lc3_vm_set_traps(lc3_vm *vm, int traps);
+
+// block entries before the JIT compiles them, 1 to LC3_JIT_THRESHOLD_MAX and
+// clamped to that, default 16
+enum { LC3_JIT_THRESHOLD_MAX = 0xFFFE };
+
+void lc3_vm_set_jit_threshold(lc3_vm *vm, unsigned threshold);
+
+// superinstructions: LC3_DISPATCH_DECODED runs a set of idioms, pairs and
+// triples of instructions, with one handler each, on by default
+void lc3_vm_set_fusion(lc3_vm *vm, int on);
+
+// idle loops: a guest spinning on `LDI R, KBSR` (or LDR) and a BR back to it
+// while nothing is latched is put to sleep in lc3_io.wait until input
+// arrives, at most until the end of the run or the next device event, and
+// its instruction and cycle counts move on as if the loop had run at
+// LC3_IDLE_RATE instructions a millisecond. Without wait the loop is skipped
+// to that point right away, with the counts of the run it replaces; when the
+// run is unlimited (LC3_RUN_FOREVER) and no event is pending there is no such
+// point, and the loop spins on as it would with idle loops off. On by
+// default; tracing, profiling, breakpoints and recordings see every
+// iteration.
+enum { LC3_IDLE_RATE = 100000 };
+
+void lc3_vm_set_idle(lc3_vm *vm, int on);
+
+// load an .obj image: a big-endian origin followed by big-endian words
+// both return 1 on success, 0 when the file cannot be read or is too short
+int lc3_vm_load_image(lc3_vm *vm, const char *path);
+int lc3_vm_load(lc3_vm *vm, const void *obj, size_t size);
+
+// static analysis
+// lc3_vm_analyze() follows the control flow of memory from the PC: BR both
+// ways, JSR into the subroutine and on past it, traps past them. The targets
+// of JMP, JSRR and traps served from the vector table are only known when
+// they run; RET is taken to return past a JSR. The report counts what it
+// found: ST instructions writing a data word or an instruction, STR and STI
+// whose address is computed, and results whose condition codes no BR reads.
+// may_self_modify is 0 only when no store can write a reachable instruction.
+// With LC3_TRAPS_NATIVE the analysis is kept: LC3_DISPATCH_DECODED runs the
+// ST instructions that only write data without touching its caches, until
+// the guest jumps off the analyzed code or writes some of it, memory is
+// loaded or restored, or the engine or trap mode changes. Returns 0 when out
+// of memory.
+struct lc3_analysis {
+  size_t code_words;     // reachable instructions
+  size_t blocks;         // basic blocks among them
+  size_t unknown_jumps;  // JMP other than RET, JSRR and table traps
+  size_t data_stores;    // ST to a word that is not code
+  size_t code_stores;    // ST to a reachable instruction
+  size_t dynamic_stores; // STR and STI
+  size_t flag_results;   // ADD, AND, NOT, LEA and loads
+  size_t dead_flags;     // and how many of them no BR reads
+  int may_self_modify;
+};
+
+int lc3_vm_analyze(lc3_vm *vm, struct lc3_analysis *report);
+
+// shared images
+// An lc3_image is an .obj file converted once into the native-endian contents
+// of a whole memory. Any number of VMs, on any thread, can map it; they share
+// its pages until they write to them. With LC3_IMAGE_CACHE the conversion is
+// kept next to the image as <path>.cache and reused while the .obj does not
+// change. An image can be closed while VMs still map it.
+typedef struct lc3_image lc3_image;
+
+enum { LC3_IMAGE_CACHE = 1 << 0 };
+
+lc3_image *lc3_image_open(const char *path, int flags);
+void lc3_image_close(lc3_image *image);
+
+// replace all of memory with a copy-on-write view of the image
+int lc3_vm_map_image(lc3_vm *vm, lc3_image *image);
+// copy only the words of the image, like lc3_vm_load_image()
+int lc3_vm_load_from(lc3_vm *vm, const lc3_image *image);
+
+// a copy of vm: memory, registers, run state and settings, NULL when out of
+// memory. Only the pages vm wrote since its memory was mapped are copied, the
+// rest stays shared with the image, so forking a booted VM takes microseconds
+// and the child costs a few host pages. The decode cache and JIT start cold
+// and the I/O callbacks are the parent's until changed.
+lc3_vm *lc3_vm_fork(const lc3_vm *vm);
+
+// persistent code cache
+// With a directory, the first lc3_vm_run() after memory was loaded hashes
+// the words below the device page and looks in <dir>/<hash>.lc3p for what
+// earlier runs of the same program left: the addresses they decoded, the
+// heads of their superinstruction groups and the entries of the blocks they
+// compiled. Before the first instruction the decoded engine has those
+// entries decoded and fused and the JIT those blocks compiled. Loading over
+// the memory and lc3_vm_destroy() merge what the run added into the file,
+// which is only rewritten when that is something. Every entry is still built
+// from the memory there, so a profile can only make a run cheaper. Returns 0
+// when dir cannot be created or out of memory, NULL turns it off. Forks do
+// not inherit it.
+int lc3_vm_set_code_cache(lc3_vm *vm, const char *dir);
+
+// profiling
+// A profiled VM runs a counting copy of the switch engine whatever its
+// dispatch setting: instructions per opcode and per address, traps per
+// vector, taken and not taken per branch, and a call tree from JSR, JSRR and
+// RET. Turning it off drops the counts. lc3_vm_write_profile() writes a
+// sorted report and, unless folded is NULL, the call stacks in the folded
+// format of flamegraph.pl; both return 0 when out of memory or on I/O errors.
+int lc3_vm_set_profile(lc3_vm *vm, int on);
+int lc3_vm_write_profile(const lc3_vm *vm, const char *report,
+                         const char *folded);
+
+// profile-guided superinstructions: besides the idioms of lc3_vm_set_fusion(),
+// the `pairs` opcode pairs run most often back to back, of those that start
+// with an instruction that neither stores nor jumps, get one handler each.
+// lc3_vm_fuse_profiled() takes the counts of the running profile, for a VM
+// that turns it off afterwards; lc3_vm_fuse_report() the pairs section of a
+// report an earlier run wrote. Both return the number of pairs chosen, -1
+// without a profile or when the report cannot be read; 0 pairs fuses none.
+int lc3_vm_fuse_profiled(lc3_vm *vm, int pairs);
+int lc3_vm_fuse_report(lc3_vm *vm, const char *report, int pairs);
+
+// tracing
+// A traced VM runs a recording copy of the switch engine whatever its dispatch
+// setting, and takes precedence over profiling. Every retired instruction is
+// recorded with its PC, the instruction, the value of the register named by
+// bits 11:9 afterwards (the result of ALU ops and loads, the source of stores)
+// or R0 for traps, and the flags, eight bytes in a ring that keeps the most
+// recent ones that fit in `bytes`; 0 turns it off. lc3_vm_write_trace()
+// writes the ring to fd delta-encoded, one to seven bytes a record, with
+// nothing but write(2), so it may be called from a signal handler on the
+// thread running the VM.
+// With a breakpoint lc3_vm_run() returns LC3_EXIT_BREAK before the
+// instruction at pc; the next call runs it.
+int lc3_vm_set_trace(lc3_vm *vm, size_t bytes); // 0 when out of memory
+void lc3_vm_set_trace_break(lc3_vm *vm, int on, uint16_t pc);
+int lc3_vm_write_trace(const lc3_vm *vm, int fd);
+
+// trace files, read back record by record from the oldest; lc3_trace_next()
+// returns 1 for a record, 0 at the end and -1 when the file is corrupt
+typedef struct lc3_trace lc3_trace;
+
+struct lc3_trace_record {
+  uint64_t index; // instructions retired before this one
+  uint16_t pc;
+  uint16_t instr;
+  int reg; // the register value is from, -1 for none
+  uint16_t value;
+  uint8_t flags; // N 4, Z 2, P 1
+};
+
+lc3_trace *lc3_trace_open(const char *path); // NULL when not a trace
+int lc3_trace_next(lc3_trace *trace, struct lc3_trace_record *record);
+void lc3_trace_close(lc3_trace *trace);
+
+// debugging
+// With breakpoints set a VM runs a checking copy of the switch engine, and
+// lc3_vm_run() returns LC3_EXIT_BREAK before the instruction at one of them;
+// the next call runs it. Without any the engines run untouched.
+// lc3_vm_set_breakpoint() returns 0 when out of memory.
+int lc3_vm_set_breakpoint(lc3_vm *vm, uint16_t address, int on);
+void lc3_vm_clear_breakpoints(lc3_vm *vm);
+
+// Serves the GDB remote serial protocol to one debugger connecting to port on
+// the loopback interface, waiting for it first: registers, memory,
+// breakpoints, single steps and continuing until it interrupts. Returns when
+// the debugger detaches, kills the guest or disconnects, with LC3_EXIT_BUDGET
+// when the guest can go on, the exit it stopped with otherwise, and -1 when
+// the port could not be opened. Its breakpoints go with it.
+int lc3_vm_serve_gdb(lc3_vm *vm, int port);
+
+// live counters
+// lc3_stats_create() maps the POSIX shared memory segment NAME with room for
+// `slots` VMs, creating it or joining one another process made with the same
+// size; lc3_stats_open() maps an existing one read-only, for a monitor such
+// as lc3-top. lc3_vm_set_stats() gives a VM a free slot of the segment, or
+// one left LIVE by a process that has exited, until it is destroyed or the
+// call is made again with NULL; it returns the slot, -1 when none is free.
+// The thread running the VM updates its slot with relaxed atomic stores and
+// no locks, at traps, device reads, when code is decoded, compiled or
+// dropped, and at least every LC3_STATS_INTERVAL instructions. Slots are
+// cache-line aligned so VMs on different cores never share a line. The
+// segment stays until it is unlinked, e.g. rm /dev/shm/NAME.
+enum { LC3_STATS_INTERVAL = 1 << 20 };
+enum { LC3_STATS_FREE = 0, LC3_STATS_CLAIMED, LC3_STATS_LIVE };
+
+struct lc3_stats {
+  _Alignas(64) _Atomic uint32_t state; // LC3_STATS_*, LIVE once label is set
+  int32_t pid;
+  char label[56];
+  _Alignas(64) _Atomic uint64_t instructions;
+  _Atomic uint64_t kbsr_polls;       // guest reads of KBSR
+  _Atomic uint64_t output_bytes;
+  _Atomic uint64_t decoded;          // decode cache misses
+  _Atomic uint64_t jit_instructions; // retired by compiled blocks
+  _Atomic uint64_t jit_compiles;
+  _Atomic uint64_t invalidations; // decoded words, blocks and whole caches
+  _Atomic uint64_t traps[256];    // by vector
+};
+
+typedef struct lc3_stats_segment lc3_stats_segment;
+
+lc3_stats_segment *lc3_stats_create(const char *name, int slots);
+lc3_stats_segment *lc3_stats_open(const char *name);
+void lc3_stats_close(lc3_stats_segment *seg);
+int lc3_stats_slots(const lc3_stats_segment *seg);
+const struct lc3_stats *lc3_stats_slot(const lc3_stats_segment *seg, int i);
+int lc3_vm_set_stats(lc3_vm *vm, lc3_stats_segment *seg, const char *label);
+
+// assembler
+// lc3_vm_assemble() assembles LC-3 source in two passes straight into the
+// memory of vm, leaving every location outside its .ORIG blocks, and the
+// registers, as they were. It knows the 15 opcodes with BR[n][z][p], JSRR,
+// RET, RTI and the trap aliases GETC, OUT, PUTS, IN, PUTSP and HALT, and
+// .ORIG, .FILL, .BLKW, .STRINGZ and .END; numbers are #decimal, decimal or
+// xhex. Mnemonics and labels are not case sensitive. Several .ORIG blocks are
+// allowed, each closed by .END before the next. Both return 1 on success and
+// 0 with error filled in, when it is not NULL; memory may then hold part of
+// the program. The labels are added to symbols unless it is NULL.
+typedef struct lc3_symbols lc3_symbols;
+
+struct lc3_asm_error {
+  int line; // 1-based, 0 when the error is not about a line
+  char message[160];
+};
+
+int lc3_vm_assemble(lc3_vm *vm, const char *text, size_t len,
+                    lc3_symbols *symbols, struct lc3_asm_error *error);
+int lc3_vm_assemble_file(lc3_vm *vm, const char *path, lc3_symbols *symbols,
+                         struct lc3_asm_error *error);
+
+// symbol tables: labels and their addresses, a name defined twice keeps the
+// first. lc3_symbols_near() is the last label at or below address, with
+// address minus its own in offset, NULL when there is none.
+// lc3_symbols_write() writes the .sym layout of lc3as.
+lc3_symbols *lc3_symbols_create(void); // NULL when out of memory
+void lc3_symbols_free(lc3_symbols *symbols);
+int lc3_symbols_lookup(const lc3_symbols *symbols, const char *name,
+                       uint16_t *address);
+const char *lc3_symbols_near(const lc3_symbols *symbols, uint16_t address,
+                             uint16_t *offset);
+int lc3_symbols_write(const lc3_symbols *symbols, const char *path);
+
+// names for the addresses of the profile report and the folded stacks, NULL
+// for none; symbols must outlive its use
+void lc3_vm_set_symbols(lc3_vm *vm, const lc3_symbols *symbols);
+
+// snapshots
+// A snapshot holds the registers, the run state, pending device events and
+// every page of memory that differs from the VM's base, the image it mapped or
+// zeros, including the device page with a latched key. It must be restored
+// into a VM mapping the same image. lc3_snapshot_open() maps the file once so
+// that it can be restored any number of times; input the lc3_io backend has
+// not handed to the guest yet is not part of it.
+typedef struct lc3_snapshot lc3_snapshot;
+
+// both return 1 on success, 0 when the file cannot be written or does not fit
+int lc3_vm_save(const lc3_vm *vm, const char *path);
+int lc3_vm_restore(lc3_vm *vm, const lc3_snapshot *snapshot);
+
+lc3_snapshot *lc3_snapshot_open(const char *path); // NULL when not valid
+void lc3_snapshot_close(lc3_snapshot *snapshot);
+
+// record and replay
+// A recording is a directory with everything the guest got from its lc3_io,
+// the results of poll and getc in order, and a snapshot every `interval`
+// instructions, the first taken by lc3_vm_record() itself and the last when
+// the recording ends. What the guest does depends on nothing else, so
+// lc3_vm_replay() can put a VM with the same images and settings at any
+// instruction count of the recording: it restores the last snapshot at or
+// before target and runs on to it, one interval at most, with the recorded
+// input. From there the VM keeps getting that input, until it runs out and
+// getc returns -1 and poll 0; output goes to the VM's lc3_io as usual.
+//
+// lc3_vm_record() goes between the VM and the lc3_io it has, so that has to
+// be set first. A NULL dir ends the recording or replay and puts the lc3_io
+// back; it returns 0 when part of a recording could not be written. Replaying
+// returns 1 at target, or earlier when the guest stopped before it, and 0
+// when the recording cannot be read, starts after target or the guest took
+// input other than what was recorded.
+int lc3_vm_record(lc3_vm *vm, const char *dir, uint64_t interval);
+int lc3_vm_replay(lc3_vm *vm, const char *dir, uint64_t target);
+
+// run at most max_instructions, returns LC3_EXIT_*
+// A halted or crashed VM keeps returning its exit reason.
+int lc3_vm_run(lc3_vm *vm, uint64_t max_instructions);
+
+// lockstep
+// lc3_vm_run_lockstep() runs every VM of vms for at most max_instructions,
+// with the same result as lc3_vm_run() on each, and their exit reasons in
+// exits unless it is NULL. Guests of the same image run in groups of
+// LC3_LOCKSTEP_LANES, their registers side by side in SIMD vectors, so that
+// most instructions are executed once for all guests at the same PC; guests
+// that branch apart wait for each other where their paths join. VMs with
+// LC3_TRAPS_OS, a cost table, a profile, a trace or breakpoints run on their
+// own. A VM must not appear twice in vms.
+enum { LC3_LOCKSTEP_LANES = 16 };
+
+void lc3_vm_run_lockstep(lc3_vm *const *vms, int count,
+                         uint64_t max_instructions, int *exits);
+
+// instructions retired since the VM was created
+uint64_t lc3_vm_instructions(const lc3_vm *vm);
+
+// timing
+// With a cost table every retired instruction adds the cycles of its opcode,
+// indexed by the top four bits, to lc3_vm_cycles(). The VM then runs a timed
+// copy of the switch engine whatever its dispatch setting; NULL turns the
+// model off and the engines run untouched. lc3_default_cycles follows the
+// LC-3 state machine with 5 cycles per memory access: 9 for ALU ops, LEA and
+// JMP, 15 for LD, LDR, ST, STR and TRAP, 21 and 22 for LDI and STI.
+extern const uint8_t lc3_default_cycles[16];
+
+void lc3_vm_set_cycle_costs(lc3_vm *vm, const uint8_t costs[16]);
+uint64_t lc3_vm_cycles(const lc3_vm *vm);
+
+// R0..R7, 8 for the PC
+uint16_t lc3_vm_reg(const lc3_vm *vm, int r);
+void lc3_vm_set_reg(lc3_vm *vm, int r, uint16_t val);
+
+// memory without device side effects
+uint16_t lc3_vm_peek(const lc3_vm *vm, uint16_t address);
+void lc3_vm_poke(lc3_vm *vm, uint16_t address, uint16_t val);
+
+// console backend
+// stdin without line buffering or echo, read by a background thread, and a
+// stdout buffer written in batches. There is a single console per process.
+// When stdin is not a terminal its settings are left alone.
+void lc3_console_start(void);
+void lc3_console_stop(void); // flush and restore the terminal
+struct lc3_io lc3_console_io(void);
+
+// When stdout is not a terminal, output is written once flush_bytes are
+// pending or flush_ms after the last write (defaults 64K and 100).
+void lc3_console_set_flush(size_t flush_bytes, long flush_ms);
+
+// memory backend
+// Input is read from `in`, output is appended to a growing heap buffer.
+struct lc3_buffer {
+  const char *in;
+  size_t in_len;
+  size_t in_pos;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+};
+
+struct lc3_io lc3_buffer_io(struct lc3_buffer *b);
+void lc3_buffer_free(struct lc3_buffer *b);
+
+// headless backend
+// Input is a mapped file or a caller's buffer, read in place. Output goes to
+// the out_cap bytes allocated by lc3_headless_init(); what does not fit is
+// counted in dropped and lost. There is no terminal, no waiting and no
+// flushing, and IN prints no prompt, so a run depends only on the image and the
+// input. lc3_headless_rewind() readies the same buffers for the next guest.
+struct lc3_headless {
+  const char *in;
+  size_t in_len;
+  size_t in_pos;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  uint64_t dropped;
+  void *map; // the mapping behind in, if any
+  size_t map_len;
+};
+
+int lc3_headless_init(struct lc3_headless *h, size_t out_cap); // 0 on ENOMEM
+int lc3_headless_map_input(struct lc3_headless *h, const char *path);
+void lc3_headless_set_input(struct lc3_headless *h, const void *in,
+                            size_t len);
+void lc3_headless_rewind(struct lc3_headless *h);
+struct lc3_io lc3_headless_io(struct lc3_headless *h);
+void lc3_headless_free(struct lc3_headless *h);
+
+#endif
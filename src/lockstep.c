@@ -0,0 +1,542 @@
+// lockstep groups
+// --------------------------------------------------
+// lc3_vm_run_lockstep() runs up to LANES guests of one image as a group: the
+// registers of all of them live in structure-of-arrays vectors, one 16-bit
+// lane per guest, and every step runs one instruction for all the lanes at
+// the same PC. ADD, AND, NOT, LEA, BR and the jumps are vector operations
+// under a lane mask; loads and stores go to each lane's own memory, a word at
+// a time, and code pages no lane has written are fetched once for all of
+// them. Everything else, traps, RTI, the device page and a lane whose next
+// device event is due, runs through lc3_vm_run() on that lane's own VM for a
+// single instruction.
+//
+// While every running lane is at the same PC the group is converged and the
+// PC is one scalar. A branch or jump that sends lanes apart puts each lane's
+// PC in its vector, and from then on a step runs the lanes at the lowest PC
+// while the others wait, which brings them back together where the paths
+// join: after an if, at the end of a loop that ran a different number of
+// times. Guests fed different input may never meet again; when the steps of a
+// phase run fewer than half of the lanes on average, the lanes run on their
+// own engines for the next rounds, twice as many each time that keeps
+// happening.
+//
+// The vectors are GCC vector extensions, SSE2 on x86-64 and NEON on arm64; on
+// x86-64 the engine is built a second time for AVX2 and picked at run time
+// like the string kernels.
+#include "vm.h"
+
+#include <string.h>
+
+#ifndef LC3_HAVE_SIMD
+#define LC3_HAVE_SIMD 1
+#endif
+#if LC3_HAVE_SIMD && defined(__SSE2__)
+#define LC3_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+#if LC3_HAVE_SIMD && defined(__SSE2__) && defined(__x86_64__) &&               \
+    defined(__GNUC__)
+#define LC3_HAVE_AVX2 1
+#endif
+#if LC3_HAVE_SIMD && defined(__aarch64__) && defined(__ARM_NEON)
+#define LC3_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+enum {
+  LANES = LC3_LOCKSTEP_LANES,
+  PHASE_MAX = UINT16_MAX, // instructions per lane between two refills
+};
+
+// lane_bit and lane_bits_of() are written for 16 lanes
+_Static_assert(LANES == 16, "lockstep groups are 16 lanes");
+
+typedef uint16_t lanes __attribute__((vector_size(2 * LANES)));
+typedef int16_t lanes_signed __attribute__((vector_size(2 * LANES)));
+
+struct group {
+  lanes r[R_COUNT]; // R0..R7, the PC while not converged, R_COND
+  lanes ran;        // instructions since the refill
+  lanes fuel;       // and how many the lane may run before the next one
+  uint32_t active;  // lanes that run vector steps
+  int converged;    // every active lane is at pc
+  uint16_t pc;
+  int count;
+  uint64_t steps;      // vector steps of the phase
+  uint64_t lane_steps; // and the instructions they ran
+  lc3_vm *vm[LANES];
+  uint16_t *mem[LANES];
+  uint64_t left[LANES];
+  // words that may hold something else in some lane, fetched lane by lane
+  uint64_t differs[(UINT16_MAX + 1) / 64];
+};
+
+// The helpers below go into both copies of group_phase(), and those pass a
+// vector by value differently: the AVX2 one in ymm registers, the baseline
+// one through memory. So no helper takes or returns one by value; vectors
+// come out of macros and go in by pointer, and the helpers are always
+// inlined.
+#define LANES_INLINE static inline __attribute__((always_inline))
+
+static const lanes lane_bit = {1 << 0,  1 << 1,  1 << 2,  1 << 3,
+                               1 << 4,  1 << 5,  1 << 6,  1 << 7,
+                               1 << 8,  1 << 9,  1 << 10, 1 << 11,
+                               1 << 12, 1 << 13, 1 << 14, 1 << 15};
+
+#define splat(x) ((lanes){0} + (uint16_t)(x))
+
+// all ones in the lanes of bitmask m
+#define lane_mask(m) ((lanes)((lane_bit & (uint16_t)(m)) != 0))
+
+// a where m is set, b elsewhere; m is evaluated twice
+#define blend(m, a, b) (((a) & (m)) | ((b) & ~(m)))
+
+LANES_INLINE uint32_t lane_bits_of(const lanes *v) {
+#if LC3_HAVE_SSE2
+  __m128i lo, hi;
+  memcpy(&lo, v, 16);
+  memcpy(&hi, (const char *)v + 16, 16);
+  return _mm_movemask_epi8(_mm_packs_epi16(lo, hi));
+#elif LC3_HAVE_NEON
+  uint16x8_t lo, hi;
+  lanes b = *v & lane_bit;
+  memcpy(&lo, &b, 16);
+  memcpy(&hi, (const char *)&b + 16, 16);
+  return vaddvq_u16(lo) | vaddvq_u16(hi);
+#else
+  uint32_t bits = 0;
+  for (int l = 0; l < LANES; l++) {
+    bits |= ((*v)[l] & 1) << l;
+  }
+  return bits;
+#endif
+}
+
+// the bitmask of the lanes of a comparison result
+#define lane_bits(v)                                                           \
+  ({                                                                           \
+    lanes bits_of_ = (lanes)(v);                                               \
+    lane_bits_of(&bits_of_);                                                   \
+  })
+
+// lanes that run through lc3_vm_run() alone
+static int lockstep_eligible(const lc3_vm *vm) {
+  return vm->traps == LC3_TRAPS_NATIVE && !vm->debug && !vm->trace &&
+         !vm->profile && !vm->timed;
+}
+
+static void group_load(struct group *g, int l) {
+  for (int r = 0; r < R_COUNT; r++) {
+    g->r[r][l] = g->vm[l]->reg[r];
+  }
+}
+
+static void group_store(struct group *g, int l) {
+  for (int r = 0; r < R_COUNT; r++) {
+    g->vm[l]->reg[r] = g->r[r][l];
+  }
+}
+
+// the PC of every active lane in its vector
+LANES_INLINE void diverge(struct group *g) {
+  if (g->converged) {
+    g->r[R_PC] = blend(lane_mask(g->active), splat(g->pc), g->r[R_PC]);
+    g->converged = 0;
+  }
+}
+
+// what the lane may run before lc3_vm_run() has to look at it, 0 when it is
+// due now or stopped
+static void refuel(struct group *g, int l) {
+  lc3_vm *vm = g->vm[l];
+  uint64_t fuel = 0;
+  if (vm->running && g->left[l]) {
+    fuel = vm_next_stop(vm) - vm->instructions;
+    fuel = fuel < g->left[l] ? fuel : g->left[l];
+    fuel = fuel < PHASE_MAX ? fuel : PHASE_MAX;
+  }
+  g->ran[l] = 0;
+  g->fuel[l] = fuel;
+  if (fuel) {
+    g->active |= 1u << l;
+  } else {
+    g->active &= ~(1u << l);
+  }
+}
+
+// the vector steps of the lane so far go into its count
+static void settle(struct group *g, int l) {
+  g->vm[l]->instructions += g->ran[l];
+  if (g->vm[l]->stats) {
+    stat_add(&g->vm[l]->stats->instructions, g->ran[l]);
+  }
+  g->left[l] -= g->ran[l];
+  g->ran[l] = 0;
+}
+
+// the instruction at the lanes' PC, on their own VMs
+static void group_scalar(struct group *g, uint32_t m) {
+  diverge(g);
+  for (; m; m &= m - 1) {
+    int l = __builtin_ctz(m);
+    lc3_vm *vm = g->vm[l];
+    settle(g, l);
+    group_store(g, l);
+    uint64_t before = vm->instructions;
+    lc3_vm_run(vm, 1);
+    g->left[l] -= vm->instructions - before;
+    group_load(g, l);
+    refuel(g, l);
+  }
+}
+
+// the stores of a step keep the fetch of shared code honest
+LANES_INLINE void group_written(struct group *g, uint16_t address) {
+  g->differs[address >> 6] |= (uint64_t)1 << (address & 63);
+}
+
+LANES_INLINE void set_pc(struct group *g, uint32_t m, uint16_t pc) {
+  if (g->converged) {
+    g->pc = pc;
+  } else {
+    g->r[R_PC] = blend(lane_mask(m), splat(pc), g->r[R_PC]);
+  }
+}
+
+// per-lane targets, scalar again when they agree
+LANES_INLINE void set_pc_lanes(struct group *g, uint32_t m, const lanes *pc) {
+  uint16_t first = (*pc)[__builtin_ctz(m)];
+  if ((lane_bits(*pc == splat(first)) & m) == m) {
+    set_pc(g, m, first);
+    return;
+  }
+  diverge(g);
+  g->r[R_PC] = blend(lane_mask(m), *pc, g->r[R_PC]);
+}
+
+LANES_INLINE void set_result_of(struct group *g, uint32_t m, int dr,
+                                const lanes *v) {
+  lanes mask = lane_mask(m);
+  g->r[dr] = blend(mask, *v, g->r[dr]);
+  g->r[R_COND] = blend(mask, *v, g->r[R_COND]);
+}
+
+#define set_result(g, m, dr, v)                                                \
+  ({                                                                           \
+    lanes result_ = (v);                                                       \
+    set_result_of(g, m, dr, &result_);                                         \
+  })
+
+// any lane addressing the device page
+LANES_INLINE int touches_devices(const lanes *address, uint32_t m) {
+  return (lane_bits(*address >= IO_PAGE) & m) != 0;
+}
+
+// Runs until every lane is out of fuel or for PHASE_MAX steps. Built once for
+// the baseline and once for AVX2 from this body.
+LANES_INLINE void group_phase(struct group *g) {
+  while (g->active && g->steps < PHASE_MAX) {
+    uint16_t pc;
+    uint32_t m;
+    if (g->converged) {
+      pc = g->pc;
+      m = g->active;
+    } else {
+      // the lanes at the lowest PC
+      lanes pcs = g->r[R_PC] | ~lane_mask(g->active);
+      pc = UINT16_MAX;
+      for (int l = 0; l < LANES; l++) {
+        pc = pcs[l] < pc ? pcs[l] : pc;
+      }
+      m = lane_bits(pcs == splat(pc)) & g->active;
+      if (m == g->active) {
+        g->converged = 1;
+        g->pc = pc;
+      }
+    }
+
+    int first = __builtin_ctz(m);
+    uint16_t instr = g->mem[first][pc];
+    if (g->differs[pc >> 6] >> (pc & 63) & 1) {
+      // lanes whose code differs wait for a step of their own
+      for (uint32_t o = m & (m - 1); o; o &= o - 1) {
+        int l = __builtin_ctz(o);
+        if (g->mem[l][pc] != instr) {
+          m &= ~(1u << l);
+        }
+      }
+      if (m != g->active) {
+        diverge(g);
+      }
+    }
+    if (pc >= IO_PAGE) {
+      group_scalar(g, m);
+      continue;
+    }
+
+    uint16_t next = pc + 1;
+    int dr = (instr >> 9) & 0x7;
+    int sr1 = (instr >> 6) & 0x7;
+    switch (instr >> 12) {
+    case OP_ADD:
+      set_result(g, m, dr,
+                 g->r[sr1] + (instr & 0x20 ? splat(sign_extend(instr & 0x1F, 5))
+                                           : g->r[instr & 0x7]));
+      set_pc(g, m, next);
+      break;
+    case OP_AND:
+      set_result(g, m, dr,
+                 g->r[sr1] & (instr & 0x20 ? splat(sign_extend(instr & 0x1F, 5))
+                                           : g->r[instr & 0x7]));
+      set_pc(g, m, next);
+      break;
+    case OP_NOT:
+      set_result(g, m, dr, ~g->r[sr1]);
+      set_pc(g, m, next);
+      break;
+    case OP_LEA:
+      set_result(g, m, dr, splat(next + sign_extend(instr & 0x1FF, 9)));
+      set_pc(g, m, next);
+      break;
+    case OP_BR: {
+      lanes cond = g->r[R_COND];
+      lanes zero = (lanes)(cond == 0);
+      lanes neg = (lanes)((lanes_signed)cond < 0);
+      lanes want = (instr & 0x800 ? neg : splat(0)) |
+                   (instr & 0x400 ? zero : splat(0)) |
+                   (instr & 0x200 ? ~(zero | neg) : splat(0));
+      uint32_t taken = lane_bits(want) & m;
+      uint16_t target = next + sign_extend(instr & 0x1FF, 9);
+      if (taken == m) {
+        set_pc(g, m, target);
+      } else if (!taken) {
+        set_pc(g, m, next);
+      } else {
+        diverge(g);
+        g->r[R_PC] = blend(lane_mask(taken), splat(target),
+                           blend(lane_mask(m), splat(next), g->r[R_PC]));
+      }
+      break;
+    }
+    case OP_JMP:
+      set_pc_lanes(g, m, &g->r[sr1]);
+      break;
+    case OP_JSR: {
+      // R7 first, JSRR R7 jumps to the new R7 like vm_JSR() does
+      lanes mask = lane_mask(m);
+      g->r[R_R7] = blend(mask, splat(next), g->r[R_R7]);
+      if (instr & 0x800) {
+        set_pc(g, m, next + sign_extend(instr & 0x7FF, 11));
+      } else {
+        set_pc_lanes(g, m, &g->r[sr1]);
+      }
+      break;
+    }
+    case OP_LD:
+    case OP_LDR:
+    case OP_LDI: {
+      int op = instr >> 12;
+      lanes address = op == OP_LDR
+                          ? g->r[sr1] + sign_extend(instr & 0x3F, 6)
+                          : splat(next + sign_extend(instr & 0x1FF, 9));
+      if (touches_devices(&address, m)) {
+        group_scalar(g, m);
+        continue;
+      }
+      lanes v = g->r[dr];
+      for (uint32_t o = m; o; o &= o - 1) {
+        int l = __builtin_ctz(o);
+        v[l] = g->mem[l][address[l]];
+      }
+      if (op == OP_LDI) {
+        if (touches_devices(&v, m)) {
+          group_scalar(g, m);
+          continue;
+        }
+        address = v;
+        for (uint32_t o = m; o; o &= o - 1) {
+          int l = __builtin_ctz(o);
+          v[l] = g->mem[l][address[l]];
+        }
+      }
+      set_result(g, m, dr, v);
+      set_pc(g, m, next);
+      break;
+    }
+    case OP_ST:
+    case OP_STR:
+    case OP_STI: {
+      int op = instr >> 12;
+      lanes address = op == OP_STR
+                          ? g->r[sr1] + sign_extend(instr & 0x3F, 6)
+                          : splat(next + sign_extend(instr & 0x1FF, 9));
+      if (op == OP_STI) {
+        if (touches_devices(&address, m)) {
+          group_scalar(g, m);
+          continue;
+        }
+        for (uint32_t o = m; o; o &= o - 1) {
+          int l = __builtin_ctz(o);
+          address[l] = g->mem[l][address[l]];
+        }
+      }
+      if (touches_devices(&address, m)) {
+        group_scalar(g, m);
+        continue;
+      }
+      for (uint32_t o = m; o; o &= o - 1) {
+        int l = __builtin_ctz(o);
+        mem_write_ram(g->vm[l], address[l], g->r[dr][l]);
+        group_written(g, address[l]);
+      }
+      set_pc(g, m, next);
+      break;
+    }
+    default: // TRAP, RTI, the reserved opcode
+      group_scalar(g, m);
+      continue;
+    }
+
+    g->steps++;
+    g->lane_steps += __builtin_popcount(m);
+    g->ran += lane_mask(m) & 1;
+    uint32_t out = lane_bits(g->ran == g->fuel) & m;
+    if (out) {
+      if (g->converged) {
+        g->r[R_PC] = blend(lane_mask(out), splat(g->pc), g->r[R_PC]);
+      }
+      g->active &= ~out;
+    }
+  }
+  diverge(g);
+}
+
+static void phase_baseline(struct group *g) { group_phase(g); }
+
+#if LC3_HAVE_AVX2
+static __attribute__((target("avx2"))) void phase_avx2(struct group *g) {
+  group_phase(g);
+}
+#endif
+
+// the words that differ between the lanes
+// A page nobody wrote over the same image is the same everywhere, the others
+// are compared word by word.
+static void group_compare(struct group *g) {
+  int same_base = 1;
+  for (int l = 1; l < g->count; l++) {
+    same_base &= g->vm[l]->base == g->vm[0]->base;
+  }
+  memset(g->differs, 0, sizeof(g->differs));
+  for (int p = 0; p < VM_PAGES; p++) {
+    int dirty = !same_base;
+    for (int l = 0; l < g->count; l++) {
+      dirty |= g->vm[l]->page_dirty[p];
+    }
+    for (int a = p * VM_PAGE_WORDS; dirty && a < (p + 1) * VM_PAGE_WORDS;
+         a++) {
+      for (int l = 1; l < g->count; l++) {
+        if (g->mem[l][a] != g->mem[0][a]) {
+          group_written(g, a);
+          break;
+        }
+      }
+    }
+  }
+}
+
+// the fuel of every active lane on its own engine
+static void group_alone(struct group *g) {
+  for (uint32_t m = g->active; m; m &= m - 1) {
+    int l = __builtin_ctz(m);
+    lc3_vm *vm = g->vm[l];
+    group_store(g, l);
+    uint64_t before = vm->instructions;
+    lc3_vm_run(vm, g->fuel[l]);
+    g->left[l] -= vm->instructions - before;
+    group_load(g, l);
+  }
+  group_compare(g);
+}
+
+static void run_group(struct group *g, uint64_t max_instructions) {
+  void (*phase)(struct group *) = phase_baseline;
+#if LC3_HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    phase = phase_avx2;
+  }
+#endif
+  for (int l = 0; l < g->count; l++) {
+    g->mem[l] = g->vm[l]->memory;
+    g->left[l] = max_instructions;
+    group_load(g, l);
+  }
+  group_compare(g);
+
+  uint64_t backoff = 1;
+  uint64_t alone = 0; // rounds left to run on the lanes' own engines
+  for (;;) {
+    g->active = 0;
+    g->converged = 0;
+    uint32_t due = 0;
+    for (int l = 0; l < g->count; l++) {
+      refuel(g, l);
+      if (!(g->active >> l & 1) && g->vm[l]->running && g->left[l]) {
+        due |= 1u << l;
+      }
+    }
+    // lanes at a device event take one instruction alone, then join in
+    if (due) {
+      group_scalar(g, due);
+    }
+    if (!g->active) {
+      if (!due) {
+        break;
+      }
+      continue;
+    }
+    if (alone) {
+      alone--;
+      group_alone(g);
+      continue;
+    }
+    g->steps = 0;
+    g->lane_steps = 0;
+    phase(g);
+    for (int l = 0; l < g->count; l++) {
+      settle(g, l);
+    }
+    if (2 * g->lane_steps < g->steps * g->count) {
+      alone = backoff;
+      backoff = backoff < 1024 ? 2 * backoff : backoff;
+    } else {
+      backoff = 1;
+    }
+  }
+  for (int l = 0; l < g->count; l++) {
+    group_store(g, l);
+  }
+}
+
+void lc3_vm_run_lockstep(lc3_vm *const *vms, int count,
+                         uint64_t max_instructions, int *exits) {
+  struct group g;
+  g.count = 0;
+  for (int i = 0; i < count; i++) {
+    if (!lockstep_eligible(vms[i])) {
+      lc3_vm_run(vms[i], max_instructions);
+      continue;
+    }
+    g.vm[g.count++] = vms[i];
+    if (g.count == LANES) {
+      run_group(&g, max_instructions);
+      g.count = 0;
+    }
+  }
+  if (g.count) {
+    run_group(&g, max_instructions);
+  }
+  for (int i = 0; exits && i < count; i++) {
+    exits[i] = vms[i]->running ? LC3_EXIT_BUDGET : vms[i]->exit;
+  }
+}
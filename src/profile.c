@@ -0,0 +1,465 @@
+// execution profiler
+// --------------------------------------------------
+// A VM with a profile runs under vm_run_profile(), a copy of the switch loop
+// that counts every retired instruction by opcode and address, every trap by
+// vector, both outcomes of every branch, every pair of opcodes run one after
+// the other from consecutive addresses, which is what superinstructions can
+// fuse, and cycles when they are timed.
+// The other engines know nothing about it, so profiling costs nothing when it
+// is off.
+//
+// Calls are tracked as a tree: JSR, JSRR and traps served from the vector
+// table enter a child of the current node named by the target address, RET
+// (JMP R7) returns to its parent. Every instruction is charged to the node it
+// runs in, which gives the folded stacks flamegraph.pl reads. Interrupts are
+// not tracked, their RTI is not a RET.
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// deeper calls are charged to the deepest node, returns still match up
+enum { PROFILE_MAX_DEPTH = 1024, PROFILE_TOP = 50, PROFILE_TOP_PAIRS = 20 };
+
+struct call_node {
+  uint32_t parent;
+  uint16_t addr;
+  uint64_t self; // instructions retired in this node
+};
+
+struct profile {
+  uint64_t op[16];
+  uint64_t trap[256];
+  uint64_t pc[UINT16_MAX + 1];
+  uint64_t taken[UINT16_MAX + 1];
+  uint64_t not_taken[UINT16_MAX + 1];
+  uint64_t pair[16 * 16]; // first opcode * 16 + second
+  uint32_t next_pc;       // after the last instruction, 0x10000 at first
+  uint8_t last_op;
+  struct call_node *nodes; // nodes[0] is the root
+  uint32_t node_count;
+  uint32_t node_cap;
+  uint32_t *index; // open addressing on (parent, addr), 0 is empty
+  uint32_t index_cap;
+  uint32_t current;
+  uint32_t depth;    // of current
+  uint32_t overflow; // calls not entered below PROFILE_MAX_DEPTH
+};
+
+static const char *const op_names[16] = {
+    "BR", "ADD", "LD",  "ST",  "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
+
+static uint32_t call_hash(uint32_t parent, uint16_t addr) {
+  uint32_t h = (parent * 0x9E3779B1u) ^ addr;
+  return h ^ (h >> 15);
+}
+
+static int index_grow(struct profile *p) {
+  uint32_t cap = p->index_cap ? p->index_cap * 2 : 1024;
+  uint32_t *index = calloc(cap, sizeof(*index));
+  if (!index) {
+    return 0;
+  }
+  for (uint32_t i = 1; i < p->node_count; i++) {
+    uint32_t h = call_hash(p->nodes[i].parent, p->nodes[i].addr) & (cap - 1);
+    while (index[h]) {
+      h = (h + 1) & (cap - 1);
+    }
+    index[h] = i;
+  }
+  free(p->index);
+  p->index = index;
+  p->index_cap = cap;
+  return 1;
+}
+
+// the child of the current node for a call to addr, created on first use;
+// the current node when out of memory
+static uint32_t call_child(struct profile *p, uint16_t addr) {
+  uint32_t mask = p->index_cap - 1;
+  uint32_t h = call_hash(p->current, addr) & mask;
+  for (uint32_t i; (i = p->index[h]); h = (h + 1) & mask) {
+    if (p->nodes[i].parent == p->current && p->nodes[i].addr == addr) {
+      return i;
+    }
+  }
+  if (p->node_count == p->node_cap) {
+    struct call_node *nodes =
+        realloc(p->nodes, 2 * p->node_cap * sizeof(*nodes));
+    if (!nodes) {
+      return p->current;
+    }
+    p->nodes = nodes;
+    p->node_cap *= 2;
+  }
+  uint32_t i = p->node_count++;
+  p->nodes[i] = (struct call_node){p->current, addr, 0};
+  p->index[h] = i;
+  if (2 * p->node_count > p->index_cap && !index_grow(p)) {
+    p->node_count--; // keep the index usable, forget the node
+    p->index[h] = 0;
+    return p->current;
+  }
+  return i;
+}
+
+static void call_enter(struct profile *p, uint16_t addr) {
+  if (p->depth == PROFILE_MAX_DEPTH) {
+    p->overflow++;
+    return;
+  }
+  uint32_t child = call_child(p, addr);
+  if (child == p->current) {
+    p->overflow++;
+    return;
+  }
+  p->current = child;
+  p->depth++;
+}
+
+static void call_return(struct profile *p) {
+  if (p->overflow) {
+    p->overflow--;
+  } else if (p->depth > 0) {
+    p->current = p->nodes[p->current].parent;
+    p->depth--;
+  }
+}
+
+void vm_profile_free(lc3_vm *vm) {
+  struct profile *p = vm->profile;
+  if (p) {
+    free(p->nodes);
+    free(p->index);
+    free(p);
+    vm->profile = NULL;
+  }
+}
+
+// the root is named after the PC profiling starts at
+static int profile_init(lc3_vm *vm) {
+  if (vm->profile) {
+    return 1;
+  }
+  struct profile *p = calloc(1, sizeof(*p));
+  if (!p) {
+    return 0;
+  }
+  vm->profile = p;
+  p->node_cap = 1024;
+  p->nodes = malloc(p->node_cap * sizeof(*p->nodes));
+  if (!p->nodes || !index_grow(p)) {
+    vm_profile_free(vm);
+    return 0;
+  }
+  p->nodes[0] = (struct call_node){0, vm->reg[R_PC], 0};
+  p->node_count = 1;
+  p->next_pc = UINT16_MAX + 1;
+  return 1;
+}
+
+int lc3_vm_set_profile(lc3_vm *vm, int on) {
+  if (!on) {
+    vm_profile_free(vm);
+    return 1;
+  }
+  return profile_init(vm);
+}
+
+uint64_t vm_run_profile(lc3_vm *vm, uint64_t budget) {
+  struct profile *p = vm->profile;
+  uint64_t n = 0;
+  while (n < budget && vm->running) {
+    uint16_t pc = vm->reg[R_PC]++;
+    uint16_t instr = mem_fetch(vm, pc);
+    uint16_t op = instr >> 12;
+    n++;
+    p->op[op]++;
+    p->pc[pc]++;
+    if (pc == p->next_pc) {
+      p->pair[p->last_op * 16 + op]++;
+    }
+    p->next_pc = (uint16_t)(pc + 1);
+    p->last_op = op;
+    if (vm->timed) {
+      vm->cycles += vm->cycle_cost[op];
+    }
+    p->nodes[p->current].self++;
+
+    switch (op) {
+    case OP_ADD:
+      vm_ADD(vm, instr);
+      break;
+    case OP_AND:
+      vm_AND(vm, instr);
+      break;
+    case OP_NOT:
+      vm_NOT(vm, instr);
+      break;
+    case OP_BR:
+      if ((instr >> 9) & cond_flags(vm)) {
+        p->taken[pc]++;
+      } else {
+        p->not_taken[pc]++;
+      }
+      vm_BR(vm, instr);
+      break;
+    case OP_JMP:
+      vm_JMP(vm, instr);
+      if (((instr >> 6) & 0x7) == R_R7) {
+        call_return(p);
+      }
+      break;
+    case OP_JSR:
+      vm_JSR(vm, instr);
+      call_enter(p, vm->reg[R_PC]);
+      break;
+    case OP_LD:
+      vm_LD(vm, instr);
+      break;
+    case OP_LDI:
+      vm_LDI(vm, instr);
+      break;
+    case OP_LDR:
+      vm_LDR(vm, instr);
+      break;
+    case OP_LEA:
+      vm_LEA(vm, instr);
+      break;
+    case OP_ST:
+      vm_ST(vm, instr);
+      break;
+    case OP_STI:
+      vm_STI(vm, instr);
+      break;
+    case OP_STR:
+      vm_STR(vm, instr);
+      break;
+    case OP_TRAP:
+      p->trap[instr & 0xFF]++;
+      vm_TRAP(vm, instr);
+      if (vm->reg[R_PC] != (uint16_t)(pc + 1)) {
+        call_enter(p, vm->reg[R_PC]);
+      }
+      break;
+    case OP_RTI:
+      vm_RTI(vm);
+      break;
+    case OP_RES:
+      vm_RES(vm);
+      break;
+    }
+  }
+  return n;
+}
+
+// report
+// --------------------------------------------------
+
+static const uint64_t *sort_counts;
+
+static int by_count(const void *a, const void *b) {
+  uint64_t x = sort_counts[*(const uint32_t *)a];
+  uint64_t y = sort_counts[*(const uint32_t *)b];
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// indices of the nonzero counts, most frequent first
+static uint32_t *sorted(const uint64_t *counts, uint32_t n, uint32_t *used) {
+  uint32_t *order = malloc(n * sizeof(*order));
+  if (!order) {
+    return NULL;
+  }
+  *used = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (counts[i]) {
+      order[(*used)++] = i;
+    }
+  }
+  sort_counts = counts;
+  qsort(order, *used, sizeof(*order), by_count);
+  return order;
+}
+
+static double percent(uint64_t part, uint64_t total) {
+  return total ? 100.0 * part / total : 0;
+}
+
+// the label of address and the distance from it after an address column,
+// nothing without symbols
+static void write_label(const lc3_vm *vm, uint16_t address, FILE *f) {
+  uint16_t offset;
+  const char *name = lc3_symbols_near(vm->symbols, address, &offset);
+  if (name && offset) {
+    fprintf(f, "  %s+%u", name, offset);
+  } else if (name) {
+    fprintf(f, "  %s", name);
+  }
+}
+
+static void write_report(const lc3_vm *vm, FILE *f) {
+  const struct profile *p = vm->profile;
+  uint64_t total = 0;
+  for (int i = 0; i < 16; i++) {
+    total += p->op[i];
+  }
+  fprintf(f, "instructions %llu\n\nopcodes\n", (unsigned long long)total);
+  uint32_t used;
+  uint32_t *order = sorted(p->op, 16, &used);
+  for (uint32_t i = 0; order && i < used; i++) {
+    fprintf(f, "  %-4s %14llu %6.2f%%\n", op_names[order[i]],
+            (unsigned long long)p->op[order[i]],
+            percent(p->op[order[i]], total));
+  }
+  free(order);
+
+  fprintf(f, "\ntraps\n");
+  order = sorted(p->trap, 256, &used);
+  for (uint32_t i = 0; order && i < used; i++) {
+    fprintf(f, "  x%02X %14llu\n", order[i],
+            (unsigned long long)p->trap[order[i]]);
+  }
+  free(order);
+
+  fprintf(f, "\npairs\n");
+  order = sorted(p->pair, 16 * 16, &used);
+  for (uint32_t i = 0; order && i < used && i < PROFILE_TOP_PAIRS; i++) {
+    fprintf(f, "  %-4s %-4s %14llu %6.2f%%\n", op_names[order[i] / 16],
+            op_names[order[i] % 16], (unsigned long long)p->pair[order[i]],
+            percent(p->pair[order[i]], total));
+  }
+  free(order);
+
+  fprintf(f, "\nhottest addresses\n");
+  order = sorted(p->pc, UINT16_MAX + 1, &used);
+  for (uint32_t i = 0; order && i < used && i < PROFILE_TOP; i++) {
+    uint16_t pc = order[i];
+    fprintf(f, "  x%04X %-4s %14llu %6.2f%%", pc,
+            op_names[vm->memory[pc] >> 12], (unsigned long long)p->pc[pc],
+            percent(p->pc[pc], total));
+    write_label(vm, pc, f);
+    fprintf(f, "\n");
+  }
+  free(order);
+
+  fprintf(f, "\nbranches          taken      not taken\n");
+  uint64_t *branches = malloc((UINT16_MAX + 1) * sizeof(*branches));
+  if (!branches) {
+    return;
+  }
+  for (uint32_t pc = 0; pc <= UINT16_MAX; pc++) {
+    branches[pc] = p->taken[pc] + p->not_taken[pc];
+  }
+  order = sorted(branches, UINT16_MAX + 1, &used);
+  for (uint32_t i = 0; order && i < used && i < PROFILE_TOP; i++) {
+    uint16_t pc = order[i];
+    fprintf(f, "  x%04X %14llu %14llu %6.2f%% taken", pc,
+            (unsigned long long)p->taken[pc],
+            (unsigned long long)p->not_taken[pc],
+            percent(p->taken[pc], branches[pc]));
+    write_label(vm, pc, f);
+    fprintf(f, "\n");
+  }
+  free(order);
+  free(branches);
+}
+
+// a call tree node: its label when one starts there, else its address
+static void write_frame(const lc3_vm *vm, uint16_t address, FILE *f) {
+  uint16_t offset;
+  const char *name = lc3_symbols_near(vm->symbols, address, &offset);
+  if (name && !offset) {
+    fprintf(f, "%s", name);
+  } else {
+    fprintf(f, "x%04X", address);
+  }
+}
+
+// one line per node with instructions of its own: the frames from the root
+// down, separated by ';', and the count
+static void write_folded(const lc3_vm *vm, FILE *f) {
+  const struct profile *p = vm->profile;
+  uint32_t path[PROFILE_MAX_DEPTH + 1];
+  for (uint32_t i = 0; i < p->node_count; i++) {
+    if (!p->nodes[i].self) {
+      continue;
+    }
+    uint32_t depth = 0;
+    for (uint32_t n = i; n; n = p->nodes[n].parent) {
+      path[depth++] = n;
+    }
+    write_frame(vm, p->nodes[0].addr, f);
+    while (depth > 0) {
+      fprintf(f, ";");
+      write_frame(vm, p->nodes[path[--depth]].addr, f);
+    }
+    fprintf(f, " %llu\n", (unsigned long long)p->nodes[i].self);
+  }
+}
+
+int lc3_vm_write_profile(const lc3_vm *vm, const char *report,
+                         const char *folded) {
+  if (!vm->profile) {
+    return 0;
+  }
+  FILE *f = fopen(report, "w");
+  if (!f) {
+    return 0;
+  }
+  write_report(vm, f);
+  int ok = fclose(f) == 0;
+  if (folded) {
+    f = fopen(folded, "w");
+    if (!f) {
+      return 0;
+    }
+    write_folded(vm, f);
+    ok &= fclose(f) == 0;
+  }
+  return ok;
+}
+
+int lc3_vm_fuse_profiled(lc3_vm *vm, int pairs) {
+  if (!vm->profile) {
+    return -1;
+  }
+  return vm_fuse_select(vm, vm->profile->pair, pairs);
+}
+
+// the opcode of a name in a report, -1 for none
+static int op_index(const char *name) {
+  for (int op = 0; op < 16; op++) {
+    if (strcmp(name, op_names[op]) == 0) {
+      return op;
+    }
+  }
+  return -1;
+}
+
+// only the pairs section is read, the rest of the report may be anything
+int lc3_vm_fuse_report(lc3_vm *vm, const char *report, int pairs) {
+  FILE *f = fopen(report, "r");
+  if (!f) {
+    return -1;
+  }
+  uint64_t counts[16 * 16] = {0};
+  char line[256];
+  int in_pairs = 0;
+  while (fgets(line, sizeof(line), f)) {
+    char first[8];
+    char second[8];
+    unsigned long long n;
+    if (line[0] != ' ') {
+      in_pairs = strcmp(line, "pairs\n") == 0;
+    } else if (in_pairs &&
+               sscanf(line, "%7s %7s %llu", first, second, &n) == 3 &&
+               op_index(first) >= 0 && op_index(second) >= 0) {
+      counts[op_index(first) * 16 + op_index(second)] = n;
+    }
+  }
+  int ok = !ferror(f);
+  fclose(f);
+  return ok ? vm_fuse_select(vm, counts, pairs) : -1;
+}
@@ -0,0 +1,383 @@
+// record and replay
+// --------------------------------------------------
+// A run depends on its images, its settings and what lc3_io hands the guest,
+// nothing else: the time is the instruction count, and interrupts are taken at
+// fixed points of it. A recording keeps the last of these, the result of every
+// poll and getc in order, and a snapshot every `interval` instructions, so
+// that any point of the run is one restore and at most one interval away.
+//
+// DIR/input is an input_header and then one 16-bit word per entry, in host
+// byte order like the snapshots:
+//   x0000-x0100  getc returned the word minus 1, 0 for the end of input
+//   x4000        poll returned nonzero
+//   x8000 | n    poll returned 0 n times in a row
+// A guest spinning on KBSR costs a word per 32767 polls.
+// DIR/checkpoints is a checkpoint_header and then a struct checkpoint per
+// snapshot, DIR/<instructions>.snap. Both files are flushed at every
+// checkpoint, so a recording cut short still replays up to the last one.
+#include "vm.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum {
+  IN_GETC_MAX = 0x100,
+  IN_READY = 0x4000,
+  IN_EMPTY = 0x8000,
+  IN_RUN_MAX = 0x7FFF,
+};
+
+struct input_header {
+  char magic[8]; // "LC3INP1"
+};
+
+struct checkpoint_header {
+  char magic[8]; // "LC3REC1"
+  uint64_t interval;
+};
+
+static const char input_magic[8] = "LC3INP1";
+static const char checkpoint_magic[8] = "LC3REC1";
+
+static void record_path(const struct record *r, char *buf, size_t n,
+                        const char *name) {
+  snprintf(buf, n, "%s/%s", r->dir, name);
+}
+
+static void snapshot_path(const struct record *r, char *buf, size_t n,
+                          uint64_t instructions) {
+  snprintf(buf, n, "%s/%llu.snap", r->dir, (unsigned long long)instructions);
+}
+
+// recording
+// --------------------------------------------------
+
+static void record_put(struct record *r, uint16_t entry) {
+  if (fwrite(&entry, sizeof(entry), 1, r->input) != 1) {
+    r->failed = 1;
+  }
+  r->inputs++;
+}
+
+// the polls that came up empty since the last entry
+static void record_flush_run(struct record *r) {
+  if (r->run) {
+    uint16_t run = r->run;
+    r->run = 0;
+    record_put(r, IN_EMPTY | run);
+  }
+}
+
+static int record_getc(void *ctx) {
+  struct record *r = ctx;
+  int c = r->io.getc(r->io.ctx);
+  record_flush_run(r);
+  record_put(r, c < 0 ? 0 : (uint16_t)(c & 0xFF) + 1);
+  return c < 0 ? -1 : c & 0xFF;
+}
+
+static int record_poll(void *ctx) {
+  struct record *r = ctx;
+  if (r->io.poll(r->io.ctx)) {
+    record_flush_run(r);
+    record_put(r, IN_READY);
+    return 1;
+  }
+  if (++r->run == IN_RUN_MAX) {
+    record_flush_run(r);
+  }
+  return 0;
+}
+
+static void record_write(void *ctx, const char *buf, size_t n) {
+  struct record *r = ctx;
+  r->io.write(r->io.ctx, buf, n);
+}
+
+static void record_flush(void *ctx) {
+  struct record *r = ctx;
+  r->io.flush(r->io.ctx);
+}
+
+// the input so far and a snapshot, both on disk before the entry naming them
+void vm_record_checkpoint(lc3_vm *vm) {
+  struct record *r = vm->record;
+  vm_events_commit(vm); // events asked for in the last run are saved too
+  record_flush_run(r);
+  r->next = vm->instructions + r->interval;
+  char path[4096 + 32];
+  snapshot_path(r, path, sizeof(path), vm->instructions);
+  struct checkpoint c = {vm->instructions, r->inputs};
+  if (fflush(r->input) != 0 || !lc3_vm_save(vm, path) ||
+      fwrite(&c, sizeof(c), 1, r->index) != 1 || fflush(r->index) != 0) {
+    r->failed = 1;
+  }
+  r->last = vm->instructions;
+}
+
+void vm_record_free(lc3_vm *vm) {
+  struct record *r = vm->record;
+  if (!r) {
+    return;
+  }
+  vm->io = r->io;
+  if (r->input) {
+    fclose(r->input);
+  }
+  if (r->index) {
+    fclose(r->index);
+  }
+  if (r->map) {
+    munmap(r->map, r->map_size);
+  }
+  free(r->checkpoints);
+  free(r);
+  vm->record = NULL;
+}
+
+// the last instructions since a checkpoint get one of their own, so that the
+// end of the run replays without running anything
+static int record_stop(lc3_vm *vm) {
+  struct record *r = vm->record;
+  if (!r->replaying && vm->instructions != r->last) {
+    vm_record_checkpoint(vm);
+  }
+  int ok = !r->failed;
+  if (r->input) {
+    ok &= fclose(r->input) == 0;
+    r->input = NULL;
+  }
+  if (r->index) {
+    ok &= fclose(r->index) == 0;
+    r->index = NULL;
+  }
+  vm_record_free(vm);
+  return ok;
+}
+
+static struct record *record_new(lc3_vm *vm, const char *dir) {
+  struct record *r = calloc(1, sizeof(*r));
+  if (!r || strlen(dir) >= sizeof(r->dir)) {
+    free(r);
+    return NULL;
+  }
+  strcpy(r->dir, dir);
+  r->io = vm->io;
+  r->next = UINT64_MAX;
+  return r;
+}
+
+int lc3_vm_record(lc3_vm *vm, const char *dir, uint64_t interval) {
+  int ok = vm->record ? record_stop(vm) : 1;
+  if (!dir) {
+    return ok;
+  }
+  if (!interval || (mkdir(dir, 0755) < 0 && errno != EEXIST)) {
+    return 0;
+  }
+  struct record *r = record_new(vm, dir);
+  if (!r) {
+    return 0;
+  }
+  char path[4096 + 32];
+  record_path(r, path, sizeof(path), "input");
+  r->input = fopen(path, "wb");
+  record_path(r, path, sizeof(path), "checkpoints");
+  r->index = fopen(path, "wb");
+  struct input_header ih;
+  struct checkpoint_header ch = {{0}, interval};
+  memcpy(ih.magic, input_magic, sizeof(ih.magic));
+  memcpy(ch.magic, checkpoint_magic, sizeof(ch.magic));
+  if (!r->input || !r->index || fwrite(&ih, sizeof(ih), 1, r->input) != 1 ||
+      fwrite(&ch, sizeof(ch), 1, r->index) != 1) {
+    vm->record = r;
+    vm_record_free(vm);
+    return 0;
+  }
+  r->interval = interval;
+  vm->record = r;
+  vm->io = (struct lc3_io){r,           record_getc, record_poll,
+                           record_write, record_flush, r->io.flags};
+  vm_record_checkpoint(vm);
+  if (r->failed) {
+    vm_record_free(vm);
+    return 0;
+  }
+  return 1;
+}
+
+// replaying
+// --------------------------------------------------
+
+// A replay hands out the log from the position of the checkpoint it
+// restored. An entry of the wrong kind means the VM is not running what was
+// recorded; from there on, and past the end, there is no more input.
+static void replay_diverged(struct record *r) {
+  r->diverged = r->pos < r->count;
+  r->pos = r->count;
+  r->run = 0;
+}
+
+static int replay_getc(void *ctx) {
+  struct record *r = ctx;
+  if (r->run || r->pos == r->count || r->log[r->pos] > IN_GETC_MAX) {
+    replay_diverged(r);
+    return -1;
+  }
+  return r->log[r->pos++] - 1;
+}
+
+static int replay_poll(void *ctx) {
+  struct record *r = ctx;
+  if (!r->run) {
+    if (r->pos == r->count) {
+      return 0;
+    }
+    uint16_t e = r->log[r->pos];
+    if (e == IN_READY) {
+      r->pos++;
+      return 1;
+    }
+    if (!(e & IN_EMPTY)) {
+      replay_diverged(r);
+      return 0;
+    }
+    r->run = e & IN_RUN_MAX;
+    r->pos++;
+  }
+  r->run--;
+  return 0;
+}
+
+static void *map_file(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+  *size = st.st_size;
+  return p;
+}
+
+static int replay_open(struct record *r) {
+  char path[4096 + 32];
+  record_path(r, path, sizeof(path), "checkpoints");
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return 0;
+  }
+  struct checkpoint_header ch;
+  int ok = fread(&ch, sizeof(ch), 1, f) == 1 &&
+           memcmp(ch.magic, checkpoint_magic, sizeof(ch.magic)) == 0;
+  size_t cap = 0;
+  while (ok) {
+    if (r->checkpoint_count == cap) {
+      cap = cap ? 2 * cap : 64;
+      struct checkpoint *c =
+          realloc(r->checkpoints, cap * sizeof(*r->checkpoints));
+      if (!c) {
+        ok = 0;
+        break;
+      }
+      r->checkpoints = c;
+    }
+    // a checkpoint cut short by the end of the recording is left out
+    if (fread(&r->checkpoints[r->checkpoint_count], sizeof(struct checkpoint),
+              1, f) != 1) {
+      break;
+    }
+    r->checkpoint_count++;
+  }
+  fclose(f);
+  if (!ok || !r->checkpoint_count) {
+    return 0;
+  }
+  r->interval = ch.interval;
+
+  record_path(r, path, sizeof(path), "input");
+  const struct input_header *ih = r->map = map_file(path, &r->map_size);
+  if (!ih || r->map_size < sizeof(*ih) ||
+      memcmp(ih->magic, input_magic, sizeof(ih->magic)) != 0) {
+    return 0;
+  }
+  r->log = (const uint16_t *)(ih + 1);
+  r->count = (r->map_size - sizeof(*ih)) / sizeof(uint16_t);
+  for (size_t i = 0; i < r->checkpoint_count; i++) {
+    if (r->checkpoints[i].inputs > r->count) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// the VM back at the last checkpoint at or before target, run on to it
+int vm_replay_seek(lc3_vm *vm, uint64_t target) {
+  struct record *r = vm->record;
+  size_t i = r->checkpoint_count;
+  while (i > 0 && r->checkpoints[i - 1].instructions > target) {
+    i--;
+  }
+  if (i == 0) {
+    return 0;
+  }
+  const struct checkpoint *c = &r->checkpoints[i - 1];
+  char path[4096 + 32];
+  snapshot_path(r, path, sizeof(path), c->instructions);
+  lc3_snapshot *s = lc3_snapshot_open(path);
+  int ok = s && lc3_vm_restore(vm, s);
+  lc3_snapshot_close(s);
+  if (!ok) {
+    return 0;
+  }
+  r->pos = c->inputs;
+  r->run = 0;
+  r->diverged = 0;
+  // breakpoints do not stop it on the way
+  while (vm->instructions < target &&
+         (vm->running || vm->exit == LC3_EXIT_BREAK)) {
+    lc3_vm_run(vm, target - vm->instructions);
+  }
+  return !r->diverged;
+}
+
+int lc3_vm_replay(lc3_vm *vm, const char *dir, uint64_t target) {
+  struct record *r = vm->record;
+  if (r && (!r->replaying || strcmp(r->dir, dir) != 0)) {
+    if (!r->replaying) {
+      return 0; // a recording has to be ended first
+    }
+    vm_record_free(vm);
+    r = NULL;
+  }
+  if (!r) {
+    r = record_new(vm, dir);
+    if (!r) {
+      return 0;
+    }
+    r->replaying = 1;
+    vm->record = r;
+    if (!replay_open(r)) {
+      vm_record_free(vm);
+      return 0;
+    }
+    vm->io = (struct lc3_io){r,           replay_getc,  replay_poll,
+                             record_write, record_flush, r->io.flags};
+  }
+  return vm_replay_seek(vm, target);
+}
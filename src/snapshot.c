@@ -0,0 +1,193 @@
+// snapshots
+// --------------------------------------------------
+// A snapshot file is a header followed by the pages that differ from the base
+// of the VM, in address order, as native-endian words. The header names the
+// base by its hash and has one byte per page telling whether it is stored.
+//
+// Restoring remaps the base, which drops every page the VM wrote and all of
+// its code caches, and copies the stored pages from the mapped file.
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum { SNAPSHOT_VERSION = 5, SNAPSHOT_BYTE_ORDER = 0x01020304 };
+
+struct snapshot_header {
+  char magic[4]; // "LC3S"
+  uint32_t version;
+  uint32_t byte_order; // SNAPSHOT_BYTE_ORDER as written by the host
+  uint32_t pages;      // stored after the header
+  uint64_t base_hash;  // vm_image_hash() of the base, 0 for zeros
+  uint64_t instructions;
+  uint64_t cycles;
+  int32_t running;
+  int32_t exit;
+  int32_t wait;
+  uint16_t reg[R_COUNT];
+  uint16_t psr; // without the flags, which come from reg[R_COND]
+  uint16_t saved_ssp;
+  uint16_t saved_usp;
+  uint8_t stored[VM_PAGES];
+  uint64_t event_when[EV_COUNT]; // of the events in `scheduled`
+  uint32_t scheduled;
+};
+
+struct lc3_snapshot {
+  const struct snapshot_header *header;
+  size_t size;
+};
+
+static const uint16_t zero_page[VM_PAGE_WORDS];
+
+// the page as it is in the base, before the VM wrote anything
+static const uint16_t *base_page(const lc3_vm *vm, int page) {
+  if (!vm->base) {
+    return zero_page;
+  }
+  return vm_image_words(vm->base) + page * VM_PAGE_WORDS;
+}
+
+// written to a temporary name and moved into place, like the image cache
+int lc3_vm_save(const lc3_vm *vm, const char *path) {
+  struct snapshot_header h;
+  memset(&h, 0, sizeof(h)); // padding included, saves are reproducible
+  memcpy(h.magic, "LC3S", 4);
+  h.version = SNAPSHOT_VERSION;
+  h.byte_order = SNAPSHOT_BYTE_ORDER;
+  h.base_hash = vm->base ? vm_image_hash(vm->base) : 0;
+  h.instructions = vm->instructions;
+  h.cycles = vm->cycles;
+  h.running = vm->running;
+  h.exit = vm->exit;
+  h.wait = vm->wait;
+  memcpy(h.reg, vm->reg, sizeof(h.reg));
+  h.psr = vm->psr;
+  h.saved_ssp = vm->saved_ssp;
+  h.saved_usp = vm->saved_usp;
+  for (int e = 0; e < EV_COUNT; e++) {
+    if (vm_event_when(vm, e, &h.event_when[e])) {
+      h.scheduled |= 1 << e;
+    }
+  }
+  for (int p = 0; p < VM_PAGES; p++) {
+    const uint16_t *words = vm->memory + p * VM_PAGE_WORDS;
+    if (vm->page_dirty[p] &&
+        memcmp(words, base_page(vm, p), VM_PAGE_WORDS * sizeof(uint16_t))) {
+      h.stored[p] = 1;
+      h.pages++;
+    }
+  }
+
+  char tmp[4096 + 8];
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd < 0) {
+    return 0;
+  }
+  FILE *f = fdopen(fd, "wb");
+  if (!f) {
+    close(fd);
+    unlink(tmp);
+    return 0;
+  }
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  for (int p = 0; ok && p < VM_PAGES; p++) {
+    if (h.stored[p]) {
+      ok = fwrite(vm->memory + p * VM_PAGE_WORDS, sizeof(uint16_t),
+                  VM_PAGE_WORDS, f) == VM_PAGE_WORDS;
+    }
+  }
+  ok &= fchmod(fd, 0644) == 0;
+  ok &= fclose(f) == 0;
+  if (!ok || rename(tmp, path) < 0) {
+    unlink(tmp);
+    return 0;
+  }
+  return 1;
+}
+
+lc3_snapshot *lc3_snapshot_open(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      st.st_size < (off_t)sizeof(struct snapshot_header)) {
+    close(fd);
+    return NULL;
+  }
+  const struct snapshot_header *h =
+      mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) {
+    return NULL;
+  }
+  uint32_t pages = 0;
+  for (int p = 0; p < VM_PAGES; p++) {
+    pages += h->stored[p] != 0;
+  }
+  lc3_snapshot *s = NULL;
+  if (memcmp(h->magic, "LC3S", 4) == 0 && h->version == SNAPSHOT_VERSION &&
+      h->byte_order == SNAPSHOT_BYTE_ORDER && h->pages == pages &&
+      (size_t)st.st_size ==
+          sizeof(*h) + (size_t)pages * VM_PAGE_WORDS * sizeof(uint16_t)) {
+    s = malloc(sizeof(*s));
+  }
+  if (!s) {
+    munmap((void *)h, st.st_size);
+    return NULL;
+  }
+  s->header = h;
+  s->size = st.st_size;
+  return s;
+}
+
+void lc3_snapshot_close(lc3_snapshot *snapshot) {
+  if (!snapshot) {
+    return;
+  }
+  munmap((void *)snapshot->header, snapshot->size);
+  free(snapshot);
+}
+
+int lc3_vm_restore(lc3_vm *vm, const lc3_snapshot *snapshot) {
+  const struct snapshot_header *h = snapshot->header;
+  if (h->base_hash != (vm->base ? vm_image_hash(vm->base) : 0) ||
+      !vm_map_base(vm, vm->base)) {
+    return 0;
+  }
+  const uint16_t *words = (const uint16_t *)(h + 1);
+  for (int p = 0; p < VM_PAGES; p++) {
+    if (h->stored[p]) {
+      memcpy(vm->memory + p * VM_PAGE_WORDS, words,
+             VM_PAGE_WORDS * sizeof(uint16_t));
+      vm->page_dirty[p] = 1;
+      words += VM_PAGE_WORDS;
+    }
+  }
+  memcpy(vm->reg, h->reg, sizeof(vm->reg));
+  vm->psr = h->psr;
+  vm->saved_ssp = h->saved_ssp;
+  vm->saved_usp = h->saved_usp;
+  vm->running = h->running;
+  vm->exit = h->exit;
+  vm->wait = h->wait;
+  vm->instructions = h->instructions;
+  vm->cycles = h->cycles;
+  vm->out_len = 0;
+  for (int e = 0; e < EV_COUNT; e++) {
+    if (h->scheduled & (1 << e)) {
+      vm_event_at(vm, e, h->event_when[e]);
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,229 @@
+// live counters
+// --------------------------------------------------
+// A segment is a stats_header and then `slots` struct lc3_stats, each a whole
+// number of cache lines. A VM claims a free slot by moving its state from
+// FREE to CLAIMED, clears the counters, writes its label and publishes it as
+// LIVE with a release store; a reader that sees LIVE with an acquire load sees
+// the label. Releasing a slot only sets it FREE again, a reader may still be
+// looking at the counters. A process that dies with slots LIVE never releases
+// them; the next claim takes such a slot back, from LIVE to CLAIMED, once
+// kill() says its pid is gone.
+//
+// The counters are bumped where the VM already leaves the fast path: traps,
+// device reads, flushed output, decode misses, compiles and invalidations.
+// Instructions are added after every engine run, which lc3_vm_run() keeps to
+// LC3_STATS_INTERVAL instructions while the VM has a slot.
+#include "vm.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix */
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct stats_header {
+  _Alignas(64) char magic[8]; // "LC3STAT1"
+  uint32_t slots;
+  uint32_t slot_size; // sizeof(struct lc3_stats) of the writer
+  _Atomic uint32_t ready; // the creator finished the header
+};
+
+struct lc3_stats_segment {
+  struct stats_header *header;
+  struct lc3_stats *slots;
+  size_t size;
+  int writable;
+};
+
+static const char stats_magic[8] = "LC3STAT1";
+
+// shm_open() wants one leading slash
+static void stats_name(char *buf, size_t n, const char *name) {
+  snprintf(buf, n, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+static size_t stats_size(int slots) {
+  return sizeof(struct stats_header) + (size_t)slots * sizeof(struct lc3_stats);
+}
+
+static lc3_stats_segment *stats_map(int fd, size_t size, int writable) {
+  lc3_stats_segment *seg = calloc(1, sizeof(*seg));
+  void *p = MAP_FAILED;
+  if (seg) {
+    p = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+             MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) {
+    free(seg);
+    return NULL;
+  }
+  seg->header = p;
+  seg->slots = (struct lc3_stats *)(seg->header + 1);
+  seg->size = size;
+  seg->writable = writable;
+  return seg;
+}
+
+// the header of a segment someone else made, once it is complete
+static int stats_valid(const struct stats_header *h, size_t size) {
+  for (int tries = 0; !atomic_load_explicit(&h->ready, memory_order_acquire);
+       tries++) {
+    if (tries == 100) {
+      return 0;
+    }
+    usleep(1000);
+  }
+  return memcmp(h->magic, stats_magic, sizeof(h->magic)) == 0 &&
+         h->slot_size == sizeof(struct lc3_stats) &&
+         stats_size(h->slots) <= size;
+}
+
+lc3_stats_segment *lc3_stats_create(const char *name, int slots) {
+  char path[256];
+  stats_name(path, sizeof(path), name);
+  if (slots < 1 || strlen(path) >= sizeof(path) - 1) {
+    return NULL;
+  }
+  size_t size = stats_size(slots);
+  int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd >= 0) {
+    if (ftruncate(fd, size) < 0) {
+      close(fd);
+      shm_unlink(path);
+      return NULL;
+    }
+    lc3_stats_segment *seg = stats_map(fd, size, 1);
+    if (!seg) {
+      shm_unlink(path);
+      return NULL;
+    }
+    memcpy(seg->header->magic, stats_magic, sizeof(stats_magic));
+    seg->header->slots = slots;
+    seg->header->slot_size = sizeof(struct lc3_stats);
+    atomic_store_explicit(&seg->header->ready, 1, memory_order_release);
+    return seg;
+  }
+  if (errno != EEXIST) {
+    return NULL;
+  }
+  // join it, if it is the same layout and size
+  fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size != size) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  lc3_stats_segment *seg = stats_map(fd, size, 1);
+  if (seg && (!stats_valid(seg->header, size) ||
+              seg->header->slots != (uint32_t)slots)) {
+    lc3_stats_close(seg);
+    return NULL;
+  }
+  return seg;
+}
+
+lc3_stats_segment *lc3_stats_open(const char *name) {
+  char path[256];
+  stats_name(path, sizeof(path), name);
+  int fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 ||
+      (size_t)st.st_size < sizeof(struct stats_header)) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  lc3_stats_segment *seg = stats_map(fd, st.st_size, 0);
+  if (seg && !stats_valid(seg->header, seg->size)) {
+    lc3_stats_close(seg);
+    return NULL;
+  }
+  return seg;
+}
+
+// VMs with a slot in it must be destroyed or detached first
+void lc3_stats_close(lc3_stats_segment *seg) {
+  if (seg) {
+    munmap(seg->header, seg->size);
+    free(seg);
+  }
+}
+
+int lc3_stats_slots(const lc3_stats_segment *seg) {
+  return seg->header->slots;
+}
+
+const struct lc3_stats *lc3_stats_slot(const lc3_stats_segment *seg, int i) {
+  return &seg->slots[i];
+}
+
+void vm_stats_release(lc3_vm *vm) {
+  if (vm->stats) {
+    atomic_store_explicit(&vm->stats->state, LC3_STATS_FREE,
+                          memory_order_release);
+    vm->stats = NULL;
+  }
+}
+
+// moves a FREE slot, or a LIVE one of a process that is gone, to CLAIMED
+static int stats_claim(struct lc3_stats *s) {
+  uint32_t state = atomic_load_explicit(&s->state, memory_order_acquire);
+  if (state == LC3_STATS_FREE) {
+    return atomic_compare_exchange_strong(&s->state, &state,
+                                          LC3_STATS_CLAIMED);
+  }
+  if (state != LC3_STATS_LIVE) {
+    return 0;
+  }
+  int32_t pid = s->pid;
+  if (pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH ||
+      !atomic_compare_exchange_strong(&s->state, &state, LC3_STATS_CLAIMED)) {
+    return 0;
+  }
+  if (s->pid != pid) {
+    // another claim took it back and published it between the load and the
+    // exchange, return it unless its owner has let it go since
+    state = LC3_STATS_CLAIMED;
+    atomic_compare_exchange_strong(&s->state, &state, LC3_STATS_LIVE);
+    return 0;
+  }
+  return 1;
+}
+
+int lc3_vm_set_stats(lc3_vm *vm, lc3_stats_segment *seg, const char *label) {
+  vm_stats_release(vm);
+  if (!seg || !seg->writable) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < seg->header->slots; i++) {
+    struct lc3_stats *s = &seg->slots[i];
+    if (!stats_claim(s)) {
+      continue;
+    }
+    atomic_store_explicit(&s->instructions, 0, memory_order_relaxed);
+    atomic_store_explicit(&s->kbsr_polls, 0, memory_order_relaxed);
+    atomic_store_explicit(&s->output_bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&s->decoded, 0, memory_order_relaxed);
+    atomic_store_explicit(&s->jit_instructions, 0, memory_order_relaxed);
+    atomic_store_explicit(&s->jit_compiles, 0, memory_order_relaxed);
+    atomic_store_explicit(&s->invalidations, 0, memory_order_relaxed);
+    for (int t = 0; t < 256; t++) {
+      atomic_store_explicit(&s->traps[t], 0, memory_order_relaxed);
+    }
+    s->pid = getpid();
+    snprintf(s->label, sizeof(s->label), "%s", label ? label : "");
+    atomic_store_explicit(&s->state, LC3_STATS_LIVE, memory_order_release);
+    vm->stats = s;
+    return i;
+  }
+  return -1;
+}
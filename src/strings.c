@@ -0,0 +1,271 @@
+#include "vm.h"
+
+// SIMD kernels for PUTS/PUTSP and image loading, other hosts use the scalar
+// loops
+#ifndef LC3_HAVE_SIMD
+#define LC3_HAVE_SIMD 1
+#endif
+#if LC3_HAVE_SIMD && defined(__SSE2__)
+#define LC3_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+#if LC3_HAVE_SIMD && defined(__SSE2__) && defined(__x86_64__) &&               \
+    defined(__GNUC__)
+#define LC3_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+#if LC3_HAVE_SIMD && defined(__aarch64__) && defined(__ARM_NEON) &&            \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LC3_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+// string kernels
+// --------------------------------------------------
+// PUTS narrows every word to its low byte, PUTSP copies the low and, unless
+// it is zero, the high byte. Both stop at the first x0000 word. src[0..n)
+// never crosses the end of memory: the traps split the scan there, so a
+// string wraps around to x0000 like every other access.
+//
+// Each kernel returns the number of words consumed before the terminator, n
+// when there was none. The unpacking kernels also report the bytes written,
+// at most 2 * n. Blocks are handed to the scalar loop as soon as they hold a
+// terminator or, for PUTSP, a zero high byte.
+
+static size_t narrow_scalar(const uint16_t *src, size_t n, char *dst) {
+  for (size_t i = 0; i < n; i++) {
+    if (!src[i]) {
+      return i;
+    }
+    dst[i] = (char)src[i];
+  }
+  return n;
+}
+
+static size_t unpack_scalar(const uint16_t *src, size_t n, char *dst,
+                            size_t *out) {
+  size_t o = 0;
+  size_t i = 0;
+  for (; i < n && src[i]; i++) {
+    dst[o++] = src[i] & 0xff;
+    if (src[i] >> 8) {
+      dst[o++] = src[i] >> 8;
+    }
+  }
+  *out = o;
+  return i;
+}
+
+#if LC3_HAVE_SSE2
+static size_t narrow_sse2(const uint16_t *src, size_t n, char *dst) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i low = _mm_set1_epi16(0xff);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+    __m128i z =
+        _mm_or_si128(_mm_cmpeq_epi16(a, zero), _mm_cmpeq_epi16(b, zero));
+    if (_mm_movemask_epi8(z)) {
+      break;
+    }
+    a = _mm_and_si128(a, low);
+    b = _mm_and_si128(b, low);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+  }
+  return i + narrow_scalar(src + i, n - i, dst + i);
+}
+
+// a block without zero high bytes is already its own little-endian byte image
+static size_t unpack_sse2(const uint16_t *src, size_t n, char *dst,
+                          size_t *out) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t o = 0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_srli_epi16(v, 8), zero))) {
+      size_t w;
+      size_t k = unpack_scalar(src + i, 8, dst + o, &w);
+      o += w;
+      if (k < 8) {
+        *out = o;
+        return i + k;
+      }
+      continue;
+    }
+    _mm_storeu_si128((__m128i *)(dst + o), v);
+    o += 16;
+  }
+  size_t w;
+  i += unpack_scalar(src + i, n - i, dst + o, &w);
+  *out = o + w;
+  return i;
+}
+#endif
+
+#if LC3_HAVE_AVX2
+static __attribute__((target("avx2"))) size_t
+narrow_avx2(const uint16_t *src, size_t n, char *dst) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i low = _mm256_set1_epi16(0xff);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+    __m256i z = _mm256_or_si256(_mm256_cmpeq_epi16(a, zero),
+                                _mm256_cmpeq_epi16(b, zero));
+    if (_mm256_movemask_epi8(z)) {
+      break;
+    }
+    a = _mm256_and_si256(a, low);
+    b = _mm256_and_si256(b, low);
+    // packus works per 128-bit lane, put the quadwords back in order
+    __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+    _mm256_storeu_si256((__m256i *)(dst + i), bytes);
+  }
+  return i + narrow_sse2(src + i, n - i, dst + i);
+}
+
+static __attribute__((target("avx2"))) size_t
+unpack_avx2(const uint16_t *src, size_t n, char *dst, size_t *out) {
+  const __m256i zero = _mm256_setzero_si256();
+  size_t o = 0;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i hi = _mm256_srli_epi16(v, 8);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(hi, zero))) {
+      size_t w;
+      size_t k = unpack_sse2(src + i, 16, dst + o, &w);
+      o += w;
+      if (k < 16) {
+        *out = o;
+        return i + k;
+      }
+      continue;
+    }
+    _mm256_storeu_si256((__m256i *)(dst + o), v);
+    o += 32;
+  }
+  size_t w;
+  i += unpack_sse2(src + i, n - i, dst + o, &w);
+  *out = o + w;
+  return i;
+}
+#endif
+
+#if LC3_HAVE_NEON
+size_t narrow_neon(const uint16_t *src, size_t n, char *dst) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    uint16x8_t a = vld1q_u16(src + i);
+    uint16x8_t b = vld1q_u16(src + i + 8);
+    if (vminvq_u16(vminq_u16(a, b)) == 0) {
+      break;
+    }
+    vst1q_u8((uint8_t *)dst + i, vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+  }
+  return i + narrow_scalar(src + i, n - i, dst + i);
+}
+
+size_t unpack_neon(const uint16_t *src, size_t n, char *dst, size_t *out) {
+  size_t o = 0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint16x8_t v = vld1q_u16(src + i);
+    if (vminvq_u16(vshrq_n_u16(v, 8)) == 0) {
+      size_t w;
+      size_t k = unpack_scalar(src + i, 8, dst + o, &w);
+      o += w;
+      if (k < 8) {
+        *out = o;
+        return i + k;
+      }
+      continue;
+    }
+    vst1q_u8((uint8_t *)dst + o, vreinterpretq_u8_u16(v));
+    o += 16;
+  }
+  size_t w;
+  i += unpack_scalar(src + i, n - i, dst + o, &w);
+  *out = o + w;
+  return i;
+}
+#endif
+
+// image kernels
+// --------------------------------------------------
+// .obj files hold big-endian words, swap_words converts n of them from src
+// (any alignment) to native order in dst.
+
+static void swap_scalar(uint16_t *dst, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = (src[2 * i] << 8) | src[2 * i + 1];
+  }
+}
+
+#if LC3_HAVE_SSE2 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static void swap_sse2(uint16_t *dst, const uint8_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+  swap_scalar(dst + i, src + 2 * i, n - i);
+}
+#endif
+
+#if LC3_HAVE_AVX2
+static __attribute__((target("avx2"))) void
+swap_avx2(uint16_t *dst, const uint8_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+    v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+  swap_sse2(dst + i, src + 2 * i, n - i);
+}
+#endif
+
+#if LC3_HAVE_NEON
+void swap_neon(uint16_t *dst, const uint8_t *src, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    vst1q_u8((uint8_t *)(dst + i), vrev16q_u8(vld1q_u8(src + 2 * i)));
+  }
+  swap_scalar(dst + i, src + 2 * i, n - i);
+}
+#endif
+
+size_t (*vm_narrow_words)(const uint16_t *src, size_t n, char *dst) =
+    narrow_scalar;
+size_t (*vm_unpack_words)(const uint16_t *src, size_t n, char *dst,
+                          size_t *out) = unpack_scalar;
+void (*vm_swap_words)(uint16_t *dst, const uint8_t *src, size_t n) =
+    swap_scalar;
+
+// pick the widest kernels the host runs
+void vm_strings_init(void) {
+#if LC3_HAVE_SSE2
+  vm_narrow_words = narrow_sse2;
+  vm_unpack_words = unpack_sse2;
+#endif
+#if LC3_HAVE_SSE2 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  vm_swap_words = swap_sse2;
+#endif
+#if LC3_HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    vm_narrow_words = narrow_avx2;
+    vm_unpack_words = unpack_avx2;
+    vm_swap_words = swap_avx2;
+  }
+#endif
+#if LC3_HAVE_NEON
+  vm_narrow_words = narrow_neon;
+  vm_unpack_words = unpack_neon;
+  vm_swap_words = swap_neon;
+#endif
+}
@@ -0,0 +1,234 @@
+// symbol tables
+// --------------------------------------------------
+// Labels and their addresses in the order they were defined. Names are found
+// through an open addressing table on their upper-case FNV-1a hash, since
+// LC-3 labels are not case sensitive; addresses through a list of the symbols
+// sorted by address, built once the table is complete.
+#include "vm.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct symbol {
+  uint32_t name; // offset in names
+  uint16_t address;
+};
+
+struct lc3_symbols {
+  struct symbol *list;
+  uint32_t count;
+  uint32_t cap;
+  char *names; // NUL-terminated, as written in the source
+  size_t names_len;
+  size_t names_cap;
+  uint32_t *index; // 1 + position in list, 0 is empty
+  uint32_t index_cap;
+  uint32_t *by_address; // positions in list, NULL until symbols_sort()
+};
+
+static uint32_t symbol_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)toupper((unsigned char)name[i])) * 16777619u;
+  }
+  return h;
+}
+
+static int symbol_is(const lc3_symbols *s, uint32_t i, const char *name,
+                     size_t len) {
+  const char *n = s->names + s->list[i].name;
+  return strncasecmp(n, name, len) == 0 && n[len] == '\0';
+}
+
+lc3_symbols *lc3_symbols_create(void) {
+  return calloc(1, sizeof(lc3_symbols));
+}
+
+void lc3_symbols_free(lc3_symbols *s) {
+  if (!s) {
+    return;
+  }
+  free(s->list);
+  free(s->names);
+  free(s->index);
+  free(s->by_address);
+  free(s);
+}
+
+static int index_resize(lc3_symbols *s) {
+  uint32_t cap = s->index_cap ? s->index_cap * 2 : 256;
+  uint32_t *index = calloc(cap, sizeof(*index));
+  if (!index) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < s->count; i++) {
+    const char *n = s->names + s->list[i].name;
+    uint32_t h = symbol_hash(n, strlen(n)) & (cap - 1);
+    while (index[h]) {
+      h = (h + 1) & (cap - 1);
+    }
+    index[h] = i + 1;
+  }
+  free(s->index);
+  s->index = index;
+  s->index_cap = cap;
+  return 1;
+}
+
+// position of name in the list, -1 when it is not defined
+long vm_symbols_find(const lc3_symbols *s, const char *name, size_t len) {
+  if (!s->index_cap) {
+    return -1;
+  }
+  uint32_t mask = s->index_cap - 1;
+  for (uint32_t h = symbol_hash(name, len) & mask; s->index[h];
+       h = (h + 1) & mask) {
+    if (symbol_is(s, s->index[h] - 1, name, len)) {
+      return s->index[h] - 1;
+    }
+  }
+  return -1;
+}
+
+// 1 when added, 0 when out of memory; a name defined twice keeps the first
+// address
+int vm_symbols_add(lc3_symbols *s, const char *name, size_t len,
+                   uint16_t address) {
+  if (vm_symbols_find(s, name, len) >= 0) {
+    return 1;
+  }
+  if (s->count == s->cap) {
+    uint32_t cap = s->cap ? s->cap * 2 : 64;
+    struct symbol *list = realloc(s->list, cap * sizeof(*list));
+    if (!list) {
+      return 0;
+    }
+    s->list = list;
+    s->cap = cap;
+  }
+  if (s->names_cap - s->names_len < len + 1) {
+    size_t cap = s->names_cap ? s->names_cap : 1024;
+    while (cap - s->names_len < len + 1) {
+      cap *= 2;
+    }
+    char *names = realloc(s->names, cap);
+    if (!names) {
+      return 0;
+    }
+    s->names = names;
+    s->names_cap = cap;
+  }
+  if (2 * (s->count + 1) > s->index_cap && !index_resize(s)) {
+    return 0;
+  }
+  memcpy(s->names + s->names_len, name, len);
+  s->names[s->names_len + len] = '\0';
+  s->list[s->count] = (struct symbol){(uint32_t)s->names_len, address};
+  s->names_len += len + 1;
+  uint32_t mask = s->index_cap - 1;
+  uint32_t h = symbol_hash(name, len) & mask;
+  while (s->index[h]) {
+    h = (h + 1) & mask;
+  }
+  s->index[h] = ++s->count;
+  free(s->by_address);
+  s->by_address = NULL;
+  return 1;
+}
+
+static const lc3_symbols *sort_symbols;
+
+static int by_address(const void *a, const void *b) {
+  const struct symbol *x = &sort_symbols->list[*(const uint32_t *)a];
+  const struct symbol *y = &sort_symbols->list[*(const uint32_t *)b];
+  if (x->address != y->address) {
+    return x->address < y->address ? -1 : 1;
+  }
+  return x->name < y->name ? -1 : x->name > y->name; // first defined first
+}
+
+static int symbols_sort(lc3_symbols *s) {
+  free(s->by_address);
+  s->by_address = malloc((s->count ? s->count : 1) * sizeof(uint32_t));
+  if (!s->by_address) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < s->count; i++) {
+    s->by_address[i] = i;
+  }
+  sort_symbols = s;
+  qsort(s->by_address, s->count, sizeof(uint32_t), by_address);
+  return 1;
+}
+
+int vm_symbols_lookup(const lc3_symbols *s, const char *name, size_t len,
+                      uint16_t *address) {
+  long i = vm_symbols_find(s, name, len);
+  if (i < 0) {
+    return 0;
+  }
+  *address = s->list[i].address;
+  return 1;
+}
+
+int vm_symbols_append(lc3_symbols *s, const lc3_symbols *from) {
+  for (uint32_t i = 0; i < from->count; i++) {
+    const char *name = from->names + from->list[i].name;
+    if (!vm_symbols_add(s, name, strlen(name), from->list[i].address)) {
+      return 0;
+    }
+  }
+  return symbols_sort(s);
+}
+
+int lc3_symbols_lookup(const lc3_symbols *s, const char *name,
+                       uint16_t *address) {
+  return vm_symbols_lookup(s, name, strlen(name), address);
+}
+
+const char *lc3_symbols_near(const lc3_symbols *s, uint16_t address,
+                             uint16_t *offset) {
+  if (!s || !s->by_address || !s->count) {
+    return NULL;
+  }
+  // the last symbol at or below address, the first defined of equals
+  uint32_t lo = 0;
+  uint32_t hi = s->count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (s->list[s->by_address[mid]].address <= address) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return NULL;
+  }
+  const struct symbol *sym = &s->list[s->by_address[lo - 1]];
+  while (lo > 1 && s->list[s->by_address[lo - 2]].address == sym->address) {
+    sym = &s->list[s->by_address[--lo - 1]];
+  }
+  *offset = address - sym->address;
+  return s->names + sym->name;
+}
+
+// the layout of the .sym files written by lc3as
+int lc3_symbols_write(const lc3_symbols *s, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    return 0;
+  }
+  fprintf(f, "// Symbol table\n"
+             "// Scope level 0:\n"
+             "//\tSymbol Name       Page Address\n"
+             "//\t----------------  ------------\n");
+  for (uint32_t i = 0; i < s->count; i++) {
+    fprintf(f, "//\t%-16s  %04X\n", s->names + s->list[i].name,
+            s->list[i].address);
+  }
+  fprintf(f, "\n");
+  return fclose(f) == 0;
+}
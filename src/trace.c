@@ -0,0 +1,375 @@
+// execution trace
+// --------------------------------------------------
+// A VM with a trace runs under vm_run_trace(), the switch loop of vm.c with
+// trace_record() from vm.h after every instruction. That puts each retired
+// instruction into a ring as it is, eight bytes: its PC, the instruction, the
+// register named by bits 11:9, which holds the result of ALU ops and loads and
+// the source of stores, R0 for traps, and R_COND for the flags. A store and
+// the count are all the loop pays; encoding as it went, even a batch at a
+// time, cost more than running the instructions.
+//
+// lc3_vm_write_trace() delta-encodes the ring into chunks of up to 64K as it
+// writes the file, each against only itself, so that any chunk decodes on its
+// own. The first byte of a record:
+//   bits 1:0  PC: 0 the one after the last record, 0 at the start of a
+//             chunk, 1 a signed byte from there, 2 two bytes
+//   bit 2     1 when the instruction follows in two bytes, 0 when it is the
+//             one recorded last at that PC in this chunk
+//   bits 4:3  value: 0 none, 1 a signed byte from the value recorded last at
+//             that PC in this chunk, 0 for the first, 2 two bytes
+//   bit 5     N
+//   bit 6     Z, P when neither is set
+// Loops take one to two bytes per instruction, seven at most.
+//
+// The VM is the only writer and publishes the count after every record, so
+// lc3_vm_write_trace() can run from a signal handler that interrupted it at
+// any point, without a lock.
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char trace_magic[8] = "LC3TRC1";
+
+// layout of a trace file, in host byte order: the header, then the chunks
+// from the oldest to the end of the file, each as a chunk_header and its bytes
+struct trace_header {
+  char magic[8];
+  uint32_t chunk_bytes;
+  uint32_t reserved;
+};
+
+struct chunk_header {
+  uint64_t start; // instructions retired before its first record
+  uint32_t len;
+  uint32_t reserved;
+};
+
+enum {
+  CHUNK_BYTES = 1 << 16,
+  RECORD_MAX = 7,
+  TRACE_MIN = 1024, // records
+  // opcodes that name a register in bits 11:9: ADD, AND, NOT, the loads and
+  // stores, LEA and TRAP
+  VALUE_OPS = 0xCEEE,
+};
+
+enum {
+  T_PC_NEXT = 0,
+  T_PC_DELTA = 1,
+  T_PC_ABS = 2,
+  T_INSTR = 1 << 2,
+  T_VALUE_DELTA = 1 << 3,
+  T_VALUE_ABS = 2 << 3,
+};
+
+// the register a record of instr holds, -1 for none
+static int traced_reg(uint16_t instr) {
+  return VALUE_OPS >> (instr >> 12) & 1 ? (instr >> 9) & 0x7 : -1;
+}
+
+void vm_trace_free(lc3_vm *vm) {
+  struct trace *t = vm->trace;
+  if (!t) {
+    return;
+  }
+  free(t->ring);
+  free(t->chunk);
+  free(t->tag);
+  free(t->last);
+  free(t);
+  vm->trace = NULL;
+}
+
+int lc3_vm_set_trace(lc3_vm *vm, size_t bytes) {
+  vm_trace_free(vm);
+  if (!bytes) {
+    return 1;
+  }
+  struct trace *t = calloc(1, sizeof(*t));
+  if (!t) {
+    return 0;
+  }
+  // a power of two records, for the mask
+  size_t records = TRACE_MIN;
+  while (records * 2 * sizeof(struct trace_raw) <= bytes) {
+    records *= 2;
+  }
+  t->ring = malloc(records * sizeof(struct trace_raw));
+  t->mask = records - 1;
+  t->chunk = malloc(CHUNK_BYTES);
+  t->tag = calloc(UINT16_MAX + 1, sizeof(*t->tag));
+  t->last = malloc((UINT16_MAX + 1) * sizeof(*t->last));
+  if (!t->ring || !t->chunk || !t->tag || !t->last) {
+    vm->trace = t;
+    vm_trace_free(vm);
+    return 0;
+  }
+  atomic_init(&t->recorded, 0);
+  t->origin = vm->instructions;
+  t->break_hit = UINT64_MAX;
+  vm->trace = t;
+  return 1;
+}
+
+void lc3_vm_set_trace_break(lc3_vm *vm, int on, uint16_t pc) {
+  if (vm->trace) {
+    vm->trace->has_break = on;
+    vm->trace->break_pc = pc;
+  }
+}
+
+// writing
+// --------------------------------------------------
+
+int vm_write_all(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w <= 0) {
+      return 0;
+    }
+    p += w;
+    n -= w;
+  }
+  return 1;
+}
+
+static uint8_t *put16(uint8_t *q, uint16_t x) {
+  q[0] = x & 0xFF;
+  q[1] = x >> 8;
+  return q + 2;
+}
+
+// encodes records from k on into t->chunk until it is full or they run out
+// at end, the number of bytes it took in *len
+static uint64_t encode_chunk(struct trace *t, uint64_t k, uint64_t end,
+                             uint32_t *len) {
+  if (++t->gen > UINT16_MAX) {
+    memset(t->tag, 0, (UINT16_MAX + 1) * sizeof(*t->tag));
+    t->gen = 1;
+  }
+  uint32_t gen = t->gen << 16;
+  uint8_t *q = t->chunk;
+  uint16_t next_pc = 0;
+  for (; k < end && q - t->chunk <= CHUNK_BYTES - RECORD_MAX; k++) {
+    struct trace_raw e = t->ring[k & t->mask];
+    uint8_t *head = q++;
+    uint8_t h = e.cond >> 15 ? 0x20 : e.cond == 0 ? 0x40 : 0;
+
+    uint16_t d = e.pc - next_pc;
+    if (d == 0) {
+      h |= T_PC_NEXT;
+    } else if ((uint16_t)(d + 0x80) < 0x100) {
+      h |= T_PC_DELTA;
+      *q++ = d & 0xFF;
+    } else {
+      h |= T_PC_ABS;
+      q = put16(q, e.pc);
+    }
+    uint32_t old = t->tag[e.pc];
+    uint16_t prev = (old & 0xFFFF0000) == gen ? t->last[e.pc] : 0;
+    if (old != (gen | e.instr)) {
+      t->tag[e.pc] = gen | e.instr;
+      h |= T_INSTR;
+      q = put16(q, e.instr);
+    }
+    if (VALUE_OPS >> (e.instr >> 12) & 1) {
+      uint16_t v = e.value - prev;
+      if ((uint16_t)(v + 0x80) < 0x100) {
+        h |= T_VALUE_DELTA;
+        *q++ = v & 0xFF;
+      } else {
+        h |= T_VALUE_ABS;
+        q = put16(q, e.value);
+      }
+      prev = e.value;
+    }
+    t->last[e.pc] = prev;
+    *head = h;
+    next_pc = e.pc + 1;
+  }
+  *len = q - t->chunk;
+  return k;
+}
+
+// only loads, stores to the trace's own buffers and write(2), nothing that
+// could be interrupted halfway
+int lc3_vm_write_trace(const lc3_vm *vm, int fd) {
+  struct trace *t = vm->trace;
+  if (!t) {
+    return 0;
+  }
+  uint64_t end = atomic_load_explicit(&t->recorded, memory_order_acquire);
+  // the oldest record may be being overwritten by the one after end
+  uint64_t k = end > t->mask ? end - t->mask : 0;
+  struct trace_header h = {{0}, CHUNK_BYTES, 0};
+  memcpy(h.magic, trace_magic, sizeof(h.magic));
+  if (!vm_write_all(fd, &h, sizeof(h))) {
+    return 0;
+  }
+  while (k < end) {
+    struct chunk_header ch = {t->origin + k, 0, 0};
+    k = encode_chunk(t, k, end, &ch.len);
+    if (!vm_write_all(fd, &ch, sizeof(ch)) ||
+        !vm_write_all(fd, t->chunk, ch.len)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// reading
+// --------------------------------------------------
+
+struct lc3_trace {
+  uint8_t *buf;
+  size_t size;
+  size_t pos; // of the next chunk header
+  const uint8_t *p; // in the current chunk
+  const uint8_t *end;
+  uint64_t index;
+  uint16_t next_pc;
+  uint32_t gen;
+  uint32_t seen[UINT16_MAX + 1];
+  uint16_t instr[UINT16_MAX + 1];
+  uint16_t last[UINT16_MAX + 1];
+};
+
+lc3_trace *lc3_trace_open(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  lc3_trace *r = calloc(1, sizeof(*r));
+  struct trace_header h;
+  if (!r || fread(&h, sizeof(h), 1, f) != 1 ||
+      memcmp(h.magic, trace_magic, sizeof(h.magic)) != 0 ||
+      h.chunk_bytes != CHUNK_BYTES || fseek(f, 0, SEEK_END) != 0) {
+    free(r);
+    fclose(f);
+    return NULL;
+  }
+  long size = ftell(f);
+  r->buf = size > 0 ? malloc(size) : NULL;
+  if (!r->buf || fseek(f, 0, SEEK_SET) != 0 ||
+      fread(r->buf, 1, size, f) != (size_t)size) {
+    free(r->buf);
+    free(r);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  r->size = size;
+  r->pos = sizeof(h);
+  return r;
+}
+
+void lc3_trace_close(lc3_trace *r) {
+  if (r) {
+    free(r->buf);
+    free(r);
+  }
+}
+
+static int next_chunk(lc3_trace *r) {
+  struct chunk_header ch;
+  if (r->size - r->pos < sizeof(ch)) {
+    return -1;
+  }
+  memcpy(&ch, r->buf + r->pos, sizeof(ch));
+  r->pos += sizeof(ch);
+  if (ch.len > CHUNK_BYTES || r->size - r->pos < ch.len) {
+    return -1;
+  }
+  r->p = r->buf + r->pos;
+  r->end = r->p + ch.len;
+  r->pos += ch.len;
+  r->index = ch.start;
+  r->next_pc = 0;
+  r->gen++;
+  return 1;
+}
+
+int lc3_trace_next(lc3_trace *r, struct lc3_trace_record *record) {
+  while (r->p == r->end) {
+    if (r->pos == r->size) {
+      return 0;
+    }
+    if (next_chunk(r) < 0) {
+      return -1;
+    }
+  }
+  const uint8_t *q = r->p;
+  const uint8_t *end = r->end;
+  uint8_t head = *q++;
+  if (head & 0x80) {
+    return -1;
+  }
+  uint16_t pc;
+  switch (head & 3) {
+  case T_PC_NEXT:
+    pc = r->next_pc;
+    break;
+  case T_PC_DELTA:
+    if (end - q < 1) {
+      return -1;
+    }
+    pc = (uint16_t)(r->next_pc + (int8_t)*q++);
+    break;
+  case T_PC_ABS:
+    if (end - q < 2) {
+      return -1;
+    }
+    pc = q[0] | q[1] << 8;
+    q += 2;
+    break;
+  default:
+    return -1;
+  }
+  uint16_t prev = r->seen[pc] == r->gen ? r->last[pc] : 0;
+  if (head & T_INSTR) {
+    if (end - q < 2) {
+      return -1;
+    }
+    r->instr[pc] = q[0] | q[1] << 8;
+    r->seen[pc] = r->gen;
+    q += 2;
+  } else if (r->seen[pc] != r->gen) {
+    return -1;
+  }
+  uint16_t instr = r->instr[pc];
+  int reg = traced_reg(instr);
+  uint16_t value = 0;
+  switch (head & (3 << 3)) {
+  case 0:
+    if (reg >= 0) {
+      return -1;
+    }
+    break;
+  case T_VALUE_DELTA:
+    if (reg < 0 || end - q < 1) {
+      return -1;
+    }
+    value = (uint16_t)(prev + (int8_t)*q++);
+    break;
+  case T_VALUE_ABS:
+    if (reg < 0 || end - q < 2) {
+      return -1;
+    }
+    value = q[0] | q[1] << 8;
+    q += 2;
+    break;
+  default:
+    return -1;
+  }
+  r->p = q;
+  r->last[pc] = reg >= 0 ? value : prev;
+  r->next_pc = (uint16_t)(pc + 1);
+  uint8_t flags = head & 0x20 ? FL_NEG : head & 0x40 ? FL_ZRO : FL_POS;
+  *record =
+      (struct lc3_trace_record){r->index++, pc, instr, reg, value, flags};
+  return 1;
+}
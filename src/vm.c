@@ -0,0 +1,1317 @@
+// lc3 virtual machine: state, memory, devices, traps and the interpreters
+#include "vm.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* unix */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// I/O of a VM nobody plugged anything into
+static int null_getc(void *ctx) { return -1; }
+
+static int null_poll(void *ctx) { return 0; }
+
+static void null_write(void *ctx, const char *buf, size_t n) {}
+
+static void null_flush(void *ctx) {}
+
+static const struct lc3_io null_io = {NULL, null_getc, null_poll, null_write,
+                                      null_flush};
+
+#if LC3_HAVE_COMPUTED_GOTO
+static uint64_t run_threaded(lc3_vm *vm, uint64_t budget);
+#endif
+
+// guest output
+// Every trap stages its output in vm->out, which goes to io.write in one call
+// once the trap is done, or earlier when it fills up.
+static void out_trap_done(lc3_vm *vm) {
+  if (vm->out_len > 0) {
+    if (vm->stats) {
+      stat_add(&vm->stats->output_bytes, vm->out_len);
+    }
+    vm->io.write(vm->io.ctx, vm->out, vm->out_len);
+    vm->out_len = 0;
+  }
+}
+
+// the output so far has to reach the host now
+static void out_flush(lc3_vm *vm) {
+  out_trap_done(vm);
+  vm->io.flush(vm->io.ctx);
+}
+
+static void out_putc(lc3_vm *vm, char c) {
+  if (vm->out_len == VM_OUT_SIZE) {
+    out_trap_done(vm);
+  }
+  vm->out[vm->out_len++] = c;
+}
+
+static void out_write(lc3_vm *vm, const char *s, size_t n) {
+  while (n > 0) {
+    if (vm->out_len == VM_OUT_SIZE) {
+      out_trap_done(vm);
+    }
+    size_t chunk = VM_OUT_SIZE - vm->out_len;
+    if (chunk > n) {
+      chunk = n;
+    }
+    memcpy(vm->out + vm->out_len, s, chunk);
+    vm->out_len += chunk;
+    s += chunk;
+    n -= chunk;
+  }
+}
+
+// room for at least `min` bytes, written by the caller and then committed
+// by adding to vm->out_len
+static char *out_reserve(lc3_vm *vm, size_t min, size_t *room) {
+  if (VM_OUT_SIZE - vm->out_len < min) {
+    out_trap_done(vm);
+  }
+  *room = VM_OUT_SIZE - vm->out_len;
+  return vm->out + vm->out_len;
+}
+
+// Memory Mapped Registers
+void vm_io_register(lc3_vm *vm, uint16_t address, io_read_fn read,
+                    io_write_fn write) {
+  vm->io_page[address - IO_PAGE].read = read;
+  vm->io_page[address - IO_PAGE].write = write;
+}
+
+uint16_t vm_io_read(lc3_vm *vm, uint16_t address) {
+  io_read_fn read = vm->io_page[address - IO_PAGE].read;
+  return read ? read(vm, address) : vm->memory[address];
+}
+
+void vm_io_write(lc3_vm *vm, uint16_t address, uint16_t val) {
+  io_write_fn write = vm->io_page[address - IO_PAGE].write;
+  if (write) {
+    write(vm, address, val);
+    return;
+  }
+  vm->memory[address] = val;
+  store_hook(vm, address);
+}
+
+// keyboard
+// Reading KBSR while no key is latched asks io.poll whether one is waiting
+// and, if so, latches it into KBDR. Reading KBDR consumes the latched key.
+// With the interrupt enable bit of KBSR set the keyboard event polls every
+// KEYBOARD_POLL instructions instead, so a key raises the interrupt without
+// the guest reading KBSR, and always at the same instruction count: a key
+// latched by a read in the middle of an engine run would be taken wherever
+// that run happens to end.
+void vm_keyboard_latch(lc3_vm *vm) {
+  if (!(vm->memory[MR_KBSR] & DEV_READY) && vm->io.poll(vm->io.ctx)) {
+    int c = vm->io.getc(vm->io.ctx);
+    if (c >= 0) {
+      vm->memory[MR_KBSR] |= DEV_READY;
+      vm->memory[MR_KBDR] = (uint16_t)c;
+      store_hook(vm, MR_KBSR);
+      store_hook(vm, MR_KBDR);
+    }
+  }
+}
+
+// A guest without input that polls for it waits with LC3_IO_NONBLOCK, after
+// the load: it reads KBSR again when it runs next. Otherwise the engine ends
+// its run after the load, for lc3_vm_run() to see whether it is in an idle
+// loop.
+static uint16_t kbsr_read(lc3_vm *vm, uint16_t address) {
+  if (vm->stats) {
+    stat_add(&vm->stats->kbsr_polls, 1);
+  }
+  if (!(vm->memory[MR_KBSR] & DEV_IE)) {
+    vm_keyboard_latch(vm);
+    if (!(vm->memory[MR_KBSR] & DEV_READY) && vm->running) {
+      if (vm->io.flags & LC3_IO_NONBLOCK) {
+        vm->wait = VM_WAIT_KEY;
+        vm_stop(vm, LC3_EXIT_WAIT);
+      } else if (vm->idle && !vm->trace && !vm->profile && !vm->debug &&
+                 !vm->record) {
+        if (vm->idle_backoff) {
+          vm->idle_backoff--;
+        } else {
+          vm->idle_check = 1;
+          vm_yield(vm);
+        }
+      }
+    }
+  }
+  return vm->memory[MR_KBSR];
+}
+
+static void kbsr_write(lc3_vm *vm, uint16_t address, uint16_t val) {
+  vm->memory[MR_KBSR] = (vm->memory[MR_KBSR] & DEV_READY) | (val & DEV_IE);
+  store_hook(vm, MR_KBSR);
+  if (val & DEV_IE) {
+    vm_event_after(vm, EV_KEYBOARD, 0);
+  } else {
+    vm_event_cancel(vm, EV_KEYBOARD);
+  }
+}
+
+static uint16_t kbdr_read(lc3_vm *vm, uint16_t address) {
+  if (vm->memory[MR_KBSR] & DEV_READY) {
+    vm->memory[MR_KBSR] &= ~DEV_READY;
+    store_hook(vm, MR_KBSR);
+  }
+  return vm->memory[MR_KBDR];
+}
+
+// display, always ready; every character is one write like the OUT trap
+static uint16_t dsr_read(lc3_vm *vm, uint16_t address) { return 1 << 15; }
+
+static void ddr_write(lc3_vm *vm, uint16_t address, uint16_t val) {
+  out_putc(vm, (char)val);
+  out_trap_done(vm);
+}
+
+static uint16_t psr_read(lc3_vm *vm, uint16_t address) { return vm_psr(vm); }
+
+// the clock runs while the VM does, the OS HALT routine clears bit 15
+static uint16_t mcr_read(lc3_vm *vm, uint16_t address) {
+  return vm->running ? 1 << 15 : 0;
+}
+
+static void mcr_write(lc3_vm *vm, uint16_t address, uint16_t val) {
+  if (!(val & (1 << 15))) {
+    out_flush(vm);
+    vm_stop(vm, LC3_EXIT_HALT);
+  }
+}
+
+static void io_init(lc3_vm *vm) {
+  vm_io_register(vm, MR_KBSR, kbsr_read, kbsr_write);
+  vm_io_register(vm, MR_KBDR, kbdr_read, NULL);
+  vm_io_register(vm, MR_DSR, dsr_read, NULL);
+  vm_io_register(vm, MR_DDR, NULL, ddr_write);
+  vm_io_register(vm, MR_PSR, psr_read, NULL);
+  vm_io_register(vm, MR_MCR, mcr_read, mcr_write);
+  vm_timer_init(vm);
+}
+
+// waiting for input
+// --------------------------------------------------
+
+// the read of a GETC or IN, also one that waited for it, see the traps
+static void getc_finish(lc3_vm *vm);
+static void in_finish(lc3_vm *vm);
+
+// With LC3_IO_NONBLOCK and nothing to read the trap stops the VM, its PC
+// already past it; input_resume() finishes it in the next run with input.
+static int input_wait(lc3_vm *vm, int wait) {
+  if (!(vm->io.flags & LC3_IO_NONBLOCK) || vm->io.poll(vm->io.ctx)) {
+    return 0;
+  }
+  vm->wait = wait;
+  vm_stop(vm, LC3_EXIT_WAIT);
+  return 1;
+}
+
+// 0 while there is still nothing to read
+static int input_resume(lc3_vm *vm) {
+  if (!vm->io.poll(vm->io.ctx)) {
+    return 0;
+  }
+  int wait = vm->wait;
+  vm->wait = VM_WAIT_NONE;
+  vm->running = 1;
+  if (wait == VM_WAIT_GETC) {
+    getc_finish(vm);
+  } else if (wait == VM_WAIT_IN) {
+    in_finish(vm);
+  }
+  return 1;
+}
+
+// idle loops
+// --------------------------------------------------
+
+enum {
+  IDLE_BACKOFF = 64, // empty KBSR reads let go by after a loop that is not one
+};
+
+// a run this long has no end to skip to
+#define IDLE_UNBOUNDED ((uint64_t)1 << 62)
+
+// The KBSR read that just retired at PC - 1 and a BR at PC taken back to it on
+// zero: with interrupts off and nothing latched the read gives 0, so every
+// further lap leaves the machine as it is, only the counts move on. cost is
+// the cycles of a lap.
+static int idle_loop(const lc3_vm *vm, uint64_t *cost) {
+  uint16_t pc = vm->reg[R_PC];
+  uint16_t load_pc = pc - 1;
+  uint16_t load = vm->memory[load_pc];
+  uint16_t br = vm->memory[pc];
+  if ((br >> 12) != OP_BR || !(br & (FL_ZRO << 9)) ||
+      (uint16_t)(pc + 1 + sign_extend(br & 0x1FF, 9)) != load_pc) {
+    return 0;
+  }
+  uint16_t dr = (load >> 9) & 0x7;
+  uint16_t address;
+  switch (load >> 12) {
+  case OP_LDI:
+    address = vm->memory[(uint16_t)(pc + sign_extend(load & 0x1FF, 9))];
+    break;
+  case OP_LDR: {
+    uint16_t base = (load >> 6) & 0x7;
+    if (base == dr) {
+      return 0; // the next lap reads somewhere else
+    }
+    address = vm->reg[base] + sign_extend(load & 0x3F, 6);
+    break;
+  }
+  default:
+    return 0;
+  }
+  if (address != MR_KBSR || vm->reg[dr] != 0) {
+    return 0;
+  }
+  *cost = vm->cycle_cost[load >> 12] + vm->cycle_cost[OP_BR];
+  return 1;
+}
+
+static uint64_t elapsed_us(const struct timespec *since) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - since->tv_sec) * 1000000 +
+         (ts.tv_nsec - since->tv_nsec) / 1000;
+}
+
+// Laps are skipped up to the end of the run or the next device event,
+// whichever comes first. With lc3_io.wait the guest sleeps for as long as
+// those laps take at LC3_IDLE_RATE, and a key cuts it short to the laps that
+// fit in the time it slept. Without wait and without an end in sight the loop
+// is left to spin, for the next IDLE_BACKOFF empty reads before it is looked
+// at again.
+static uint64_t idle_skip(lc3_vm *vm, uint64_t left) {
+  uint64_t cost;
+  if (!idle_loop(vm, &cost)) {
+    vm->idle_backoff = IDLE_BACKOFF;
+    return 0;
+  }
+  uint64_t span = vm_next_stop(vm) - vm->instructions;
+  span = span < left ? span : left;
+  uint64_t laps = span / 2; // the BR, then the read again
+  if (!laps) {
+    return 0;
+  }
+  if (vm->io.wait) {
+    long timeout = -1;
+    if (span < IDLE_UNBOUNDED) {
+      timeout = (long)((span + LC3_IDLE_RATE - 1) / LC3_IDLE_RATE);
+    }
+    vm->io.flush(vm->io.ctx);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ready = vm->io.wait(vm->io.ctx, timeout);
+    if (ready || timeout < 0) {
+      uint64_t slept = elapsed_us(&start) * (LC3_IDLE_RATE / 1000) / 2;
+      laps = slept < laps ? slept : laps;
+      if (!ready) {
+        vm->idle_backoff = IDLE_BACKOFF; // end of input, nothing will come
+      }
+    }
+  } else if (span >= IDLE_UNBOUNDED) {
+    vm->idle_backoff = IDLE_BACKOFF;
+    return 0;
+  }
+  vm->instructions += 2 * laps;
+  if (vm->timed) {
+    vm->cycles += laps * cost;
+  }
+  if (vm->stats) {
+    stat_add(&vm->stats->instructions, 2 * laps);
+    stat_add(&vm->stats->kbsr_polls, laps);
+  }
+  return 2 * laps;
+}
+
+// VM lifetime
+// --------------------------------------------------
+
+static pthread_once_t strings_once = PTHREAD_ONCE_INIT;
+
+lc3_vm *lc3_vm_create(void) {
+  pthread_once(&strings_once, vm_strings_init);
+
+  lc3_vm *vm = calloc(1, sizeof(*vm));
+  if (!vm) {
+    return NULL;
+  }
+  // untouched pages cost nothing until the guest writes them
+  void *memory = mmap(NULL, VM_MEMORY_BYTES, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    free(vm);
+    return NULL;
+  }
+  vm->memory = memory;
+  vm->reg[R_PC] = PC_START;
+  vm->psr = PSR_USER;
+  vm->saved_ssp = SSP_START;
+  vm->running = 1;
+  vm->jit_threshold = 16;
+  vm->fusion = 1;
+  vm->idle = 1;
+  vm_events_clear(vm);
+  vm->io = null_io;
+  io_init(vm);
+  lc3_vm_set_dispatch(vm, LC3_DISPATCH_DEFAULT);
+  return vm;
+}
+
+void lc3_vm_destroy(lc3_vm *vm) {
+  if (!vm) {
+    return;
+  }
+  vm_code_cache_free(vm); // saves what the caches below hold
+  vm_decode_free(vm);
+  vm_analysis_drop(vm);
+#if LC3_HAVE_JIT
+  vm_jit_free(vm);
+#endif
+  vm_profile_free(vm);
+  vm_trace_free(vm);
+  vm_debug_free(vm);
+  vm_record_free(vm);
+  vm_stats_release(vm);
+  lc3_image_close(vm->base);
+  munmap(vm->memory, VM_MEMORY_BYTES);
+  free(vm);
+}
+
+lc3_vm *lc3_vm_fork(const lc3_vm *vm) {
+  lc3_vm *child = lc3_vm_create();
+  if (!child) {
+    return NULL;
+  }
+  if (vm->base && !vm_map_base(child, vm->base)) {
+    lc3_vm_destroy(child);
+    return NULL;
+  }
+  for (int p = 0; p < VM_PAGES; p++) {
+    if (vm->page_dirty[p]) {
+      memcpy(child->memory + p * VM_PAGE_WORDS, vm->memory + p * VM_PAGE_WORDS,
+             VM_PAGE_WORDS * sizeof(uint16_t));
+      child->page_dirty[p] = 1;
+    }
+  }
+  memcpy(child->reg, vm->reg, sizeof(vm->reg));
+  child->running = vm->running;
+  child->exit = vm->exit;
+  child->wait = vm->wait;
+  child->traps = vm->traps;
+  child->psr = vm->psr;
+  child->saved_ssp = vm->saved_ssp;
+  child->saved_usp = vm->saved_usp;
+  child->instructions = vm->instructions;
+  child->cycles = vm->cycles;
+  child->timed = vm->timed;
+  memcpy(child->cycle_cost, vm->cycle_cost, sizeof(vm->cycle_cost));
+  child->events = vm->events;
+  child->io = vm->record ? vm->record->io : vm->io; // not recorded
+  memcpy(child->io_page, vm->io_page, sizeof(vm->io_page));
+  child->jit_threshold = vm->jit_threshold;
+  child->fusion = vm->fusion;
+  memcpy(child->fuse_pairs, vm->fuse_pairs, sizeof(vm->fuse_pairs));
+  child->idle = vm->idle;
+  child->symbols = vm->symbols;
+  lc3_vm_set_dispatch(child, vm->dispatch);
+  return child;
+}
+
+void lc3_vm_set_traps(lc3_vm *vm, int traps) {
+  if (traps != LC3_TRAPS_NATIVE) {
+    vm_analysis_drop(vm); // the graph did not follow the trap tables
+  }
+  vm->traps = traps;
+}
+
+void lc3_vm_set_io(lc3_vm *vm, const struct lc3_io *io) { vm->io = *io; }
+
+int lc3_vm_set_dispatch(lc3_vm *vm, int dispatch) {
+#if !LC3_HAVE_COMPUTED_GOTO
+  if (dispatch == LC3_DISPATCH_THREADED) {
+    dispatch = LC3_DISPATCH_SWITCH;
+  }
+#endif
+  if (dispatch == LC3_DISPATCH_JIT) {
+#if LC3_HAVE_JIT
+    if (!vm_jit_init(vm)) {
+      dispatch = LC3_DISPATCH_DECODED;
+    }
+#else
+    dispatch = LC3_DISPATCH_DECODED;
+#endif
+  }
+  if (dispatch == LC3_DISPATCH_DECODED || dispatch == LC3_DISPATCH_JIT) {
+    if (!vm_decode_init(vm)) {
+      dispatch = LC3_DISPATCH_SWITCH;
+    }
+  }
+  // the JIT interprets one instruction per entry, drop the superinstructions
+  if (vm->dispatch == LC3_DISPATCH_DECODED && dispatch != vm->dispatch &&
+      vm->decode_cache) {
+    vm_decode_invalidate_all(vm);
+  }
+  // the other engines do not check that control stays on the analyzed code
+  if (dispatch != vm->dispatch) {
+    vm_analysis_drop(vm);
+  }
+  vm->dispatch = dispatch;
+  return dispatch;
+}
+
+void lc3_vm_set_jit_threshold(lc3_vm *vm, unsigned threshold) {
+  // the JIT counts entries in 16 bits and keeps the top value for blocks
+  // that failed to compile, a higher threshold would never be reached
+  if (threshold < 1) {
+    threshold = 1;
+  } else if (threshold > LC3_JIT_THRESHOLD_MAX) {
+    threshold = LC3_JIT_THRESHOLD_MAX;
+  }
+  vm->jit_threshold = threshold;
+}
+
+void lc3_vm_set_idle(lc3_vm *vm, int on) { vm->idle = on; }
+
+void lc3_vm_set_fusion(lc3_vm *vm, int on) {
+  vm->fusion = on;
+  if (vm->decode_cache) {
+    vm_decode_invalidate_all(vm);
+  }
+}
+
+void lc3_vm_set_symbols(lc3_vm *vm, const lc3_symbols *symbols) {
+  vm->symbols = symbols;
+}
+
+void vm_invalidate_all(lc3_vm *vm) {
+  vm_analysis_drop(vm);
+  if (vm->decode_cache) {
+    vm_decode_invalidate_all(vm);
+  }
+#if LC3_HAVE_JIT
+  if (vm->jit) {
+    vm_jit_reset(vm);
+  }
+#endif
+}
+
+// copy count native-endian words to origin, keeping the code caches coherent
+void vm_load_words(lc3_vm *vm, uint16_t origin, const uint16_t *words,
+                   size_t count) {
+  vm_code_cache_detach(vm);
+  memcpy(vm->memory + origin, words, count * sizeof(uint16_t));
+  for (size_t i = 0; i < count; i++) {
+    store_hook(vm, origin + i);
+  }
+}
+
+// obj[0..size) is an .obj image: a big-endian origin and big-endian words
+// Words past the end of memory are dropped.
+static int vm_load_obj(lc3_vm *vm, const uint8_t *obj, size_t size) {
+  if (size < 2) {
+    return 0;
+  }
+  uint16_t origin = (obj[0] << 8) | obj[1];
+  size_t max_read = UINT16_MAX + 1 - origin;
+  size_t read = (size - 2) / 2;
+  if (read > max_read) {
+    read = max_read;
+  }
+  vm_code_cache_detach(vm);
+  vm_swap_words(vm->memory + origin, obj + 2, read);
+  for (size_t i = 0; i < read; i++) {
+    store_hook(vm, origin + i);
+  }
+  return 1;
+}
+
+int lc3_vm_load(lc3_vm *vm, const void *obj, size_t size) {
+  return vm_load_obj(vm, obj, size);
+}
+
+// the file is mapped and swapped straight into memory, no read buffer
+int lc3_vm_load_image(lc3_vm *vm, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < 2) {
+    close(fd);
+    return 0;
+  }
+  void *obj = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (obj == MAP_FAILED) {
+    return 0;
+  }
+  int ok = vm_load_obj(vm, obj, st.st_size);
+  munmap(obj, st.st_size);
+  return ok;
+}
+
+void vm_stop(lc3_vm *vm, int exit) {
+  vm->running = 0;
+  vm->exit = exit;
+}
+
+// engines stop whenever running is cleared, lc3_vm_run() sets it again
+void vm_yield(lc3_vm *vm) {
+  if (vm->running) {
+    vm_stop(vm, VM_EXIT_YIELD);
+  }
+}
+
+static uint64_t run_engine(lc3_vm *vm, uint64_t budget) {
+  if (vm->debug) {
+    return vm_run_debug(vm, budget);
+  }
+  if (vm->trace) {
+    return vm_run_trace(vm, budget);
+  }
+  if (vm->profile) {
+    return vm_run_profile(vm, budget);
+  }
+  if (vm->timed) {
+    return vm_run_timed(vm, budget);
+  }
+  switch (vm->dispatch) {
+#if LC3_HAVE_COMPUTED_GOTO
+  case LC3_DISPATCH_THREADED:
+    return run_threaded(vm, budget);
+#endif
+  case LC3_DISPATCH_DECODED:
+    return vm_run_decoded(vm, budget);
+#if LC3_HAVE_JIT
+  case LC3_DISPATCH_JIT:
+    return vm_run_jit(vm, budget);
+#endif
+  default:
+    return vm_run_switch(vm, budget);
+  }
+}
+
+uint64_t vm_next_stop(const lc3_vm *vm) {
+  uint64_t next = vm_event_next(vm);
+  if (vm->record && vm->record->next < next) {
+    next = vm->record->next;
+  }
+  return next;
+}
+
+// The engine runs up to the next device event at most; in between events
+// fire, interrupts are taken and a recording VM takes its checkpoints.
+int lc3_vm_run(lc3_vm *vm, uint64_t max_instructions) {
+  uint64_t left = max_instructions;
+  if (vm->code_cache && !vm->code_cache->key) {
+    vm_code_cache_attach(vm);
+  }
+  if (!vm->running && vm->exit == LC3_EXIT_BREAK) {
+    vm->running = 1; // the breakpoint does not stop it again
+  }
+  if (!vm->running && vm->exit == LC3_EXIT_WAIT && !input_resume(vm)) {
+    return LC3_EXIT_WAIT;
+  }
+  while (vm->running && left > 0) {
+    if (vm->record && vm->instructions >= vm->record->next) {
+      vm_record_checkpoint(vm);
+    }
+    vm_events_run(vm);
+    vm_interrupts_deliver(vm);
+    uint64_t budget = left;
+    uint64_t next = vm_next_stop(vm);
+    if (next - vm->instructions < budget) {
+      budget = next - vm->instructions;
+    }
+    if (vm->stats && budget > LC3_STATS_INTERVAL) {
+      budget = LC3_STATS_INTERVAL;
+    }
+    uint64_t n = run_engine(vm, budget);
+    vm->instructions += n;
+    if (vm->stats) {
+      stat_add(&vm->stats->instructions, n);
+    }
+    left -= n;
+    if (!vm->running && vm->exit == VM_EXIT_YIELD) {
+      vm->running = 1;
+      if (vm->idle_check) {
+        vm->idle_check = 0;
+        left -= idle_skip(vm, left);
+      }
+    }
+  }
+  vm_events_commit(vm);
+  out_trap_done(vm);
+  return vm->running ? LC3_EXIT_BUDGET : vm->exit;
+}
+
+// fetch and decode take 3 + 5 cycles, every further state 1 and every
+// further memory access 5
+const uint8_t lc3_default_cycles[16] = {
+    [OP_BR] = 10,  [OP_ADD] = 9,  [OP_LD] = 15,  [OP_ST] = 15,
+    [OP_JSR] = 10, [OP_AND] = 9,  [OP_LDR] = 15, [OP_STR] = 15,
+    [OP_RTI] = 24, [OP_NOT] = 9,  [OP_LDI] = 21, [OP_STI] = 22,
+    [OP_JMP] = 9,  [OP_RES] = 9,  [OP_LEA] = 9,  [OP_TRAP] = 15};
+
+void lc3_vm_set_cycle_costs(lc3_vm *vm, const uint8_t costs[16]) {
+  vm->timed = costs != NULL;
+  if (costs) {
+    memcpy(vm->cycle_cost, costs, sizeof(vm->cycle_cost));
+  }
+}
+
+uint64_t lc3_vm_cycles(const lc3_vm *vm) { return vm->cycles; }
+
+uint64_t lc3_vm_instructions(const lc3_vm *vm) { return vm->instructions; }
+
+uint16_t lc3_vm_reg(const lc3_vm *vm, int r) { return vm->reg[r]; }
+
+void lc3_vm_set_reg(lc3_vm *vm, int r, uint16_t val) { vm->reg[r] = val; }
+
+uint16_t lc3_vm_peek(const lc3_vm *vm, uint16_t address) {
+  return vm->memory[address];
+}
+
+void lc3_vm_poke(lc3_vm *vm, uint16_t address, uint16_t val) {
+  vm->memory[address] = val;
+  store_hook(vm, address);
+}
+
+// -------------------------------------------------
+
+// Addition
+// ADD | DR | SR1 | SR2/imm5
+// example:
+// ADD R2, R3, R4 ;R2 ← R3 + R4
+// ADD R2, R3, #7 ;R@ ← R3 + 7
+void vm_ADD(lc3_vm *vm, uint16_t instr) {
+  uint16_t dr = (instr >> 9) & 0x7;
+  uint16_t sr1 = (instr >> 6) & 0x7;
+  uint16_t imm_flag = (instr >> 5) & 0x1;
+
+  if (!imm_flag) {
+    uint16_t sr2 = instr & 0x7;
+    vm->reg[dr] = vm->reg[sr1] + vm->reg[sr2];
+  } else {
+    uint16_t imm = sign_extend(instr & 0x1F, 5);
+    vm->reg[dr] = vm->reg[sr1] + imm;
+  }
+
+  update_flags(vm, dr);
+}
+
+// Bit-wise Logical AND
+// AND | DR | SR1 | SR2/imm5
+// example:
+// AND R2, R3, R4 ;R2 ← R3 AND R4
+// AND R2, R3, #7 ;R2 ← R3 AND 7
+void vm_AND(lc3_vm *vm, uint16_t instr) {
+  uint16_t dr = (instr >> 9) & 0x7;
+  uint16_t sr1 = (instr >> 6) & 0x7;
+  uint16_t imm_flag = (instr >> 5) & 0x1;
+
+  if (!imm_flag) {
+    uint16_t sr2 = instr & 0x7;
+    vm->reg[dr] = vm->reg[sr1] & vm->reg[sr2];
+  } else {
+    uint16_t imm = sign_extend(instr & 0x1f, 5);
+    vm->reg[dr] = vm->reg[sr1] & imm;
+  }
+
+  update_flags(vm, dr);
+}
+
+// Bit-Wise Complement
+// Assembler Format
+// NOT DR, SR
+// example:
+// NOT R4, R2 ;R4 <- NOT(R2)
+void vm_NOT(lc3_vm *vm, uint16_t instr) {
+  uint16_t dr = (instr >> 9) & 0x7;
+  uint16_t sr = (instr >> 6) & 0x7;
+
+  vm->reg[dr] = ~vm->reg[sr];
+  update_flags(vm, dr);
+}
+
+// Conditional Branch
+// Format:
+// BR LAMBEL
+
+// Description：
+// The condition codes specified by the state of bits [11:9] are tested. If bit
+// [11] is set, N is tested; if bit [11] is clear, N is not tested. If bit [10]
+// is set, Z is tested, etc. If any of the condition codes tested is set, the
+// program branches to the location specified by adding the sign-extended
+// PCoffset9 field to the incremented PC.
+
+// example：
+// BRzp LOOP ;Branch to LOOP if the last result was zero or positive.
+// BR   NEXT ;Unconditionally branch to NEXT.
+void vm_BR(lc3_vm *vm, uint16_t instr) {
+  uint16_t cond_flag = (instr >> 9) & 0x7;
+  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+  if (cond_flag & cond_flags(vm)) {
+    vm->reg[R_PC] += pc_offset;
+  }
+}
+
+// Jump/Return from Subroutine
+// example:
+// JMP R2 ;PC <- R2
+// RET    ;PC <- R7
+void vm_JMP(lc3_vm *vm, uint16_t instr) {
+  // Also handles RET
+  uint16_t jmp_flag = (instr >> 6) & 0x7;
+  vm->reg[R_PC] = vm->reg[jmp_flag];
+}
+
+// Jump to Subroutine
+// JSR/JSRR LABEL/BaseR
+// Description
+// First, the incremented PC is saved in R7. This is the linkage back to the
+// calling routine. Then the PC is loaded with the address of the first
+// instruction of the subroutine, causing an unconditional jump to that address.
+// The address of the subroutine is obtained from the base register (if bit [11]
+// is 0), or the address is computed by sign-extending bits [10:0] and adding
+// this value to the incremented PC (if bit [11] is 1).
+
+void vm_JSR(lc3_vm *vm, uint16_t instr) {
+  uint16_t baser = (instr >> 6) & 0x7;
+  uint16_t long_pc_offset = sign_extend(instr & 0x7ff, 11);
+  uint16_t long_flag = (instr >> 11) & 1;
+
+  vm->reg[R_R7] = vm->reg[R_PC];
+
+  if (long_flag) {
+    vm->reg[R_PC] += long_pc_offset; // JSR
+  } else {
+    vm->reg[R_PC] = vm->reg[baser]; // JSRR
+  }
+}
+
+// load
+// lD DR, LABEL
+// example:
+// LD R4, VALUE ;R4 <- mem[VALUE]
+void vm_LD(lc3_vm *vm, uint16_t instr) {
+  uint16_t dr = (instr >> 9) & 0x7;
+  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+
+  vm->reg[dr] = mem_read(vm, vm->reg[R_PC] + pc_offset);
+  update_flags(vm, dr);
+}
+
+// load indirect
+// example:
+// LDI R4, ONEMORE ; R4 <- mem[mem[ONEMORE]]
+void vm_LDI(lc3_vm *vm, uint16_t instr) {
+  uint16_t dr = (instr >> 9) & 0x7;
+  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+
+  vm->reg[dr] = mem_read(vm, mem_read(vm, vm->reg[R_PC] + pc_offset));
+  update_flags(vm, dr);
+}
+
+// Load Base+offset
+// Assembler Format
+// LDR DR, BaseR, offset6
+// example:
+// LDR R4, R2, #−5 ;R4 <- mem[R2 − 5]
+void vm_LDR(lc3_vm *vm, uint16_t instr) {
+  uint16_t dr = (instr >> 9) & 0x7;
+  uint16_t baser = (instr >> 6) & 0x7;
+  uint16_t offset = sign_extend(instr & 0x3f, 6);
+
+  vm->reg[dr] = mem_read(vm, vm->reg[baser] + offset);
+  update_flags(vm, dr);
+}
+
+// Load Effective Address
+// Assembler Format
+// LEA DR, LABEL
+// Description:
+// An address is computed by sign-extending bits [8:0] to 16 bits and adding
+// this value to the incremented PC. This address is loaded into DR. The
+// condition codes are set, based on whether the value loaded is negative, zero,
+// or positive.
+// Example:
+// LEA R4, TARGET ;R4 <- address of TARGET.
+
+void vm_LEA(lc3_vm *vm, uint16_t instr) {
+  uint16_t dr = (instr >> 9) & 0x7;
+  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+
+  vm->reg[dr] = vm->reg[R_PC] + pc_offset;
+  update_flags(vm, dr);
+}
+
+// Store
+// Assembler Format
+// ST SR, LABEL
+// Description:
+// The contents of the register specified by SR are stored in the memory
+// location whose address is computed by sign-extending bits [8:0] to 16 bits
+// and adding this value to the incremented PC.
+// Example:
+// ST R4, HERE ;mem[HERE] <- R4
+void vm_ST(lc3_vm *vm, uint16_t instr) {
+  uint16_t sr = (instr >> 9) & 0x7;
+  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+
+  mem_write(vm, vm->reg[R_PC] + pc_offset, vm->reg[sr]);
+}
+
+// Store Indirect
+// Assembler Format
+// STI SR, LABEL
+// Description
+// The contents of the register specified by SR are stored in the memory
+// location whose address is obtained as follows: Bits [8:0] are sign-extended
+// to 16 bits and added to the incremented PC. What is in memory at this address
+// is the address of the location to which the data in SR is stored.
+// Example:
+// STI R4, NOT_HERE ;mem[mem[NOT_HERE]] <- R4
+void vm_STI(lc3_vm *vm, uint16_t instr) {
+  uint16_t sr = (instr >> 9) & 0x7;
+  uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+
+  mem_write(vm, mem_read(vm, vm->reg[R_PC] + pc_offset), vm->reg[sr]);
+}
+// Store Base+offset
+// Assembler Format
+// STR SR, BaseR, offset6
+// Example:
+// STR R4, R2, #5 ;mem[R2 + 5] <- R4
+void vm_STR(lc3_vm *vm, uint16_t instr) {
+  uint16_t sr = (instr >> 9) & 0x7;
+  uint16_t baser = (instr >> 6) & 0x7;
+  uint16_t offset = sign_extend(instr & 0x3f, 6);
+
+  mem_write(vm, vm->reg[baser] + offset, vm->reg[sr]);
+}
+
+// TRAP
+// --------------------------------------------------
+
+// the read of GETC, also when it waited for it
+static void getc_finish(lc3_vm *vm) {
+  vm->reg[R_R0] = (uint16_t)vm->io.getc(vm->io.ctx);
+}
+
+// GETC
+// Read a single character from the keyboard. The character is not echoed onto
+// the console. Its ASCII code is copied into R0. The high eight bits of R0 are
+// cleared.
+static void GETC(lc3_vm *vm) {
+  out_flush(vm);
+  if (!input_wait(vm, VM_WAIT_GETC)) {
+    getc_finish(vm);
+  }
+}
+
+// OUT
+// Write a character in R0[7:0] to the console display.
+static void OUT(lc3_vm *vm) {
+  out_putc(vm, (char)vm->reg[R_R0]);
+  out_trap_done(vm);
+}
+
+// PUTS
+// Write a string of ASCII characters to the console display. The characters are
+// contained in consecutive memory locations, one character per memory location,
+// starting with the address specified in R0. Writing terminates with the
+// occurrence of x0000 in a memory location.
+static void PUTS(lc3_vm *vm) {
+  uint16_t address = vm->reg[R_R0];
+  size_t left = UINT16_MAX + 1; // stop after one full lap of memory
+  while (left > 0) {
+    size_t room;
+    char *dst = out_reserve(vm, 1, &room);
+    size_t n = UINT16_MAX + 1 - address;
+    n = n < left ? n : left;
+    n = n < room ? n : room;
+    size_t done = vm_narrow_words(vm->memory + address, n, dst);
+    vm->out_len += done;
+    if (done < n) {
+      break;
+    }
+    address += done;
+    left -= done;
+  }
+  out_trap_done(vm);
+}
+
+// the character read and echoed, the prompt is out already
+static void in_finish(lc3_vm *vm) {
+  char c = (char)vm->io.getc(vm->io.ctx);
+  out_putc(vm, c);
+  out_trap_done(vm);
+  vm->reg[R_R0] = (uint16_t)c;
+}
+
+// IN
+// Print a prompt on the screen and read a single character from the keyboard.
+// The character is echoed onto the console monitor, and its ASCII code is
+// copied into R0. The high eight bits of R0 are cleared.
+static void IN(lc3_vm *vm) {
+  static const char prompt[] = "Enter a character: ";
+  if (!(vm->io.flags & LC3_IO_NO_PROMPT)) {
+    out_write(vm, prompt, sizeof(prompt) - 1);
+  }
+  out_flush(vm);
+  if (!input_wait(vm, VM_WAIT_IN)) {
+    in_finish(vm);
+  }
+}
+
+// PUTSP
+// Write a string of ASCII characters to the console. The characters are
+// contained in
+// consecutive memory locations, two characters per memory location, starting
+// with the address specified in R0. The ASCII code contained in bits [7:0] of a
+// memory location is written to the console first. Then the ASCII code contained
+// in bits [15:8] of that memory location is written to the console. (A character
+// string consisting of an odd number of characters to be written will have x00
+// in bits [15:8] of the memory location containing the last character to be
+// written.) Writing terminates with the occurrence of x0000 in a memory
+// location.
+static void PUTSP(lc3_vm *vm) {
+  uint16_t address = vm->reg[R_R0];
+  size_t left = UINT16_MAX + 1; // stop after one full lap of memory
+  while (left > 0) {
+    size_t room;
+    char *dst = out_reserve(vm, 2, &room);
+    size_t n = UINT16_MAX + 1 - address;
+    n = n < left ? n : left;
+    n = n < room / 2 ? n : room / 2;
+    size_t bytes;
+    size_t done = vm_unpack_words(vm->memory + address, n, dst, &bytes);
+    vm->out_len += bytes;
+    if (done < n) {
+      break;
+    }
+    address += done;
+    left -= done;
+  }
+  out_trap_done(vm);
+}
+
+// HALT
+// Halt execution and print a message on the console.
+static void HALT(lc3_vm *vm) {
+  out_write(vm, "HALT\n", 5);
+  out_flush(vm);
+  vm_stop(vm, LC3_EXIT_HALT);
+}
+
+// dispatch
+// --------------------------------------------------
+
+// execute trap
+// In native mode the routines below run as host code and every other vector
+// goes through the trap table; in OS mode all of them do. Host routines leave
+// R7 alone, as they always have; a vector served from the table gets the
+// return address in R7 like on the real machine. In native mode an empty
+// table entry keeps the old behaviour of ignoring the trap, the table itself
+// lives at 0 so no handler can.
+void vm_TRAP(lc3_vm *vm, uint16_t instr) {
+  uint16_t handler = mem_read(vm, TRAP_TABLE + (instr & 0xFF));
+  if (vm->stats) {
+    stat_add(&vm->stats->traps[instr & 0xFF], 1);
+  }
+  if (vm->traps == LC3_TRAPS_NATIVE) {
+    switch (instr & 0xFF) {
+    case TRAP_GETC:
+      GETC(vm);
+      return;
+    case TRAP_OUT:
+      OUT(vm);
+      return;
+    case TRAP_PUTS:
+      PUTS(vm);
+      return;
+    case TRAP_IN:
+      IN(vm);
+      return;
+    case TRAP_PUTSP:
+      PUTSP(vm);
+      return;
+    case TRAP_HALT:
+      HALT(vm);
+      return;
+    }
+    if (handler == 0) {
+      return;
+    }
+  }
+  vm->reg[R_R7] = vm->reg[R_PC];
+  vm->reg[R_PC] = handler;
+}
+
+// privilege mode, interrupts and exceptions
+// --------------------------------------------------
+
+uint16_t vm_psr(const lc3_vm *vm) { return vm->psr | cond_flags(vm); }
+
+// Push PSR and PC on the supervisor stack, switching to it from user mode,
+// and continue at the handler in the interrupt vector table.
+void vm_interrupt(lc3_vm *vm, uint8_t vector, uint16_t priority) {
+  uint16_t psr = vm_psr(vm);
+  if (vm->psr & PSR_USER) {
+    vm->saved_usp = vm->reg[R_R6];
+    vm->reg[R_R6] = vm->saved_ssp;
+  }
+  mem_write(vm, --vm->reg[R_R6], psr);
+  mem_write(vm, --vm->reg[R_R6], vm->reg[R_PC]);
+  vm->psr = (priority << 8) & PSR_PRIORITY;
+  vm->reg[R_PC] = mem_read(vm, INT_TABLE + vector);
+}
+
+void vm_RTI(lc3_vm *vm) {
+  if (vm->traps == LC3_TRAPS_NATIVE) {
+    vm_stop(vm, LC3_EXIT_ILLEGAL);
+    return;
+  }
+  if (vm->psr & PSR_USER) {
+    vm_interrupt(vm, INT_PRIVILEGE, vm->psr >> 8);
+    return;
+  }
+  vm->reg[R_PC] = mem_read(vm, vm->reg[R_R6]++);
+  uint16_t psr = mem_read(vm, vm->reg[R_R6]++);
+  vm_yield(vm); // a pending interrupt may be above the new priority
+  vm->psr = psr & (PSR_USER | PSR_PRIORITY);
+  // any result with the same N/Z/P
+  vm->reg[R_COND] = psr & FL_NEG ? 0x8000 : psr & FL_ZRO ? 0 : 1;
+  if (vm->psr & PSR_USER) {
+    vm->saved_ssp = vm->reg[R_R6];
+    vm->reg[R_R6] = vm->saved_usp;
+  }
+}
+
+void vm_RES(lc3_vm *vm) {
+  if (vm->traps == LC3_TRAPS_NATIVE) {
+    vm_stop(vm, LC3_EXIT_ILLEGAL);
+    return;
+  }
+  vm_interrupt(vm, INT_ILLEGAL, vm->psr >> 8);
+}
+
+// run_switch and run_timed are this loop with timing off and on, run_trace
+// adds the breakpoint and a trace record after every instruction
+static ALWAYS_INLINE uint64_t switch_loop(lc3_vm *vm, uint64_t budget,
+                                          int timed, int traced) {
+  uint64_t n = 0;
+  uint64_t cycles = 0;
+  uint64_t base = vm->instructions;
+  struct trace *t = vm->trace;
+  uint64_t recorded = traced ? trace_begin(t) : 0;
+  int has_break = traced && t->has_break;
+  while (n < budget && vm->running) {
+    uint16_t pc = vm->reg[R_PC];
+    if (has_break && pc == t->break_pc && t->break_hit != base + n) {
+      t->break_hit = base + n;
+      vm_stop(vm, LC3_EXIT_BREAK);
+      break;
+    }
+    vm->reg[R_PC]++;
+    uint16_t instr = mem_fetch(vm, pc);
+    uint16_t op = instr >> 12;
+    n++;
+    if (timed) {
+      cycles += vm->cycle_cost[op];
+    }
+
+    switch (op) {
+    case OP_ADD:
+      vm_ADD(vm, instr);
+      break;
+    case OP_AND:
+      vm_AND(vm, instr);
+      break;
+    case OP_NOT:
+      vm_NOT(vm, instr);
+      break;
+    case OP_BR:
+      vm_BR(vm, instr);
+      break;
+    case OP_JMP:
+      vm_JMP(vm, instr);
+      break;
+    case OP_JSR:
+      vm_JSR(vm, instr);
+      break;
+    case OP_LD:
+      vm_LD(vm, instr);
+      break;
+    case OP_LDI:
+      vm_LDI(vm, instr);
+      break;
+    case OP_LDR:
+      vm_LDR(vm, instr);
+      break;
+    case OP_LEA:
+      vm_LEA(vm, instr);
+      break;
+    case OP_ST:
+      vm_ST(vm, instr);
+      break;
+    case OP_STI:
+      vm_STI(vm, instr);
+      break;
+    case OP_STR:
+      vm_STR(vm, instr);
+      break;
+    case OP_TRAP:
+      vm_TRAP(vm, instr);
+      break;
+    case OP_RTI:
+      vm_RTI(vm);
+      break;
+    case OP_RES:
+      vm_RES(vm);
+      break;
+    }
+    if (traced) {
+      trace_record(t, &recorded, vm, pc, instr);
+    }
+  }
+  vm->cycles += cycles;
+  return n;
+}
+
+uint64_t vm_run_switch(lc3_vm *vm, uint64_t budget) {
+  return switch_loop(vm, budget, 0, 0);
+}
+
+uint64_t vm_run_timed(lc3_vm *vm, uint64_t budget) {
+  return switch_loop(vm, budget, 1, 0);
+}
+
+uint64_t vm_run_trace(lc3_vm *vm, uint64_t budget) {
+  return vm->timed ? switch_loop(vm, budget, 1, 1)
+                   : switch_loop(vm, budget, 0, 1);
+}
+
+#if LC3_HAVE_COMPUTED_GOTO
+// Every handler ends with its own copy of the fetch and the indirect jump, so
+// the branch predictor sees one jump site per opcode instead of the single
+// shared one of the switch. Only traps, RTI, the reserved opcode, stores,
+// which can reach MCR, and loads, which can reach KBSR, clear `running`, so
+// that is where it is checked; the budget is counted down on every fetch.
+static uint64_t run_threaded(lc3_vm *vm, uint64_t budget) {
+  static void *const labels[16] = {
+      &&op_br,  &&op_add, &&op_ld,  &&op_st,  &&op_jsr,  &&op_and,
+      &&op_ldr, &&op_str, &&op_rti, &&op_not, &&op_ldi,  &&op_sti,
+      &&op_jmp, &&op_res, &&op_lea, &&op_trap};
+  uint64_t left = budget;
+  uint16_t instr;
+
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if (left == 0) {                                                           \
+      goto out;                                                                \
+    }                                                                          \
+    left--;                                                                    \
+    instr = mem_fetch(vm, vm->reg[R_PC]++);                                    \
+    goto *labels[instr >> 12];                                                 \
+  } while (0)
+
+  DISPATCH();
+
+op_add:
+  vm_ADD(vm, instr);
+  DISPATCH();
+op_and:
+  vm_AND(vm, instr);
+  DISPATCH();
+op_not:
+  vm_NOT(vm, instr);
+  DISPATCH();
+op_br:
+  vm_BR(vm, instr);
+  DISPATCH();
+op_jmp:
+  vm_JMP(vm, instr);
+  DISPATCH();
+op_jsr:
+  vm_JSR(vm, instr);
+  DISPATCH();
+op_ld:
+  vm_LD(vm, instr);
+  if (!vm->running) {
+    goto out;
+  }
+  DISPATCH();
+op_ldi:
+  vm_LDI(vm, instr);
+  if (!vm->running) {
+    goto out;
+  }
+  DISPATCH();
+op_ldr:
+  vm_LDR(vm, instr);
+  if (!vm->running) {
+    goto out;
+  }
+  DISPATCH();
+op_lea:
+  vm_LEA(vm, instr);
+  DISPATCH();
+op_st:
+  vm_ST(vm, instr);
+  if (!vm->running) {
+    goto out;
+  }
+  DISPATCH();
+op_sti:
+  vm_STI(vm, instr);
+  if (!vm->running) {
+    goto out;
+  }
+  DISPATCH();
+op_str:
+  vm_STR(vm, instr);
+  if (!vm->running) {
+    goto out;
+  }
+  DISPATCH();
+op_trap:
+  vm_TRAP(vm, instr);
+  if (!vm->running) {
+    goto out;
+  }
+  DISPATCH();
+op_rti:
+  vm_RTI(vm);
+  if (!vm->running) {
+    goto out;
+  }
+  DISPATCH();
+op_res:
+  vm_RES(vm);
+  if (!vm->running) {
+    goto out;
+  }
+  DISPATCH();
+out:
+  return budget - left;
+
+#undef DISPATCH
+}
+#endif
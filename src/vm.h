@@ -0,0 +1,575 @@
+// lc3 virtual machine internals, shared by the engines
+#ifndef LC3_VM_H
+#define LC3_VM_H
+
+#include "lc3.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// the JIT tier emits x86-64 code, other hosts only get the interpreters
+#ifndef LC3_HAVE_JIT
+#if defined(__x86_64__)
+#define LC3_HAVE_JIT 1
+#else
+#define LC3_HAVE_JIT 0
+#endif
+#endif
+
+// computed goto is a GNU extension, supported by gcc and clang
+#ifndef LC3_HAVE_COMPUTED_GOTO
+#ifdef __GNUC__
+#define LC3_HAVE_COMPUTED_GOTO 1
+#else
+#define LC3_HAVE_COMPUTED_GOTO 0
+#endif
+#endif
+
+// for loops specialized by a constant argument
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#ifndef LC3_DISPATCH_DEFAULT
+#if LC3_HAVE_COMPUTED_GOTO
+#define LC3_DISPATCH_DEFAULT LC3_DISPATCH_THREADED
+#else
+#define LC3_DISPATCH_DEFAULT LC3_DISPATCH_SWITCH
+#endif
+#endif
+
+// registers
+enum {
+  R_R0 = 0,
+  R_R1,
+  R_R2,
+  R_R3,
+  R_R4,
+  R_R5,
+  R_R6,
+  R_R7,
+  R_PC,   // program counter
+  R_COND, // last result, the condition flags are derived from it
+  R_COUNT
+};
+
+enum {
+  OP_BR = 0, /* branch */
+  OP_ADD,    /* add  */
+  OP_LD,     /* load */
+  OP_ST,     /* store */
+  OP_JSR,    /* jump register */
+  OP_AND,    /* bitwise and */
+  OP_LDR,    /* load register */
+  OP_STR,    /* store register */
+  OP_RTI,    /* unused */
+  OP_NOT,    /* bitwise not */
+  OP_LDI,    /* load indirect */
+  OP_STI,    /* store indirect */
+  OP_JMP,    /* jump */
+  OP_RES,    /* reserved (unused) */
+  OP_LEA,    /* load effective address */
+  OP_TRAP    /* execute trap */
+};
+
+enum {
+  FL_POS = 1 << 0, /* P */
+  FL_ZRO = 1 << 1, /* Z */
+  FL_NEG = 1 << 2, /* N */
+};
+
+// definition trap code
+enum {
+  TRAP_GETC =
+      0x20, /* get character from keyboard, not echoed onto the terminal */
+  TRAP_OUT = 0x21,   /* output a character */
+  TRAP_PUTS = 0x22,  /* output a word string */
+  TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
+  TRAP_PUTSP = 0x24, /* output a byte string */
+  TRAP_HALT = 0x25   /* halt the program */
+};
+
+// KBSR: keyboard status register
+// KBDR: keyboard data register
+enum {
+  MR_KBSR = 0xFE00, /* keyboard status */
+  MR_KBDR = 0xFE02, /* keyboard data */
+  MR_DSR = 0xFE04,  /* display status */
+  MR_DDR = 0xFE06,  /* display data */
+  MR_TSR = 0xFE08,  /* timer status */
+  MR_TIR = 0xFE0A,  /* timer interval, in instructions, 0 stops it */
+  MR_PSR = 0xFFFC,  /* processor status */
+  MR_MCR = 0xFFFE   /* machine control, clearing bit 15 stops the clock */
+};
+
+// status bits of KBSR and TSR
+enum { DEV_READY = 1 << 15, DEV_IE = 1 << 14 };
+
+// trap and interrupt vector tables, the exceptions and the device interrupts
+// with their priority
+enum {
+  TRAP_TABLE = 0x0000,
+  INT_TABLE = 0x0100,
+  INT_PRIVILEGE = 0x00, /* RTI in user mode */
+  INT_ILLEGAL = 0x01,   /* reserved opcode */
+  INT_KEYBOARD = 0x80,
+  INT_TIMER = 0x81,
+  PL_KEYBOARD = 4,
+  PL_TIMER = 6
+};
+
+// PSR: privilege in bit 15, priority in 10:8, N/Z/P in 2:0
+enum { PSR_USER = 1 << 15, PSR_PRIORITY = 7 << 8 };
+
+// the supervisor stack grows down from here until the OS moves it
+enum { SSP_START = 0x3000 };
+
+// every device register lives in the page 0xFE00-0xFFFF
+enum { IO_PAGE = 0xFE00, IO_PAGE_SIZE = UINT16_MAX + 1 - IO_PAGE };
+
+/* set the PC to starting position */
+/* 0x3000 is the default */
+enum { PC_START = 0x3000 };
+
+// Memory Mapped Registers
+// Reads and writes of the device page go through the handlers registered for
+// each location, a location without a handler behaves like RAM.
+typedef uint16_t (*io_read_fn)(lc3_vm *vm, uint16_t address);
+typedef void (*io_write_fn)(lc3_vm *vm, uint16_t address, uint16_t val);
+
+struct io_handler {
+  io_read_fn read;
+  io_write_fn write;
+};
+
+// decoded instruction cache, one entry per memory location
+// The operands of every instruction are extracted once, the first time it runs
+// from a given address, and reused until that location is written again.
+// Handlers return the number of instructions they retired.
+struct decoded;
+typedef int (*exec_fn)(lc3_vm *vm, const struct decoded *d);
+
+struct decoded {
+  exec_fn fn;   // handler, vm_d_miss until the location is decoded
+  uint8_t dr;   // destination, source of a store, or BR condition bits
+  uint8_t sr1;  // first source or base register
+  uint8_t sr2;  // second source register
+  uint8_t len;  // instructions fn runs, more than 1 for a superinstruction
+  uint16_t imm; // sign-extended immediate/offset, or the resolved address
+};
+
+struct jit;
+struct profile;
+struct trace;
+struct debug;
+struct record;
+struct code_cache;
+
+// static analysis, see analysis.c
+// Bitmaps over all addresses: the instructions reachable from where the
+// analysis started, and the ST instructions among them that write a word
+// that is not one of them.
+struct analysis {
+  uint64_t code[(UINT16_MAX + 1) / 64];
+  uint64_t data_st[(UINT16_MAX + 1) / 64];
+};
+
+// memory is one mapping, private to the VM
+#define VM_MEMORY_BYTES ((size_t)(UINT16_MAX + 1) * sizeof(uint16_t))
+
+// Memory is a copy-on-write view of its base, an image or zeros, and written
+// locations are tracked in pages of 512 words. Only dirty pages have to be
+// copied when a VM is forked.
+enum { VM_PAGE_WORDS = 512, VM_PAGES = (UINT16_MAX + 1) / VM_PAGE_WORDS };
+
+// trap output is staged here and handed to io.write when the trap is done
+enum { VM_OUT_SIZE = 4096 };
+
+// device events
+// Every device owns one event, due at an absolute count of retired
+// instructions. lc3_vm_run() ends each engine run at the earliest one, so the
+// engines never look at devices themselves. `heap` orders the scheduled
+// events by `when`, `pos` is the slot of each or EV_IDLE.
+enum { EV_KEYBOARD = 0, EV_TIMER, EV_COUNT, EV_IDLE = 0xFF };
+
+// instructions between checks for a key while keyboard interrupts are on
+enum { KEYBOARD_POLL = 4096 };
+
+struct events {
+  uint64_t when[EV_COUNT];
+  uint8_t heap[EV_COUNT];
+  uint8_t pos[EV_COUNT];
+  uint8_t count;
+  uint8_t arming;              // events asked for during the current run
+  uint64_t delay[EV_COUNT];    // and how far from its end
+};
+
+// internal exit reason: a device needs lc3_vm_run() before the next
+// instruction, the engine only stops
+enum { VM_EXIT_YIELD = -1 };
+
+// what a VM stopped with LC3_EXIT_WAIT waits for, the exit alone for KBSR
+enum { VM_WAIT_NONE = 0, VM_WAIT_KEY, VM_WAIT_GETC, VM_WAIT_IN };
+
+struct lc3_vm {
+  uint16_t *memory; // 65536 locations
+  uint16_t reg[R_COUNT];
+  int running; // the break condition
+  int exit;    // LC3_EXIT_* once running is cleared
+  int wait;    // VM_WAIT_*, the trap to finish for LC3_EXIT_WAIT
+  int dispatch;
+  int traps; // LC3_TRAPS_*
+  uint16_t psr;       // privilege and priority, the flags come from R_COND
+  uint16_t saved_ssp; // R6 of the mode not running
+  uint16_t saved_usp;
+  uint64_t instructions;
+  uint64_t cycles;
+  int timed; // cycle_cost is in use
+  uint8_t cycle_cost[16];
+  struct events events;
+  struct lc3_io io;
+  struct io_handler io_page[IO_PAGE_SIZE];
+  struct decoded *decode_cache; // allocated by the first decoded run
+  struct jit *jit;              // allocated by the first JIT run
+  struct profile *profile;      // while profiling
+  const lc3_symbols *symbols;   // names for the profile, owned by the caller
+  struct trace *trace;          // while tracing
+  struct debug *debug;          // while there are breakpoints
+  struct record *record;        // while recording or replaying
+  struct analysis *analysis;    // from lc3_vm_analyze() until it goes stale
+  struct lc3_stats *stats;      // slot in a live counters segment
+  struct code_cache *code_cache; // profiles of earlier runs on disk
+  unsigned jit_threshold;
+  int fusion; // superinstructions under LC3_DISPATCH_DECODED
+  int idle;   // idle loop skipping is on
+  int idle_check; // a KBSR read came up empty, lc3_vm_run() looks at the PC
+  int idle_backoff; // empty reads to let go by after a loop that did not fit
+  uint16_t fuse_pairs[16]; // profiled pairs: bit second opcode of word first
+  lc3_image *base; // mapped under memory, NULL for zeros
+  uint8_t page_dirty[VM_PAGES];
+  size_t out_len;
+  char out[VM_OUT_SIZE];
+};
+
+int vm_d_miss(lc3_vm *vm, const struct decoded *d);
+void vm_analysis_drop(lc3_vm *vm);
+
+// Slots have one writer, the thread running the VM: a plain load and store,
+// each atomic so a reader never sees a torn value, instead of a locked add.
+static inline void stat_add(_Atomic uint64_t *counter, uint64_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+static inline int analysis_bit(const uint64_t *bits, uint16_t address) {
+  return bits[address >> 6] >> (address & 63) & 1;
+}
+
+// the decoded engine is about to run the instruction at pc
+static inline void analysis_check(lc3_vm *vm, uint16_t pc) {
+  if (vm->analysis && !analysis_bit(vm->analysis->code, pc)) {
+    vm_analysis_drop(vm);
+  }
+}
+#if LC3_HAVE_JIT
+void vm_jit_store_hook(lc3_vm *vm, uint16_t address);
+#endif
+
+// called for every location written, keeps the code caches coherent
+static inline void store_hook(lc3_vm *vm, uint16_t address) {
+  vm->page_dirty[address / VM_PAGE_WORDS] = 1;
+  if (vm->analysis && analysis_bit(vm->analysis->code, address)) {
+    vm_analysis_drop(vm); // the program changed under it
+  }
+  if (vm->decode_cache) {
+    struct decoded *cache = vm->decode_cache;
+    if (vm->stats && cache[address].fn != vm_d_miss) {
+      stat_add(&vm->stats->invalidations, 1);
+    }
+    cache[address].fn = vm_d_miss;
+    // superinstructions starting up to two words before cover it
+    if (cache[(uint16_t)(address - 1)].len > 1) {
+      cache[(uint16_t)(address - 1)].fn = vm_d_miss;
+    }
+    if (cache[(uint16_t)(address - 2)].len > 2) {
+      cache[(uint16_t)(address - 2)].fn = vm_d_miss;
+    }
+  }
+#if LC3_HAVE_JIT
+  if (vm->jit) {
+    vm_jit_store_hook(vm, address);
+  }
+#endif
+}
+
+// sign-extending
+static inline uint16_t sign_extend(uint16_t x, int bit_count) {
+  if ((x >> (bit_count - 1)) & 1) {
+    x |= (0xFFFF << bit_count);
+  }
+  return x;
+}
+
+// The condition codes are set, based on whether the result is
+// negative, zero, or positive.
+// Only BR reads them, so instead of computing N/Z/P after every ALU and load
+// op the result itself is kept in reg[R_COND] and the flags are derived from
+// it when they are needed.
+
+// update flags: negative, zero, positive
+static inline void update_flags(lc3_vm *vm, uint16_t r) {
+  vm->reg[R_COND] = vm->reg[r];
+}
+
+// N, Z or P of the last result
+static inline uint16_t cond_flags(const lc3_vm *vm) {
+  uint16_t v = vm->reg[R_COND];
+  return FL_POS << ((v == 0) + ((v >> 15) << 1));
+}
+
+void vm_io_register(lc3_vm *vm, uint16_t address, io_read_fn read,
+                    io_write_fn write);
+uint16_t vm_io_read(lc3_vm *vm, uint16_t address);
+void vm_io_write(lc3_vm *vm, uint16_t address, uint16_t val);
+
+// execution trace, see trace.c
+struct trace_raw {
+  uint16_t pc;
+  uint16_t instr;
+  uint16_t value; // the register named by bits 11:9 afterwards
+  uint16_t cond;  // R_COND, the last result
+};
+
+struct trace {
+  struct trace_raw *ring; // record k in ring[k & mask]
+  uint64_t mask;
+  _Atomic uint64_t recorded;
+  uint64_t origin; // instructions retired before record 0
+  // lc3_vm_write_trace() encodes into these, so it needs no allocation
+  uint8_t *chunk;
+  uint32_t gen;
+  uint32_t *tag;  // gen << 16 | the instruction recorded last at each PC
+  uint16_t *last; // and its value
+  int has_break;
+  uint16_t break_pc;
+  uint64_t break_hit; // instruction count of the last stop, to resume from
+};
+
+// the engine keeps the count in a local for a whole run, so that stores to
+// the ring do not make it reload it
+static inline uint64_t trace_begin(const struct trace *t) {
+  return atomic_load_explicit(&t->recorded, memory_order_relaxed);
+}
+
+static inline void trace_record(struct trace *t, uint64_t *recorded,
+                                const lc3_vm *vm, uint16_t pc,
+                                uint16_t instr) {
+  t->ring[*recorded & t->mask] = (struct trace_raw){
+      pc, instr, vm->reg[(instr >> 9) & 0x7], vm->reg[R_COND]};
+  atomic_store_explicit(&t->recorded, ++*recorded, memory_order_release);
+}
+
+// instruction fetch, never reaches a device
+static inline uint16_t mem_fetch(const lc3_vm *vm, uint16_t address) {
+  return vm->memory[address];
+}
+
+// ordinary RAM, the caller knows address is below IO_PAGE
+static inline uint16_t mem_read_ram(const lc3_vm *vm, uint16_t address) {
+  return vm->memory[address];
+}
+
+static inline void mem_write_ram(lc3_vm *vm, uint16_t address, uint16_t val) {
+  vm->memory[address] = val;
+  store_hook(vm, address);
+}
+
+static inline uint16_t mem_read(lc3_vm *vm, uint16_t address) {
+  if (address >= IO_PAGE) {
+    return vm_io_read(vm, address);
+  }
+  return vm->memory[address];
+}
+
+static inline void mem_write(lc3_vm *vm, uint16_t address, uint16_t val) {
+  if (address >= IO_PAGE) {
+    vm_io_write(vm, address, val);
+    return;
+  }
+  mem_write_ram(vm, address, val);
+}
+
+// instruction handlers, see vm.c
+void vm_ADD(lc3_vm *vm, uint16_t instr);
+void vm_AND(lc3_vm *vm, uint16_t instr);
+void vm_NOT(lc3_vm *vm, uint16_t instr);
+void vm_BR(lc3_vm *vm, uint16_t instr);
+void vm_JMP(lc3_vm *vm, uint16_t instr);
+void vm_JSR(lc3_vm *vm, uint16_t instr);
+void vm_LD(lc3_vm *vm, uint16_t instr);
+void vm_LDI(lc3_vm *vm, uint16_t instr);
+void vm_LDR(lc3_vm *vm, uint16_t instr);
+void vm_LEA(lc3_vm *vm, uint16_t instr);
+void vm_ST(lc3_vm *vm, uint16_t instr);
+void vm_STI(lc3_vm *vm, uint16_t instr);
+void vm_STR(lc3_vm *vm, uint16_t instr);
+
+// execute trap
+void vm_TRAP(lc3_vm *vm, uint16_t instr);
+// return from interrupt and the reserved opcode
+void vm_RTI(lc3_vm *vm);
+void vm_RES(lc3_vm *vm);
+
+// the whole PSR, and the interrupt or exception `vector` taken at priority
+uint16_t vm_psr(const lc3_vm *vm);
+void vm_interrupt(lc3_vm *vm, uint8_t vector, uint16_t priority);
+
+// all of memory changed at once
+void vm_invalidate_all(lc3_vm *vm);
+
+// shared images, see image.c
+// vm_map_base maps image, or zeros for NULL, over all of memory and makes it
+// the base of the VM.
+const uint16_t *vm_image_words(const lc3_image *image);
+uint64_t vm_image_hash(const lc3_image *image);
+int vm_map_base(lc3_vm *vm, lc3_image *image);
+
+// image loading, see vm.c
+void vm_load_words(lc3_vm *vm, uint16_t origin, const uint16_t *words,
+                   size_t count);
+
+// the machine stopped, for HALT or an illegal instruction
+void vm_stop(lc3_vm *vm, int exit);
+// end the current engine run after this instruction
+void vm_yield(lc3_vm *vm);
+// the instruction count lc3_vm_run() ends the engine run at, for the next
+// device event or checkpoint
+uint64_t vm_next_stop(const lc3_vm *vm);
+
+// device events and interrupts, see events.c
+// vm_event_after() may be called from device handlers in the middle of a run,
+// the event is scheduled `delay` instructions after that run ends, which is
+// right after the calling instruction.
+void vm_event_after(lc3_vm *vm, int event, uint64_t delay);
+void vm_event_cancel(lc3_vm *vm, int event);
+uint64_t vm_event_next(const lc3_vm *vm);
+void vm_events_clear(lc3_vm *vm);
+void vm_events_commit(lc3_vm *vm);
+void vm_events_run(lc3_vm *vm);
+// absolute times, for snapshots; vm_event_when() is 0 when it is not scheduled
+void vm_event_at(lc3_vm *vm, int event, uint64_t when);
+int vm_event_when(const lc3_vm *vm, int event, uint64_t *when);
+void vm_interrupts_deliver(lc3_vm *vm);
+void vm_keyboard_latch(lc3_vm *vm);
+void vm_timer_init(lc3_vm *vm);
+
+// engines, each returns the number of instructions it retired
+uint64_t vm_run_switch(lc3_vm *vm, uint64_t budget);
+uint64_t vm_run_timed(lc3_vm *vm, uint64_t budget);
+int vm_decode_init(lc3_vm *vm);
+void vm_decode_free(lc3_vm *vm);
+void vm_decode(lc3_vm *vm, uint16_t pc, struct decoded *d);
+void vm_fuse(lc3_vm *vm, uint16_t pc);
+int vm_fuse_select(lc3_vm *vm, const uint64_t counts[16 * 16], int pairs);
+void vm_decode_invalidate_all(lc3_vm *vm);
+uint64_t vm_run_decoded(lc3_vm *vm, uint64_t budget);
+void vm_profile_free(lc3_vm *vm);
+uint64_t vm_run_profile(lc3_vm *vm, uint64_t budget);
+void vm_trace_free(lc3_vm *vm);
+uint64_t vm_run_trace(lc3_vm *vm, uint64_t budget);
+int vm_write_all(int fd, const void *buf, size_t n);
+
+// breakpoints, see debug.c
+struct debug {
+  uint64_t bits[(UINT16_MAX + 1) / 64];
+  uint32_t count;
+  uint64_t resume; // instruction count a run may go past a breakpoint at
+};
+
+void vm_debug_free(lc3_vm *vm);
+uint64_t vm_run_debug(lc3_vm *vm, uint64_t budget);
+
+// live counters, see stats.c
+void vm_stats_release(lc3_vm *vm);
+
+// persistent code cache, see codecache.c
+// key is the hash of the memory the profile describes, taken by the first
+// lc3_vm_run() after it was loaded, 0 until then.
+struct code_cache {
+  char dir[4096];
+  uint64_t key;
+};
+
+void vm_code_cache_attach(lc3_vm *vm);
+// the memory is about to be replaced: save, and attach again on the next run
+void vm_code_cache_detach(lc3_vm *vm);
+void vm_code_cache_free(lc3_vm *vm);
+
+// record and replay, see replay.c
+// `next` is the instruction count lc3_vm_run() takes the next checkpoint at,
+// UINT64_MAX while replaying.
+struct checkpoint {
+  uint64_t instructions;
+  uint64_t inputs; // log entries before it
+};
+
+struct record {
+  struct lc3_io io; // the backend underneath, for the output and the input
+  char dir[4096];
+  int replaying;
+  uint64_t interval;
+  uint64_t next;
+  uint64_t last;   // the last checkpoint taken
+  uint64_t inputs; // entries logged
+  uint32_t run;    // empty polls not logged yet, or left of the current entry
+  int failed;      // a write failed, the recording is incomplete
+  FILE *input;
+  FILE *index;
+  // replaying: the mapped log and the checkpoints
+  void *map;
+  size_t map_size;
+  const uint16_t *log;
+  size_t count;
+  size_t pos;
+  int diverged;
+  struct checkpoint *checkpoints;
+  size_t checkpoint_count;
+};
+
+void vm_record_free(lc3_vm *vm);
+void vm_record_checkpoint(lc3_vm *vm);
+int vm_replay_seek(lc3_vm *vm, uint64_t target);
+#if LC3_HAVE_JIT
+int vm_jit_init(lc3_vm *vm);
+void vm_jit_free(lc3_vm *vm);
+void vm_jit_reset(lc3_vm *vm);
+uint64_t vm_run_jit(lc3_vm *vm, uint64_t budget);
+// compile the blocks entered at the addresses set in the bitmap; list those
+// compiled now, 0 when there are none
+void vm_jit_warm(lc3_vm *vm, const uint64_t *entries, int words);
+int vm_jit_entries(const lc3_vm *vm, uint64_t *entries, int words);
+#endif
+
+// symbol tables, see symbols.c
+// vm_symbols_add() keeps the first address of a name defined twice,
+// vm_symbols_append() copies every symbol of `from` and sorts the table for
+// lc3_symbols_near().
+long vm_symbols_find(const lc3_symbols *s, const char *name, size_t len);
+int vm_symbols_lookup(const lc3_symbols *s, const char *name, size_t len,
+                      uint16_t *address);
+int vm_symbols_add(lc3_symbols *s, const char *name, size_t len,
+                   uint16_t address);
+int vm_symbols_append(lc3_symbols *s, const lc3_symbols *from);
+
+// string and image kernels, see strings.c
+extern size_t (*vm_narrow_words)(const uint16_t *src, size_t n, char *dst);
+extern size_t (*vm_unpack_words)(const uint16_t *src, size_t n, char *dst,
+                                 size_t *out);
+extern void (*vm_swap_words)(uint16_t *dst, const uint8_t *src, size_t n);
+void vm_strings_init(void);
+
+#endif
@@ -0,0 +1,594 @@
+// batch runner: many guests in one process, spread over all cores
+//
+// lc3-batch [--dispatch=ENGINE] [--threads=N] [--slice=N] [--budget=N]
+//           [--input=FILE] [--manifest=FILE] [--results=FILE] [--obj-cache]
+//           [--lockstep] [--stats=NAME] [--code-cache=DIR] [image ...]
+//
+// Every job is an image plus an optional keyboard input file and runs in its
+// own VM. Jobs come from the manifest, one `image [input]` per line (blank
+// lines and lines starting with # are skipped), and from the image arguments,
+// which all get the --input file. Every distinct image is converted once and
+// shared by all guests running it, copy-on-write; --obj-cache keeps the
+// converted image next to it as <image>.cache for the next run.
+//
+// Worker threads (one per core unless --threads is given) run their guests in
+// time slices of --slice instructions, round robin, so a long-running guest
+// only delays a short one by a slice. A worker keeps at most WORKER_ACTIVE
+// guests started; it starts the next job from the manifest when it has room,
+// and otherwise, when its own queue is empty, steals a started guest from
+// another worker.
+//
+// With --lockstep a worker instead takes the next LC3_LOCKSTEP_LANES jobs of
+// the manifest at once and runs them to the end with lc3_vm_run_lockstep(),
+// their registers side by side in SIMD vectors; jobs of the same image next to
+// each other in the manifest then share most instructions. There are no time
+// slices and no stealing.
+//
+// With --stats every running guest has a slot, labelled with its image, in
+// the live counters segment NAME that lc3-top shows. With --code-cache every
+// guest starts from the code cache profile in DIR that earlier guests of its
+// image left, and adds to it when it finishes.
+//
+// A guest finishes on HALT, an illegal instruction or after --budget
+// instructions in total. One JSON object per job is written, in manifest
+// order, to stdout or --results:
+//
+//   {"image":"a.obj","exit":"halt","instructions":145,"output_bytes":53,
+//    "output_hash":"af63bd4c8601b7df"}
+//
+// output_hash is the 64-bit FNV-1a hash of everything the guest printed.
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* unix */
+#include <unistd.h>
+
+#include "lc3.h"
+
+enum { WORKER_ACTIVE = 8 }; // started guests per worker
+
+// of a --stats segment, the same in lc3-host so both can share one
+enum { STATS_SLOTS = 4096 };
+
+// results that are not an LC3_EXIT_* reason
+enum { EXIT_NOT_RUN = -1, EXIT_LOAD_FAILED = -2 };
+
+struct job {
+  const char *image;
+  const char *input_path;
+  lc3_image *shared; // NULL when the image cannot be opened
+  // while running
+  lc3_vm *vm;
+  char *input;
+  size_t input_len;
+  size_t input_pos;
+  uint64_t hash;
+  uint64_t output_bytes;
+  struct job *next; // in a worker queue
+  // result
+  int exit;
+  uint64_t instructions;
+};
+
+// started guests of one worker, taken from the front and requeued at the back
+// after each slice; thieves also take from the front, the longest waiting
+struct queue {
+  pthread_mutex_t lock;
+  struct job *head;
+  struct job *tail;
+  int count;
+};
+
+struct batch {
+  struct job *jobs;
+  size_t job_count;
+  _Atomic size_t next_job; // next job nobody has started
+  _Atomic size_t done;
+  int dispatch;
+  int lockstep;
+  uint64_t slice;
+  uint64_t budget;
+  int workers;
+  struct queue *queues;
+  lc3_stats_segment *stats; // NULL without --stats
+  const char *code_cache;   // NULL without --code-cache
+};
+
+struct worker {
+  struct batch *batch;
+  int id;
+};
+
+void queue_push(struct queue *q, struct job *job) {
+  pthread_mutex_lock(&q->lock);
+  job->next = NULL;
+  if (q->tail) {
+    q->tail->next = job;
+  } else {
+    q->head = job;
+  }
+  q->tail = job;
+  q->count++;
+  pthread_mutex_unlock(&q->lock);
+}
+
+struct job *queue_pop(struct queue *q) {
+  pthread_mutex_lock(&q->lock);
+  struct job *job = q->head;
+  if (job) {
+    q->head = job->next;
+    if (!q->head) {
+      q->tail = NULL;
+    }
+    q->count--;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return job;
+}
+
+int queue_count(struct queue *q) {
+  pthread_mutex_lock(&q->lock);
+  int count = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return count;
+}
+
+// guest I/O: input from the job's file, output only hashed and counted
+int job_getc(void *ctx) {
+  struct job *job = ctx;
+  if (job->input_pos == job->input_len) {
+    return -1;
+  }
+  return (unsigned char)job->input[job->input_pos++];
+}
+
+int job_poll(void *ctx) {
+  struct job *job = ctx;
+  return job->input_pos < job->input_len;
+}
+
+void job_write(void *ctx, const char *buf, size_t n) {
+  struct job *job = ctx;
+  uint64_t hash = job->hash;
+  for (size_t i = 0; i < n; i++) {
+    hash = (hash ^ (unsigned char)buf[i]) * 0x100000001b3ull;
+  }
+  job->hash = hash;
+  job->output_bytes += n;
+}
+
+void job_flush(void *ctx) {}
+
+// whole file in a heap buffer, NULL when it cannot be read
+char *read_file(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  size_t cap = 4096;
+  size_t len = 0;
+  char *buf = malloc(cap);
+  size_t n;
+  while (buf && (n = fread(buf + len, 1, cap - len, file)) > 0) {
+    len += n;
+    if (len == cap) {
+      cap *= 2;
+      char *grown = realloc(buf, cap);
+      if (!grown) {
+        free(buf);
+      }
+      buf = grown;
+    }
+  }
+  fclose(file);
+  *size = len;
+  return buf;
+}
+
+void job_finish(struct batch *batch, struct job *job, int exit) {
+  job->exit = exit;
+  if (job->vm) {
+    job->instructions = lc3_vm_instructions(job->vm);
+    lc3_vm_destroy(job->vm);
+    job->vm = NULL;
+  }
+  free(job->input);
+  job->input = NULL;
+  atomic_fetch_add(&batch->done, 1);
+}
+
+// create the guest of a job, NULL when the job already failed
+struct job *job_start(struct batch *batch, struct job *job) {
+  job->hash = 0xcbf29ce484222325ull;
+  job->vm = lc3_vm_create();
+  if (!job->vm || !job->shared || !lc3_vm_map_image(job->vm, job->shared)) {
+    job_finish(batch, job, EXIT_LOAD_FAILED);
+    return NULL;
+  }
+  if (job->input_path) {
+    job->input = read_file(job->input_path, &job->input_len);
+    if (!job->input) {
+      job_finish(batch, job, EXIT_LOAD_FAILED);
+      return NULL;
+    }
+  }
+  if (batch->dispatch >= 0) {
+    lc3_vm_set_dispatch(job->vm, batch->dispatch);
+  }
+  if (batch->stats) {
+    lc3_vm_set_stats(job->vm, batch->stats, job->image);
+  }
+  if (batch->code_cache) {
+    lc3_vm_set_code_cache(job->vm, batch->code_cache);
+  }
+  struct lc3_io io = {job, job_getc, job_poll, job_write, job_flush};
+  lc3_vm_set_io(job->vm, &io);
+  return job;
+}
+
+// a started job from another worker
+struct job *steal(struct batch *batch, int self) {
+  for (int i = 1; i < batch->workers; i++) {
+    struct job *job = queue_pop(&batch->queues[(self + i) % batch->workers]);
+    if (job) {
+      return job;
+    }
+  }
+  return NULL;
+}
+
+void *worker_main(void *arg) {
+  struct worker *w = arg;
+  struct batch *batch = w->batch;
+  struct queue *own = &batch->queues[w->id];
+
+  while (atomic_load(&batch->done) < batch->job_count) {
+    struct job *job = NULL;
+    if (queue_count(own) < WORKER_ACTIVE) {
+      size_t next = atomic_fetch_add(&batch->next_job, 1);
+      if (next < batch->job_count) {
+        job = job_start(batch, &batch->jobs[next]);
+        if (!job) {
+          continue;
+        }
+      }
+    }
+    if (!job) {
+      job = queue_pop(own);
+    }
+    if (!job) {
+      job = steal(batch, w->id);
+    }
+    if (!job) {
+      // the remaining guests are all running on other workers
+      struct timespec pause = {0, 100000};
+      nanosleep(&pause, NULL);
+      continue;
+    }
+
+    uint64_t slice = batch->slice;
+    uint64_t left = batch->budget - lc3_vm_instructions(job->vm);
+    int exit = lc3_vm_run(job->vm, slice < left ? slice : left);
+    if (exit != LC3_EXIT_BUDGET ||
+        lc3_vm_instructions(job->vm) >= batch->budget) {
+      job_finish(batch, job, exit);
+    } else {
+      queue_push(own, job);
+    }
+  }
+  return NULL;
+}
+
+// --lockstep: jobs first to first + LC3_LOCKSTEP_LANES, as one group
+void lockstep_block(struct batch *batch, size_t first) {
+  lc3_vm *vms[LC3_LOCKSTEP_LANES];
+  struct job *jobs[LC3_LOCKSTEP_LANES];
+  int exits[LC3_LOCKSTEP_LANES];
+  int count = 0;
+  for (size_t i = first;
+       i < batch->job_count && i < first + LC3_LOCKSTEP_LANES; i++) {
+    struct job *job = job_start(batch, &batch->jobs[i]);
+    if (job) {
+      jobs[count] = job;
+      vms[count++] = job->vm;
+    }
+  }
+  if (count == 0) {
+    return; // every image of the block failed to load
+  }
+  lc3_vm_run_lockstep(vms, count, batch->budget, exits);
+  for (int i = 0; i < count; i++) {
+    job_finish(batch, jobs[i], exits[i]);
+  }
+}
+
+void *lockstep_main(void *arg) {
+  struct worker *w = arg;
+  struct batch *batch = w->batch;
+  for (;;) {
+    size_t first = atomic_fetch_add(&batch->next_job, LC3_LOCKSTEP_LANES);
+    if (first >= batch->job_count) {
+      return NULL;
+    }
+    lockstep_block(batch, first);
+  }
+}
+
+void add_job(struct batch *batch, size_t *cap, const char *image,
+             const char *input) {
+  if (batch->job_count == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    batch->jobs = realloc(batch->jobs, *cap * sizeof(struct job));
+    if (!batch->jobs) {
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+  struct job *job = &batch->jobs[batch->job_count++];
+  memset(job, 0, sizeof(*job));
+  job->image = image;
+  job->input_path = input;
+  job->exit = EXIT_NOT_RUN;
+}
+
+// manifest lines are `image [input]`, the strings are kept for the whole run
+int read_manifest(struct batch *batch, size_t *cap, const char *path) {
+  size_t size;
+  char *text = read_file(path, &size);
+  if (!text) {
+    return 0;
+  }
+  char *line = text;
+  char *end = text + size;
+  while (line < end) {
+    char *eol = memchr(line, '\n', end - line);
+    if (!eol) {
+      eol = end;
+    }
+    *eol = '\0';
+    char *save;
+    char *image = strtok_r(line, " \t\r", &save);
+    if (image && image[0] != '#') {
+      add_job(batch, cap, image, strtok_r(NULL, " \t\r", &save));
+    }
+    line = eol + 1;
+  }
+  return 1;
+}
+
+// open every distinct image once
+// Open addressing on the path; the table owns the images.
+struct image_table {
+  const char **paths;
+  lc3_image **images;
+  size_t size; // power of two, at least twice the number of jobs
+};
+
+void open_images(struct image_table *t, struct batch *batch, int flags) {
+  t->size = 16;
+  while (t->size < 2 * batch->job_count) {
+    t->size *= 2;
+  }
+  t->paths = calloc(t->size, sizeof(*t->paths));
+  t->images = calloc(t->size, sizeof(*t->images));
+  if (!t->paths || !t->images) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < batch->job_count; i++) {
+    struct job *job = &batch->jobs[i];
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const char *c = job->image; *c; c++) {
+      hash = (hash ^ (unsigned char)*c) * 0x100000001b3ull;
+    }
+    size_t slot = hash & (t->size - 1);
+    while (t->paths[slot] && strcmp(t->paths[slot], job->image) != 0) {
+      slot = (slot + 1) & (t->size - 1);
+    }
+    if (!t->paths[slot]) {
+      t->paths[slot] = job->image;
+      t->images[slot] = lc3_image_open(job->image, flags);
+    }
+    job->shared = t->images[slot];
+  }
+}
+
+void close_images(struct image_table *t) {
+  for (size_t i = 0; i < t->size; i++) {
+    lc3_image_close(t->images[i]);
+  }
+  free(t->paths);
+  free(t->images);
+}
+
+int parse_dispatch(const char *name) {
+  static const char *const names[] = {"switch", "threaded", "decoded", "jit"};
+  for (int i = 0; i < 4; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char *exit_name(int exit) {
+  switch (exit) {
+  case LC3_EXIT_BUDGET:
+    return "budget";
+  case LC3_EXIT_HALT:
+    return "halt";
+  case LC3_EXIT_ILLEGAL:
+    return "illegal";
+  case EXIT_LOAD_FAILED:
+    return "load_failed";
+  }
+  return "not_run";
+}
+
+void write_json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, const char *argv[]) {
+  struct batch batch = {.dispatch = -1,
+                        .slice = 1000000,
+                        .budget = LC3_RUN_FOREVER};
+  size_t cap = 0;
+  const char *input = NULL;
+  const char *results = NULL;
+  const char *stats = NULL;
+  int image_flags = 0;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--dispatch=", 11) == 0) {
+      batch.dispatch = parse_dispatch(argv[i] + 11);
+      if (batch.dispatch < 0) {
+        printf("unknown dispatch engine: %s\n", argv[i] + 11);
+        exit(2);
+      }
+      continue;
+    }
+    if (strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = atol(argv[i] + 10);
+      continue;
+    }
+    if (strncmp(argv[i], "--slice=", 8) == 0) {
+      batch.slice = strtoull(argv[i] + 8, NULL, 10);
+      continue;
+    }
+    if (strncmp(argv[i], "--budget=", 9) == 0) {
+      batch.budget = strtoull(argv[i] + 9, NULL, 10);
+      continue;
+    }
+    if (strncmp(argv[i], "--input=", 8) == 0) {
+      input = argv[i] + 8;
+      continue;
+    }
+    if (strncmp(argv[i], "--results=", 10) == 0) {
+      results = argv[i] + 10;
+      continue;
+    }
+    if (strcmp(argv[i], "--obj-cache") == 0) {
+      image_flags |= LC3_IMAGE_CACHE;
+      continue;
+    }
+    if (strcmp(argv[i], "--lockstep") == 0) {
+      batch.lockstep = 1;
+      continue;
+    }
+    if (strncmp(argv[i], "--stats=", 8) == 0) {
+      stats = argv[i] + 8;
+      continue;
+    }
+    if (strncmp(argv[i], "--code-cache=", 13) == 0) {
+      batch.code_cache = argv[i] + 13;
+      continue;
+    }
+    if (strncmp(argv[i], "--manifest=", 11) == 0) {
+      if (!read_manifest(&batch, &cap, argv[i] + 11)) {
+        printf("failed to read manifest: %s\n", argv[i] + 11);
+        exit(1);
+      }
+      continue;
+    }
+    add_job(&batch, &cap, argv[i], input);
+  }
+
+  // show usage string
+  if (batch.job_count == 0) {
+    printf("lc3-batch [--dispatch=switch|threaded|decoded|jit] [--threads=N] "
+           "[--slice=N] [--budget=N] [--input=FILE] [--manifest=FILE] "
+           "[--results=FILE] [--obj-cache] [--lockstep] [--stats=NAME] "
+           "[--code-cache=DIR] [image ...]\n");
+    exit(2);
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (batch.slice == 0) {
+    batch.slice = 1;
+  }
+  FILE *out = results ? fopen(results, "w") : stdout;
+  if (!out) {
+    printf("failed to open results: %s\n", results);
+    exit(1);
+  }
+
+  if (stats) {
+    batch.stats = lc3_stats_create(stats, STATS_SLOTS);
+    if (!batch.stats) {
+      printf("failed to open counters segment: %s\n", stats);
+      exit(1);
+    }
+  }
+
+  double start = now();
+  struct image_table images;
+  open_images(&images, &batch, image_flags);
+
+  batch.workers = threads;
+  batch.queues = calloc(threads, sizeof(struct queue));
+  struct worker *workers = calloc(threads, sizeof(struct worker));
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+  if (!batch.queues || !workers || !tids) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_mutex_init(&batch.queues[i].lock, NULL);
+    workers[i].batch = &batch;
+    workers[i].id = i;
+    pthread_create(&tids[i], NULL, batch.lockstep ? lockstep_main : worker_main,
+                   &workers[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  double elapsed = now() - start;
+  close_images(&images);
+  lc3_stats_close(batch.stats);
+
+  int failed = 0;
+  uint64_t instructions = 0;
+  for (size_t i = 0; i < batch.job_count; i++) {
+    struct job *job = &batch.jobs[i];
+    fputs("{\"image\":", out);
+    write_json_string(out, job->image);
+    fprintf(out,
+            ",\"exit\":\"%s\",\"instructions\":%llu,\"output_bytes\":%llu,"
+            "\"output_hash\":\"%016llx\"}\n",
+            exit_name(job->exit), (unsigned long long)job->instructions,
+            (unsigned long long)job->output_bytes,
+            (unsigned long long)job->hash);
+    failed |= job->exit == LC3_EXIT_ILLEGAL || job->exit == EXIT_LOAD_FAILED;
+    instructions += job->instructions;
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+  fprintf(stderr, "%zu jobs, %ld threads, %.3f s, %.0f jobs/s, %.1f MIPS\n",
+          batch.job_count, threads, elapsed, batch.job_count / elapsed,
+          instructions / elapsed / 1e6);
+  return failed;
+}
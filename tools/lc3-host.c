@@ -0,0 +1,471 @@
+// interactive host: one guest per TCP connection, all of them in one thread
+//
+// lc3-host [--listen=[ADDR:]PORT] [--dispatch=ENGINE] [--slice=N]
+//          [--budget=N] [--obj-cache] [--stats=NAME] image
+//
+// Every connection gets its own VM running the image, which is converted once
+// and mapped copy-on-write into all of them. What the client sends is the
+// keyboard, what the guest prints is sent back, byte for byte: a raw TCP
+// terminal, `nc 127.0.0.1 2323` or telnet in character mode.
+//
+// The guests run with LC3_IO_NONBLOCK. One that reads input nobody typed yet,
+// with GETC, IN or by polling KBSR, stops with LC3_EXIT_WAIT and is not run
+// again until its socket becomes readable, so an idle session costs its
+// memory and nothing else. The others take turns of --slice instructions,
+// round robin; between turns the sockets are checked without blocking, and
+// the loop only sleeps in epoll_wait() when every guest waits.
+//
+// Output goes out after every turn. A guest with more than OUTPUT_MAX bytes
+// its client has not taken yet is held back until the socket drains. A
+// session ends on HALT, an illegal instruction or after --budget instructions,
+// once its output is sent, and right away when the client hangs up.
+//
+// With --stats every session has a slot, labelled with its number and
+// client address, in the live counters segment NAME that lc3-top shows.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "lc3.h"
+
+enum {
+  INPUT_MAX = 4096,     // bytes read from a client at a time
+  OUTPUT_MAX = 1 << 16, // unsent bytes before a guest is held back
+  EVENTS_MAX = 256,     // epoll events taken per wait
+  STATS_SLOTS = 4096,   // of a --stats segment, as in lc3-batch
+};
+
+enum {
+  S_QUEUED,  // in the run queue
+  S_WAITING, // stopped with LC3_EXIT_WAIT, until the socket is readable
+  S_HELD,    // too much unsent output, until the socket is writable
+  S_DONE,    // finished, until its output is sent
+};
+
+struct session {
+  int fd;
+  int id;
+  int state;
+  int hangup;     // the client closed or reset the connection
+  int want_write; // EPOLLOUT is on
+  int exit;
+  lc3_vm *vm;
+  unsigned char in[INPUT_MAX];
+  size_t in_pos;
+  size_t in_len;
+  char *out;
+  size_t out_len; // bytes in out
+  size_t out_put; // of them sent
+  size_t out_cap;
+  struct session *next; // in the run queue
+};
+
+struct host {
+  int epoll;
+  int listener;
+  int dispatch;
+  uint64_t slice;
+  uint64_t budget;
+  lc3_image *image;
+  lc3_stats_segment *stats; // NULL without --stats
+  struct session *head;     // run queue
+  struct session *tail;
+  int sessions;
+  int next_id;
+};
+
+void run_queue_push(struct host *h, struct session *s) {
+  s->state = S_QUEUED;
+  s->next = NULL;
+  if (h->tail) {
+    h->tail->next = s;
+  } else {
+    h->head = s;
+  }
+  h->tail = s;
+}
+
+struct session *run_queue_pop(struct host *h) {
+  struct session *s = h->head;
+  if (s) {
+    h->head = s->next;
+    if (!h->head) {
+      h->tail = NULL;
+    }
+  }
+  return s;
+}
+
+// guest I/O
+// --------------------------------------------------
+
+// the socket is only read when the buffer is empty, without blocking
+int session_poll(void *ctx) {
+  struct session *s = ctx;
+  if (s->in_pos < s->in_len) {
+    return 1;
+  }
+  if (s->hangup) {
+    return 0;
+  }
+  ssize_t n = recv(s->fd, s->in, sizeof(s->in), MSG_DONTWAIT);
+  if (n > 0) {
+    s->in_pos = 0;
+    s->in_len = n;
+    return 1;
+  }
+  if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    s->hangup = 1;
+  }
+  return 0;
+}
+
+// only called once poll was nonzero
+int session_getc(void *ctx) {
+  struct session *s = ctx;
+  if (s->in_pos == s->in_len) {
+    return -1;
+  }
+  return s->in[s->in_pos++];
+}
+
+void session_write(void *ctx, const char *buf, size_t n) {
+  struct session *s = ctx;
+  if (s->out_len + n > s->out_cap) {
+    size_t cap = s->out_cap ? s->out_cap : 4096;
+    while (cap < s->out_len + n) {
+      cap *= 2;
+    }
+    char *grown = realloc(s->out, cap);
+    if (!grown) {
+      s->hangup = 1; // nothing sensible to send any more
+      return;
+    }
+    s->out = grown;
+    s->out_cap = cap;
+  }
+  memcpy(s->out + s->out_len, buf, n);
+  s->out_len += n;
+}
+
+// output goes out after every turn anyway
+void session_flush(void *ctx) {}
+
+// sessions
+// --------------------------------------------------
+
+void session_watch(struct host *h, struct session *s, int want_write) {
+  if (s->want_write == want_write) {
+    return;
+  }
+  struct epoll_event ev = {EPOLLIN | EPOLLRDHUP | EPOLLET, {.ptr = s}};
+  if (want_write) {
+    ev.events |= EPOLLOUT;
+  }
+  epoll_ctl(h->epoll, EPOLL_CTL_MOD, s->fd, &ev);
+  s->want_write = want_write;
+}
+
+// as much of the output as the socket takes
+void session_send(struct host *h, struct session *s) {
+  while (s->out_put < s->out_len) {
+    ssize_t n = send(s->fd, s->out + s->out_put, s->out_len - s->out_put,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        s->hangup = 1;
+      }
+      break;
+    }
+    s->out_put += n;
+  }
+  if (s->out_put == s->out_len) {
+    s->out_put = s->out_len = 0;
+  }
+  session_watch(h, s, s->out_len > 0 && !s->hangup);
+}
+
+const char *exit_name(int exit) {
+  switch (exit) {
+  case LC3_EXIT_BUDGET:
+    return "budget";
+  case LC3_EXIT_HALT:
+    return "halt";
+  case LC3_EXIT_ILLEGAL:
+    return "illegal";
+  }
+  return "hangup";
+}
+
+void session_close(struct host *h, struct session *s) {
+  fprintf(stderr, "session %d: %s, %llu instructions\n", s->id,
+          exit_name(s->exit),
+          (unsigned long long)lc3_vm_instructions(s->vm));
+  close(s->fd); // also takes it out of the epoll set
+  lc3_vm_destroy(s->vm);
+  free(s->out);
+  free(s);
+  h->sessions--;
+}
+
+void session_open(struct host *h, int fd, const struct sockaddr_in *peer) {
+  struct session *s = calloc(1, sizeof(*s));
+  lc3_vm *vm = lc3_vm_create();
+  if (!s || !vm || !lc3_vm_map_image(vm, h->image)) {
+    free(s);
+    lc3_vm_destroy(vm);
+    close(fd);
+    return;
+  }
+  s->fd = fd;
+  s->id = h->next_id++;
+  s->vm = vm;
+  s->exit = -1;
+  if (h->dispatch >= 0) {
+    lc3_vm_set_dispatch(vm, h->dispatch);
+  }
+  if (h->stats) {
+    char label[64];
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &peer->sin_addr, addr, sizeof(addr));
+    snprintf(label, sizeof(label), "session %d %s:%d", s->id, addr,
+             ntohs(peer->sin_port));
+    lc3_vm_set_stats(vm, h->stats, label);
+  }
+  struct lc3_io io = {s,           session_getc,  session_poll,
+                      session_write, session_flush, LC3_IO_NONBLOCK};
+  lc3_vm_set_io(vm, &io);
+  struct epoll_event ev = {EPOLLIN | EPOLLRDHUP | EPOLLET, {.ptr = s}};
+  if (epoll_ctl(h->epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    lc3_vm_destroy(vm);
+    free(s);
+    close(fd);
+    return;
+  }
+  int one = 1; // keystrokes and echoes are single bytes
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  h->sessions++;
+  run_queue_push(h, s);
+}
+
+void accept_all(struct host *h) {
+  for (;;) {
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    int fd = accept4(h->listener, (struct sockaddr *)&peer, &len,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return; // EAGAIN, or out of descriptors until a session ends
+    }
+    session_open(h, fd, &peer);
+  }
+}
+
+// one turn of a queued guest
+void session_turn(struct host *h, struct session *s) {
+  uint64_t left = h->budget - lc3_vm_instructions(s->vm);
+  int exit = lc3_vm_run(s->vm, h->slice < left ? h->slice : left);
+  session_send(h, s);
+  if (s->hangup) {
+    session_close(h, s);
+    return;
+  }
+  if (exit == LC3_EXIT_WAIT) {
+    s->state = S_WAITING;
+  } else if (exit != LC3_EXIT_BUDGET ||
+             lc3_vm_instructions(s->vm) >= h->budget) {
+    s->exit = exit;
+    s->state = S_DONE;
+  } else if (s->out_len - s->out_put > OUTPUT_MAX) {
+    s->state = S_HELD;
+  } else {
+    run_queue_push(h, s);
+  }
+  if (s->state == S_DONE && s->out_len == 0) {
+    session_close(h, s);
+  }
+}
+
+void session_event(struct host *h, struct session *s, uint32_t events) {
+  if (events & EPOLLOUT) {
+    session_send(h, s);
+  }
+  if (events & (EPOLLHUP | EPOLLERR)) {
+    s->hangup = 1;
+  }
+  // a queued guest reads the socket itself when it runs; waiting guests are
+  // queued for the input, or to find out it was a hangup
+  if (s->hangup && s->state != S_QUEUED) {
+    session_close(h, s);
+  } else if (s->state == S_WAITING && (events & (EPOLLIN | EPOLLRDHUP))) {
+    run_queue_push(h, s);
+  } else if (s->state == S_HELD && s->out_len - s->out_put <= OUTPUT_MAX) {
+    run_queue_push(h, s);
+  } else if (s->state == S_DONE && s->out_len == 0) {
+    session_close(h, s);
+  }
+}
+
+// --------------------------------------------------
+
+// [ADDR:]PORT, IPv4
+int open_listener(const char *spec) {
+  struct sockaddr_in addr = {.sin_family = AF_INET};
+  char host[64] = "127.0.0.1";
+  const char *port = spec;
+  const char *colon = strrchr(spec, ':');
+  if (colon) {
+    if ((size_t)(colon - spec) >= sizeof(host)) {
+      return -1;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = 0;
+    port = colon + 1;
+  }
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    return -1;
+  }
+  addr.sin_port = htons((uint16_t)atoi(port));
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int parse_dispatch(const char *name) {
+  static const char *const names[] = {"switch", "threaded", "decoded", "jit"};
+  for (int i = 0; i < 4; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int main(int argc, const char *argv[]) {
+  struct host h = {.dispatch = -1,
+                   .slice = 100000,
+                   .budget = LC3_RUN_FOREVER};
+  const char *listen_spec = "2323";
+  const char *image = NULL;
+  const char *stats = NULL;
+  int image_flags = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--listen=", 9) == 0) {
+      listen_spec = argv[i] + 9;
+      continue;
+    }
+    if (strncmp(argv[i], "--dispatch=", 11) == 0) {
+      h.dispatch = parse_dispatch(argv[i] + 11);
+      if (h.dispatch < 0) {
+        printf("unknown dispatch engine: %s\n", argv[i] + 11);
+        exit(2);
+      }
+      continue;
+    }
+    if (strncmp(argv[i], "--slice=", 8) == 0) {
+      h.slice = strtoull(argv[i] + 8, NULL, 10);
+      continue;
+    }
+    if (strncmp(argv[i], "--budget=", 9) == 0) {
+      h.budget = strtoull(argv[i] + 9, NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--obj-cache") == 0) {
+      image_flags |= LC3_IMAGE_CACHE;
+      continue;
+    }
+    if (strncmp(argv[i], "--stats=", 8) == 0) {
+      stats = argv[i] + 8;
+      continue;
+    }
+    image = argv[i];
+  }
+
+  // show usage string
+  if (!image) {
+    printf("lc3-host [--listen=[ADDR:]PORT] "
+           "[--dispatch=switch|threaded|decoded|jit] [--slice=N] "
+           "[--budget=N] [--obj-cache] [--stats=NAME] image\n");
+    exit(2);
+  }
+  if (h.slice == 0) {
+    h.slice = 1;
+  }
+  h.image = lc3_image_open(image, image_flags);
+  if (!h.image) {
+    printf("failed to load image: %s\n", image);
+    exit(1);
+  }
+  if (stats) {
+    h.stats = lc3_stats_create(stats, STATS_SLOTS);
+    if (!h.stats) {
+      printf("failed to open counters segment: %s\n", stats);
+      exit(1);
+    }
+  }
+  h.listener = open_listener(listen_spec);
+  if (h.listener < 0) {
+    printf("failed to listen on %s: %s\n", listen_spec, strerror(errno));
+    exit(1);
+  }
+  h.epoll = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {EPOLLIN, {.ptr = NULL}};
+  if (h.epoll < 0 || epoll_ctl(h.epoll, EPOLL_CTL_ADD, h.listener, &ev) < 0) {
+    printf("epoll: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  struct epoll_event events[EVENTS_MAX];
+  for (;;) {
+    int n = epoll_wait(h.epoll, events, EVENTS_MAX, h.head ? 0 : -1);
+    if (n < 0 && errno != EINTR) {
+      printf("epoll_wait: %s\n", strerror(errno));
+      exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+      if (!events[i].data.ptr) {
+        accept_all(&h);
+      } else {
+        session_event(&h, events[i].data.ptr, events[i].events);
+      }
+    }
+    // one round: each guest queued now gets a turn, those it requeues wait
+    // for the next round, after the sockets were looked at again
+    struct session *last = h.tail;
+    struct session *s;
+    while (last && (s = run_queue_pop(&h))) {
+      int was_last = s == last;
+      session_turn(&h, s);
+      if (was_last) {
+        break;
+      }
+    }
+  }
+}
@@ -0,0 +1,226 @@
+// live monitor for the counters of lc3_vm_set_stats()
+//
+// lc3-top [--interval=SECONDS] [--rows=N] [--once] NAME
+//
+// Maps the shared memory segment NAME read-only and, every --interval
+// seconds (default 1), prints one line per live VM, the busiest first:
+// instructions per second and in total, KBSR reads and output bytes per
+// second, the share of instructions served by the decode cache and by
+// compiled blocks, the invalidations and the most used trap vector. Slots of
+// processes that have died are skipped. --once prints the first table and
+// exits. Nothing is written to the segment, the VMs run on undisturbed.
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/* unix */
+#include <unistd.h>
+
+#include "lc3.h"
+
+// what one slot showed last time
+struct sample {
+  int live;
+  int32_t pid;
+  char label[56];
+  uint64_t instructions;
+  uint64_t kbsr_polls;
+  uint64_t output_bytes;
+  uint64_t decoded;
+  uint64_t jit_instructions;
+  uint64_t jit_compiles;
+  uint64_t invalidations;
+  int top_trap;
+  uint64_t top_trap_count;
+};
+
+struct row {
+  const struct sample *now;
+  double mips;
+  double polls;
+  double output;
+};
+
+void take_sample(const struct lc3_stats *s, struct sample *out) {
+  out->live = atomic_load_explicit(&s->state, memory_order_acquire) ==
+              LC3_STATS_LIVE;
+  if (!out->live) {
+    return;
+  }
+  out->pid = s->pid;
+  memcpy(out->label, s->label, sizeof(out->label));
+  out->label[sizeof(out->label) - 1] = 0;
+  if (kill(out->pid, 0) < 0 && errno == ESRCH) {
+    out->live = 0;
+    return;
+  }
+  out->instructions =
+      atomic_load_explicit(&s->instructions, memory_order_relaxed);
+  out->kbsr_polls = atomic_load_explicit(&s->kbsr_polls, memory_order_relaxed);
+  out->output_bytes =
+      atomic_load_explicit(&s->output_bytes, memory_order_relaxed);
+  out->decoded = atomic_load_explicit(&s->decoded, memory_order_relaxed);
+  out->jit_instructions =
+      atomic_load_explicit(&s->jit_instructions, memory_order_relaxed);
+  out->jit_compiles =
+      atomic_load_explicit(&s->jit_compiles, memory_order_relaxed);
+  out->invalidations =
+      atomic_load_explicit(&s->invalidations, memory_order_relaxed);
+  out->top_trap = -1;
+  out->top_trap_count = 0;
+  for (int t = 0; t < 256; t++) {
+    uint64_t n = atomic_load_explicit(&s->traps[t], memory_order_relaxed);
+    if (n > out->top_trap_count) {
+      out->top_trap = t;
+      out->top_trap_count = n;
+    }
+  }
+}
+
+// a slot freed and claimed again in between starts over
+int same_guest(const struct sample *a, const struct sample *b) {
+  return a->live && b->live && a->pid == b->pid &&
+         strcmp(a->label, b->label) == 0 && a->instructions <= b->instructions;
+}
+
+int by_mips(const void *a, const void *b) {
+  const struct row *x = a;
+  const struct row *y = b;
+  if (x->mips != y->mips) {
+    return x->mips < y->mips ? 1 : -1;
+  }
+  return x->now->instructions < y->now->instructions ? 1 : -1;
+}
+
+// a share of the instructions, "-" when there is nothing to share
+void print_share(uint64_t part, uint64_t whole) {
+  if (whole == 0) {
+    printf(" %5s", "-");
+  } else {
+    printf(" %5.1f", 100.0 * part / whole);
+  }
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, const char *argv[]) {
+  double interval = 1;
+  int rows_max = 40;
+  int once = 0;
+  const char *name = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--interval=", 11) == 0) {
+      interval = atof(argv[i] + 11);
+      continue;
+    }
+    if (strncmp(argv[i], "--rows=", 7) == 0) {
+      rows_max = atoi(argv[i] + 7);
+      continue;
+    }
+    if (strcmp(argv[i], "--once") == 0) {
+      once = 1;
+      continue;
+    }
+    name = argv[i];
+  }
+
+  // show usage string
+  if (!name) {
+    printf("lc3-top [--interval=SECONDS] [--rows=N] [--once] NAME\n");
+    exit(2);
+  }
+  if (interval <= 0) {
+    interval = 1;
+  }
+  lc3_stats_segment *seg = lc3_stats_open(name);
+  if (!seg) {
+    printf("no counters segment: %s\n", name);
+    exit(1);
+  }
+  int slots = lc3_stats_slots(seg);
+  struct sample *prev = calloc(slots, sizeof(*prev));
+  struct sample *cur = calloc(slots, sizeof(*cur));
+  struct row *rows = calloc(slots, sizeof(*rows));
+  if (!prev || !cur || !rows) {
+    printf("out of memory\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < slots; i++) {
+    take_sample(lc3_stats_slot(seg, i), &prev[i]);
+  }
+  double last = now();
+  struct timespec pause = {(time_t)interval,
+                           (long)((interval - (time_t)interval) * 1e9)};
+  for (;;) {
+    nanosleep(&pause, NULL);
+    double t = now();
+    double dt = t - last;
+    last = t;
+
+    int live = 0;
+    double total = 0;
+    for (int i = 0; i < slots; i++) {
+      take_sample(lc3_stats_slot(seg, i), &cur[i]);
+      if (!cur[i].live) {
+        continue;
+      }
+      const struct sample *p = &prev[i];
+      struct row *r = &rows[live++];
+      r->now = &cur[i];
+      r->mips = r->polls = r->output = 0;
+      if (same_guest(p, &cur[i])) {
+        r->mips = (cur[i].instructions - p->instructions) / dt / 1e6;
+        r->polls = (cur[i].kbsr_polls - p->kbsr_polls) / dt;
+        r->output = (cur[i].output_bytes - p->output_bytes) / dt;
+      }
+      total += r->mips;
+    }
+    qsort(rows, live, sizeof(*rows), by_mips);
+
+    if (!once) {
+      printf("\033[H\033[J");
+    }
+    printf("%s: %d live of %d slots, %.1f MIPS\n", name, live, slots, total);
+    printf("%8s %-24s %8s %14s %9s %9s %5s %5s %8s %s\n", "PID", "LABEL",
+           "MIPS", "INSTRUCTIONS", "KBSR/s", "OUT B/s", "DEC%", "JIT%",
+           "INVAL", "TOP TRAP");
+    for (int i = 0; i < live && i < rows_max; i++) {
+      const struct row *r = &rows[i];
+      const struct sample *s = r->now;
+      printf("%8d %-24.24s %8.2f %14llu %9.0f %9.0f", (int)s->pid, s->label,
+             r->mips, (unsigned long long)s->instructions, r->polls,
+             r->output);
+      // instructions that found their decode, only for the caching engines
+      uint64_t hits =
+          s->instructions > s->decoded ? s->instructions - s->decoded : 0;
+      print_share(hits, s->decoded ? s->instructions : 0);
+      print_share(s->jit_instructions, s->jit_compiles ? s->instructions : 0);
+      printf(" %8llu", (unsigned long long)s->invalidations);
+      if (s->top_trap >= 0) {
+        printf(" x%02X %llu", s->top_trap,
+               (unsigned long long)s->top_trap_count);
+      }
+      printf("\n");
+    }
+    fflush(stdout);
+    if (once) {
+      break;
+    }
+    struct sample *swap = prev;
+    prev = cur;
+    cur = swap;
+  }
+  free(prev);
+  free(cur);
+  free(rows);
+  lc3_stats_close(seg);
+  return 0;
+}
@@ -0,0 +1,163 @@
+// trace decoder: the records of a file written by lc3_vm --trace
+//
+// lc3-trace [--last=N] FILE
+//
+// One line per retired instruction, the oldest first: the number of
+// instructions retired before it, its address, the instruction word and its
+// disassembly, the register it left or stored with the value, and the flags:
+//
+//       1041  x3005  x1261  ADD R1, R1, #1          R1=x0005  P
+//
+// --last prints only the N most recent records, what led to the trigger.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3.h"
+
+static const char *const trap_names[] = {"GETC", "OUT",   "PUTS",
+                                         "IN",   "PUTSP", "HALT"};
+
+int sext(uint16_t x, int bits) {
+  int v = x & ((1 << bits) - 1);
+  return v & (1 << (bits - 1)) ? v - (1 << bits) : v;
+}
+
+// the instruction at pc in assembly, PC-relative operands as addresses
+void disassemble(uint16_t pc, uint16_t instr, char *buf, size_t n) {
+  int dr = (instr >> 9) & 7;
+  int sr = (instr >> 6) & 7;
+  uint16_t next = pc + 1;
+  switch (instr >> 12) {
+  case 0x0:
+    snprintf(buf, n, "BR%s%s%s x%04X", instr & 0x800 ? "n" : "",
+             instr & 0x400 ? "z" : "", instr & 0x200 ? "p" : "",
+             (uint16_t)(next + sext(instr, 9)));
+    break;
+  case 0x1:
+  case 0x5:
+    if (instr & 0x20) {
+      snprintf(buf, n, "%s R%d, R%d, #%d", instr >> 12 == 1 ? "ADD" : "AND",
+               dr, sr, sext(instr, 5));
+    } else {
+      snprintf(buf, n, "%s R%d, R%d, R%d", instr >> 12 == 1 ? "ADD" : "AND",
+               dr, sr, instr & 7);
+    }
+    break;
+  case 0x2:
+  case 0x3:
+  case 0xA:
+  case 0xB:
+  case 0xE: {
+    static const char *const names[16] = {[0x2] = "LD",  [0x3] = "ST",
+                                          [0xA] = "LDI", [0xB] = "STI",
+                                          [0xE] = "LEA"};
+    snprintf(buf, n, "%s R%d, x%04X", names[instr >> 12], dr,
+             (uint16_t)(next + sext(instr, 9)));
+    break;
+  }
+  case 0x4:
+    if (instr & 0x800) {
+      snprintf(buf, n, "JSR x%04X", (uint16_t)(next + sext(instr, 11)));
+    } else {
+      snprintf(buf, n, "JSRR R%d", sr);
+    }
+    break;
+  case 0x6:
+  case 0x7:
+    snprintf(buf, n, "%s R%d, R%d, #%d", instr >> 12 == 6 ? "LDR" : "STR", dr,
+             sr, sext(instr, 6));
+    break;
+  case 0x8:
+    snprintf(buf, n, "RTI");
+    break;
+  case 0x9:
+    snprintf(buf, n, "NOT R%d, R%d", dr, sr);
+    break;
+  case 0xC:
+    if (sr == 7) {
+      snprintf(buf, n, "RET");
+    } else {
+      snprintf(buf, n, "JMP R%d", sr);
+    }
+    break;
+  case 0xD:
+    snprintf(buf, n, ".FILL x%04X", instr);
+    break;
+  case 0xF:
+    if ((instr & 0xFF) >= 0x20 && (instr & 0xFF) <= 0x25) {
+      snprintf(buf, n, "%s", trap_names[(instr & 0xFF) - 0x20]);
+    } else {
+      snprintf(buf, n, "TRAP x%02X", instr & 0xFF);
+    }
+    break;
+  }
+}
+
+void print_record(const struct lc3_trace_record *r) {
+  char text[32];
+  disassemble(r->pc, r->instr, text, sizeof(text));
+  printf("%12llu  x%04X  x%04X  %-22s", (unsigned long long)r->index, r->pc,
+         r->instr, text);
+  if (r->reg >= 0) {
+    printf("  R%d=x%04X", r->reg, r->value);
+  } else {
+    printf("          ");
+  }
+  printf("  %s%s%s\n", r->flags & 4 ? "N" : "", r->flags & 2 ? "Z" : "",
+         r->flags & 1 ? "P" : "");
+}
+
+int main(int argc, const char *argv[]) {
+  unsigned long last = 0;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strncmp(argv[i], "--last=", 7) == 0) {
+      last = strtoul(argv[i] + 7, NULL, 10);
+    } else {
+      break;
+    }
+  }
+  if (i + 1 != argc) {
+    printf("lc3-trace [--last=N] FILE\n");
+    return 2;
+  }
+  lc3_trace *trace = lc3_trace_open(argv[i]);
+  if (!trace) {
+    printf("not a trace file: %s\n", argv[i]);
+    return 1;
+  }
+
+  // with --last, the records go round a ring and the tail is printed at the
+  // end
+  struct lc3_trace_record *ring = NULL;
+  if (last) {
+    ring = malloc(last * sizeof(*ring));
+    if (!ring) {
+      printf("out of memory\n");
+      return 1;
+    }
+  }
+  struct lc3_trace_record r;
+  unsigned long long count = 0;
+  int status;
+  while ((status = lc3_trace_next(trace, &r)) == 1) {
+    if (ring) {
+      ring[count % last] = r;
+    } else {
+      print_record(&r);
+    }
+    count++;
+  }
+  for (unsigned long long k = count > last ? count - last : 0;
+       ring && k < count; k++) {
+    print_record(&ring[k % last]);
+  }
+  free(ring);
+  lc3_trace_close(trace);
+  if (status < 0) {
+    printf("corrupt record after %llu\n", count);
+    return 1;
+  }
+  return 0;
+}